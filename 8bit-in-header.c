@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #define PGMNAME "8bit-in-header"
 
@@ -38,20 +42,50 @@
 
 #define MAX_NAMES 200
 
+/* The longest header line we accept; see RFC822.  */
+#define MAX_LINELEN 1998
+
 static int silent;
 static int sloppy;
+static int mbox_mode;
+static int list_mode;
+
+/* A simple buffered reader so that we can scan large blocks.  */
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t size;   /* allocated size of BUF */
+    size_t len;    /* number of valid bytes in BUF */
+    size_t pos;    /* current read position */
+    int eof;
+} reader_t;
+
 
 static void
 usage(void)
 {
-    fputs("usage: " PGMNAME " [-q] [-s] [--] [headernames]\n"
+    fputs("usage: " PGMNAME " [-q] [-s] [-m] [-l] [--] [headernames]\n"
           "\n"
           "  -q   be silent\n"
           "  -s   sloppy match: accept up to 2 non ascii characters\n"
+          "  -m   the input is a mailbox; check all messages\n"
+          "  -l   read file names from stdin and check them; each file\n"
+          "       is a message, a mailbox (with -m) or a Maildir\n"
                       , stderr );
     exit(2);
 }
 
+static void *
+xrealloc( void *p, size_t n )
+{
+    p = realloc( p, n );
+    if( !p ) {
+        fputs( PGMNAME ": out of core\n", stderr );
+        exit(2);
+    }
+    return p;
+}
+
 static int
 name_cmp( const char *a, const char *b )
 {
@@ -63,26 +97,29 @@ name_cmp( const char *a, const char *b )
     return *a != *b;
 }
 
+/* Return an error description if P is not a valid header line */
+static const char *
+header_error( const char *p )
+{
+    const char *p2;
+
+    p2 = strchr(p, ':');
+    if( !p2 || p == p2 )
+        return "header line without colon or name";
+    if( p2[-1] == ' ' || p2[-1] == '\t' )
+        return "invalid header field";
+    return NULL;
+}
+
 static int
 headerp( char *p, char **names )
 {
     int i, c;
     char *p2;
 
-    p2 = strchr(p, ':');
-    if( !p2 || p == p2 ) {
-        if( !silent )
-            fputs( "header line without colon or name\n", stdout );
-        exit(1);
-    }
-    if( p2[-1] == ' ' || p2[-1] == '\t' ) {
-        if( !silent )
-            fputs( "invalid header field\n", stdout );
-        exit(1);
-    }
-
     if( !names[0] )
         return 1;  /* check all fields */
+    p2 = strchr(p, ':');
     c = *p2;
     *p2 = 0;
     for(i=0 ; names[i]; i++ ) {
@@ -106,13 +143,323 @@ count_bad( const char *s )
     return bad;
 }
 
+/* Return true if one of the N bytes at S has the high bit set.  This
+ * is the fast path; we test a word at a time.
+ */
+static int
+has_8bit( const char *s, size_t n )
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned long highbits = ~0UL / 255 * 128;
+    unsigned long w;
+
+    for( ; n && ((unsigned long)p & (sizeof w - 1)); p++, n-- ) {
+        if( *p & 0x80 )
+            return 1;
+    }
+    for( ; n >= 4 * sizeof w; p += 4 * sizeof w, n -= 4 * sizeof w ) {
+        w  = ((const unsigned long *)p)[0];
+        w |= ((const unsigned long *)p)[1];
+        w |= ((const unsigned long *)p)[2];
+        w |= ((const unsigned long *)p)[3];
+        if( w & highbits )
+            return 1;
+    }
+    for( ; n; p++, n-- ) {
+        if( *p & 0x80 )
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Make sure that at least one more byte after the valid data of R
+ * can be read.  Returns false at EOF.
+ */
+static int
+fill( reader_t *r )
+{
+    size_t n;
+
+    if( r->eof )
+        return 0;
+    if( r->len == r->size ) {
+        r->size = r->size? 2 * r->size : 65536;
+        r->buf = xrealloc( r->buf, r->size + 1 );
+    }
+    n = fread( r->buf + r->len, 1, r->size - r->len, r->fp );
+    if( !n ) {
+        r->eof = 1;
+        return 0;
+    }
+    r->len += n;
+    return 1;
+}
+
+/* Drop the already processed data from the buffer */
+static void
+compact( reader_t *r )
+{
+    if( r->pos ) {
+        memmove( r->buf, r->buf + r->pos, r->len - r->pos );
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+}
+
+/* Return the offset of the end of the line starting at offset OFF or
+ * -1 if there is no LF before EOF.
+ */
+static long
+find_eol( reader_t *r, size_t off )
+{
+    const char *p;
+    size_t scanned = off;
+
+    for(;;) {
+        if( r->len > scanned ) {
+            p = memchr( r->buf + scanned, '\n', r->len - scanned );
+            if( p )
+                return p - r->buf;
+        }
+        scanned = r->len;
+        if( !fill( r ) )
+            return -1;
+    }
+}
+
+/* Read the header of the next message and set *R_LEN to its length.
+ * The header starts at the returned pointer and includes the LF of the
+ * last header line;  the empty line is skipped.
+ */
+static char *
+get_header( reader_t *r, size_t *r_len )
+{
+    size_t start, off;
+    long eol;
+
+    /* Don't move the data for each message of a mailbox.  */
+    if( r->pos > r->size / 2 )
+        compact( r );
+    start = r->pos;
+    for( off = start; ; off = eol + 1 ) {
+        eol = find_eol( r, off );
+        if( eol < 0 ) {  /* EOF within the header */
+            *r_len = r->len - start;
+            r->pos = r->len;
+            return r->buf + start;
+        }
+        if( eol == off || (eol == off + 1 && r->buf[off] == '\r') ) {
+            *r_len = off - start;  /* Here is the body */
+            r->pos = eol + 1;
+            return r->buf + start;
+        }
+    }
+}
+
+/* Skip the body of a message in a mailbox */
+static void
+skip_body( reader_t *r )
+{
+    const char *p;
+    long eol;
+
+    for(;;) {
+        if( r->len - r->pos < 5 ) {
+            compact( r );
+            while( r->len < 5 && fill( r ) )
+                ;
+        }
+        if( r->len - r->pos >= 5 && !memcmp( r->buf + r->pos, "From ", 5 ) )
+            return;
+        p = memchr( r->buf + r->pos, '\n', r->len - r->pos );
+        if( p ) {
+            r->pos = p - r->buf + 1;
+            continue;
+        }
+        compact( r );
+        eol = find_eol( r, 0 );
+        if( eol < 0 ) {
+            r->pos = r->len;
+            return;
+        }
+        r->pos = eol + 1;
+    }
+}
+
+/* Skip the envelope line of a mailbox message.  Returns false at EOF.  */
+static int
+skip_envelope( reader_t *r )
+{
+    long eol;
+
+    if( r->len == r->pos ) {
+        compact( r );
+        if( !fill( r ) )
+            return 0;
+    }
+    eol = find_eol( r, r->pos );
+    r->pos = eol < 0? r->len : eol + 1;
+    return 1;
+}
+
+
+/* Check the header HDR of length LEN.  Returns NULL if it is okay or
+ * a description of the problem.
+ */
+static const char *
+check_header( char *hdr, size_t len, char **names )
+{
+    char *line, *eol;
+    const char *errtxt;
+    int thisone, bad, n, fast;
+
+    /* If there is no 8 bit character at all we only need to check the
+     * structure of the header lines.  */
+    fast = !has_8bit( hdr, len );
+
+    bad = thisone = 0;
+    for( line = hdr; line < hdr + len; line = eol + 1 ) {
+        eol = memchr( line, '\n', hdr + len - line );
+        if( !eol || eol - line > MAX_LINELEN )
+            return "line too long - see RFC822";
+        n = eol - line;
+        *eol = 0;
+        if( n && line[n-1] == '\r' )
+            line[--n] = 0;
+        if( *line == ' ' || *line == '\t' ) {
+            /* we don't care when the first line is an invalid cont.-line */
+            if( thisone && !fast )
+                bad += count_bad( line );
+        }
+        else if( (errtxt = header_error( line )) ) {
+            *eol = '\n';
+            return errtxt;
+        }
+        else if( !fast && headerp( line, names ) ) {
+            thisone = 1;
+            bad = count_bad( line );
+        }
+        else {
+            thisone = 0;
+            bad = 0;
+        }
+        *eol = '\n';
+        if( (bad && !sloppy) || bad >= BAD_LIMIT ) {
+            if( sloppy )
+                return "too many 8-bit characters in a header";
+            return "8-bit character in a header";
+        }
+    }
+    return NULL;
+}
+
+
+/* Check all messages from FP.  FNAME is used for diagnostics in the
+ * batch modes.  Returns the number of bad messages.
+ */
+static int
+check_stream( FILE *fp, const char *fname, char **names )
+{
+    static reader_t r;
+    const char *errtxt;
+    char *hdr;
+    size_t len;
+    int nbad = 0;
+    unsigned long msgno = 0;
+
+    r.fp = fp;
+    r.len = r.pos = 0;
+    r.eof = 0;
+    do {
+        if( mbox_mode && !skip_envelope( &r ) )
+            break;
+        msgno++;
+        hdr = get_header( &r, &len );
+        errtxt = check_header( hdr, len, names );
+        if( errtxt ) {
+            nbad++;
+            if( !silent ) {
+                if( mbox_mode )
+                    printf( "%s:%lu: %s\n", fname, msgno, errtxt );
+                else if( list_mode )
+                    printf( "%s: %s\n", fname, errtxt );
+                else
+                    printf( "%s\n", errtxt );
+            }
+            if( !mbox_mode && !list_mode )
+                break;
+        }
+        if( mbox_mode )
+            skip_body( &r );
+    } while( mbox_mode );
+    if( ferror(fp) ) {
+        fprintf( stderr, PGMNAME ": read error on `%s': %s\n",
+                 fname, strerror(errno) );
+        nbad++;
+    }
+    return nbad;
+}
+
+static int
+check_file( const char *fname, char **names )
+{
+    FILE *fp;
+    int nbad;
+
+    fp = fopen( fname, "rb" );
+    if( !fp ) {
+        fprintf( stderr, PGMNAME ": can't open `%s': %s\n",
+                 fname, strerror(errno) );
+        return 1;
+    }
+    nbad = check_stream( fp, fname, names );
+    fclose( fp );
+    return nbad;
+}
+
+/* Check all messages of the Maildir DIR */
+static int
+check_maildir( const char *dir, char **names )
+{
+    static const char *subdirs[] = { "cur", "new" };
+    DIR *dp;
+    struct dirent *de;
+    char *fname;
+    int i, nbad = 0;
+
+    for( i=0; i < 2; i++ ) {
+        fname = xrealloc( NULL, strlen(dir) + 5 );
+        sprintf( fname, "%s/%s", dir, subdirs[i] );
+        dp = opendir( fname );
+        if( !dp ) {
+            fprintf( stderr, PGMNAME ": can't open `%s': %s\n",
+                     fname, strerror(errno) );
+            free( fname );
+            nbad++;
+            continue;
+        }
+        while( (de = readdir( dp )) ) {
+            if( *de->d_name == '.' )
+                continue;
+            fname = xrealloc( fname, strlen(dir) + strlen(de->d_name) + 6 );
+            sprintf( fname, "%s/%s/%s", dir, subdirs[i], de->d_name );
+            nbad += check_file( fname, names );
+        }
+        closedir( dp );
+        free( fname );
+    }
+    return nbad;
+}
+
 int
 main( int argc, char **argv )
 {
     int skip = 0;
     char *names[MAX_NAMES+1];
-    int thisone, bad, i;
+    int nbad, i, n;
     char line[2000];
+    struct stat st;
 
     if( argc < 1)
         usage();  /* Hey, read how to uses exec*(2) */
@@ -138,6 +485,14 @@ main( int argc, char **argv )
                     sloppy=1;
                     s++;
                 }
+                else if( *s=='m' ) {
+                    mbox_mode=1;
+                    s++;
+                }
+                else if( *s=='l' ) {
+                    list_mode=1;
+                    s++;
+                }
                 else if( *s )
                     usage();
             }
@@ -151,51 +506,27 @@ main( int argc, char **argv )
     }
     names[i] = NULL;
 
+    if( !list_mode )
+        return check_stream( stdin, "[stdin]", names )? 1 : 0;
 
-    /* now get the lines */
-    bad = thisone = 0;
+    /* now get the file names */
+    nbad = 0;
     while( fgets( line, sizeof line, stdin ) ) {
-        int n = strlen(line);
-        if( !n || line[n-1] != '\n' ) {
-            /* n == 0 should never happen */
-            if( !silent )
-                fputs( "line too long - see RFC822\n", stdout );
-            exit(1);  /* maybe someone wants to circument this */
-        }
-        line[--n] = 0;
-        if( n && line[n-1] == '\r' )
+        n = strlen(line);
+        if( n && line[n-1] == '\n' )
             line[--n] = 0;
-        if( !n ) {
-            exit(0); /* Here is the body - stop */
-        }
-        if( *line == ' ' || *line == '\t' ) {
-            /* we don't care when the first line is an invalid cont.-line */
-            if( thisone )
-                bad += count_bad( line );
-        }
-        else if( headerp( line, names ) ) {
-            thisone = 1;
-            bad = count_bad( line );
-        }
-        else {
-            thisone = 0;
-            bad = 0;
-        }
-        if( (bad && !sloppy) || bad >= BAD_LIMIT ) {
-            if( !silent ) {
-                if( sloppy )
-                    fputs( "too many 8-bit characters in a header\n", stdout );
-                else
-                    fputs( "8-bit character in a header\n", stdout );
-            }
-            exit(1);
-        }
+        if( !n )
+            continue;
+        if( !mbox_mode && !stat( line, &st ) && S_ISDIR(st.st_mode) )
+            nbad += check_maildir( line, names );
+        else
+            nbad += check_file( line, names );
     }
     if( ferror(stdin) ) {
         fputs( PGMNAME ": read error\n", stderr );
         exit(1);
     }
-    return 0;
+    return nbad? 1 : 0;
 }
 
 /*
@@ -104,7 +104,8 @@ To convert regular CSV data into our record format you may use this:
 
   addrutil --readcsv FILENAME
 
-Add any number of -F options to name the fields.  To select only
+Add any number of -F options to name the fields.  With -j N the
+conversion of a regular file is done by N threads.  To select only
 unique records the -u option may be used.  Example:
 
   addrutil -f3 -u Name DATA
@@ -132,20 +133,48 @@ To use a numeric sort use:
 Both flags may also be combined.  Currently sorting is only possible
 on one field; future versions of this tool may allow to add more than
 one field.  Sorting works only on a regular file and requires that the
-file does not change during an addrutil run.
+file does not change during an addrutil run.  Regular files are mapped
+into memory and single line values are used directly from there.  If
+the sort keys take more than 64 MB (change with --sort-memory N, N
+given in MB), sorted runs of them are written to temporary files which
+are merged while the records are written.
+
+Selecting records by the exact value of a field may be sped up by an
+index:
+
+  addrutil -f3 --index Name -S Name='Ben Bitfiddle' DATA
+
+The first run creates the file DATA.Name.idx which maps the values of
+the field Name to the offsets of their records; later runs use it to
+seek directly to the matching records.  The index is rebuilt if the
+size or the modification time of DATA does not match the one recorded
+in the index.  Only a select with the = operator on the indexed field
+makes use of the index.
 
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define PGMNAME "addrutil"
 #define VERSION "0.72"
 #define FIELDNAMELEN 40		/* max. length of a fieldname */
+#define MAX_SORT_RUNS 64	/* max. number of runs merged at once */
+#define MAX_JOBS 64		/* max. number of threads for --readcsv */
+#define CSV_CHUNK_SIZE (4*1024*1024) /* bytes converted by a thread */
+#define INDEX_MAGIC "addrutil-index-1" /* 16 bytes, no terminating nul */
 
 #ifdef __GNUC__
 #define INLINE __inline__
@@ -177,6 +206,7 @@ typedef struct outfield_struct
 {
   struct outfield_struct *next;
   int flags;
+  struct field_struct *field;   /* The field once it has been seen.  */
   char name[1];
 } *OUTFIELD;
 
@@ -186,7 +216,11 @@ typedef struct selectexpr_struct
   struct selectexpr_struct *next;
   select_op_t op;
   const char *value;  /* Points into NAME.  */
+  size_t valuelen;
   long numvalue;
+  int numeric;        /* OP compares the numerical value.  */
+  size_t *skip;       /* Shift table for SELECT_SUB and SELECT_NOTSUB.  */
+  struct field_struct *field; /* The field once it has been seen.  */
   char name[1];
 } *SELECTEXPR;
 
@@ -197,6 +231,7 @@ static struct
   int debug;
   int checkonly;
   int readcsv;
+  int jobs;
   int format;
   int texfile;
   const char *template;
@@ -205,6 +240,8 @@ static struct
   OUTFIELD outfields;
   SELECTEXPR selectexpr;
   OUTFIELD sortfields;
+  unsigned long sortmem;        /* Memory limit for the sort keys.  */
+  const char *indexfield;       /* Use an index on this field.  */
 } opt;
 
 
@@ -213,13 +250,26 @@ typedef struct data_struct
   struct data_struct *next;
   int activ;			/* True if slot is in use. */
   int index;			/* Index number of this item.  */
-  size_t size;			/* Available length of D. */
+  size_t size;			/* Available length of BUF. */
   size_t used;			/* Used length of D. */
-  char d[1];			/* (this is not a string) */
+  char *d;			/* Either BUF or a slice of the mapped
+                                   input (this is not a string).  */
+  char buf[1];
 } *DATA;
 
 static DATA unused_data;	/* LL of unused data blocks. */
 
+/* The input of process.  If the file has been mapped into memory
+   MAP is not NULL and POS is the offset of the next byte.  */
+typedef struct
+{
+  FILE *fp;
+  const char *map;
+  size_t maplen;
+  size_t pos;
+} INPUT;
+
+
 typedef struct field_struct
 {
   struct field_struct *nextfield;
@@ -240,11 +290,16 @@ typedef struct sort_struct
 typedef struct namebucket_struct
 {
   struct namebucket_struct *next;
+  unsigned long hash;		/* The hash value of the name.  */
   FIELD ptr;
 } *NAMEBUCKET;
 
-#define NO_NAMEBUCKETS 51
-static NAMEBUCKET namebuckets[NO_NAMEBUCKETS];
+/* The hash table of the field names.  Its size is a power of 2 and
+   it is doubled if it has more entries than buckets.  */
+#define MIN_NAMEBUCKETS 64
+static NAMEBUCKET *namebuckets;
+static size_t no_namebuckets;
+static size_t no_names;
 
 
 static FIELD fieldlist;		/* Description of the record. */
@@ -252,17 +307,84 @@ static FIELD fieldlist;		/* Description of the record. */
 static FIELD next_field;	/* Used by GetFirst/NextField(). */
 static OUTFIELD next_outfield;
 static SORT sortlist;		/* Used when sortmode or uniqmode is activ.*/
+static size_t sortlist_mem;	/* Memory used by the items of SORTLIST.  */
+static SORT next_sort;		/* Next item of SORTLIST to output.  */
+
+/* Sorted runs of sort items spilled to temporary files.  Each item is
+   stored as its offset, the length of the key including the
+   terminating nul and the key.  */
+typedef struct sortrun_struct
+{
+  FILE *fp;
+  SORT cur;			/* The current item or NULL at EOF.  */
+  size_t cursize;		/* Allocated size of CUR's key.  */
+} SORTRUN;
+static SORTRUN sortruns[MAX_SORT_RUNS];
+static int nsortruns;
+
+/* The header of an index file.  It is followed by the keys as
+   strings and the array of entries sorted by key.  All values are
+   stored in native byte order; HDRSIZE and BYTEORDER detect an index
+   written on a different kind of machine.  */
+typedef struct
+{
+  char magic[16];
+  unsigned int hdrsize;		/* sizeof (INDEXHDR).  */
+  unsigned int byteorder;	/* 0x01020304.  */
+  off_t size;			/* Size of the data file.  */
+  time_t mtime;			/* Modification time of the data file.  */
+  size_t nentries;		/* Number of entries.  */
+  size_t entries;		/* File offset of the first entry.  */
+  char field[FIELDNAMELEN + 1];	/* Name of the indexed field.  */
+} INDEXHDR;
+
+typedef struct
+{
+  long offset;			/* Offset of the record.  */
+  size_t key;			/* File offset of the key string.  */
+} INDEXENTRY;
+
+/* The alignment of the entries in the index file; the keys are
+   padded with nuls to it.  */
+#define INDEXENTRY_ALIGN offsetof (struct { char c; INDEXENTRY e; }, e)
+
 static ulong output_count;
 static long start_of_record;	/* Fileoffset of the current record.  */
 static int new_record_flag;
+
+/* The template is compiled into a sequence of these items.  */
+typedef enum {
+  TPL_LITERAL,      /* Text to copy.  */
+  TPL_INVALID,      /* A pseudo-op not terminated on its line.  */
+  TPL_UNCLOSED,     /* A pseudo-op not terminated at EOF. */
+  TPL_BEGIN,        /* @@begin-record-block@@  */
+  TPL_END,          /* @@end-record-block@@  */
+  TPL_NEXT,         /* @@next-record@@  */
+  TPL_NEXT_REWIND,  /* @@next-record-rewind@@  */
+  TPL_RECNO,        /* @@_recno@@  */
+  TPL_FIELD         /* The value of a field.  */
+} tplitem_t;
+
+typedef struct
+{
+  tplitem_t type;
+  const char *text;		/* The literal text or the pseudo-op.  */
+  size_t len;			/* Length of TEXT for TPL_LITERAL.  */
+  char *name;			/* TPL_FIELD: The name of the field.  */
+  const char *lfrepl;		/* TPL_FIELD: Replacement for LFs or NULL. */
+  struct field_struct *field;	/* TPL_FIELD: The field once seen.  */
+} TPLITEM;
+
 static struct
 {
-  FILE *fp;
+  TPLITEM *items;
+  size_t nitems;
+  size_t pos;                   /* Index of the next item.  */
   int in_record_block;
   int rewind_data;
   int record_number;
-  long begin_block;
-  long end_block;
+  size_t begin_block;
+  size_t end_block;
 } tex;
 
 
@@ -307,21 +429,29 @@ static void show_version (void);
 
 static INLINE unsigned long hash_name (const char *s);
 static void dump_hash_infos (void);
+static FIELD lookup_field_name (const char *name);
+static FIELD find_field (const char *name);
 static void log_error (int rc, const char *s, ...);
 static void process (const char *filename);
 static void read_and_print_csv (const char *filename);
 static FIELD store_field_name (const char *fname, long offset);
 static DATA expand_data_slot (FIELD field, DATA data);
+static DATA own_data_slot (FIELD field, DATA data);
 static void new_record (long);
 static FIELD get_first_field (void);
 static FIELD get_next_field (void);
 static void finish_record (void);
 static void print_format2 (int flush);
+static void compile_template (FILE *fp);
 static void print_template (int);
-static int process_template_op (const char *op);
+static int process_template_op (TPLITEM *item);
 static void do_sort (void);
 static int do_sort_fnc (const void *arg_a, const void *arg_b);
+static void spill_sortlist (void);
+static int rewind_sortlist (void);
+static long next_sort_offset (void);
 static void do_uniq (void);
+static void use_index (const char *filename);
 
 static const char *get_usage_str (int level);
 
@@ -448,29 +578,26 @@ strip_trailing_ws (char *str)
 }
 
 
-/* Find string SUB in (BUFFER,BUFLEN).  */
-static const char *
-memstr (const void *buffer, size_t buflen, const char *sub)
+/* Return true if the string SUB of length SUBLEN is contained in
+   (BUFFER,BUFLEN).  SKIP is the Horspool shift table for SUB.  */
+static int
+memstr_skip (const void *buffer, size_t buflen,
+             const char *sub, size_t sublen, const size_t *skip)
 {
-  const char *buf = buffer;
-  const char *t = buf;
-  const char *s = sub;
-  size_t n = buflen;
+  const unsigned char *buf = buffer;
+  const unsigned char *s = (const unsigned char *)sub;
+  size_t pos, i;
 
-  for (; n; t++, n--)
+  if (!sublen)
+    return 1;
+  for (pos = 0; pos + sublen <= buflen; pos += skip[buf[pos + sublen - 1]])
     {
-      if (*t == *s)
-        {
-          for (buf = t++, buflen = n--, s++; n && *t == *s; t++, s++, n--)
-            ;
-          if (!*s)
-            return buf;
-          t = buf;
-          s = sub ;
-          n = buflen;
-	}
+      for (i = sublen; i && buf[pos + i - 1] == s[i - 1]; i--)
+        ;
+      if (!i)
+        return 1;
     }
-  return NULL;
+  return 0;
 }
 
 
@@ -964,7 +1091,25 @@ parse_selectexpr (const char *expr)
   if (!se->value[0] && !(se->op == SELECT_EMPTY || se->op == SELECT_NOTEMPTY))
     log_error (1, "%s: no value given for select\n", PGMNAME);
 
+  /* Prepare everything required to evaluate the expression so that
+     select_record_p only needs to do the comparisons.  */
+  se->valuelen = strlen (se->value);
   se->numvalue = strtol (se->value, NULL, 10);
+  se->numeric = (se->op == SELECT_EQ || se->op == SELECT_NE
+                 || se->op == SELECT_LE || se->op == SELECT_GE
+                 || se->op == SELECT_LT || se->op == SELECT_GT);
+  se->field = NULL;
+  se->skip = NULL;
+  if (se->op == SELECT_SUB || se->op == SELECT_NOTSUB)
+    {
+      size_t i;
+
+      se->skip = xmalloc (256 * sizeof *se->skip);
+      for (i = 0; i < 256; i++)
+        se->skip[i] = se->valuelen;
+      for (i = 0; i + 1 < se->valuelen; i++)
+        se->skip[((const unsigned char *)se->value)[i]] = se->valuelen - 1 - i;
+    }
 
   return se;
 }
@@ -981,6 +1126,7 @@ add_sortfield (ARGPARSE_ARGS *pargs)
       of = xmalloc (sizeof *of + strlen (pargs->r.ret_str));
       of->next = NULL;
       of->flags = 0;
+      of->field = NULL;
       strcpy (of->name, pargs->r.ret_str);
       p = strchr (of->name, '/');
       if (p)
@@ -1026,6 +1172,9 @@ main (int argc, char **argv)
     {'T', "tex-file", 2, "use TeX file as template"},
     {'c', "check-only", 0, "do only a syntax check"},
     { 501, "readcsv",   0, "read CSV data" },
+    { 502, "sort-memory", 4, "use N MB of memory for sorting" },
+    { 503, "index", 2, "use an index on field N for selects" },
+    {'j', "jobs", 1, "use N threads for --readcsv" },
     {'v', "verbose", 0, "verbose"},
     {'d', "debug", 0, "increase the debug level"},
     {0}
@@ -1069,6 +1218,7 @@ main (int argc, char **argv)
 	case 'F':
 	  of = xmalloc (sizeof *of + strlen (pargs.r.ret_str));
 	  of->next = NULL;
+	  of->field = NULL;
 	  strcpy (of->name, pargs.r.ret_str);
 	  if (!(of2 = opt.outfields))
 	    opt.outfields = of;
@@ -1082,6 +1232,20 @@ main (int argc, char **argv)
         case 501:
           opt.readcsv = 1;
           break;
+        case 502:
+          opt.sortmem = pargs.r.ret_ulong * 1024 * 1024;
+          break;
+        case 503:
+          opt.indexfield = pargs.r.ret_str;
+          if (!*opt.indexfield || strlen (opt.indexfield) > FIELDNAMELEN)
+            log_error (1, "%s: invalid field name for --index", PGMNAME);
+          break;
+        case 'j':
+          opt.jobs = pargs.r.ret_int;
+          if (opt.jobs < 1 || opt.jobs > MAX_JOBS)
+            log_error (1, "%s: number of jobs must be 1 to %d",
+                       PGMNAME, MAX_JOBS);
+          break;
 	case 'S':
           se = parse_selectexpr (pargs.r.ret_str);
           if (se)
@@ -1134,13 +1298,15 @@ main (int argc, char **argv)
 
   if (opt.template)
     {
-      tex.fp = fopen (opt.template, "r");
-      if (!tex.fp)
+      FILE *fp = fopen (opt.template, "r");
+      if (!fp)
 	{
 	  fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
 		   opt.template, strerror (errno));
 	  exit (1);
 	}
+      compile_template (fp);
+      fclose (fp);
     }
 
   if (opt.sortmode && opt.uniqmode)
@@ -1166,6 +1332,19 @@ main (int argc, char **argv)
   /* For internal purposes we set the sortmode flag with uniqmode.  */
   if (opt.uniqmode)
     opt.sortmode = 1;
+  if (!opt.sortmem)
+    opt.sortmem = 64 * 1024 * 1024;
+
+  if (opt.indexfield)
+    {
+      if (opt.sortmode || argc != 1)
+        {
+          fprintf (stderr, PGMNAME ": sorry, --index is only available"
+                   " for one file and not with sort or uniq\n");
+          exit (1);
+        }
+      use_index (*argv);
+    }
 
   org_argc = argc;
   org_argv = argv;
@@ -1185,14 +1364,7 @@ main (int argc, char **argv)
         {
           tex.rewind_data = 0;
           if (tex.end_block)
-            {
-              if (fseek (tex.fp, tex.end_block, SEEK_SET))
-                {
-                  fprintf (stderr, PGMNAME ": error seeking to offset %ld\n",
-                           tex.end_block);
-                  exit (1);
-                }
-            }
+            tex.pos = tex.end_block;
           argc = org_argc;
           argv = org_argv;
           goto pass_two;
@@ -1205,7 +1377,7 @@ main (int argc, char **argv)
   else if (opt.format == 2 && opt.sortmode != 1)
     print_format2 (1);		/* flush */
 
-  if (opt.sortmode == 1 && sortlist)
+  if (opt.sortmode == 1 && (sortlist || nsortruns))
     {
       if (opt.uniqmode)
         do_uniq ();
@@ -1222,12 +1394,12 @@ main (int argc, char **argv)
     }
 
 
-  for (se=opt.selectexpr; se; se = se->next)
+  /* If the index has been used, only the matching records have been
+     parsed; thus we can't tell whether a field is missing.  */
+  for (se = (opt.indexfield && opt.sortmode)? NULL : opt.selectexpr;
+       se; se = se->next)
     {
-      for (f = fieldlist; f; f = f->nextfield)
-        if (!strcmp (f->name, se->name))
-          break;
-      if (!f)
+      if (!find_field (se->name))
         fprintf (stderr, PGMNAME ": warning: "
                  "select field '%s' not found in data\n", se->name);
     }
@@ -1285,7 +1457,58 @@ hash_name (const char *s_arg)
 	  }
       }
 
-  return hashVal % NO_NAMEBUCKETS;
+  return hashVal;
+}
+
+
+/* Double the size of the field name hash table or create it.  */
+static void
+grow_namebuckets (void)
+{
+  NAMEBUCKET *old = namebuckets;
+  size_t i, old_size = no_namebuckets;
+  NAMEBUCKET r, r2;
+
+  no_namebuckets = old_size? 2 * old_size : MIN_NAMEBUCKETS;
+  namebuckets = xcalloc (no_namebuckets, sizeof *namebuckets);
+  for (i = 0; i < old_size; i++)
+    for (r = old[i]; r; r = r2)
+      {
+        r2 = r->next;
+        r->next = namebuckets[r->hash & (no_namebuckets - 1)];
+        namebuckets[r->hash & (no_namebuckets - 1)] = r;
+      }
+  free (old);
+}
+
+
+/* Return the field with NAME which is compared case insensitive or
+   NULL if no such field has been seen.  */
+static FIELD
+lookup_field_name (const char *name)
+{
+  unsigned long hash;
+  NAMEBUCKET buck;
+
+  if (!no_namebuckets)
+    return NULL;
+  hash = hash_name (name);
+  for (buck = namebuckets[hash & (no_namebuckets - 1)]; buck;
+       buck = buck->next)
+    if (buck->hash == hash && !strcasecmp (buck->ptr->name, name))
+      return buck->ptr;
+  return NULL;
+}
+
+
+/* Return the field with exactly NAME or NULL if no such field has
+   been seen.  */
+static FIELD
+find_field (const char *name)
+{
+  FIELD f = lookup_field_name (name);
+
+  return f && !strcmp (f->name, name)? f : NULL;
 }
 
 
@@ -1296,7 +1519,7 @@ dump_hash_infos ()
   NAMEBUCKET r;
 
   perBucket = sum = 0;
-  for (i = 0; i < NO_NAMEBUCKETS; i++)
+  for (i = 0; i < no_namebuckets; i++)
     {
       for (n = 0, r = namebuckets[i]; r; r = r->next)
 	n++;
@@ -1306,7 +1529,7 @@ dump_hash_infos ()
     }
   fprintf (stderr,
 	   "%d entries in %d hash buckets; max. %d entr%s per hash bucket\n",
-	   sum, NO_NAMEBUCKETS, perBucket, perBucket == 1 ? "y" : "ies");
+	   sum, (int)no_namebuckets, perBucket, perBucket == 1 ? "y" : "ies");
 }
 
 
@@ -1325,6 +1548,59 @@ log_error (int rc, const char *s, ...)
 }
 
 
+static INLINE int
+input_getc (INPUT *in)
+{
+  if (!in->map)
+    return getc (in->fp);
+  return in->pos < in->maplen? ((unsigned char*)in->map)[in->pos++] : EOF;
+}
+
+
+static INLINE long
+input_tell (INPUT *in)
+{
+  return in->map? (long)in->pos : ftell (in->fp);
+}
+
+
+static int
+input_seek (INPUT *in, long offset)
+{
+  if (!in->map)
+    {
+      clearerr (in->fp);
+      return fseek (in->fp, offset, SEEK_SET);
+    }
+  if (offset < 0 || offset > in->maplen)
+    return -1;
+  in->pos = offset;
+  return 0;
+}
+
+
+/* Map the file of IN into memory if it is a non-empty regular file.
+   On failure we silently fall back to stdio.  */
+static void
+input_map (INPUT *in)
+{
+  struct stat st;
+  void *p;
+
+  in->map = NULL;
+  in->maplen = 0;
+  in->pos = 0;
+  if (fstat (fileno (in->fp), &st) || !S_ISREG (st.st_mode)
+      || !st.st_size || st.st_size != (size_t)st.st_size)
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (in->fp), 0);
+  if (p == MAP_FAILED)
+    return;
+  in->map = p;
+  in->maplen = st.st_size;
+}
+
+
 static void
 process (const char *filename)
 {
@@ -1346,7 +1622,8 @@ process (const char *filename)
   } state = sINIT;
   FIELD f = NULL;		/* current field */
   DATA d = NULL;		/* current data slot */
-  SORT sort = sortlist;
+  long offset;
+  INPUT in;
   int pending_lf = 0;
   int skip_kludge = 0;
 
@@ -1365,27 +1642,27 @@ process (const char *filename)
       fp = stdin;
       filename = "[stdin]";
     }
+  memset (&in, 0, sizeof in);
+  in.fp = fp;
+  if (fp != stdin)
+    input_map (&in);
 
   if (opt.sortmode == 2)  /* Sorting/uniqing has been done. */
     {
-      if (!sort)
-	return;		  /* nothing to sort */
-    next_sortrecord:
-      if (!sort)
-	goto ready;
-      if (sort->offset == -1)
+      if (!rewind_sortlist ())
         {
-          /* Skip deleted records.  */
-          sort = sort->next;
-          goto next_sortrecord;
+          if (in.map)
+            munmap ((void*)in.map, in.maplen);
+          return;	  /* nothing to sort */
         }
-      clearerr (fp);
-      if (fseek (fp, sort->offset, SEEK_SET))
+    next_sortrecord:
+      if ((offset = next_sort_offset ()) == -1)
+	goto ready;
+      if (input_seek (&in, offset))
 	{
-	  fprintf (stderr, PGMNAME ": error seeking to %ld\n", sort->offset);
+	  fprintf (stderr, PGMNAME ": error seeking to %ld\n", offset);
 	  exit (2);
 	}
-      sort = sort->next;
       state = sINIT;
       skip_kludge = 1;
     }
@@ -1395,7 +1672,7 @@ process (const char *filename)
    */
   lineno++;
   newline = 1;
-  while ((c = getc (fp)) != EOF)
+  while ((c = input_getc (&in)) != EOF)
     {
       if (c == '\n')
 	{
@@ -1412,7 +1689,7 @@ process (const char *filename)
 	      break;
 	    }
 	  lineno++;
-	  lineoff = ftell (fp) - 1;
+	  lineoff = input_tell (&in) - 1;
           if (lineoff == -1 && opt.sortmode)
             {
 	      log_error (2, "%s:%ld: ftell() failed: %s",
@@ -1559,6 +1836,7 @@ process (const char *filename)
 			}
 		    }
 		  d->activ = 1;
+		  d->d = d->buf;
 		  d->used = 0;	/* used length */
 		  pending_lf = 0;
 		  state = sDATABEG;
@@ -1579,6 +1857,22 @@ process (const char *filename)
 	    case sDATA:
 	      if (!d)
 		abort ();
+              if (in.map && !d->used && !pending_lf)
+                {
+                  /* The start of a value in a mapped file.  Take the
+                     rest of the line directly from the map.  */
+                  const char *s = in.map + in.pos - 1;
+                  const char *e = memchr (s, '\n', in.map + in.maplen - s);
+
+                  if (!e)
+                    e = in.map + in.maplen;
+                  d->d = (char*)s;
+                  d->used = e - s;
+                  in.pos = e - in.map;
+                  break;
+                }
+              if (d->d != d->buf)
+                d = own_data_slot (f, d);
 	      for (; pending_lf; pending_lf--)
 		{
 		  if (d->used >= d->size)
@@ -1607,6 +1901,8 @@ process (const char *filename)
 
  ready:
   finish_record ();
+  if (in.map)
+    munmap ((void*)in.map, in.maplen);
   lineno--;
   if (opt.verbose)
     log_error (0, "%s: %lu line%s processed", filename, lineno,
@@ -1617,140 +1913,309 @@ process (const char *filename)
 }
 
 
-static void
-read_and_print_csv (const char *filename)
+/* An output buffer for the CSV conversion.  If FP is not NULL the
+   output goes directly to that stream.  */
+typedef struct
 {
   FILE *fp;
-  int c;
-  unsigned long lineno;
-  int newline, newfield, in_string, any_printed;
-  int fieldidx = 0;
-  OUTFIELD of;
+  char *buf;
+  size_t len;
+  size_t size;
+} OUTBUF;
 
-  if (filename)
+static void
+outbuf_write (OUTBUF *out, const char *s, size_t n)
+{
+  if (out->fp)
     {
-      fp = fopen (filename, "r");
-      if (!fp)
-	{
-	  fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
-		   filename, strerror (errno));
-	  exit (1);
-	}
+      fwrite (s, n, 1, out->fp);
+      return;
     }
-  else
+  if (out->len + n > out->size)
     {
-      fp = stdin;
-      filename = "[stdin]";
+      out->size = 2 * out->size + n + 4096;
+      out->buf = realloc (out->buf, out->size);
+      if (!out->buf)
+        {
+          fprintf (stderr, PGMNAME ": out of memory\n");
+          exit (2);
+        }
     }
+  memcpy (out->buf + out->len, s, n);
+  out->len += n;
+}
 
-  /* Read the file byte by byte; do not impose a limit on the line
-   * length.  Fieldnames are up to FIELDNAMELEN bytes long.  */
-  lineno  = 1;
-  newline = 1;
-  newfield = 0;
-  in_string = 0;
-  any_printed = 0;
-  of = NULL;
-  while ((c = getc (fp)) != EOF)
+static INLINE void
+outbuf_putc (OUTBUF *out, int c)
+{
+  char ch = c;
+
+  if (out->fp)
+    putc (c, out->fp);
+  else if (out->len < out->size)
+    out->buf[out->len++] = ch;
+  else
+    outbuf_write (out, &ch, 1);
+}
+
+
+/* The state of the CSV conversion.  A record ends at each LF and the
+   state is reset there; thus a file may be split at any LF and the
+   parts can be converted independently.  */
+typedef struct
+{
+  unsigned long lineno;
+  int newline, newfield, in_string, any_printed;
+  int fieldidx;
+  OUTFIELD of;
+} CSVSTATE;
+
+static void
+init_csv_state (CSVSTATE *st)
+{
+  memset (st, 0, sizeof *st);
+  st->newline = 1;
+}
+
+
+/* Convert the LEN bytes of CSV data in BUF and write the records to
+   OUT.  */
+static void
+convert_csv (CSVSTATE *st, const char *buf, size_t len, OUTBUF *out)
+{
+  const unsigned char *s = (const unsigned char *)buf;
+  int c;
+
+  for (; len; len--)
     {
+      c = *s++;
       if (c == '\r')
         continue;
 
       if (c == '\n')  /* End of line.  */
 	{
-          putchar ('\n');
-          putchar ('\n');
-	  lineno++;
-	  newline = 1;
-          newfield = 0;
-          in_string = 0;
-          fieldidx = 0;
+          outbuf_write (out, "\n\n", 2);
+	  st->lineno++;
+	  st->newline = 1;
+          st->newfield = 0;
+          st->in_string = 0;
+          st->fieldidx = 0;
 	  continue;
 	}
 
-      if (newline) /* At a new record.  */
+      if (st->newline) /* At a new record.  */
         {
-	  newline = 0;
-          newfield = 1;
-          of = opt.outfields? opt.outfields : NULL;
+	  st->newline = 0;
+          st->newfield = 1;
+          st->of = opt.outfields? opt.outfields : NULL;
 	}
 
-      if (newfield)
+      if (st->newfield)
         {
-          if (of)
-            printf ("%s:", of->name);
+          if (st->of)
+            {
+              outbuf_write (out, st->of->name, strlen (st->of->name));
+              outbuf_putc (out, ':');
+            }
           else
-            printf ("Field_%d:", fieldidx);
-          newfield = 0;
-          any_printed = 0;
-          in_string = 0;
+            {
+              char tmp[30];
+
+              snprintf (tmp, sizeof tmp, "Field_%d:", st->fieldidx);
+              outbuf_write (out, tmp, strlen (tmp));
+            }
+          st->newfield = 0;
+          st->any_printed = 0;
+          st->in_string = 0;
         }
 
-      if (in_string == 1)
+      if (st->in_string == 1)
         {
           if (c == '\"')
-            in_string = 2; /* Possible end of string.  */
+            st->in_string = 2; /* Possible end of string.  */
           else
             {
-              if (!any_printed)
+              if (!st->any_printed)
                 {
-                  any_printed = 1;
-                  putchar (' ');
+                  st->any_printed = 1;
+                  outbuf_putc (out, ' ');
                 }
-              putchar (c);
+              outbuf_putc (out, c);
             }
         }
-      else if (in_string == 2)
+      else if (st->in_string == 2)
         {
           if (c == '\"' )
             {
-              putchar ('\"');
-              in_string = 1;
+              outbuf_putc (out, '\"');
+              st->in_string = 1;
             }
           else
-            in_string = 0;
+            st->in_string = 0;
         }
 
-      if (in_string)
+      if (st->in_string)
         ;
       else if (c == '\"')
         {
-          in_string = 1;
+          st->in_string = 1;
         }
       else if (c == ',')
         {
-          putchar ('\n');
-          fieldidx++;
-          newfield = 1;
-          if (of)
-            of = of->next;
+          outbuf_putc (out, '\n');
+          st->fieldidx++;
+          st->newfield = 1;
+          if (st->of)
+            st->of = st->of->next;
         }
       else
         {
-          if (!any_printed)
+          if (!st->any_printed)
             {
-              any_printed = 1;
-              putchar (' ');
+              st->any_printed = 1;
+              outbuf_putc (out, ' ');
             }
-          putchar (c);
+          outbuf_putc (out, c);
+        }
+    }
+}
+
+
+#ifdef HAVE_PTHREAD
+/* A part of a mapped CSV file converted by a thread.  */
+struct csv_job_s
+{
+  pthread_t thread;
+  const char *data;
+  size_t len;
+  CSVSTATE st;
+  OUTBUF out;
+};
+
+static void *
+csv_thread (void *arg)
+{
+  struct csv_job_s *job = arg;
+
+  convert_csv (&job->st, job->data, job->len, &job->out);
+  return NULL;
+}
+
+
+/* Convert the LEN bytes of CSV data at DATA using OPT.JOBS threads.
+   The data is processed in rounds so that at most OPT.JOBS chunks of
+   about CSV_CHUNK_SIZE are converted and buffered at a time; their
+   output is then written in the original order.  The state of the
+   last chunk is returned at ST.  */
+static void
+convert_csv_parallel (CSVSTATE *st, const char *data, size_t len)
+{
+  struct csv_job_s jobs[MAX_JOBS];
+  const char *p, *end = data + len;
+  int i, njobs, err;
+
+  memset (jobs, 0, sizeof jobs);
+  for (p = data; p < end; )
+    {
+      for (njobs = 0; njobs < opt.jobs && p < end; njobs++)
+        {
+          const char *e = p + CSV_CHUNK_SIZE;
+
+          /* Split after a LF.  */
+          if (e >= end || !(e = memchr (e, '\n', end - e)))
+            e = end;
+          else
+            e++;
+          jobs[njobs].data = p;
+          jobs[njobs].len = e - p;
+          jobs[njobs].out.len = 0;
+          init_csv_state (&jobs[njobs].st);
+          if ((err = pthread_create (&jobs[njobs].thread, NULL,
+                                     csv_thread, &jobs[njobs])))
+            log_error (2, "%s: error creating thread: %s",
+                       PGMNAME, strerror (err));
+          p = e;
+        }
+      for (i = 0; i < njobs; i++)
+        {
+          pthread_join (jobs[i].thread, NULL);
+          fwrite (jobs[i].out.buf, jobs[i].out.len, 1, stdout);
+          st->lineno += jobs[i].st.lineno;
+          st->newline = jobs[i].st.newline;
+        }
+    }
+  for (i = 0; i < opt.jobs; i++)
+    free (jobs[i].out.buf);
+}
+#endif /*HAVE_PTHREAD*/
+
+
+static void
+read_and_print_csv (const char *filename)
+{
+  FILE *fp;
+  CSVSTATE st;
+  OUTBUF out;
+  char buffer[8192];
+  size_t n;
+
+  if (filename)
+    {
+      fp = fopen (filename, "r");
+      if (!fp)
+	{
+	  fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
+		   filename, strerror (errno));
+	  exit (1);
+	}
+    }
+  else
+    {
+      fp = stdin;
+      filename = "[stdin]";
+    }
+
+  /* Read the file in blocks; do not impose a limit on the line
+   * length.  Fieldnames are up to FIELDNAMELEN bytes long.  */
+  init_csv_state (&st);
+  st.lineno = 1;
+  memset (&out, 0, sizeof out);
+  out.fp = stdout;
+#ifdef HAVE_PTHREAD
+  if (opt.jobs > 1 && fp != stdin)
+    {
+      INPUT in;
+
+      in.fp = fp;
+      input_map (&in);
+      if (in.map)
+        {
+          convert_csv_parallel (&st, in.map, in.maplen);
+          munmap ((void*)in.map, in.maplen);
         }
+      else
+        opt.jobs = 1; /* Can't map it; fall back to sequential mode.  */
     }
+  if (opt.jobs <= 1 || fp == stdin)
+#endif /*HAVE_PTHREAD*/
+    while ((n = fread (buffer, 1, sizeof buffer, fp)))
+      convert_csv (&st, buffer, n, &out);
 
   if (ferror (fp))
     {
       fprintf (stderr, PGMNAME ":%s:%lu: read error: %s\n",
-	       filename, lineno, strerror (errno));
+	       filename, st.lineno, strerror (errno));
       exit (2);
     }
-  if (!newline)
+  if (!st.newline)
     {
       log_error (0, "%s: warning: last line not terminated by a LF", filename);
     }
 
-  lineno--;
+  st.lineno--;
   if (opt.verbose)
-    log_error (0, "%s: %lu line%s processed", filename, lineno,
-               lineno == 1 ? "" : "s");
+    log_error (0, "%s: %lu line%s processed", filename, st.lineno,
+               st.lineno == 1 ? "" : "s");
 
   if (fp != stdin)
     fclose (fp);
@@ -1771,37 +2236,32 @@ read_and_print_csv (const char *filename)
 static FIELD
 store_field_name (const char *fname, long offset)
 {
-  unsigned long hash;
+  static FIELD lastfield;        /* The last field of FIELDLIST.  */
   NAMEBUCKET buck;
-  FIELD fdes, f2;
+  FIELD fdes;
 
-  for (buck = namebuckets[hash = hash_name (fname)]; buck; buck = buck->next)
-    if (!strcasecmp (buck->ptr->name, fname))
-      {
-	fdes = buck->ptr;
-	break;
-      }
-
-  if (buck && fdes == fieldlist)
+  fdes = lookup_field_name (fname);
+  if (fdes && fdes == fieldlist)
     new_record (offset);
-  else if (!buck)
+  else if (!fdes)
     { /* A new fieldname.  */
       fdes = xcalloc (1, sizeof *fdes + strlen (fname));
       strcpy (fdes->name, fname);
       /* Create a hash entry to speed up field access.  */
+      if (no_names >= no_namebuckets)
+        grow_namebuckets ();
       buck = xcalloc (1, sizeof *buck);
       buck->ptr = fdes;
-      buck->next = namebuckets[hash];
-      namebuckets[hash] = buck;
+      buck->hash = hash_name (fname);
+      buck->next = namebuckets[buck->hash & (no_namebuckets - 1)];
+      namebuckets[buck->hash & (no_namebuckets - 1)] = buck;
+      no_names++;
       /* Link the field into the record description.  */
       if (!fieldlist)
 	fieldlist = fdes;
       else
-	{
-	  for (f2 = fieldlist; f2->nextfield; f2 = f2->nextfield)
-	    ;
-	  f2->nextfield = fdes;
-	}
+        lastfield->nextfield = fdes;
+      lastfield = fdes;
     }
   fdes->valid = 1; /* This is in the current record.  */
   return fdes;
@@ -1816,16 +2276,20 @@ static DATA
 expand_data_slot (FIELD field, DATA data)
 {
   DATA d, d2;
+  size_t size;
 
+  /* A value in the mapped input may be longer than the buffer.  */
+  size = data->used > data->size? data->used : data->size;
   for (d = unused_data; d; d = d->next)
-    if (d->size > data->size)
+    if (d->size > size)
       break;
   if (!d)
     {
-      d = xmalloc (sizeof *d + data->size + 200);
-      d->size = data->size + 200 + 1;
+      d = xmalloc (sizeof *d + size + 200);
+      d->size = size + 200 + 1;
     }
-  memcpy (d->d, data->d, data->used);
+  memcpy (d->buf, data->d, data->used);
+  d->d = d->buf;
   d->used = data->used;
   d->index = data->index;
   d->activ = data->activ;
@@ -1848,6 +2312,21 @@ expand_data_slot (FIELD field, DATA data)
 }
 
 
+/*
+ * Make sure that the value of DATA is stored in its own buffer and
+ * not in the mapped input.
+ */
+static DATA
+own_data_slot (FIELD field, DATA data)
+{
+  if (data->used >= data->size)
+    return expand_data_slot (field, data);
+  memcpy (data->buf, data->d, data->used);
+  data->d = data->buf;
+  return data;
+}
+
+
 /*
  * Begin a new record after closing the last one.
  */
@@ -1861,6 +2340,16 @@ new_record (long offset)
 }
 
 
+/* Return the field for the output field OF.  The lookup is cached
+   once the field has been seen.  */
+static INLINE FIELD
+get_outfield (OUTFIELD of)
+{
+  if (!of->field)
+    of->field = find_field (of->name);
+  return of->field;
+}
+
 static FIELD
 get_first_field ()
 {
@@ -1870,12 +2359,11 @@ get_first_field ()
   if (opt.outfields)
     {
       of = opt.outfields;
-      for (f = fieldlist; f; f = f->nextfield)
-	if (!strcmp (f->name, of->name))
-	  {
-	    next_outfield = of;
-	    return f;
-	  }
+      if ((f = get_outfield (of)))
+        {
+          next_outfield = of;
+          return f;
+        }
       next_outfield = NULL;
       return NULL;
     }
@@ -1892,12 +2380,11 @@ get_next_field ()
     {
       if (next_outfield && (of = next_outfield->next))
 	{
-	  for (f = fieldlist; f; f = f->nextfield)
-	    if (!strcmp (f->name, of->name))
-	      {
-		next_outfield = of;
-		return f;
-	      }
+          if ((f = get_outfield (of)))
+            {
+              next_outfield = of;
+              return f;
+            }
 	}
       next_outfield = NULL;
       return NULL;
@@ -1922,9 +2409,8 @@ select_record_p (void)
 
   for (se=opt.selectexpr; se; se = se->next)
     {
-      for (f = fieldlist; f; f = f->nextfield)
-        if (!strcmp (f->name, se->name))
-          break;
+      if (!(f = se->field))
+        f = se->field = find_field (se->name);
       if (!f || !f->valid)
         {
           /* No such field.  */
@@ -1946,25 +2432,29 @@ select_record_p (void)
           for (d = f->data; d; d = d->next)
             if (d->activ)
               break;
+          numvalue = 0;
           if (!d)
             {
               value = "";
               valuelen = 0;
-              numvalue = 0;
             }
           else
             {
-              char tmpbuf[25];
               value = d->d;
               valuelen = d->used;
-              n = valuelen;
-              if (n > sizeof tmpbuf - 1)
-                n = sizeof tmpbuf -1;
-              memcpy (tmpbuf, value, n);
-              tmpbuf[n] = 0;
-              numvalue = strtol (tmpbuf, NULL, 10);
+              if (se->numeric)
+                {
+                  char tmpbuf[25];
+
+                  n = valuelen;
+                  if (n > sizeof tmpbuf - 1)
+                    n = sizeof tmpbuf -1;
+                  memcpy (tmpbuf, value, n);
+                  tmpbuf[n] = 0;
+                  numvalue = strtol (tmpbuf, NULL, 10);
+                }
             }
-          selen = strlen (se->value);
+          selen = se->valuelen;
 
           switch (se->op)
             {
@@ -1975,10 +2465,12 @@ select_record_p (void)
               result = !(valuelen == selen && !memcmp (value, se->value,selen));
               break;
             case SELECT_SUB:
-              result = !!memstr (value, valuelen, se->value);
+              result = memstr_skip (value, valuelen,
+                                    se->value, selen, se->skip);
               break;
             case SELECT_NOTSUB:
-              result = !memstr (value, valuelen, se->value);
+              result = !memstr_skip (value, valuelen,
+                                     se->value, selen, se->skip);
               break;
             case SELECT_EMPTY:
               result = !valuelen;
@@ -2031,6 +2523,7 @@ find_sortfield (void)
             sf = xmalloc (sizeof *sf + strlen (f->name));
             sf->next = NULL;
             sf->flags = 0;
+            sf->field = NULL;
             strcpy (sf->name, f->name);
             opt.sortfields = sf;
             break;
@@ -2041,9 +2534,7 @@ find_sortfield (void)
   if (!sf)
     return NULL;
 
-  for (f = fieldlist; f; f = f->nextfield)
-    if (!strcmp (f->name, sf->name))
-      break;
+  f = find_field (sf->name);
   if (f && f->valid)
     return f;
 
@@ -2091,6 +2582,9 @@ finish_record ()
 	  sort->d[n] = 0; /* Make sure it is a string.  */
 	  sort->next = sortlist;
 	  sortlist = sort;
+          sortlist_mem += sizeof *sort + n + 1 + sizeof sort;
+          if (!opt.uniqmode && sortlist_mem > opt.sortmem)
+            spill_sortlist ();
 	}
       else if (opt.selectexpr && !select_record_p ())
         ;
@@ -2249,7 +2743,6 @@ print_format2 (int flushit)
   static int pending = 0;
   static int totlines = 0;
   static char *names[] = { "Name", "Street", "City", NULL };
-  NAMEBUCKET buck;
   FIELD f = NULL;
   DATA d;
   int n, len, lines = 0;
@@ -2273,12 +2766,7 @@ print_format2 (int flushit)
 
   for (n = 0; !flushit && (name = names[n]); n++)
     {
-      for (buck = namebuckets[hash_name (name)]; buck; buck = buck->next)
-	if (!strcasecmp (buck->ptr->name, name))
-	  {
-	    f = buck->ptr;
-	    break;
-	  }
+      f = lookup_field_name (name);
       if (!f)
 	continue;
 
@@ -2314,166 +2802,235 @@ print_format2 (int flushit)
 }
 
 
+/* Add an item of TYPE to the compiled template.  */
+static TPLITEM *
+add_template_item (tplitem_t type, const char *text, size_t len)
+{
+  static size_t allocated;
+  TPLITEM *item;
+
+  if (tex.nitems == allocated)
+    {
+      allocated += 64;
+      tex.items = realloc (tex.items, allocated * sizeof *tex.items);
+      if (!tex.items)
+        {
+          fprintf (stderr, PGMNAME ": out of memory\n");
+          exit (2);
+        }
+    }
+  item = &tex.items[tex.nitems++];
+  memset (item, 0, sizeof *item);
+  item->type = type;
+  item->text = text;
+  item->len = len;
+  return item;
+}
+
+
+static char *
+xstrndup (const char *s, size_t n)
+{
+  char *p = xmalloc (n + 1);
+
+  memcpy (p, s, n);
+  p[n] = 0;
+  return p;
+}
+
+
+/* Read the template from FP and compile it into TEX.ITEMS.  The
+   template is then printed by walking these items, so that it is
+   scanned only once and not for every record.  */
 static void
-print_template (int flushit)
+compile_template (FILE *fp)
 {
-  char pseudo_op[200];
-  int c, pseudo_op_idx = 0;
-  int state = 0;
+  char *buf = NULL;
+  size_t size = 0, len = 0, n;
+  const char *s, *lit, *op, *end;
+  TPLITEM *item;
 
-  if (flushit && tex.end_block)
+  do
     {
-      if (fseek (tex.fp, tex.end_block, SEEK_SET))
-	{
-	  fprintf (stderr, PGMNAME ": error seeking to offset %ld\n",
-		   tex.end_block);
-	  exit (1);
-	}
+      if (len == size)
+        {
+          size += 8192;
+          buf = realloc (buf, size);
+          if (!buf)
+            {
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
+            }
+        }
+      n = fread (buf + len, 1, size - len, fp);
+      len += n;
+    }
+  while (n);
+  if (ferror (fp))
+    {
+      fprintf (stderr, PGMNAME ":%s: read error\n", opt.template);
+      exit (1);
     }
 
-  while ((c = getc (tex.fp)) != EOF)
+  end = buf + len;
+  for (lit = s = buf; s < end; )
     {
-      switch (state)
-	{
-	case 0:
-	  if (c == '@')
-	    state = 1;
-	  else
-	    putchar (c);
-	  break;
-	case 1:
-	  if (c == '@')
-	    {
-	      state = 2;
-	      pseudo_op_idx = 0;
-	    }
-	  else
-	    {
-	      putchar ('@');
-	      ungetc (c, tex.fp);
-	      state = 0;
-	    }
-	  break;
-	case 2:		/* pseudo-op start */
-	  if (pseudo_op_idx >= sizeof (pseudo_op) - 1)
-	    {
-	      fprintf (stderr, PGMNAME ": pseudo-op too long\n");
-	      exit (1);
-	    }
-	  else if (c == '\n')
-	    {
-	      fprintf (stderr, PGMNAME ": invalid pseudo-op - ignored\n");
-	      pseudo_op[pseudo_op_idx] = 0;
-	      fputs (pseudo_op, stdout);
-	      putchar ('\n');
-	      state = 0;
-	    }
-	  else if (c == '@'
-		   && pseudo_op_idx && pseudo_op[pseudo_op_idx - 1] == '@')
-	    {
-	      pseudo_op[pseudo_op_idx - 1] = 0;
-	      state = 0;
-	      if (!flushit && process_template_op (pseudo_op))
-		return;
-	    }
-	  else
-	    pseudo_op[pseudo_op_idx++] = c;
-	  break;
+      if (*s != '@')
+        {
+          s++;
+          continue;
+        }
+      if (s + 1 == end)
+        {
+          /* A single '@' at EOF: Dropped like the pseudo-op start.  */
+          add_template_item (TPL_LITERAL, lit, s - lit);
+          add_template_item (TPL_UNCLOSED, NULL, 0);
+          lit = s = end;
+          break;
+        }
+      if (s[1] != '@')
+        {
+          s++;
+          continue;
+        }
+      if (s > lit)
+        add_template_item (TPL_LITERAL, lit, s - lit);
 
-	default:
-	  abort ();
-	}
+      /* Scan the pseudo-op up to the first "@@".  */
+      for (op = s += 2; s < end && *s != '\n'; s++)
+        {
+          if (s - op >= 199)
+            {
+              fprintf (stderr, PGMNAME ": pseudo-op too long\n");
+              exit (1);
+            }
+          if (*s == '@' && s > op && s[-1] == '@')
+            break;
+        }
+      if (s == end)
+        {
+          add_template_item (TPL_UNCLOSED, NULL, 0);
+          lit = end;
+          break;
+        }
+      else if (*s == '\n')
+        {
+          add_template_item (TPL_INVALID, xstrndup (op, s - op), 0);
+          lit = ++s;
+          continue;
+        }
+
+      /* We have the pseudo-op in (OP,S-1).  */
+      op = xstrndup (op, s - 1 - op);
+      lit = ++s;
+      if (!strcasecmp (op, "begin-record-block"))
+        add_template_item (TPL_BEGIN, op, 0);
+      else if (!strcasecmp (op, "end-record-block"))
+        add_template_item (TPL_END, op, 0);
+      else if (!strcasecmp (op, "next-record"))
+        add_template_item (TPL_NEXT, op, 0);
+      else if (!strcasecmp (op, "next-record-rewind"))
+        add_template_item (TPL_NEXT_REWIND, op, 0);
+      else if (!strcasecmp (op, "_recno"))
+        add_template_item (TPL_RECNO, op, 0);
+      else /* Take it as the key to the record data. */
+        {
+          const char *p = strchr (op, ':');
+
+          item = add_template_item (TPL_FIELD, op, 0);
+          item->name = xstrndup (op, p? p - op : strlen (op));
+          if (p && !strncmp (p + 1, "N=", 2))
+            item->lfrepl = p + 3;
+        }
     }
-  if (c == EOF)
+  if (end > lit)
+    add_template_item (TPL_LITERAL, lit, end - lit);
+  /* BUF is referenced by the literals and thus not released.  */
+}
+
+
+static void
+print_template (int flushit)
+{
+  TPLITEM *item;
+
+  if (flushit && tex.end_block)
+    tex.pos = tex.end_block;
+
+  while (tex.pos < tex.nitems)
     {
-      if (ferror (tex.fp))
-	{
-	  fprintf (stderr, PGMNAME ":%s: read error\n", opt.template);
-	  exit (1);
-	}
-      else if (state)
-	{
-	  fprintf (stderr, PGMNAME ":%s: unclosed pseudo-op\n", opt.template);
-	}
+      item = &tex.items[tex.pos++];
+      switch (item->type)
+        {
+        case TPL_LITERAL:
+          fwrite (item->text, item->len, 1, stdout);
+          break;
+        case TPL_INVALID:
+          fprintf (stderr, PGMNAME ": invalid pseudo-op - ignored\n");
+          fputs (item->text, stdout);
+          putchar ('\n');
+          break;
+        case TPL_UNCLOSED:
+          fprintf (stderr, PGMNAME ":%s: unclosed pseudo-op\n",
+                   opt.template);
+          break;
+        default:
+          if (!flushit && process_template_op (item))
+            return;
+          break;
+        }
     }
-
 }
 
 
 static int
-process_template_op (const char *op)
+process_template_op (TPLITEM *item)
 {
-  NAMEBUCKET buck;
   FIELD f;
   DATA d;
 
-  if (!strcasecmp (op, "begin-record-block"))
+  if (item->type == TPL_BEGIN)
     {
       tex.in_record_block = 1;
       tex.rewind_data = 0;
       tex.record_number = 0;
-      tex.begin_block = ftell (tex.fp);
+      tex.begin_block = tex.pos;
     }
-  else if (!strcasecmp (op, "end-record-block"))
+  else if (item->type == TPL_END)
     {
       tex.in_record_block = 0;
     }
-  else if (!strcasecmp (op, "next-record") && tex.in_record_block)
-    {
-      tex.end_block = ftell (tex.fp);
-      if (fseek (tex.fp, tex.begin_block, SEEK_SET))
-	{
-	  fprintf (stderr, PGMNAME ": error seeking to offset %ld\n",
-		   tex.begin_block);
-	  exit (1);
-	}
-      tex.rewind_data = 0;
-      tex.record_number++;
-      return 1;
-    }
-  else if (!strcasecmp (op, "next-record-rewind") && tex.in_record_block)
+  else if ((item->type == TPL_NEXT || item->type == TPL_NEXT_REWIND)
+           && tex.in_record_block)
     {
-      tex.end_block = ftell (tex.fp);
-      if (fseek (tex.fp, tex.begin_block, SEEK_SET))
-	{
-	  fprintf (stderr, PGMNAME ": error seeking to offset %ld\n",
-		   tex.begin_block);
-	  exit (1);
-	}
-      tex.rewind_data = 1;
+      tex.end_block = tex.pos;
+      tex.pos = tex.begin_block;
+      tex.rewind_data = (item->type == TPL_NEXT_REWIND);
       tex.record_number++;
       return 1;
     }
   else if (!tex.in_record_block)
     {
       fprintf (stderr,
-	       PGMNAME ": pseudo op '%s' not allowed in this context\n", op);
+	       PGMNAME ": pseudo op '%s' not allowed in this context\n",
+               item->text);
     }
-  else if (!strcasecmp (op, "_recno"))
+  else if (item->type == TPL_RECNO)
     {
       printf ("%d", tex.record_number);
     }
-  else /* Take it as the key to the record data. */
+  else /* The key to the record data. */
     {
-      char *p = strchr (op, ':');
-
-      if (p)
-	*p++ = 0; /* Strip modifier. */
-
-      f = NULL;
-      for (buck = namebuckets[hash_name (op)]; buck; buck = buck->next)
-	if (!strcasecmp (buck->ptr->name, op))
-	  {
-	    f = buck->ptr;
-	    break;
-	  }
+      if (!(f = item->field))
+        f = item->field = lookup_field_name (item->name);
       if (f) /* We have an entry with this name.  */
 	{
 	  for (d = f->data; d; d = d->next)
 	    if (d->activ)
 	      {
-		printf ("%s", d->index > 1 ? (opt.texfile?"\\par ":"\n\n"):"");
-		if (p && !strncmp (p, "N=", 2))
+		if (d->index > 1)
+                  fputs (opt.texfile? "\\par " : "\n\n", stdout);
+		if (item->lfrepl)
 		  {
 		    size_t n;
 
@@ -2481,12 +3038,12 @@ process_template_op (const char *op)
 		      if (d->d[n] == '\r')
 			;
 		      else if (d->d[n] == '\n')
-			fputs (p + 2, stdout);
+			fputs (item->lfrepl, stdout);
 		      else
 			putchar (((unsigned char *) d->d)[n]);
 		  }
 		else
-		  printf ("%.*s", (int) d->used, d->d);
+		  fwrite (d->d, d->used, 1, stdout);
 	      }
 	}
     }
@@ -2494,7 +3051,7 @@ process_template_op (const char *op)
 }
 
 
-
+
 static int
 do_sort_fnc_num (const void *arg_a, const void *arg_b)
 {
@@ -2535,16 +3092,26 @@ do_sort_fnc_rev (const void *arg_a, const void *arg_b)
   return strcmp (b->d, a->d);
 }
 
+/* Return the compare function for the requested sort order.  */
+static int (*get_sort_fnc (void)) (const void *, const void *)
+{
+  int reverse = opt.sortfields? (opt.sortfields->flags & SORTFLAG_REVERSE) : 0;
+  int numeric = opt.sortfields? (opt.sortfields->flags & SORTFLAG_NUMERIC) : 0;
+
+  return ((numeric && reverse)? do_sort_fnc_numrev :
+          (numeric           )? do_sort_fnc_num :
+          (reverse           )? do_sort_fnc_rev :
+          /* */                 do_sort_fnc);
+}
+
 /*
  * Sort the sortlist
  */
 static void
-do_sort ()
+sort_sortlist ()
 {
   size_t i, n;
   SORT s, *array;
-  int reverse = opt.sortfields? (opt.sortfields->flags & SORTFLAG_REVERSE) : 0;
-  int numeric = opt.sortfields? (opt.sortfields->flags & SORTFLAG_NUMERIC) : 0;
 
   for (n = 0, s = sortlist; s; s = s->next)
     n++;
@@ -2554,14 +3121,243 @@ do_sort ()
   for (n = 0, s = sortlist; s; s = s->next)
     array[n++] = s;
   array[n] = NULL;
-  qsort (array, n, sizeof *array,
-         (numeric && reverse)? do_sort_fnc_numrev :
-         (numeric           )? do_sort_fnc_num :
-         (reverse           )? do_sort_fnc_rev :
-         /* */                 do_sort_fnc);
+  qsort (array, n, sizeof *array, get_sort_fnc ());
   sortlist = array[0];
   for (i = 0; i < n; i++)
     array[i]->next = array[i + 1];
+  free (array);
+}
+
+
+/* Read the next item of the run R into R->CUR.  At EOF R->CUR is set
+   to NULL.  */
+static void
+read_sortrun (SORTRUN *r)
+{
+  long offset;
+  size_t n;
+
+  if (fread (&offset, sizeof offset, 1, r->fp) != 1
+      || fread (&n, sizeof n, 1, r->fp) != 1)
+    {
+      if (ferror (r->fp))
+        log_error (2, "%s: error reading sort run: %s",
+                   PGMNAME, strerror (errno));
+      r->cur = NULL;
+      return;
+    }
+  if (!r->cur || n > r->cursize)
+    {
+      free (r->cur);
+      r->cur = xmalloc (sizeof *r->cur + n);
+      r->cursize = n;
+    }
+  r->cur->offset = offset;
+  if (fread (r->cur->d, n, 1, r->fp) != 1)
+    log_error (2, "%s: error reading sort run: %s", PGMNAME,
+               ferror (r->fp)? strerror (errno) : "premature EOF");
+}
+
+
+/* Rewind all runs and read their first items.  */
+static void
+start_sortruns (void)
+{
+  int i;
+
+  for (i = 0; i < nsortruns; i++)
+    {
+      rewind (sortruns[i].fp);
+      read_sortrun (&sortruns[i]);
+    }
+}
+
+
+/* Return the run with the least current item or NULL if all runs are
+   exhausted.  FNC is the compare function.  */
+static SORTRUN *
+least_sortrun (int (*fnc) (const void *, const void *))
+{
+  SORTRUN *r = NULL;
+  int i;
+
+  /* There are only a few runs; thus a linear search is sufficient.
+     On ties the earlier run wins.  */
+  for (i = 0; i < nsortruns; i++)
+    if (sortruns[i].cur
+        && (!r || fnc (&sortruns[i].cur, &r->cur) < 0))
+      r = &sortruns[i];
+  return r;
+}
+
+
+static void
+write_sortitem (FILE *fp, SORT s)
+{
+  size_t n = strlen (s->d) + 1;
+
+  if (fwrite (&s->offset, sizeof s->offset, 1, fp) != 1
+      || fwrite (&n, sizeof n, 1, fp) != 1
+      || fwrite (s->d, n, 1, fp) != 1)
+    log_error (2, "%s: error writing sort run: %s", PGMNAME, strerror (errno));
+}
+
+
+static FILE *
+create_sortrun (void)
+{
+  FILE *fp = tmpfile ();
+
+  if (!fp)
+    log_error (2, "%s: error creating temporary file: %s",
+               PGMNAME, strerror (errno));
+  return fp;
+}
+
+
+/* Merge all runs into a single one.  */
+static void
+merge_sortruns (void)
+{
+  int (*fnc) (const void *, const void *) = get_sort_fnc ();
+  SORTRUN *r;
+  FILE *fp;
+  int i;
+
+  if (opt.verbose)
+    log_error (0, "%s: merging %d sort runs", PGMNAME, nsortruns);
+  fp = create_sortrun ();
+  start_sortruns ();
+  while ((r = least_sortrun (fnc)))
+    {
+      write_sortitem (fp, r->cur);
+      read_sortrun (r);
+    }
+  if (fflush (fp))
+    log_error (2, "%s: error writing sort run: %s", PGMNAME, strerror (errno));
+  for (i = 0; i < nsortruns; i++)
+    {
+      fclose (sortruns[i].fp);
+      free (sortruns[i].cur);
+    }
+  memset (sortruns, 0, sizeof sortruns);
+  sortruns[0].fp = fp;
+  nsortruns = 1;
+}
+
+
+/* Sort the items of the sortlist and write them as a new run to a
+   temporary file.  The sortlist is empty afterwards.  */
+static void
+spill_sortlist ()
+{
+  SORT s, s2;
+  FILE *fp;
+
+  if (!sortlist)
+    return;
+  if (nsortruns == MAX_SORT_RUNS)
+    merge_sortruns ();
+
+  sort_sortlist ();
+  fp = create_sortrun ();
+  for (s = sortlist; s; s = s2)
+    {
+      s2 = s->next;
+      write_sortitem (fp, s);
+      free (s);
+    }
+  if (fflush (fp))
+    log_error (2, "%s: error writing sort run: %s", PGMNAME, strerror (errno));
+  sortlist = NULL;
+  sortlist_mem = 0;
+  sortruns[nsortruns].fp = fp;
+  sortruns[nsortruns].cur = NULL;
+  sortruns[nsortruns].cursize = 0;
+  nsortruns++;
+  if (opt.verbose)
+    log_error (0, "%s: sort run %d written", PGMNAME, nsortruns);
+}
+
+
+/*
+ * Sort the sortlist.  If runs have already been written to disk, the
+ * remaining items also go into a run; merging them is then done while
+ * reading them back.
+ */
+static void
+do_sort ()
+{
+  if (nsortruns)
+    spill_sortlist ();
+  else
+    sort_sortlist ();
+}
+
+
+/* Prepare to return the sorted items from the beginning.  Returns
+   false if there are no items at all.  */
+static int
+rewind_sortlist (void)
+{
+  if (nsortruns)
+    {
+      start_sortruns ();
+      return 1;
+    }
+  next_sort = sortlist;
+  return !!next_sort;
+}
+
+
+/* Return the offset of the next record to output or -1 if all
+   records have been output.  */
+static long
+next_sort_offset (void)
+{
+  SORTRUN *r;
+  long offset;
+
+  if (nsortruns)
+    {
+      if (!(r = least_sortrun (get_sort_fnc ())))
+        return -1;
+      offset = r->cur->offset;
+      read_sortrun (r);
+      return offset;
+    }
+
+  /* Skip deleted records.  */
+  while (next_sort && next_sort->offset == -1)
+    next_sort = next_sort->next;
+  if (!next_sort)
+    return -1;
+  offset = next_sort->offset;
+  next_sort = next_sort->next;
+  return offset;
+}
+
+
+/* Return a hash value for the sort data S.  This is the same
+   function as hash_name but case sensitive.  */
+static INLINE unsigned long
+hash_sortdata (const char *s_arg)
+{
+  const unsigned char *s = (const unsigned char*)s_arg;
+  unsigned long hashVal = 0;
+  unsigned long carry;
+
+  for (; *s; s++)
+    {
+      hashVal = (hashVal << 4) + *s;
+      if ((carry = (hashVal & 0xf0000000)))
+        {
+          hashVal ^= (carry >> 24);
+          hashVal ^= carry;
+        }
+    }
+
+  return hashVal;
 }
 
 
@@ -2572,8 +3368,8 @@ do_sort ()
 static void
 do_uniq ()
 {
-  size_t i, n;
-  SORT s, *array;
+  size_t i, n, mask;
+  SORT s, *array, *table;
   int reverse = opt.sortfields? (opt.sortfields->flags & SORTFLAG_REVERSE) : 0;
 
   /* Allocate an array large enough to hold all items.  */
@@ -2583,32 +3379,40 @@ do_uniq ()
     return;
   array = xmalloc ((n + 1) * sizeof *array);
 
-  /* Put all items into the array and mark the duplicates.  */
+  /* The items not yet deleted are kept in a hash table using open
+     addressing; its size is a power of 2 at least twice the number of
+     items.  */
+  for (mask = 1; mask < 2 * n; mask <<= 1)
+    ;
+  table = xcalloc (mask, sizeof *table);
+  mask--;
+
+  /* Put all items into the array and mark the duplicates.  Note that
+     the sortlist is in reverse order of the records.  */
   for (n = 0, s = sortlist; s; s = s->next)
     {
-      if (reverse)
+      for (i = hash_sortdata (s->d) & mask; table[i]; i = (i + 1) & mask)
+        if (!strcmp (table[i]->d, s->d))
+          break;
+
+      if (!table[i])
+        table[i] = s;
+      else if (reverse)
         {
-          for (i=0; i < n; i++)
-            if (array[i]->offset != -1 && !strcmp (array[i]->d, s->d))
-              {
-                /* Same item found.  */
-                array[i]->offset = -1; /* Mark that as deleted.  */
-              }
+          /* Same item found.  */
+          table[i]->offset = -1; /* Mark that as deleted.  */
+          table[i] = s;
         }
       else
         {
-          for (i=0; i < n; i++)
-            if (array[i]->offset != -1 && !strcmp (array[i]->d, s->d))
-              {
-                /* We already have such an item.  */
-                s->offset = -1; /* Mark me as deleted.  */
-                break;
-              }
+          /* We already have such an item.  */
+          s->offset = -1; /* Mark me as deleted.  */
         }
 
       array[n++] = s;
     }
   array[n] = NULL;
+  free (table);
 
   /* Rebuild the sortlist.  Reverse it to keep the order of records.  */
   if (!n)
@@ -2620,10 +3424,321 @@ do_uniq ()
         array[i]->next = array[i-1];
       array[0]->next = NULL;
     }
+  free (array);
+}
+
+
+/* Return the name of the index file for the data file FILENAME.  The
+   caller must free the result.  */
+static char *
+index_file_name (const char *filename, const char *suffix)
+{
+  char *fname;
+
+  fname = xmalloc (strlen (filename) + strlen (opt.indexfield)
+                   + strlen (suffix) + 7);
+  sprintf (fname, "%s.%s.idx%s", filename, opt.indexfield, suffix);
+  return fname;
+}
+
+
+/* Call FNC for all items of the sorted sortlist in order.  */
+static void
+for_each_sortitem (void (*fnc) (void *opaque, SORT s), void *opaque)
+{
+  SORT s;
+
+  if (nsortruns)
+    {
+      if (nsortruns > 1)
+        merge_sortruns ();
+      rewind (sortruns[0].fp);
+      for (read_sortrun (&sortruns[0]); sortruns[0].cur;
+           read_sortrun (&sortruns[0]))
+        fnc (opaque, sortruns[0].cur);
+    }
+  else
+    for (s = sortlist; s; s = s->next)
+      fnc (opaque, s);
+}
+
+
+/* Free the sortlist and the sort runs.  */
+static void
+release_sortlist (void)
+{
+  SORT s, s2;
+  int i;
+
+  for (s = sortlist; s; s = s2)
+    {
+      s2 = s->next;
+      free (s);
+    }
+  sortlist = NULL;
+  sortlist_mem = 0;
+  for (i = 0; i < nsortruns; i++)
+    {
+      fclose (sortruns[i].fp);
+      free (sortruns[i].cur);
+    }
+  memset (sortruns, 0, sizeof sortruns);
+  nsortruns = 0;
+}
+
+
+struct write_index_parm_s
+{
+  FILE *fp;
+  size_t nentries;
+  size_t keypos;
+};
+
+
+static void
+write_index_key (void *opaque, SORT s)
+{
+  struct write_index_parm_s *parm = opaque;
+
+  if (fputs (s->d, parm->fp) == EOF || putc (0, parm->fp) == EOF)
+    return;
+  parm->nentries++;
+}
+
+
+static void
+write_index_entry (void *opaque, SORT s)
+{
+  struct write_index_parm_s *parm = opaque;
+  INDEXENTRY e;
+
+  e.offset = s->offset;
+  e.key = parm->keypos;
+  parm->keypos += strlen (s->d) + 1;
+  fwrite (&e, sizeof e, 1, parm->fp);
+}
+
+
+/* Create the index file for FILENAME whose stat information is ST.
+   Returns true on success.  */
+static int
+build_index (const char *filename, struct stat *st)
+{
+  char *fname, *tmpname;
+  OUTFIELD sf;
+  INDEXHDR hdr;
+  struct write_index_parm_s parm;
+  int okay;
+
+  if (opt.verbose)
+    log_error (0, "%s: creating index for field '%s'",
+               filename, opt.indexfield);
+
+  /* Collect the keys by sorting on the indexed field.  */
+  sf = xmalloc (sizeof *sf + strlen (opt.indexfield));
+  sf->next = NULL;
+  sf->flags = 0;
+  sf->field = NULL;
+  strcpy (sf->name, opt.indexfield);
+  opt.sortfields = sf;
+  opt.sortmode = 1;
+  process (filename);
+  do_sort ();
+  opt.sortmode = 0;
+  opt.sortfields = NULL;
+  free (sf);
+
+  fname = index_file_name (filename, "");
+  tmpname = index_file_name (filename, ".tmp");
+  memset (&parm, 0, sizeof parm);
+  parm.fp = fopen (tmpname, "wb");
+  if (!parm.fp)
+    {
+      fprintf (stderr, PGMNAME ": warning: can't create `%s': %s\n",
+               tmpname, strerror (errno));
+      release_sortlist ();
+      free (tmpname);
+      free (fname);
+      return 0;
+    }
+
+  memset (&hdr, 0, sizeof hdr);
+  fwrite (&hdr, sizeof hdr, 1, parm.fp);
+  for_each_sortitem (write_index_key, &parm);
+  while (ftell (parm.fp) % INDEXENTRY_ALIGN)
+    putc (0, parm.fp);
+  memcpy (hdr.magic, INDEX_MAGIC, sizeof hdr.magic);
+  hdr.hdrsize = sizeof hdr;
+  hdr.byteorder = 0x01020304;
+  hdr.size = st->st_size;
+  hdr.mtime = st->st_mtime;
+  hdr.nentries = parm.nentries;
+  hdr.entries = ftell (parm.fp);
+  strcpy (hdr.field, opt.indexfield);
+  parm.keypos = sizeof hdr;
+  for_each_sortitem (write_index_entry, &parm);
+  rewind (parm.fp);
+  fwrite (&hdr, sizeof hdr, 1, parm.fp);
+  release_sortlist ();
+
+  okay = !ferror (parm.fp);
+  if (fclose (parm.fp))
+    okay = 0;
+  if (okay && rename (tmpname, fname))
+    okay = 0;
+  if (!okay)
+    {
+      fprintf (stderr, PGMNAME ": warning: error writing `%s': %s\n",
+               fname, strerror (errno));
+      remove (tmpname);
+    }
+  free (tmpname);
+  free (fname);
+  return okay;
+}
+
+
+/* Map the index for FILENAME and check that it is valid for the data
+   file with the stat information ST.  Returns the header or NULL.  */
+static const INDEXHDR *
+map_index (const char *filename, struct stat *st, size_t *r_maplen)
+{
+  char *fname = index_file_name (filename, "");
+  const INDEXHDR *hdr;
+  struct stat ist;
+  void *p;
+  int fd;
+
+  fd = open (fname, O_RDONLY);
+  free (fname);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &ist) || ist.st_size < sizeof *hdr
+      || ist.st_size != (size_t)ist.st_size)
+    {
+      close (fd);
+      return NULL;
+    }
+  p = mmap (NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  hdr = p;
+  if (memcmp (hdr->magic, INDEX_MAGIC, sizeof hdr->magic)
+      || hdr->hdrsize != sizeof *hdr || hdr->byteorder != 0x01020304
+      || hdr->size != st->st_size || hdr->mtime != st->st_mtime
+      || strncmp (hdr->field, opt.indexfield, sizeof hdr->field)
+      || hdr->entries <= sizeof *hdr
+      || hdr->entries > ist.st_size
+      || hdr->entries % INDEXENTRY_ALIGN
+      || ((char*)p)[hdr->entries - 1]
+      || (ist.st_size - hdr->entries) / sizeof (INDEXENTRY) != hdr->nentries)
+    {
+      munmap (p, ist.st_size);
+      return NULL; /* Outdated or not an index.  */
+    }
+  *r_maplen = ist.st_size;
+  return hdr;
+}
+
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  long aval = *(const long *)a;
+  long bval = *(const long *)b;
+
+  return aval < bval? -1 : aval > bval? 1 : 0;
+}
+
+
+/* Prepare the processing of FILENAME using the index on
+   opt.indexfield.  The index is built if it does not exist or is
+   outdated.  If there is a select for an exact value of the indexed
+   field, the offsets of the matching records are put into the
+   sortlist and the sort mode is set so that process only looks at
+   these records.  */
+static void
+use_index (const char *filename)
+{
+  struct stat st;
+  const INDEXHDR *hdr;
+  const INDEXENTRY *entries;
+  const char *base;
+  size_t maplen, lo, hi, mid, n, i;
+  SELECTEXPR se;
+  long *offsets;
+  SORT s;
+
+  if (stat (filename, &st) || !S_ISREG (st.st_mode))
+    {
+      fprintf (stderr, PGMNAME ": sorry, --index requires a regular file\n");
+      exit (1);
+    }
+
+  if (!(hdr = map_index (filename, &st, &maplen)))
+    {
+      if (!build_index (filename, &st)
+          || !(hdr = map_index (filename, &st, &maplen)))
+        return;  /* Process the file without the index.  */
+    }
+
+  for (se = opt.selectexpr; se; se = se->next)
+    if (se->op == SELECT_SAME && !strcmp (se->name, opt.indexfield))
+      break;
+  if (!se)
+    {
+      munmap ((void*)hdr, maplen);
+      return;
+    }
+
+  /* Find the first entry with the value using a binary search.  */
+  base = (const char*)hdr;
+  entries = (const INDEXENTRY*)(base + hdr->entries);
+  lo = 0;
+  hi = hdr->nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (entries[mid].key < sizeof *hdr || entries[mid].key >= hdr->entries)
+        log_error (2, "%s: index is corrupted", filename);
+      if (strcmp (base + entries[mid].key, se->value) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  for (n = 0; lo + n < hdr->nentries; n++)
+    {
+      if (entries[lo+n].key < sizeof *hdr
+          || entries[lo+n].key >= hdr->entries)
+        log_error (2, "%s: index is corrupted", filename);
+      if (strcmp (base + entries[lo+n].key, se->value))
+        break;
+    }
+
+  /* Output the records in the order of the file.  */
+  offsets = xmalloc ((n + 1) * sizeof *offsets);
+  for (i = 0; i < n; i++)
+    offsets[i] = entries[lo+i].offset;
+  munmap ((void*)hdr, maplen);
+  qsort (offsets, n, sizeof *offsets, compare_offsets);
+  for (i = n; i > 0; i--)
+    {
+      s = xcalloc (1, sizeof *s);
+      s->offset = offsets[i-1];
+      s->next = sortlist;
+      sortlist = s;
+    }
+  free (offsets);
+  if (opt.verbose)
+    log_error (0, "%s: %lu record%s found in index", filename,
+               (unsigned long)n, n == 1? "":"s");
+  opt.sortmode = 2;
 }
 
 /*
 Local Variables:
-compile-command: "cc -Wall -O2 -o addrutil addrutil.c"
+compile-command: "cc -Wall -O2 -DHAVE_PTHREAD -o addrutil addrutil.c -lpthread"
 End:
 */
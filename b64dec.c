@@ -18,23 +18,37 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define digitp(p)   ((p) >= '0' && (p) <= '9')
-#define hexdigitp(a) (digitp (a)                     \
-                      || ((a) >= 'A' && (a) <= 'F')  \
-                      || ((a) >= 'a' && (a) <= 'f'))
-#define ascii_isspace(a) ((a)==' ' || (a)=='\n' || (a)=='\r' || (a)=='\t')
-#define xtoi_1(p)   ((p) <= '9'? ((p)- '0'): \
-                     (p) <= 'F'? ((p)-'A'+10):((p)-'a'+10))
+#define BUFFER_SIZE 65536
 
+/* The value of a hex digit, -2 for white space or -1. */
+static signed char hexval[256];
 
+static unsigned char inbuf[BUFFER_SIZE];
+static unsigned char outbuf[BUFFER_SIZE/2];
+
+
+static void
+init_tables (void)
+{
+  int i;
+
+  memset (hexval, -1, sizeof hexval);
+  for (i=0; i < 10; i++)
+    hexval['0'+i] = i;
+  for (i=0; i < 6; i++)
+    hexval['A'+i] = hexval['a'+i] = 10 + i;
+  hexval[' '] = hexval['\n'] = hexval['\t'] = hexval['\r'] = -2;
+}
 
 
 int
 main (int argc, char **argv )
 {
-  int c1, c2;
-  unsigned int value;
+  size_t inlen, inpos, outlen;
+  int v1, v2;
+  int pending;  /* The first nibble or -1.  */
 
   if ( argc > 1 ) 
     {
@@ -43,33 +57,62 @@ main (int argc, char **argv )
     }
     
 
-  while ( (c1=getchar ()) != EOF )
+  init_tables ();
+  pending = -1;
+  while ( (inlen = fread (inbuf, 1, sizeof inbuf, stdin)) )
     {
-      if (ascii_isspace (c1))
-        continue;
-      if (!hexdigitp (c1))
-        {
-          fprintf (stderr, "undump: non hex-digit encountered\n");
-          return 1;
-        }
-      if ( (c2=getchar ()) == EOF )
+      inpos = outlen = 0;
+      if (pending != -1)
         {
-          fprintf (stderr, "undump: error reading second nibble\n");
-          return 1;
+          /* The second nibble is the first octet of this block.  */
+          v1 = pending;
+          pending = -1;
+          goto second_nibble;
         }
-      if (!hexdigitp (c2))
+      while (inpos < inlen)
         {
-          fprintf (stderr, "undump: second nibble is not a hex-digit\n");
-          return 1;
+          v1 = hexval[inbuf[inpos++]];
+          if (v1 == -2)
+            continue;
+          if (v1 < 0)
+            {
+              fwrite (outbuf, outlen, 1, stdout);
+              fprintf (stderr, "undump: non hex-digit encountered\n");
+              return 1;
+            }
+          if (inpos == inlen)
+            {
+              pending = v1;
+              break;
+            }
+        second_nibble:
+          v2 = hexval[inbuf[inpos++]];
+          if (v2 < 0)
+            {
+              fwrite (outbuf, outlen, 1, stdout);
+              fprintf (stderr, "undump: second nibble is not a hex-digit\n");
+              return 1;
+            }
+          outbuf[outlen++] = v1 * 16 + v2;
         }
-      value = xtoi_1 (c1) * 16 + xtoi_1 (c2);
-      putchar (value);
+      if (outlen)
+        fwrite (outbuf, outlen, 1, stdout);
+    }
+  if (pending != -1 && !ferror (stdin))
+    {
+      fprintf (stderr, "undump: error reading second nibble\n");
+      return 1;
     }
   if (ferror (stdin))
     {
       fprintf (stderr, "undump: read error\n");
       return 1;
     }
+  if (fflush (stdout) || ferror (stdout))
+    {
+      fprintf (stderr, "undump: write error\n");
+      return 1;
+    }
 
   return 0;
 }
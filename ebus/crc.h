@@ -0,0 +1,49 @@
+/* crc.h - CRC functions for the nodes and the host tools
+ * Copyright (C) 2011 g10 Code GmbH
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* On the nodes the table is kept in the flash memory.  */
+#ifdef __AVR__
+# include <avr/pgmspace.h>
+# define CRC_TABLE_ATTR PROGMEM
+# define CRC_TABLE_WORD(i) pgm_read_word (crc_ccitt_table + (i))
+#else
+# define CRC_TABLE_ATTR
+# define CRC_TABLE_WORD(i) (crc_ccitt_table[(i)])
+#endif
+
+/* The initial value of the CRC.  */
+#define CRC_CCITT_INIT 0xffff
+
+extern const uint16_t crc_ccitt_table[256] CRC_TABLE_ATTR;
+
+/* Update CRC with DATA.  This is the same as the AVR's
+   _crc_ccitt_update but uses a lookup table.  */
+static inline uint16_t
+crc_ccitt_update (uint16_t crc, uint8_t data)
+{
+  return (crc >> 8) ^ CRC_TABLE_WORD ((crc ^ data) & 0xff);
+}
+
+uint16_t compute_crc (const unsigned char *msg, size_t msglen);
+
+#endif /*CRC_H*/
@@ -30,9 +30,9 @@
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
 #include <avr/sleep.h>
-#include <util/crc16.h>
 
 #include "ebus.h"
+#include "crc.h"
 
 
 
@@ -73,36 +73,79 @@
 # error Specified baud rate not supported
 #endif
 
+/* The time for one octet in units of 10us.  */
+#define T_c_10US  ((uint32_t)10 * 100000 / BAUD)
+
+
+/* Number of slots in the receive and transmit rings.  Must be a power
+   of 2.  */
+#define RX_SLOTS 4
+#define TX_SLOTS 4
+
 
 static volatile unsigned int frames_sent;
 static volatile unsigned int frames_received;
 static volatile unsigned int collision_count;
 static volatile unsigned int overflow_count;
-
-/* Flag indicating that a PCINT2 was triggered.  */
-volatile byte rx_pin_level_change;
-
-/* The buffer filled by an ISR with the message.  */
-static volatile byte rx_buffer[MSGSIZE];
+static volatile unsigned int retry_count;
+static volatile byte max_retries;
+
+/* Number of octets seen on the bus.  Multiplied by Tc this gives the
+   time the bus was busy.  */
+static volatile uint32_t bus_octets;
+
+/* Histogram of the time from calling csma_send_message to the
+   successful transmission of the frame.  Bucket 0 counts frames sent
+   within 10ms, bucket N frames sent within 10*2^N ms, and the last
+   bucket all slower frames.  */
+#define LATENCY_BUCKETS 8
+static volatile unsigned int latency_hist[LATENCY_BUCKETS];
+
+/* The ring of buffers filled by the ISR with received messages.  The
+   ISR fills the slot at RX_HEAD and advances RX_HEAD after a valid
+   frame has been received; the main function processes the slot at
+   RX_TAIL and advances it with csma_message_done.  The ring is full
+   if advancing RX_HEAD would make it equal to RX_TAIL.  */
+static volatile byte rx_ring[RX_SLOTS][MSGSIZE];
+static volatile byte rx_head;
+static volatile byte rx_tail;
+
+/* The queue of messages to send.  csma_send_message appends at
+   TX_HEAD; the transmitter takes the messages from TX_TAIL.  */
+static byte tx_queue[TX_SLOTS][MSGSIZE];
+static uint16_t tx_queue_crc[TX_SLOTS];
+static uint16_t tx_queue_time[TX_SLOTS];
+static volatile byte tx_head;
+static volatile byte tx_tail;
 
 /* The buffer with the currently sent message.  We need to store it to
    send retries.  It is also used by the receiver to detect collisions.  */
 static volatile byte tx_buffer[MSGSIZE];
 static volatile uint16_t tx_buffer_crc;
+static uint16_t tx_buffer_time;  /* The tick count at queuing time.  */
 
 /* Flag set if we do not want to receive but check our own sending for
    collisions.  */
 static volatile byte check_sending;
 
-/* If true RX_BUFFER has a new message.  This flag is set by the ISR
-   and must be cleared by the main fucntion so that the ISR can
-   continue to work.  */
-static volatile byte rx_ready;
-
+/* The state of the transmitter.  All transitions are done by the
+   ISRs, except for the start from TX_IDLE.  */
+enum
+  {
+    TX_IDLE = 0,   /* Nothing to send.  */
+    TX_WAIT_IDLE,  /* Waiting for TX_LOOPS+1 quiet periods of Tc.  */
+    TX_SENDING,    /* Feeding the UART from the UDRE interrupt.  */
+    TX_CHECKING    /* Waiting for the receiver to check our frame.  */
+  };
+static volatile byte tx_state;
+static volatile byte tx_loops;
+static byte tx_backoff;   /* The current backoff exponent.  */
+static byte tx_tccount;   /* Periods of Tc waited in TX_CHECKING.  */
+static byte tx_pos;       /* The next octet of TX_BUFFER to send.  */
+static byte tx_escaped;   /* If not 0 this octet needs to be sent next.  */
 
 
 
-
 /* Reset the gap timer (timer 0).  Note that this resets both
    timers.  */
 static void
@@ -121,45 +164,120 @@ reset_retry_timer (void)
 }
 
 
-static inline int
-t_c_reached_p (void)
+
+/*
+   Transmitter state machine.  These functions are called with
+   interrupts disabled, either from an ISR or from csma_send_message.
+ */
+
+
+/* Wait until the bus has been idle for LOOPS+1 periods of Tc.  Any
+   level change on the RX pin restarts the current period.  */
+static void
+tx_wait_idle (byte loops)
 {
-  return !!(TIFR0 & _BV(OCF0A));
+  tx_loops = loops;
+  tx_state = TX_WAIT_IDLE;
+
+  PCMSK2  = _BV(PCINT16);  /* We only want to use this pin.  */
+  PCICR  |= _BV(PCIE2);
+
+  reset_retry_timer ();
+  TIMSK0 = _BV(OCIE0A);
 }
 
 
+/* Take the next message from the queue and start to send it.  */
 static void
-wait_t_c_reached (void)
+tx_start_next (void)
 {
-  set_sleep_mode (SLEEP_MODE_IDLE);
-  while (!t_c_reached_p ())
-    {
-      cli();
-      if (!t_c_reached_p ())
-        {
-          sleep_enable ();
-          sei ();
-          sleep_cpu ();
-          sleep_disable ();
-        }
-      sei ();
-    }
+  byte idx;
+
+  for (idx=0; idx < MSGSIZE; idx++)
+    tx_buffer[idx] = tx_queue[tx_tail][idx];
+  tx_buffer_crc = tx_queue_crc[tx_tail];
+  tx_buffer_time = tx_queue_time[tx_tail];
+  tx_backoff = 0;
+
+  tx_wait_idle (0);
 }
 
 
-/* Compute the CRC for MSG.  MSG must be of MSGSIZE.  The CRC used is
-   possible not the optimal CRC for our message length.  However we
-   have a convenient inline function for it.  */
-static uint16_t
-compute_crc (const volatile byte *msg)
+/* The bus is idle - put the frame on the wire.  */
+static void
+tx_start_frame (void)
 {
-  int idx;
-  uint16_t crc = 0xffff;
+  PCMSK2 &= ~_BV(PCINT16);
+  PCICR  &= ~_BV(PCIE2);
+  TIMSK0 = 0;
+
+  /* Switch a lit collision LED off.  We do this here to give a
+     feedback on the used delay.  */
+  if (tx_backoff)
+    LED_Collision &= ~_BV(LED_Collision_BIT);
+
+  check_sending = 1;
+  tx_state = TX_SENDING;
+  tx_pos = 0xff;  /* Start with the sync byte.  */
+  tx_escaped = 0;
+
+  /* Switch TX LED on.  */
+  LED_Transmit |= _BV(LED_Transmit_BIT);
+
+  /* Enable the LT1785 driver output (DE) and let the UDRE interrupt
+     do the rest.  */
+  PORTD |= _BV(2);
+  UCSR0B |= _BV(UDRIE0);
+}
 
-  for (idx=0; idx < MSGSIZE; idx++)
-    crc = _crc_ccitt_update (crc, msg[idx]);
 
-  return crc;
+/* A collision has been detected - schedule a retry.  */
+static void
+tx_resend (void)
+{
+  check_sending = 0;
+
+  /* Switch TX LED off.  */
+  LED_Transmit &= ~_BV(LED_Transmit_BIT);
+
+  /* Exponential backoff up to 32.  For the first two resents we
+     randomly use one or two wait loops; the 3rd and 4th time 1 to 4,
+     then 1 to 8, then 1 to 16 and finally stick to 1 to 32.  The
+     additional loop accounts for the initial wait for an idle bus.  */
+  if (tx_backoff < 8)
+    tx_backoff++;
+  retry_count++;
+  tx_wait_idle ((rand () % (1 << tx_backoff/2)) + 2);
+}
+
+
+/* The frame has been sent and checked.  */
+static void
+tx_done (void)
+{
+  uint16_t ticks;
+  byte bucket;
+
+  check_sending = 0;
+  TIMSK0 = 0;
+
+  /* Switch TX LED and a lit collision LED off.  */
+  LED_Transmit &= ~_BV(LED_Transmit_BIT);
+  LED_Collision &= ~_BV(LED_Collision_BIT);
+
+  frames_sent++;
+  if (tx_backoff > max_retries)
+    max_retries = tx_backoff;  /* Only counts up to 8.  */
+  ticks = get_tick_count () - tx_buffer_time;
+  for (bucket=0; ticks && bucket < LATENCY_BUCKETS - 1; bucket++)
+    ticks >>= 1;
+  latency_hist[bucket]++;
+
+  tx_tail = (tx_tail + 1) & (TX_SLOTS - 1);
+  if (tx_tail != tx_head)
+    tx_start_next ();
+  else
+    tx_state = TX_IDLE;
 }
 
 
@@ -169,10 +287,115 @@ compute_crc (const volatile byte *msg)
  */
 
 
+/* UART data register empty interrupt service routine.  This feeds
+   the frame with byte stuffing to the UART.  */
+ISR (USART_UDRE_vect)
+{
+  byte c;
+
+  if (check_sending == 2)
+    {
+      /* Collision detected - stop sending as soon as possible.  We
+         even disable the driver output right now so that we won't
+         clobber the bus any further with data in the tx queue.  */
+      PORTD &= ~_BV(2);  /* Disable LT1785 driver output.  */
+      UCSR0B &= ~_BV(UDRIE0);
+      tx_resend ();
+      return;
+    }
+
+  if (tx_escaped)
+    {
+      c = tx_escaped;
+      tx_escaped = 0;
+    }
+  else if (tx_pos == 0xff)
+    {
+      c = FRAMESYNCBYTE;
+      tx_pos = 0;
+    }
+  else if (tx_pos < MSGSIZE + 2)
+    {
+      if (tx_pos < MSGSIZE)
+        c = tx_buffer[tx_pos];
+      else if (tx_pos == MSGSIZE)
+        c = tx_buffer_crc >> 8;
+      else
+        c = tx_buffer_crc;
+      tx_pos++;
+      if (c == FRAMESYNCBYTE || c == FRAMEESCBYTE)
+        {
+          tx_escaped = c ^ FRAMEESCMASK;
+          c = FRAMEESCBYTE;
+        }
+    }
+  else
+    {
+      /* All octets are in the UART; wait for the transmit complete
+         interrupt to disable the driver.  */
+      UCSR0B &= ~_BV(UDRIE0);
+      UCSR0B |= _BV(TXCIE0);
+      return;
+    }
+
+  /* Clear the TXC bit by setting it so that the transmit complete
+     interrupt won't trigger before the last octet is out.  */
+  UCSR0A |= _BV(TXC0);
+  UDR0 = c;
+}
+
+
 /* UART tx complete interrupt service routine. */
 ISR (USART_TX_vect)
 {
-  /* Nothing to do.  */
+  UCSR0B &= ~_BV(TXCIE0);
+  if (tx_state != TX_SENDING)
+    return;
+
+  /* Now disable the LT1785 driver output (DE).  It is important to
+     do that as soon as possible.  */
+  PORTD &= ~_BV(2);
+
+  /* Wait until the receiver received and checked all our octets.  */
+  tx_state = TX_CHECKING;
+  tx_tccount = 0;
+  reset_retry_timer ();
+  TIMSK0 = _BV(OCIE0A);
+}
+
+
+/* Timer 0 compare match A interrupt service routine.  This is only
+   enabled while the transmitter waits for something.  */
+ISR (TIMER0_COMPA_vect)
+{
+  reset_retry_timer ();
+
+  switch (tx_state)
+    {
+    case TX_WAIT_IDLE:
+      if (tx_loops)
+        tx_loops--;
+      else
+        tx_start_frame ();
+      break;
+
+    case TX_CHECKING:
+      if (check_sending == 1 && ++tx_tccount > 3)
+        {
+          /* Nothing received for 4*Tc - assume receiver is clogged
+             due to collisions.  */
+          check_sending = 2;
+        }
+      if (check_sending == 2)
+        tx_resend ();
+      else if (!check_sending)
+        tx_done ();
+      break;
+
+    default:
+      TIMSK0 = 0;
+      break;
+    }
 }
 
 
@@ -186,9 +409,11 @@ ISR (USART_RX_vect)
   static byte idx;
   static byte escape;
   static uint16_t crc;
+  static uint16_t rx_crc;  /* The CRC computed over the octets so far.  */
   byte c;
 
   c = UDR0;
+  bus_octets++;
 
   if (sentinel)
     return;
@@ -211,13 +436,15 @@ ISR (USART_RX_vect)
         {
           receiving = 1;
           idx = escape = 0;
+          rx_crc = CRC_CCITT_INIT;
         }
     }
   else if (!receiving)
     ; /* No sync seen, thus skip this octet.  */
-  else if (rx_ready && !check_sending)
+  else if (!idx && !check_sending
+           && ((rx_head + 1) & (RX_SLOTS - 1)) == rx_tail)
     {
-      /* Overflow.  The previous message has not yet been processed.  */
+      /* Overflow.  All slots of the ring are waiting to be processed.  */
       receiving = 0;
       overflow_count++;
     }
@@ -276,7 +503,10 @@ ISR (USART_RX_vect)
           receiving = 0;
         }
       else if (idx < MSGSIZE)
-        rx_buffer[idx++] = c;
+        {
+          rx_ring[rx_head][idx++] = c;
+          rx_crc = crc_ccitt_update (rx_crc, c);
+        }
       else if (idx == MSGSIZE)
         {
           crc = c << 8;
@@ -285,7 +515,7 @@ ISR (USART_RX_vect)
       else /* idx == MSGSIZE + 1 */
         {
           crc |= c;
-          if (crc != compute_crc (rx_buffer))
+          if (crc != rx_crc)
             {
               LED_Collision |= _BV(LED_Collision_BIT);
               collision_count++;
@@ -297,8 +527,9 @@ ISR (USART_RX_vect)
               frames_received++;
               /* Switch a lit collision LED off. */
               LED_Collision &= ~_BV(LED_Collision_BIT);
-              /* Tell the mainloop that there is something to process.  */
-              rx_ready = 1;
+              /* Hand the slot over to the mainloop and tell it that
+                 there is something to process.  */
+              rx_head = (rx_head + 1) & (RX_SLOTS - 1);
               wakeup_main = 1;
             }
           /* Prepare for the next frame.  */
@@ -310,206 +541,53 @@ ISR (USART_RX_vect)
 }
 
 
-/* Pin Change Interrupt Request 2 handler.  */
+/* Pin Change Interrupt Request 2 handler.  A level change on the bus
+   restarts the measurement of the idle time.  */
 ISR (PCINT2_vect)
 {
-  rx_pin_level_change = 1;
-  reset_retry_timer ();
-  rx_pin_level_change = 0;
-}
-
-
-/* Send out the raw byte C.  */
-static void
-send_byte_raw (const byte c)
-{
-  /* Wait until transmit buffer is empty.  */
-  while (!bit_is_set (UCSR0A, UDRE0))
-    ;
-  /* Send the byte.  */
-  UDR0 = c;
-}
-
-
-/* Send byte C with byte stuffing.  */
-static void
-send_byte (const byte c)
-{
-  if (c == FRAMESYNCBYTE || c == FRAMEESCBYTE)
-    {
-      send_byte_raw (FRAMEESCBYTE);
-      send_byte_raw ((c ^ FRAMEESCMASK));
-    }
-  else
-    send_byte_raw (c);
-}
-
-
-static int
-bus_idle_p (void)
-{
-  rx_pin_level_change = 0;
-
   reset_retry_timer ();
-
-  PCMSK2  = _BV(PCINT16);  /* We only want to use this pin.  */
-  PCICR  |= _BV(PCIE2);
-
-  wait_t_c_reached ();
-
-  PCMSK2 &= ~_BV(PCINT16);
-  PCICR  &= ~_BV(PCIE2);
-
-  return !rx_pin_level_change;
 }
 
 
-static void
-wait_bus_idle (void)
-{
-  while (!bus_idle_p ())
-    ;
-}
-
-
-/* Send a message.  This function does the framing and and retries
-   until the message has been sent.  */
+/* Queue a message for sending.  The framing, the collision detection
+   and the retries are done in the background by the ISRs.  This
+   function only blocks if the transmit queue is full.  */
 void
 csma_send_message (const byte *data, byte datalen)
 {
-  byte idx;
-  byte resend = 0;
-  byte backoff = 0;
+  byte next;
+  byte sreg;
+  uint16_t start;
 
-  memcpy ((byte*)tx_buffer, data, datalen);
-  if (datalen < MSGSIZE)
-    memset ((byte*)tx_buffer+datalen, 0, MSGSIZE - datalen);
-
-  tx_buffer_crc = compute_crc (tx_buffer);
+  start = get_tick_count ();
 
-  do
+  /* Wait for a free slot.  */
+  set_sleep_mode (SLEEP_MODE_IDLE);
+  while ((next = ((tx_head + 1) & (TX_SLOTS - 1))) == tx_tail)
     {
-      if (resend)
-        {
-          int nloops;
-
-          /* Exponential backoff up to 32.  For the first two resents
-             we randomly use one or two wait loops; the 3rd and 4th
-             time 1 to 4, then 1 to 8, then 1 to 16 and finally stick
-             to 1 to 32. */
-          if (backoff < 8)
-            backoff++;
-
-          do
-            {
-              wait_bus_idle ();
-              nloops = (rand () % (1 << backoff/2)) + 1;
-
-              while (nloops--)
-                {
-                  reset_retry_timer ();
-                  wait_t_c_reached ();
-                }
-            }
-          while (!bus_idle_p ());
-
-          /* Switch a lit collision LED off.  We do this here to give
-             a feedback on the used delay.  */
-          LED_Collision &= ~_BV(LED_Collision_BIT);
-
-          resend = 0;
-        }
-      else
-        wait_bus_idle ();
-
-      check_sending = 1;
-
-      /* Switch TX LED on.  */
-      LED_Transmit |= _BV(LED_Transmit_BIT);
-
-      /* Before sending we need to clear the TXC bit by setting it.  */
-      UCSR0A |= _BV(TXC0);
-
-      /* Enable the LT1785 driver output (DE).  */
-      PORTD |= _BV(2);
-
-      send_byte_raw (FRAMESYNCBYTE);
-      for (idx=0; idx < MSGSIZE; idx++)
-        {
-          send_byte (tx_buffer[idx]);
-          if (check_sending == 2)
-            {
-              /* Collision detected - stop sending as soon as
-                 possible.  We even disable the driver output right
-                 now so that we won't clobber the bus any further with
-                 data in the tx queue.  */
-              PORTD &= ~_BV(2);  /* Disable LT1785 driver output.  */
-              resend++;
-              break;
-            }
-        }
-
-      if (!resend)
-        {
-          send_byte ((tx_buffer_crc >> 8));
-          send_byte (tx_buffer_crc);
-        }
-
-      /* Wait until transmit is complete.  */
-      while (!bit_is_set (UCSR0A, TXC0))
-        ;
-      UCSR0A |= _BV(TXC0);
-
-      /* Now disable the LT1785 driver output (DE).  It is important
-         to do that as soon as possible.  */
-      PORTD &= ~_BV(2);
-
-      /* Wait until the receiver received and checked all our octets.  */
-      if (check_sending == 1)
+      cli();
+      if (next == tx_tail)
         {
-          byte tccount = 0;
-
-          reset_retry_timer ();
-          while (check_sending == 1)
-            {
-              set_sleep_mode (SLEEP_MODE_IDLE);
-              cli();
-              if (t_c_reached_p ())
-                {
-                  if (++tccount > 3)
-                    {
-                      /* Nothing received for 4*Tc - assume receiver
-                         is clogged due to collisions.  */
-                      check_sending = 2;
-                    }
-                  else
-                    reset_retry_timer ();
-                }
-              else if (check_sending == 1)
-                {
-                  sleep_enable ();
-                  sei ();
-                  sleep_cpu ();
-                  sleep_disable ();
-                }
-              sei ();
-            }
+          sleep_enable ();
+          sei ();
+          sleep_cpu ();
+          sleep_disable ();
         }
-      if (check_sending == 2)
-        resend++;
-
-      check_sending = 0;
-
-      /* Switch TX LED off.  */
-      LED_Transmit &= ~_BV(LED_Transmit_BIT);
-
+      sei ();
     }
-  while (resend);
-
-  /* Switch a lit collision LED off. */
-  LED_Collision &= ~_BV(LED_Collision_BIT);
 
-  frames_sent++;
+  memcpy (tx_queue[tx_head], data, datalen);
+  if (datalen < MSGSIZE)
+    memset (tx_queue[tx_head]+datalen, 0, MSGSIZE - datalen);
+  tx_queue_crc[tx_head] = compute_crc (tx_queue[tx_head], MSGSIZE);
+  tx_queue_time[tx_head] = start;
+
+  sreg = SREG;
+  cli ();
+  tx_head = next;
+  if (tx_state == TX_IDLE)
+    tx_start_next ();
+  SREG = sreg;
 }
 
 
@@ -518,8 +596,8 @@ csma_send_message (const byte *data, byte datalen)
 byte *
 csma_get_message (void)
 {
-  if (rx_ready)
-    return (byte*)rx_buffer;
+  if (rx_tail != rx_head)
+    return (byte*)rx_ring[rx_tail];
   return NULL;
 }
 
@@ -527,20 +605,56 @@ csma_get_message (void)
 void
 csma_message_done (void)
 {
-  rx_ready = 0;
+  if (rx_tail != rx_head)
+    rx_tail = (rx_tail + 1) & (RX_SLOTS - 1);
+  /* Make sure that the mainloop comes back for the next message.  */
+  if (rx_tail != rx_head)
+    wakeup_main = 1;
 }
 
 
+
+/* Return the statistics value WHAT.  The values are grouped in pages
+   of 4 as used by the P_BUSCTL_QRY_STATS response:
+
+     1 - Frames received       5 - Retries
+     2 - Frames sent           6 - Max. retries of one frame
+     3 - Collisions            7 - Bus octets (high word)
+     4 - Overflows             8 - Bus octets (low word)
+
+     9..16 - Latency histogram buckets 0 to 7
+    17     - Tc in units of 10us
+
+   The bus octet counter is updated by the receive interrupt; value 7
+   takes a snapshot of it and value 8 returns the low word of that
+   snapshot.  Thus 7 must be requested before 8.
+*/
 unsigned int
 csma_get_stats (int what)
 {
+  static uint32_t octets;
+  byte sreg;
+
   switch (what)
     {
     case 1: return frames_received;
     case 2: return frames_sent;
     case 3: return collision_count;
     case 4: return overflow_count;
-    default: return 0;
+    case 5: return retry_count;
+    case 6: return max_retries;
+    case 7:
+      sreg = SREG;
+      cli ();
+      octets = bus_octets;
+      SREG = sreg;
+      return octets >> 16;
+    case 8: return octets;
+    case 17: return T_c_10US;
+    default:
+      if (what >= 9 && what < 9 + LATENCY_BUCKETS)
+        return latency_hist[what - 9];
+      return 0;
     }
 }
 
@@ -559,8 +673,8 @@ csma_setup (void)
 #else
   TCCR0B = 0x03;   /* Set prescaler to clk/64.  */
 #endif
-  TIMSK0 = 0x00;   /* No interrupts so that we need to clear the TIFR0
-                      flags ourself.  */
+  TIMSK0 = 0x00;   /* The compare match interrupt is only enabled
+                      while the transmitter is active.  */
   OCR0A  = T_c_CMPVAL; /* Use this for Tc.  */
   OCR0B  = 0;
 }
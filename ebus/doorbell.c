@@ -73,6 +73,7 @@ process_ebus_busctl (byte *msg)
 {
   uint16_t val16;
   byte     val8;
+  byte     idx;
   char is_response = !!(msg[5] & P_BUSCTL_RESPMASK);
 
   if (is_response)
@@ -107,6 +108,23 @@ process_ebus_busctl (byte *msg)
       csma_send_message (msg, MSGSIZE);
       break;
 
+    case P_BUSCTL_QRY_STATS:
+      val8 = msg[6];
+      msg[1] = msg[3];
+      msg[2] = msg[4];
+      msg[3] = config.nodeid_hi;
+      msg[4] = config.nodeid_lo;
+      msg[5] |= P_BUSCTL_RESPMASK;
+      for (idx=0; idx < 4; idx++)
+        {
+          val16 = val8 < 4? csma_get_stats (val8 * 4 + idx + 1) : 0;
+          msg[7+2*idx] = val16 >> 8;
+          msg[8+2*idx] = val16;
+        }
+      msg[15] = val8 == 1? csma_get_stats (17) : 0;
+      csma_send_message (msg, MSGSIZE);
+      break;
+
     default:
       break;
     }
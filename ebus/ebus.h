@@ -54,6 +54,7 @@ byte read_key_s2 (void);
 byte read_key_s3 (void);
 uint16_t get_current_time (void);
 uint16_t get_current_fulltime (byte *r_deci);
+uint16_t get_tick_count (void);
 void set_current_fulltime (uint16_t tim, byte deci);
 void set_debug_flags (uint8_t value);
 
@@ -69,9 +70,14 @@ void csma_message_done (void);
 void onewire_setup (void);
 void onewire_enable (void);
 void onewire_disable (void);
+byte onewire_check_presence (void);
 void onewire_write_byte (uint8_t c);
 uint8_t onewire_read_byte (void);
 void onewire_wait_for_one (void);
+void onewire_temp_start (void);
+void onewire_ticker (void);
+byte onewire_temp_process (void);
+int16_t onewire_temp_value (void);
 
 /*-- i2c.c --*/
 void i2c_setup (void);
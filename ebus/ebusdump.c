@@ -18,14 +18,45 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "protocol.h"
+#include "crc.h"
 
 /* Valid nodes we want to print in --top mode.  */
 #define FIRST_NODE_ID 1
 #define LAST_NODE_ID  5
 
+/* The capture file starts with a magic and then has one record for
+   each frame:
+
+     u32 seconds since Epoch
+     u16 milliseconds
+     u8  flags (bit 0 is set if the CRC is correct)
+     u8  length of the frame including the CRC
+     ... the frame
+
+   All values are big endian.  The index file has the suffix ".idx"
+   and after its magic an entry for the first record after each
+   INDEX_INTERVAL seconds:
+
+     u32 seconds since Epoch
+     u64 offset of the record in the capture file
+ */
+#define CAPTURE_MAGIC "EBUSCAP\x01"
+#define INDEX_MAGIC   "EBUSIDX\x01"
+#define MAGIC_LEN     8
+#define RECORD_HDRLEN 8
+#define INDEX_ENTLEN  12
+#define INDEX_INTERVAL 60
+
 static volatile int ctrl_c_pending;
 
 static void
@@ -35,29 +66,315 @@ control_c_handler (int signo)
   ctrl_c_pending = 1;
 }
 
-static uint16_t
-crc_ccitt_update (uint16_t crc, uint8_t data)
+
+static void
+die (const char *format, ...)
 {
-  data ^= (crc & 0xff);
-  data ^= data << 4;
+  va_list arg_ptr;
 
-  return ((((uint16_t)data << 8) | ((crc >> 8)& 0xff)) ^ (uint8_t)(data >> 4)
-          ^ ((uint16_t)data << 3));
+  fflush (stdout);
+  fputs ("ebusdump: ", stderr);
+  va_start (arg_ptr, format);
+  vfprintf (stderr, format, arg_ptr);
+  va_end (arg_ptr);
+  putc ('\n', stderr);
+  exit (1);
 }
 
-/* Compute the CRC for MSG.  MSG must be of MSGSIZE.  The CRC used is
-   possible not the optimal CRC for our message length.  However we
-   have a convenient inline function for it.  */
-static uint16_t
-compute_crc (const unsigned char *msg)
+
+static void
+put_u32 (unsigned char *p, uint32_t v)
 {
-  int idx;
-  uint16_t crc = 0xffff;
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t
+get_u32 (const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+/* Open the capture file FNAME or its index for appending.  A new
+   file gets the MAGIC; an existing one is checked for it.  */
+static FILE *
+open_for_append (const char *fname, const char *magic)
+{
+  FILE *fp;
+  char buffer[MAGIC_LEN];
+
+  fp = fopen (fname, "a+b");
+  if (!fp)
+    die ("can't open `%s': %s", fname, strerror (errno));
+  if (fread (buffer, MAGIC_LEN, 1, fp) == 1)
+    {
+      if (memcmp (buffer, magic, MAGIC_LEN))
+        die ("`%s' is not an ebusdump file", fname);
+    }
+  else if (fwrite (magic, MAGIC_LEN, 1, fp) != 1)
+    die ("error writing `%s': %s", fname, strerror (errno));
+  fseek (fp, 0, SEEK_END);
+  return fp;
+}
+
+
+/* Read frames from stdin and write them to the capture file FNAME.  */
+static void
+capture (const char *fname)
+{
+  char *idxname;
+  FILE *fp, *idxfp;
+  unsigned char inbuf[4096];
+  unsigned char rec[RECORD_HDRLEN + 48 + 2];
+  unsigned char ent[INDEX_ENTLEN];
+  unsigned char *frame = rec + RECORD_HDRLEN;
+  ssize_t n, i;
+  int c, esc = 0, synced = 0, idx = 0, framelen = 0;
+  unsigned int crc;
+  uint64_t offset;
+  uint32_t next_index = 0;
+  struct timeval tv;
+  unsigned long nframes = 0;
+
+  idxname = malloc (strlen (fname) + 5);
+  if (!idxname)
+    die ("out of core");
+  strcpy (idxname, fname);
+  strcat (idxname, ".idx");
+  fp = open_for_append (fname, CAPTURE_MAGIC);
+  idxfp = open_for_append (idxname, INDEX_MAGIC);
+
+  while (!ctrl_c_pending && (n = read (0, inbuf, sizeof inbuf)))
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          die ("read error: %s", strerror (errno));
+        }
+      for (i=0; i < n; i++)
+        {
+          c = inbuf[i];
+          if (c == FRAMESYNCBYTE)
+            {
+              esc = 0;
+              synced = 1;
+              idx = 0;
+              continue;
+            }
+          if (c == FRAMEESCBYTE && !esc)
+            {
+              esc = 1;
+              continue;
+            }
+          if (!synced)
+            continue;
+          if (esc)
+            {
+              esc = 0;
+              c ^= FRAMEESCMASK;
+            }
+          if (!idx)
+            {
+              switch ((c & PROTOCOL_MSGLEN_MASK))
+                {
+                case PROTOCOL_MSGLEN_48: framelen = 48 + 2; break;
+                case PROTOCOL_MSGLEN_32: framelen = 32 + 2; break;
+                case PROTOCOL_MSGLEN_16: framelen = 16 + 2; break;
+                default: synced = 0; continue;
+                }
+            }
+          frame[idx++] = c;
+          if (idx < framelen)
+            continue;
+          synced = 0;
+
+          gettimeofday (&tv, NULL);
+          crc = compute_crc (frame, framelen - 2);
+          put_u32 (rec, tv.tv_sec);
+          rec[4] = (tv.tv_usec / 1000) >> 8;
+          rec[5] = (tv.tv_usec / 1000);
+          rec[6] = ((crc >> 8) == frame[framelen-2]
+                    && (crc & 0xff) == frame[framelen-1]);
+          rec[7] = framelen;
+
+          if (tv.tv_sec >= next_index)
+            {
+              /* Flush the data before it is referenced by the index.  */
+              fflush (fp);
+              offset = ftell (fp);
+              put_u32 (ent, tv.tv_sec);
+              put_u32 (ent+4, offset >> 32);
+              put_u32 (ent+8, offset);
+              if (fwrite (ent, INDEX_ENTLEN, 1, idxfp) != 1
+                  || fflush (idxfp))
+                die ("error writing `%s': %s", idxname, strerror (errno));
+              next_index = tv.tv_sec - tv.tv_sec % INDEX_INTERVAL
+                           + INDEX_INTERVAL;
+            }
+          if (fwrite (rec, RECORD_HDRLEN + framelen, 1, fp) != 1)
+            die ("error writing `%s': %s", fname, strerror (errno));
+          nframes++;
+        }
+    }
+  if (fclose (fp))
+    die ("error writing `%s': %s", fname, strerror (errno));
+  if (fclose (idxfp))
+    die ("error writing `%s': %s", idxname, strerror (errno));
+  fprintf (stderr, "ebusdump: %lu frames captured\n", nframes);
+  free (idxname);
+}
+
+
+/* Return the offset of the first record to read for records not
+   before FROM using the index of the capture file FNAME.  */
+static uint64_t
+find_offset (const char *fname, uint32_t from)
+{
+  char *idxname;
+  FILE *fp;
+  unsigned char ent[INDEX_ENTLEN];
+  long lo, hi, mid, n;
+  uint64_t offset = MAGIC_LEN;
+
+  idxname = malloc (strlen (fname) + 5);
+  if (!idxname)
+    die ("out of core");
+  strcpy (idxname, fname);
+  strcat (idxname, ".idx");
+  fp = fopen (idxname, "rb");
+  free (idxname);
+  if (!fp)
+    return offset;  /* No index: Read from the start.  */
+
+  fseek (fp, 0, SEEK_END);
+  n = (ftell (fp) - MAGIC_LEN) / INDEX_ENTLEN;
+  /* Find the last entry with a time not after FROM.  */
+  lo = 0;
+  hi = n;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (fseek (fp, MAGIC_LEN + mid * INDEX_ENTLEN, SEEK_SET)
+          || fread (ent, INDEX_ENTLEN, 1, fp) != 1)
+        die ("error reading index: %s", strerror (errno));
+      if (get_u32 (ent) <= from)
+        {
+          offset = ((uint64_t)get_u32 (ent+4) << 32) | get_u32 (ent+8);
+          lo = mid + 1;
+        }
+      else
+        hi = mid;
+    }
+  fclose (fp);
+  return offset;
+}
+
 
-  for (idx=0; idx < 16; idx++)
-    crc = crc_ccitt_update (crc, msg[idx]);
+/* Parse a time given as seconds since the Epoch or as local time in
+   the format "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM[:SS]".  */
+static uint32_t
+parse_time (const char *string)
+{
+  struct tm tm;
+  char *endp;
+  unsigned long value;
+  int n;
 
-  return crc;
+  if (!strchr (string, '-'))
+    {
+      value = strtoul (string, &endp, 10);
+      if (*endp || endp == string)
+        die ("invalid time `%s'", string);
+      return value;
+    }
+
+  memset (&tm, 0, sizeof tm);
+  n = sscanf (string, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+              &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+  if (n != 3 && n != 5 && n != 6)
+    die ("invalid time `%s'", string);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  tm.tm_isdst = -1;
+  return mktime (&tm);
+}
+
+
+/* Print the frames from the capture file FNAME which are in the time
+   window [FROM,TO) and match PROTOCOL and NODE.  A PROTOCOL of -1
+   and a NODE of -1 match everything.  NODE matches the sender and
+   the receiver.  If STREAM is set the frames are written as framed
+   stream, e.g. for housed, instead of printing them.  */
+static void
+replay (const char *fname, uint32_t from, uint32_t to,
+        int protocol, int node, int stream)
+{
+  FILE *fp;
+  unsigned char rec[RECORD_HDRLEN + 255];
+  unsigned char *frame = rec + RECORD_HDRLEN;
+  uint32_t t;
+  int framelen, i, c;
+  time_t atime;
+  struct tm *tp;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    die ("can't open `%s': %s", fname, strerror (errno));
+  if (fread (rec, MAGIC_LEN, 1, fp) != 1 || memcmp (rec, CAPTURE_MAGIC,
+                                                    MAGIC_LEN))
+    die ("`%s' is not an ebusdump file", fname);
+  if (fseek (fp, find_offset (fname, from), SEEK_SET))
+    die ("error seeking in `%s': %s", fname, strerror (errno));
+
+  while (!ctrl_c_pending && fread (rec, RECORD_HDRLEN, 1, fp) == 1)
+    {
+      framelen = rec[7];
+      if (fread (frame, framelen, 1, fp) != 1)
+        break;  /* Truncated.  */
+      t = get_u32 (rec);
+      if (t < from)
+        continue;
+      if (t >= to)
+        break;
+      if (protocol != -1 && frame[0] != protocol)
+        continue;
+      if (node != -1 && framelen > 4
+          && ((frame[1] << 8) | frame[2]) != node
+          && ((frame[3] << 8) | frame[4]) != node)
+        continue;
+
+      if (stream)
+        {
+          putchar (FRAMESYNCBYTE);
+          for (i=0; i < framelen; i++)
+            {
+              c = frame[i];
+              if (c == FRAMESYNCBYTE || c == FRAMEESCBYTE)
+                {
+                  putchar (FRAMEESCBYTE);
+                  c ^= FRAMEESCMASK;
+                }
+              putchar (c);
+            }
+          continue;
+        }
+
+      atime = t;
+      tp = localtime (&atime);
+      printf ("%04d-%02d-%02d %02d:%02d:%02d.%03u",
+              1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
+              tp->tm_hour, tp->tm_min, tp->tm_sec, (rec[4] << 8) | rec[5]);
+      for (i=0; i < framelen; i++)
+        printf (" %02x", frame[i]);
+      fputs ((rec[6] & 1)? " ok\n" : " bad\n", stdout);
+    }
+  if (ferror (fp))
+    die ("error reading `%s': %s", fname, strerror (errno));
+  fclose (fp);
 }
 
 
@@ -75,26 +392,75 @@ main (int argc, char **argv )
   unsigned char buffer[18];
   unsigned int protocol;
 
+  const char *capture_fname = NULL;
+  const char *replay_fname = NULL;
+  uint32_t from = 0, to = 0xffffffff;
+  int want_protocol = -1;
+  int node = -1;
+  int stream = 0;
+
   if (argc)
     {
       argc--; argv++;
     }
 
-  if (argc && !strcmp (*argv, "--raw"))
+  while (argc)
     {
-      rawmode = 1;
+      if (!strcmp (*argv, "--raw"))
+        rawmode = 1;
+      else if (!strcmp (*argv, "--top"))
+        topmode = 1;
+      else if (!strcmp (*argv, "--stream"))
+        stream = 1;
+      else if (argc > 1 && !strcmp (*argv, "--capture"))
+        capture_fname = *++argv, argc--;
+      else if (argc > 1 && !strcmp (*argv, "--replay"))
+        replay_fname = *++argv, argc--;
+      else if (argc > 1 && !strcmp (*argv, "--from"))
+        from = parse_time (*++argv), argc--;
+      else if (argc > 1 && !strcmp (*argv, "--to"))
+        to = parse_time (*++argv), argc--;
+      else if (argc > 1 && !strcmp (*argv, "--protocol"))
+        want_protocol = strtoul (*++argv, NULL, 16), argc--;
+      else if (argc > 1 && !strcmp (*argv, "--node")
+               && strlen (argv[1]) == 5 && argv[1][2] == ':')
+        {
+          argv++; argc--;
+          node = ((strtoul (*argv, NULL, 16) << 8)
+                  | strtoul (*argv+3, NULL, 16));
+        }
+      else
+        break;
       argc--; argv++;
     }
-  else if (argc && !strcmp (*argv, "--top"))
+
+  if (argc || (rawmode && topmode) || (capture_fname && replay_fname)
+      || ((rawmode || topmode) && (capture_fname || replay_fname)))
     {
-      topmode = 1;
-      argc--; argv++;
+      fprintf (stderr,
+               "usage: ebusdump [--raw|--top] < input\n"
+               "       ebusdump --capture FILE < input\n"
+               "       ebusdump --replay FILE [--stream] [--from TIME]"
+               " [--to TIME]\n"
+               "                [--protocol HEX] [--node SEG:NODE]\n");
+      return 1;
     }
 
-  if (argc)
+  if (capture_fname || replay_fname)
     {
-      fprintf (stderr, "usage: pppdump [--raw|--top] < input\n");
-      return 1;
+      struct sigaction nact;
+
+      nact.sa_handler = control_c_handler;
+      sigemptyset (&nact.sa_mask);
+      nact.sa_flags = 0;
+      sigaction (SIGINT, &nact, NULL);
+      if (capture_fname)
+        capture (capture_fname);
+      else
+        replay (replay_fname, from, to, want_protocol, node, stream);
+      if (fflush (stdout) || ferror (stdout))
+        die ("write error");
+      return 0;
     }
 
   if (topmode)
@@ -216,7 +582,7 @@ main (int argc, char **argv )
                   printf ("%02x", c);
                   if (idx == 17 && protocol == 0x31)
                     {
-                      unsigned int crc = compute_crc (buffer);
+                      unsigned int crc = compute_crc (buffer, 16);
                       if ((crc >> 8) == buffer[16] && (crc&0xff) == buffer[17])
                         printf (" ok ");
                       else
@@ -251,6 +617,6 @@ main (int argc, char **argv )
 
 /*
 Local Variables:
-compile-command: "cc -Wall -o ebusdump ebusdump.c"
+compile-command: "cc -Wall -o ebusdump ebusdump.c crc.c"
 End:
 */
@@ -67,6 +67,9 @@ static volatile uint16_t current_time;
 /* 10 milliseconds in the 10 second period.  */
 static volatile uint16_t current_clock;
 
+/* A free running counter of 10 millisecond periods.  */
+static volatile uint16_t tick_count;
+
 
 
 /* Read key S2.  Return true once at the first debounced leading edge
@@ -127,6 +130,22 @@ get_current_fulltime (byte *r_deci)
 }
 
 
+/* Return the number of 10 millisecond periods since startup modulo
+   2^16.  This may also be called from an ISR.  */
+uint16_t
+get_tick_count (void)
+{
+  uint16_t value;
+  byte sreg;
+
+  sreg = SREG;
+  cli ();
+  value = tick_count;
+  SREG = sreg;
+  return value;
+}
+
+
 void
 set_current_fulltime (uint16_t tim, byte deci)
 {
@@ -162,6 +181,7 @@ ISR (TIMER2_COMPA_vect)
     return;
   two_ms_counter = 0;
 
+  tick_count++;
   current_clock++;
   if (current_clock >= 1000)
     {
@@ -26,7 +26,11 @@
 #include <time.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "protocol.h"
 #include "proto-busctl.h"
@@ -34,6 +38,7 @@
 
 #include "hsd-misc.h"
 #include "hsd-time.h"
+#include "crc.h"
 
 
 #define PGM           "housectl"
@@ -47,6 +52,48 @@ static int verbose;
 static int debug;
 static int line_speed = 19200;
 
+/* Set if we are connected to housed and not directly to the line.  */
+static int use_housed;
+
+/* Ask housed for its cached state instead of querying the node.  */
+static int use_cache;
+
+/* In batch mode the messages are queued as requests and sent by
+   run_batch.  */
+static int batch_mode;
+static int max_inflight = 4;
+static int batch_timeout = 2;   /* Seconds to wait for a response.  */
+
+/* Time to wait after a message without a response before the next
+   message is sent to the same node.  This avoids a message overrun
+   at the node.  */
+#define NODE_GAP 0.25
+
+/* A queued request of a batch.  */
+struct request_s
+{
+  struct request_s *next;
+  struct request_s *next_sent; /* Next in the order of the SENDs.  */
+  int lnr;                     /* Line number in the script.  */
+  char *cmd;                   /* The command from the script.  */
+  byte msg[16];
+  int want_response;           /* A response frame is expected.  */
+  unsigned int slots;          /* Schedule slots received so far.  */
+  int state;                   /* 0 = pending, 1 = sent, 2 = done.  */
+  double deadline;
+};
+typedef struct request_s *request_t;
+
+static request_t request_list;
+static request_t *request_tail = &request_list;
+
+/* The requests sent to housed but not yet answered by OK or ERR, in
+   the order of the SENDs.  */
+static request_t sent_list;
+static request_t *sent_tail = &sent_list;
+static int current_lnr;
+static const char *current_cmd;
+
 /* My node address.  */
 static unsigned char my_addr_high = 0x01;
 static unsigned char my_addr_low  = 0x01;
@@ -201,33 +248,6 @@ open_line (const char *fname)
 }
 
 
-static uint16_t
-crc_ccitt_update (uint16_t crc, uint8_t data)
-{
-  data ^= (crc & 0xff);
-  data ^= data << 4;
-
-  return ((((uint16_t)data << 8) | ((crc >> 8)& 0xff)) ^ (uint8_t)(data >> 4)
-          ^ ((uint16_t)data << 3));
-}
-
-
-/* Compute the CRC for MSG.  MSG must be of MSGLEN.  The CRC used is
-   possible not the optimal CRC for our message length.  However on
-   the AVR we have a convenient inline function for it.  */
-static uint16_t
-compute_crc (const unsigned char *msg, size_t msglen)
-{
-  int idx;
-  uint16_t crc = 0xffff;
-
-  for (idx=0; idx < msglen; idx++)
-    crc = crc_ccitt_update (crc, msg[idx]);
-
-  return crc;
-}
-
-
 /* Return the current ebus time for broadcasting.  The time is defined
    as number of 10 second periods passed since Monday 0:00.  */
 static unsigned int
@@ -281,12 +301,179 @@ send_byte (FILE *fp, byte c)
 }
 
 
+/* Connect to housed's socket NAME.  */
+static FILE *
+connect_housed (const char *name)
+{
+  struct sockaddr_un addr;
+  int fd;
+  FILE *fp;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (name) >= sizeof addr.sun_path)
+    die ("socket name `%s' is too long", name);
+  strcpy (addr.sun_path, name);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    die ("error creating socket: %s", strerror (errno));
+  if (connect (fd, (struct sockaddr *)&addr, sizeof addr))
+    die ("can't connect to housed at `%s': %s", name, strerror (errno));
+  fp = fdopen (fd, "w");
+  if (!fp)
+    die ("fdopen failed: %s", strerror (errno));
+  inf ("connected to housed at `%s'", name);
+  use_housed = 1;
+  return fp;
+}
+
+
+/* Read a reply line from housed into BUFFER of SIZE.  FP is the
+   stream to housed; the reply is read without stdio because FP is
+   only used for writing.  */
+static void
+read_reply (FILE *fp, char *buffer, size_t size)
+{
+  size_t n = 0;
+  ssize_t nread;
+  char c;
+
+  while (n + 1 < size)
+    {
+      nread = read (fileno (fp), &c, 1);
+      if (nread < 0 && errno == EINTR)
+        continue;
+      if (nread <= 0)
+        die ("error reading reply from housed: %s",
+             nread? strerror (errno) : "EOF");
+      if (c == '\n')
+        break;
+      buffer[n++] = c;
+    }
+  buffer[n] = 0;
+}
+
+
+/* Print the cached state of the node from housed.  If ALL_NODES is
+   set the state of all nodes is printed.  */
+static void
+query_cache (FILE *fp, int all_nodes)
+{
+  char reply[256];
+
+  if (all_nodes)
+    fputs ("QUERY\n", fp);
+  else
+    fprintf (fp, "QUERY %02x:%02x\n", node_high, node_low);
+  fflush (fp);
+  for (;;)
+    {
+      read_reply (fp, reply, sizeof reply);
+      if (!strncmp (reply, "D ", 2))
+        printf ("%s\n", reply + 2);
+      else
+        {
+          if (!strncmp (reply, "ERR", 3))
+            err ("housed: %s", reply);
+          break;
+        }
+    }
+}
+
+
+/* Return the current time in seconds.  */
+static double
+now_seconds (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/* Return true if the node responds to the message MSG.  */
+static int
+has_response (const byte *msg)
+{
+  if (msg[1] == 0xff || msg[2] == 0xff)
+    return 0;  /* Broadcasts may be answered by any number of nodes.  */
+  if (msg[0] == PROTOCOL_EBUS_BUSCTL)
+    return (msg[5] == P_BUSCTL_QRY_TIME
+            || msg[5] == P_BUSCTL_QRY_VERSION
+            || msg[5] == P_BUSCTL_QRY_NAME
+            || msg[5] == P_BUSCTL_QRY_DEBUG
+            || msg[5] == P_BUSCTL_QRY_STATS);
+  if (msg[0] == PROTOCOL_EBUS_H61 && msg[5] == P_H61_SHUTTER)
+    return (msg[6] == P_H61_SHUTTER_QUERY
+            || msg[6] == P_H61_SHUTTER_DRIVE
+            || msg[6] == P_H61_SHUTTER_QRY_SCHEDULE);
+  if (msg[0] == PROTOCOL_EBUS_H61 && msg[5] == P_H61_SENSOR)
+    return 1;
+  return 0;
+}
+
+
+/* Append the message MSG as a request of the current batch line.  */
+static void
+queue_request (const byte *msg)
+{
+  request_t req;
+
+  req = xmalloc (sizeof *req);
+  memset (req, 0, sizeof *req);
+  req->lnr = current_lnr;
+  req->cmd = xstrdup (current_cmd);
+  memcpy (req->msg, msg, 16);
+  req->want_response = has_response (msg);
+  *request_tail = req;
+  request_tail = &req->next;
+}
+
+
+/* Send the message MSG of MSGLEN.  If we are connected to housed the
+   message is handed over to housed, which computes the CRC and
+   queues it.  Otherwise the frame is written directly to the line.  */
+static void
+send_msg (FILE *fp, const byte *msg, size_t msglen)
+{
+  unsigned int crc;
+  size_t idx;
+  char reply[256];
+
+  if (batch_mode && msglen == 16)
+    {
+      queue_request (msg);
+      return;
+    }
+  if (use_housed)
+    {
+      fputs ("SEND ", fp);
+      for (idx=0; idx < msglen; idx++)
+        fprintf (fp, "%02x", msg[idx]);
+      putc ('\n', fp);
+      fflush (fp);
+      read_reply (fp, reply, sizeof reply);
+      if (!strncmp (reply, "ERR", 3))
+        err ("housed: %s", reply);
+      return;
+    }
+
+  crc = compute_crc (msg, msglen);
+  send_byte_raw (fp, FRAMESYNCBYTE);
+  for (idx=0; idx < msglen; idx++)
+    send_byte (fp, msg[idx]);
+  send_byte (fp, crc >> 8);
+  send_byte (fp, crc);
+  fflush (fp);
+}
+
+
 static void
 cmd_query_time (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_BUSCTL;
   msg[1] = node_high;
@@ -295,14 +482,7 @@ cmd_query_time (FILE *fp)
   msg[4] = my_addr_low;
   msg[5] = P_BUSCTL_QRY_TIME;
   memset (msg+6, 0, 10);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -310,8 +490,6 @@ static void
 cmd_query_version (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_BUSCTL;
   msg[1] = 0xff;
@@ -320,14 +498,7 @@ cmd_query_version (FILE *fp)
   msg[4] = my_addr_low;
   msg[5] = P_BUSCTL_QRY_VERSION;
   memset (msg+6, 0, 10);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -335,8 +506,6 @@ static void
 cmd_query_name (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_BUSCTL;
   msg[1] = node_high;
@@ -345,14 +514,7 @@ cmd_query_name (FILE *fp)
   msg[4] = my_addr_low;
   msg[5] = P_BUSCTL_QRY_NAME;
   memset (msg+6, 0, 10);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -361,8 +523,6 @@ static void
 cmd_set_debug_flags (FILE *fp, byte value)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_BUSCTL;
   msg[1] = node_high;
@@ -372,14 +532,7 @@ cmd_set_debug_flags (FILE *fp, byte value)
   msg[5] = P_BUSCTL_SET_DEBUG;
   msg[6] = value;
   memset (msg+7, 0, 9);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -387,8 +540,6 @@ static void
 cmd_query_debug_flags (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_BUSCTL;
   msg[1] = node_high;
@@ -397,14 +548,45 @@ cmd_query_debug_flags (FILE *fp)
   msg[4] = my_addr_low;
   msg[5] = P_BUSCTL_QRY_DEBUG;
   memset (msg+6, 0, 10);
-  crc = compute_crc (msg, 16);
+  send_msg (fp, msg, 16);
+}
 
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+
+/* Ask for the bus statistics.  Without an argument all pages are
+   requested.  */
+static void
+cmd_query_stats (FILE *fp, char *args)
+{
+  byte msg[16];
+  int page, first, last;
+
+  if (*args)
+    {
+      first = last = atoi (args);
+      if (first < 0 || first > 3)
+        {
+          err ("invalid page number - must be 0 to 3");
+          return;
+        }
+    }
+  else
+    {
+      first = 0;
+      last = 3;
+    }
+
+  for (page = first; page <= last; page++)
+    {
+      msg[0] = PROTOCOL_EBUS_BUSCTL;
+      msg[1] = node_high;
+      msg[2] = node_low;
+      msg[3] = my_addr_high;
+      msg[4] = my_addr_low;
+      msg[5] = P_BUSCTL_QRY_STATS;
+      msg[6] = page;
+      memset (msg+7, 0, 9);
+      send_msg (fp, msg, 16);
+    }
 }
 
 
@@ -412,8 +594,6 @@ static void
 cmd_query_shutter_schedule (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -424,22 +604,13 @@ cmd_query_shutter_schedule (FILE *fp)
   msg[6] = P_H61_SHUTTER_QRY_SCHEDULE;
   msg[7] = 1;
   memset (msg+8, 0, 8);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 static void
 cmd_broadcast_time (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
   unsigned int tim, dec, dst;
 
   tim = mk_ebus_time (&dec, &dst);
@@ -456,14 +627,7 @@ cmd_broadcast_time (FILE *fp)
   msg[8] = tim;
   msg[9] = dec;
   memset (msg+10, 0, 6);
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -507,8 +671,6 @@ static void
 cmd_query_shutter_state (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -526,14 +688,7 @@ cmd_query_shutter_state (FILE *fp)
   msg[13] = 0;
   msg[14] = 0;
   msg[15] = 0;
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -541,8 +696,6 @@ static void
 cmd_drive_shutter (FILE *fp, const char *subcmd)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -569,14 +722,7 @@ cmd_drive_shutter (FILE *fp, const char *subcmd)
   msg[13] = 0;
   msg[14] = 0;
   msg[15] = 0;
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -584,8 +730,6 @@ static void
 do_set_shutter_schedule (FILE *fp, int slot, int16_t t, byte action)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -603,21 +747,16 @@ do_set_shutter_schedule (FILE *fp, int slot, int16_t t, byte action)
   msg[13] = action;
   msg[14] = 0;
   msg[15] = 0;
-  crc = compute_crc (msg, 16);
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
   /* We need to sleep a while to avoid a message overrun at the node.
      A better strategy would be to ask the node whether it is ready
-     for the next setting.  To do this, we need to integrate with
-     housed first.  */
-  {
-    struct timeval tv = { 0, 250000 };
-    select (0, NULL, NULL, NULL, &tv);
-  }
+     for the next setting.  In batch mode this is done by run_batch
+     for each node.  */
+  if (!batch_mode)
+    {
+      struct timeval tv = { 0, 250000 };
+      select (0, NULL, NULL, NULL, &tv);
+    }
 }
 
 
@@ -723,8 +862,6 @@ static void
 cmd_reset_shutter_eeprom (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -742,14 +879,7 @@ cmd_reset_shutter_eeprom (FILE *fp)
   msg[13] = 0xf0;
   msg[14] = 0;
   msg[15] = 0;
-  crc = compute_crc (msg, 16);
-
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
-  fflush (fp);
+  send_msg (fp, msg, 16);
 }
 
 
@@ -758,8 +888,6 @@ static void
 cmd_sensor_temperature (FILE *fp)
 {
   byte msg[16];
-  unsigned int crc;
-  int idx;
 
   msg[0] = PROTOCOL_EBUS_H61;
   msg[1] = node_high;
@@ -777,14 +905,324 @@ cmd_sensor_temperature (FILE *fp)
   msg[13] = 0;
   msg[14] = 0;
   msg[15] = 0;
-  crc = compute_crc (msg, 16);
+  send_msg (fp, msg, 16);
+}
 
-  send_byte_raw (fp, FRAMESYNCBYTE);
-  for (idx=0; idx < 16; idx++)
-    send_byte (fp, msg[idx]);
-  send_byte (fp, crc >> 8);
-  send_byte (fp, crc);
+
+
+/* Run the command CMD with the arguments CMDARGS.  */
+static void
+run_command (FILE *fp, const char *cmd, char *cmdargs)
+{
+  if (!strcmp (cmd, "help"))
+    {
+      fputs ("help                     This help\n"
+             "broadcast-time\n"
+             "query-time\n"
+             "query-version\n"
+             "set-debug VALUE\n"
+             "query-stats [PAGE]\n"
+             "query-shutter-state\n"
+             "query-shutter-schedule\n"
+             "set-shutter-schedule SLOTNO|* TIMESPEC up|down|TIMESPEC\n"
+             "reset-shutter-eeprom\n"
+             "drive-shutter up|down\n"
+             "sensor-temperature\n"
+             ,stdout);
+    }
+  else  if (!strcmp (cmd, "broadcast-time"))
+    cmd_broadcast_time (fp);
+  else if (!strcmp (cmd, "query-time"))
+    cmd_query_time (fp);
+  else if (use_cache && !strcmp (cmd, "query-version"))
+    query_cache (fp, 1);
+  else if (use_cache && (!strcmp (cmd, "query-shutter-state")
+                         || !strcmp (cmd, "sensor-temperature")
+                         || !strcmp (cmd, "query-name")))
+    query_cache (fp, 0);
+  else if (!strcmp (cmd, "query-version"))
+    cmd_query_version (fp);
+  else if (!strcmp (cmd, "query-name"))
+    cmd_query_name (fp);
+  else if (!strcmp (cmd, "set-debug"))
+    cmd_set_debug_flags (fp, strtoul (cmdargs, NULL, 0));
+  else if (!strcmp (cmd, "query-debug"))
+    cmd_query_debug_flags (fp);
+  else if (!strcmp (cmd, "query-stats"))
+    cmd_query_stats (fp, cmdargs);
+  else if (!strcmp (cmd, "query-shutter-state"))
+    cmd_query_shutter_state (fp);
+  else if (!strcmp (cmd, "query-shutter-schedule"))
+    cmd_query_shutter_schedule (fp);
+  else if (!strcmp (cmd, "set-shutter-schedule"))
+    cmd_set_shutter_schedule (fp, cmdargs);
+  else if (!strcmp (cmd, "reset-shutter-eeprom"))
+    cmd_reset_shutter_eeprom (fp);
+  else if (!strcmp (cmd, "drive-shutter"))
+    cmd_drive_shutter (fp, cmdargs);
+  else if (!strcmp (cmd, "sensor-temperature"))
+    cmd_sensor_temperature (fp);
+  else
+    err ("invalid command `%s'", cmd);
+}
+
+
+
+/* Print the result of request REQ.  MSG is the response or NULL.  */
+static void
+print_result (request_t req, const char *result, const char *msg)
+{
+  printf ("%d %02x:%02x %s: %s%s%s\n", req->lnr, req->msg[1], req->msg[2],
+          req->cmd, result, msg? " ":"", msg? msg:"");
+}
+
+
+/* Process the line LINE received from housed during a batch.  */
+static void
+batch_reply (char *line)
+{
+  request_t req;
+  byte msg[16];
+  int i;
+
+  if (!strncmp (line, "FRAME ", 6))
+    {
+      for (i=0; i < 16; i++)
+        {
+          if (!hexdigitp (line+6+2*i) || !hexdigitp (line+7+2*i))
+            return;  /* Not a short message.  */
+          msg[i] = xtoi_2 (line+6+2*i);
+        }
+      for (req = request_list; req; req = req->next)
+        if (req->state == 1 && req->want_response
+            && msg[0] == req->msg[0]
+            && msg[3] == req->msg[1] && msg[4] == req->msg[2]
+            && msg[5] == (req->msg[5] | P_BUSCTL_RESPMASK)
+            && ((msg[0] != PROTOCOL_EBUS_H61
+                 && msg[5] != (P_BUSCTL_QRY_STATS | P_BUSCTL_RESPMASK))
+                || msg[6] == req->msg[6]))
+          {
+            print_result (req, "ok", line + 6);
+            /* The schedule is sent as one frame per slot with the
+               number of slots in byte 9 and the slot index in byte
+               10.  Keep the request open until all slots arrived.  */
+            if (msg[0] == PROTOCOL_EBUS_H61
+                && msg[6] == P_H61_SHUTTER_QRY_SCHEDULE
+                && msg[9] <= 32 && msg[10] < msg[9])
+              {
+                req->slots |= 1u << msg[10];
+                if (req->slots != (msg[9] == 32? ~0u
+                                   : (1u << msg[9]) - 1))
+                  {
+                    req->deadline = now_seconds () + batch_timeout;
+                    break;
+                  }
+              }
+            req->state = 2;
+            break;
+          }
+      return;
+    }
+
+  /* An OK or ERR is the reply to the oldest not yet answered SEND.  */
+  req = sent_list;
+  if (!req)
+    return;
+  sent_list = req->next_sent;
+  if (!sent_list)
+    sent_tail = &sent_list;
+  if (req->state == 2)
+    return;  /* Already timed out or answered by the node.  */
+  if (!strncmp (line, "ERR", 3))
+    {
+      req->state = 2;
+      any_error = 1;
+      print_result (req, "error", line);
+    }
+  else if (!req->want_response)
+    {
+      req->state = 2;
+      req->deadline = now_seconds () + NODE_GAP;
+      print_result (req, "sent", NULL);
+    }
+}
+
+
+/* Send all queued requests.  At most MAX_INFLIGHT requests are
+   outstanding at any time, but only one for each node so that the
+   order of the requests for a node is kept.  Requests for different
+   nodes are thus processed in parallel.  */
+static void
+run_batch (FILE *fp)
+{
+  request_t req, r;
+  int inflight, ndone, ntotal, busy, i;
+  double now, wakeup;
+  struct pollfd pfd;
+  char buffer[1024];
+  size_t buflen = 0;
+  ssize_t n;
+  char *p, *line;
+
+  fputs ("SUBSCRIBE\n", fp);
   fflush (fp);
+  read_reply (fp, buffer, sizeof buffer);
+  if (strncmp (buffer, "OK", 2))
+    die ("housed: %s", buffer);
+
+  for (ntotal=0, req = request_list; req; req = req->next)
+    ntotal++;
+  ndone = 0;
+  while (ndone < ntotal)
+    {
+      now = now_seconds ();
+      wakeup = now + 1;
+
+      /* Check for timeouts.  */
+      inflight = 0;
+      for (req = request_list; req; req = req->next)
+        if (req->state == 1)
+          {
+            if (req->deadline <= now)
+              {
+                req->state = 2;
+                any_error = 1;
+                print_result (req, "timeout", NULL);
+              }
+            else
+              {
+                inflight++;
+                if (req->deadline < wakeup)
+                  wakeup = req->deadline;
+              }
+          }
+
+      /* Start new requests.  */
+      for (req = request_list; req && inflight < max_inflight;
+           req = req->next)
+        {
+          if (req->state)
+            continue;
+          /* The node is busy if an earlier request for it has not
+             been done or asked us to wait.  */
+          busy = 0;
+          for (r = request_list; r != req; r = r->next)
+            if (r->msg[1] == req->msg[1] && r->msg[2] == req->msg[2]
+                && (r->state < 2 || (!r->want_response && r->deadline > now)))
+              {
+                busy = 1;
+                if (r->state == 2 && r->deadline < wakeup)
+                  wakeup = r->deadline;
+                break;
+              }
+          if (busy)
+            continue;
+
+          fputs ("SEND ", fp);
+          for (i=0; i < 16; i++)
+            fprintf (fp, "%02x", req->msg[i]);
+          putc ('\n', fp);
+          req->next_sent = NULL;
+          *sent_tail = req;
+          sent_tail = &req->next_sent;
+          req->state = 1;
+          req->deadline = now + batch_timeout;
+          inflight++;
+        }
+      fflush (fp);
+
+      /* Wait for replies.  */
+      pfd.fd = fileno (fp);
+      pfd.events = POLLIN;
+      i = (wakeup - now) * 1000 + 1;
+      if (poll (&pfd, 1, i < 1? 1 : i) > 0)
+        {
+          n = read (pfd.fd, buffer + buflen, sizeof buffer - buflen);
+          if (n <= 0)
+            die ("error reading from housed: %s",
+                 n? strerror (errno) : "EOF");
+          buflen += n;
+          line = buffer;
+          while ((p = memchr (line, '\n', buflen - (line - buffer))))
+            {
+              *p++ = 0;
+              batch_reply (line);
+              line = p;
+            }
+          buflen -= line - buffer;
+          memmove (buffer, line, buflen);
+          if (buflen == sizeof buffer)
+            buflen = 0;  /* Overlong line - can't happen.  */
+        }
+
+      for (ndone=0, req = request_list; req; req = req->next)
+        if (req->state == 2)
+          ndone++;
+    }
+}
+
+
+/* Read commands from FNAME and run them as one batch.  Each line has
+   an optional node address, the command and its arguments:
+
+     [SEG:NODE] COMMAND [ARGS]
+
+   Empty lines and lines starting with a '#' are ignored.  */
+static void
+read_batch (FILE *fp, const char *fname)
+{
+  FILE *script;
+  char line[512];
+  char *p, *cmd;
+  byte default_high = node_high;
+  byte default_low = node_low;
+  size_t len;
+
+  if (!strcmp (fname, "-"))
+    script = stdin;
+  else if (!(script = fopen (fname, "r")))
+    die ("can't open `%s': %s", fname, strerror (errno));
+
+  batch_mode = 1;
+  while (fgets (line, sizeof line, script))
+    {
+      current_lnr++;
+      len = strlen (line);
+      if (len && line[len-1] != '\n' && !feof (script))
+        die ("%s:%d: line too long", fname, current_lnr);
+      while (len && ascii_isspace (line[len-1]))
+        line[--len] = 0;
+      for (p = line; spacep (p); p++)
+        ;
+      if (!*p || *p == '#')
+        continue;
+
+      node_high = default_high;
+      node_low = default_low;
+      if (hexdigitp (p) && hexdigitp (p+1) && p[2] == ':'
+          && hexdigitp (p+3) && hexdigitp (p+4) && spacep (p+5))
+        {
+          node_high = xtoi_2 (p);
+          node_low = xtoi_2 (p+3);
+          for (p += 5; spacep (p); p++)
+            ;
+        }
+      cmd = p;
+      while (*p && !spacep (p))
+        p++;
+      if (*p)
+        *p++ = 0;
+      while (spacep (p))
+        p++;
+      current_cmd = cmd;
+      run_command (fp, cmd, p);
+    }
+  if (ferror (script))
+    die ("error reading `%s': %s", fname, strerror (errno));
+  if (script != stdin)
+    fclose (script);
+  node_high = default_high;
+  node_low = default_low;
 }
 
 
@@ -797,8 +1235,14 @@ show_usage (const char *errtext)
       err ("command line error: %s\n", errtext);
       exit (1);
     }
-  fputs ("Usage: " PGM " DEVICE COMMAND\n"
+  fputs ("Usage: " PGM " [OPTIONS] COMMAND [ARGS]\n"
          "Send message to housed\n\n"
+         "  --socket NAME  Connect to housed at NAME [" HOUSED_SOCKET_NAME "]\n"
+         "  --device DEV   Send directly to the line DEV\n"
+         "  --cached       Print the state cached by housed for queries\n"
+         "  --batch FILE   Run the commands from FILE\n"
+         "  --max-inflight N  Allow N outstanding requests in batch mode\n"
+         "  --timeout N    Wait N seconds for a response in batch mode\n"
          "  --speed N      Use given speed\n"
          "  --verbose      Enable extra informational output\n"
          "  --debug        Enable additional debug output\n"
@@ -816,6 +1260,9 @@ main (int argc, char **argv )
   FILE *fp;
   const char *cmd;
   char *cmdargs;
+  const char *socket_name = HOUSED_SOCKET_NAME;
+  const char *device = NULL;
+  const char *batch_fname = NULL;
 
   if (argc)
     {
@@ -838,6 +1285,49 @@ main (int argc, char **argv )
         {
           show_usage (NULL);
         }
+      else if (!strcmp (*argv, "--socket"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage ("argument missing - expecting a socket name");
+          socket_name = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--device"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage ("argument missing - expecting a device");
+          device = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--batch"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage ("argument missing - expecting a file name");
+          batch_fname = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--max-inflight"))
+        {
+          argc--; argv++;
+          if (!argc || (max_inflight = atoi (*argv)) < 1)
+            show_usage ("bad or missing argument for --max-inflight");
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--timeout"))
+        {
+          argc--; argv++;
+          if (!argc || (batch_timeout = atoi (*argv)) < 1)
+            show_usage ("bad or missing argument for --timeout");
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--cached"))
+        {
+          use_cache = 1;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--speed"))
         {
           argc--; argv++;
@@ -880,72 +1370,50 @@ main (int argc, char **argv )
         show_usage ("invalid option");
     }
 
-  if (argc < 2)
-    show_usage ("device or command missing");
+  if (batch_fname)
+    {
+      if (argc)
+        show_usage ("no command expected with --batch");
+      if (device || use_cache)
+        show_usage ("--batch requires housed and can't be used with --cached");
+    }
+  else if (argc < 1)
+    show_usage ("command missing");
+  if (use_cache && device)
+    show_usage ("--cached requires housed");
 
   setvbuf (stdout, NULL, _IOLBF, 0);
 
-  fp = open_line (*argv);
-  cmd = argv[1];
-  if (argc < 3)
+  if (device)
+    fp = open_line (device);
+  else
+    fp = connect_housed (socket_name);
+  if (batch_fname)
+    {
+      read_batch (fp, batch_fname);
+      run_batch (fp);
+      fclose (fp);
+      return any_error? 1:0;
+    }
+  cmd = argv[0];
+  if (argc < 2)
     cmdargs = xstrdup ("");
   else
     {
       int n,i;
 
-      for (n=0, i=2; i < argc; i++)
+      for (n=0, i=1; i < argc; i++)
         n += strlen (argv[i]) + 1;
       cmdargs = xmalloc (n);
-      strcpy (cmdargs, argv[2]);
-      for (i=3; i < argc; i++)
+      strcpy (cmdargs, argv[1]);
+      for (i=2; i < argc; i++)
         {
           strcat (cmdargs, " ");
           strcat (cmdargs, argv[i]);
         }
     }
 
-  if (!strcmp (cmd, "help"))
-    {
-      fputs ("help                     This help\n"
-             "broadcast-time\n"
-             "query-time\n"
-             "query-version\n"
-             "set-debug VALUE\n"
-             "query-shutter-state\n"
-             "query-shutter-schedule\n"
-             "set-shutter-schedule SLOTNO|* TIMESPEC up|down|TIMESPEC\n"
-             "reset-shutter-eeprom\n"
-             "drive-shutter up|down\n"
-             "sensor-temperature\n"
-             ,stdout);
-    }
-  else  if (!strcmp (cmd, "broadcast-time"))
-    cmd_broadcast_time (fp);
-  else if (!strcmp (cmd, "query-time"))
-    cmd_query_time (fp);
-  else if (!strcmp (cmd, "query-version"))
-    cmd_query_version (fp);
-  else if (!strcmp (cmd, "query-name"))
-    cmd_query_name (fp);
-  else if (!strcmp (cmd, "set-debug"))
-    cmd_set_debug_flags (fp, strtoul (cmdargs, NULL, 0));
-  else if (!strcmp (cmd, "query-debug"))
-    cmd_query_debug_flags (fp);
-  else if (!strcmp (cmd, "query-shutter-state"))
-    cmd_query_shutter_state (fp);
-  else if (!strcmp (cmd, "query-shutter-schedule"))
-    cmd_query_shutter_schedule (fp);
-  else if (!strcmp (cmd, "set-shutter-schedule"))
-    cmd_set_shutter_schedule (fp, cmdargs);
-  else if (!strcmp (cmd, "reset-shutter-eeprom"))
-    cmd_reset_shutter_eeprom (fp);
-  else if (!strcmp (cmd, "drive-shutter"))
-    cmd_drive_shutter (fp, cmdargs);
-  else if (!strcmp (cmd, "sensor-temperature"))
-    cmd_sensor_temperature (fp);
-  else
-    err ("invalid command `%s'", cmd);
-
+  run_command (fp, cmd, cmdargs);
   free (cmdargs);
 
   fclose (fp);
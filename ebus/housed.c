@@ -26,12 +26,19 @@
 #include <time.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "protocol.h"
 #include "proto-busctl.h"
 #include "proto-h61.h"
 
+#include "hsd-misc.h"
+#include "crc.h"
+
 
 #define PGM           "housed"
 #define PGM_VERSION   "0.0"
@@ -43,10 +50,79 @@ typedef unsigned char byte;
 static int verbose;
 static int debug;
 static int line_speed = 19200;
+static const char *socket_name = HOUSED_SOCKET_NAME;
 
 /* Error counter.  */
 static int any_error;
 
+/* The state of the frame decoder.  */
+struct decoder_s
+{
+  int synced;
+  int esc;
+  int idx;
+  int msglen;
+  unsigned char buffer[48+2];
+};
+
+/* A client connected to our socket.  */
+struct client_s
+{
+  struct client_s *next;
+  int fd;
+  int dead;           /* The client shall be closed.  */
+  int want_output;    /* EPOLLOUT is set for FD.  */
+  int subscribed;     /* Decoded frames are sent to the client.  */
+  byte protocols[256/8];  /* Bitmap with the subscribed protocols.  */
+  size_t inlen;
+  char inbuf[256];
+  int skip_line;      /* Skip the rest of an overlong line.  */
+  size_t outlen;
+  char outbuf[16384];
+};
+typedef struct client_s *client_t;
+
+/* The list of connected clients.  */
+static client_t client_list;
+
+/* The cached state of a node as seen in its responses.  Each item
+   has the time it has been received; 0 if it has not been seen.  */
+struct node_s
+{
+  struct node_s *next;
+  byte addr_high, addr_low;
+  time_t seen;                 /* Time of the last frame from the node.  */
+  time_t version_time;
+  byte nodetype;
+  char revision[8];
+  time_t name_time;
+  char name[9];
+  time_t shutter_time;
+  byte shutter_err, shutter_state;
+  struct
+  {
+    time_t time;
+    byte group;                /* Group and index as in the response.  */
+    int16_t value[4];
+  } temperature[8];
+};
+typedef struct node_s *node_t;
+
+/* The list of nodes.  */
+static node_t node_list;
+
+/* The epoll descriptor and the descriptors of the line and of our
+   listening socket.  The addresses of the latter are used as epoll
+   data to tell them from clients.  */
+static int epoll_fd = -1;
+static int line_fd = -1;
+static int listen_fd = -1;
+
+/* The queue of stuffed frames to be sent to the bus.  */
+static byte tx_buffer[4096];
+static size_t tx_length;
+static int tx_want_output;
+
 
 /* Print diagnostic message and exit with failure. */
 static void
@@ -123,10 +199,12 @@ dump_mcbits (int fd)
 }
 
 
-static FILE *
+/* Open the serial line FNAME and return its file descriptor.  If
+   FNAME is not a tty, e.g. a file with a captured dump, or "-" for
+   stdin, no line setup is done.  */
+static int
 open_line (const char *fname)
 {
-  FILE *fp;
   int fd;
   struct termios term;
   speed_t speed;
@@ -147,9 +225,18 @@ open_line (const char *fname)
       die ("unsupported line speed %d given", line_speed);
     }
 
-  fp = fopen (fname, "r+");
-  if (!fp || (fd = fileno (fp)) == -1)
+  if (!strcmp (fname, "-"))
+    return 0;
+  fd = open (fname, O_RDWR | O_NOCTTY);
+  if (fd == -1 && errno == EACCES)
+    fd = open (fname, O_RDONLY);
+  if (fd == -1)
     die ("can't open `%s': %s", fname, strerror (errno));
+  if (!isatty (fd))
+    {
+      inf ("replaying `%s'", fname);
+      return fd;
+    }
 
   if (tcgetattr (fd, &term))
     die ("tcgetattr(%d) failed: %s", fd, strerror (errno));
@@ -185,34 +272,7 @@ open_line (const char *fname)
   /* } */
   /* dump_mcbits (fd); */
 
-  return fp;
-}
-
-
-static uint16_t
-crc_ccitt_update (uint16_t crc, uint8_t data)
-{
-  data ^= (crc & 0xff);
-  data ^= data << 4;
-
-  return ((((uint16_t)data << 8) | ((crc >> 8)& 0xff)) ^ (uint8_t)(data >> 4)
-          ^ ((uint16_t)data << 3));
-}
-
-
-/* Compute the CRC for MSG.  MSG must be of MSGLEN.  The CRC used is
-   possible not the optimal CRC for our message length.  However on
-   the AVR we have a convenient inline function for it.  */
-static uint16_t
-compute_crc (const unsigned char *msg, size_t msglen)
-{
-  int idx;
-  uint16_t crc = 0xffff;
-
-  for (idx=0; idx < msglen; idx++)
-    crc = crc_ccitt_update (crc, msg[idx]);
-
-  return crc;
+  return fd;
 }
 
 
@@ -237,8 +297,7 @@ logmsg_start (const char *text)
 static void
 logmsg_end ()
 {
-  fprintf (stdout, "\n");
-  fflush (stdout);
+  putc ('\n', stdout);
 }
 
 static void
@@ -362,6 +421,42 @@ p_busctl_qry_debug (byte *msg, size_t msglen)
 }
 
 
+static void
+p_busctl_qry_stats (byte *msg, size_t msglen)
+{
+  unsigned int val[4];
+  unsigned long octets;
+  int i;
+
+  for (i=0; i < 4; i++)
+    val[i] = (msg[7+2*i] << 8) | msg[8+2*i];
+
+  switch (msg[6])
+    {
+    case 0:
+      logmsg_fmt ("nrx=%u ntx=%u col=%u ovf=%u",
+                  val[0], val[1], val[2], val[3]);
+      break;
+    case 1:
+      octets = ((unsigned long)val[2] << 16) | val[3];
+      logmsg_fmt ("retries=%u max_retries=%u octets=%lu busy=%lus",
+                  val[0], val[1], octets, octets * msg[15] / 100000);
+      break;
+    case 2:
+      logmsg_fmt ("lat<10ms=%u lat<20ms=%u lat<40ms=%u lat<80ms=%u",
+                  val[0], val[1], val[2], val[3]);
+      break;
+    case 3:
+      logmsg_fmt ("lat<160ms=%u lat<320ms=%u lat<640ms=%u lat>=640ms=%u",
+                  val[0], val[1], val[2], val[3]);
+      break;
+    default:
+      logmsg_fmt ("page=%u[unknown]", msg[6]);
+      break;
+    }
+}
+
+
 /* Process busctl messages.  */
 static void
 process_ebus_busctl (byte *msg, size_t msglen)
@@ -411,6 +506,14 @@ process_ebus_busctl (byte *msg, size_t msglen)
         p_busctl_qry_debug (msg, msglen);
       break;
 
+    case P_BUSCTL_QRY_STATS:
+      logmsg_fmt ("%s:QueryStats", is_response?"Rsp":"Cmd");
+      if (is_response)
+        p_busctl_qry_stats (msg, msglen);
+      else
+        logmsg_fmt ("page=%u", msg[6]);
+      break;
+
     default:
       logmsg_fmt ("%s:%02x", is_response?"Rsp":"Cmd", msg[5]);
       break;
@@ -543,92 +646,725 @@ process_ebus_h61 (byte *msg, size_t msglen)
 }
 
 
+/* Return the cache entry for node ADDR_HIGH:ADDR_LOW.  The entry is
+   created if needed.  */
+static node_t
+get_node (byte addr_high, byte addr_low)
+{
+  node_t node;
+
+  for (node = node_list; node; node = node->next)
+    if (node->addr_high == addr_high && node->addr_low == addr_low)
+      return node;
+
+  node = xmalloc (sizeof *node);
+  memset (node, 0, sizeof *node);
+  node->addr_high = addr_high;
+  node->addr_low = addr_low;
+  node->next = node_list;
+  node_list = node;
+  return node;
+}
+
+
+/* Update the node cache with the information from the valid frame
+   MSG of MSGLEN.  */
 static void
-process (FILE *fp)
+cache_frame (const byte *msg, size_t msglen)
 {
-  unsigned char buffer[48+2];
-  int idx, synced, esc;
-  int c, i;
-  int msglen = 0;
+  node_t node;
+  time_t now;
+  int i;
+
+  if (msglen < 16 || msg[3] == 0xff || msg[4] == 0xff)
+    return;  /* Short frame or invalid sender.  */
+
+  now = time (NULL);
+  node = get_node (msg[3], msg[4]);
+  node->seen = now;
+
+  if (msg[0] == PROTOCOL_EBUS_BUSCTL)
+    {
+      if (msg[5] == (P_BUSCTL_RESPMASK | P_BUSCTL_QRY_VERSION))
+        {
+          node->version_time = now;
+          node->nodetype = msg[6];
+          memcpy (node->revision, msg+8, 7);
+          node->revision[7] = 0;
+        }
+      else if (msg[5] == (P_BUSCTL_RESPMASK | P_BUSCTL_QRY_NAME))
+        {
+          node->name_time = now;
+          node->nodetype = msg[6];
+          memcpy (node->name, msg+8, 8);
+          node->name[8] = 0;
+        }
+    }
+  else if (msg[0] == PROTOCOL_EBUS_H61)
+    {
+      if (msg[5] == (P_H61_RESPMASK | P_H61_SHUTTER)
+          && msg[6] == P_H61_SHUTTER_QUERY)
+        {
+          node->shutter_time = now;
+          node->shutter_err = msg[7];
+          node->shutter_state = msg[8];
+        }
+      else if (msg[5] == (P_H61_RESPMASK | P_H61_SENSOR)
+               && msg[6] == P_H61_SENSOR_TEMPERATURE)
+        {
+          /* Use the slot of the same group or the oldest one.  */
+          int slot = 0;
+
+          for (i=0; i < DIM (node->temperature); i++)
+            {
+              if (node->temperature[i].time
+                  && node->temperature[i].group == msg[7])
+                {
+                  slot = i;
+                  break;
+                }
+              if (node->temperature[i].time < node->temperature[slot].time)
+                slot = i;
+            }
+          node->temperature[slot].time = now;
+          node->temperature[slot].group = msg[7];
+          for (i=0; i < 4; i++)
+            node->temperature[slot].value[i] = ((msg[8+2*i] << 8)
+                                                | msg[9+2*i]);
+        }
+    }
+}
+
+
+/* Set the epoll events for FD with DATA.  If ADD is set FD is new.  */
+static void
+set_epoll (int fd, uint32_t events, void *data, int add)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof ev);
+  ev.events = events;
+  ev.data.ptr = data;
+  if (epoll_ctl (epoll_fd, add? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev))
+    die ("epoll_ctl failed: %s", strerror (errno));
+}
+
+
+/* Write as much as possible of the pending output of CLIENT.  */
+static void
+flush_client (client_t client)
+{
+  ssize_t n;
+
+  while (client->outlen && !client->dead)
+    {
+      n = write (client->fd, client->outbuf, client->outlen);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno == EAGAIN)
+        break;
+      if (n < 0)
+        {
+          inf ("error writing to client %d: %s", client->fd, strerror (errno));
+          client->dead = 1;
+          break;
+        }
+      client->outlen -= n;
+      memmove (client->outbuf, client->outbuf + n, client->outlen);
+    }
+
+  if (!client->dead && !!client->outlen != client->want_output)
+    {
+      client->want_output = !!client->outlen;
+      set_epoll (client->fd,
+                 EPOLLIN | (client->want_output? EPOLLOUT : 0), client, 0);
+    }
+}
+
+
+/* Send a line to CLIENT.  A client which does not read its data is
+   dropped instead of blocking the daemon.  */
+static void
+write_client (client_t client, const char *format, ...)
+{
+  va_list arg_ptr;
+  int n;
+  size_t room = sizeof client->outbuf - client->outlen;
+
+  if (client->dead)
+    return;
+
+  va_start (arg_ptr, format);
+  n = vsnprintf (client->outbuf + client->outlen, room, format, arg_ptr);
+  va_end (arg_ptr);
+  if (n < 0 || n >= room)
+    {
+      err ("client %d is too slow - dropping", client->fd);
+      client->dead = 1;
+      return;
+    }
+  client->outlen += n;
+  flush_client (client);
+}
+
+
+/* Send the decoded frame MSG of MSGLEN to all clients which
+   subscribed to its protocol.  */
+static void
+send_frame_to_clients (const byte *msg, size_t msglen)
+{
+  client_t client;
+  char hexmsg[2*48+1];
+  size_t i;
+
+  if (!client_list)
+    return;
+
+  for (i=0; i < msglen; i++)
+    snprintf (hexmsg + 2*i, 3, "%02x", msg[i]);
+  for (client = client_list; client; client = client->next)
+    if (client->subscribed
+        && (client->protocols[msg[0] / 8] & (1 << (msg[0] % 8))))
+      write_client (client, "FRAME %s\n", hexmsg);
+}
+
+
+/* Write as much as possible of the transmit queue to the line.  */
+static void
+flush_tx (void)
+{
+  ssize_t n;
+
+  while (tx_length)
+    {
+      n = write (line_fd, tx_buffer, tx_length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno == EAGAIN)
+        break;
+      if (n < 0)
+        {
+          err ("error writing to the line: %s", strerror (errno));
+          tx_length = 0;
+          break;
+        }
+      tx_length -= n;
+      memmove (tx_buffer, tx_buffer + n, tx_length);
+    }
+
+  if (!!tx_length != tx_want_output)
+    {
+      tx_want_output = !!tx_length;
+      set_epoll (line_fd, EPOLLIN | (tx_want_output? EPOLLOUT : 0),
+                 &line_fd, 0);
+    }
+}
+
+
+/* Send the cached state of NODE to CLIENT.  */
+static void
+write_node (client_t client, node_t node)
+{
+  char addr[6];
+  char values[4*8+1];
+  int i, j;
+  int16_t val;
+
+  snprintf (addr, sizeof addr, "%02x:%02x", node->addr_high, node->addr_low);
+  write_client (client, "D %s seen %lu\n", addr, (unsigned long)node->seen);
+  if (node->version_time)
+    write_client (client, "D %s version %lu nodetype=%u rev=\"%s\"\n", addr,
+                  (unsigned long)node->version_time,
+                  node->nodetype, node->revision);
+  if (node->name_time)
+    write_client (client, "D %s name %lu nodetype=%u name=\"%s\"\n", addr,
+                  (unsigned long)node->name_time,
+                  node->nodetype, node->name);
+  if (node->shutter_time)
+    write_client (client, "D %s shutter %lu err=%d state=%02x\n", addr,
+                  (unsigned long)node->shutter_time,
+                  node->shutter_err, node->shutter_state);
+  for (i=0; i < DIM (node->temperature); i++)
+    if (node->temperature[i].time)
+      {
+        *values = 0;
+        for (j=0; j < 4; j++)
+          {
+            val = node->temperature[i].value[j];
+            if (val == (int16_t)0x8000)
+              strcat (values, " -");
+            else if (val == (int16_t)0x7fff)
+              strcat (values, " *err*");
+            else
+              snprintf (values + strlen (values), 9, " %.1f",
+                        (double)val/10.0);
+          }
+        write_client (client, "D %s temperature %lu group=%u[%u]%s\n", addr,
+                      (unsigned long)node->temperature[i].time,
+                      (node->temperature[i].group & 0x0f),
+                      (node->temperature[i].group >> 4), values);
+      }
+}
 
-  esc = synced = idx = 0;
-  while ((c=getc (fp)) != EOF)
+
+/* Append octet C to FRAME at *IDX with byte stuffing.  */
+static void
+stuff_byte (byte *frame, size_t *idx, byte c)
+{
+  if (c == FRAMESYNCBYTE || c == FRAMEESCBYTE)
+    {
+      frame[(*idx)++] = FRAMEESCBYTE;
+      frame[(*idx)++] = (c ^ FRAMEESCMASK);
+    }
+  else
+    frame[(*idx)++] = c;
+}
+
+
+/* Queue the message MSG of MSGLEN for sending.  Returns NULL on
+   success or an error description.  */
+static const char *
+queue_msg (const byte *msg, size_t msglen)
+{
+  byte frame[1 + 2*(48+2)];
+  size_t i, n = 0;
+  unsigned int crc;
+
+  switch ((msg[0] & PROTOCOL_MSGLEN_MASK))
+    {
+    case PROTOCOL_MSGLEN_48: i = 48; break;
+    case PROTOCOL_MSGLEN_32: i = 32; break;
+    case PROTOCOL_MSGLEN_16: i = 16; break;
+    default: i = 0; break;
+    }
+  if (i != msglen)
+    return "message length does not match the protocol";
+
+  crc = compute_crc (msg, msglen);
+  frame[n++] = FRAMESYNCBYTE;
+  for (i=0; i < msglen; i++)
+    stuff_byte (frame, &n, msg[i]);
+  stuff_byte (frame, &n, crc >> 8);
+  stuff_byte (frame, &n, crc);
+
+  if (tx_length + n > sizeof tx_buffer)
+    return "transmit queue full";
+  memcpy (tx_buffer + tx_length, frame, n);
+  tx_length += n;
+  flush_tx ();
+  return NULL;
+}
+
+
+/* Handle the command LINE from CLIENT.  The commands are:
+
+     SUBSCRIBE [PROTOCOL...]  Send decoded frames of the given
+                              protocols (hex octets, e.g. 86) or
+                              of all protocols as "FRAME HEXMSG".
+     UNSUBSCRIBE              Stop sending frames.
+     SEND HEXMSG              Queue the message (w/o CRC) for the bus.
+     QUERY [SEG:NODE]         Return the cached state of the node or
+                              of all nodes as "D SEG:NODE ITEM TIME ..."
+                              lines.  TIME is when the item has been
+                              received.
+
+   Each command is answered by "OK" or "ERR DESCRIPTION".  */
+static void
+client_command (client_t client, char *line)
+{
+  char *p;
+  byte msg[48];
+  size_t msglen;
+  const char *errdesc;
+
+  for (p = line; *p && !spacep (p); p++)
+    ;
+  if (*p)
+    *p++ = 0;
+  while (spacep (p))
+    p++;
+
+  if (!ascii_strcasecmp (line, "SUBSCRIBE"))
+    {
+      memset (client->protocols, *p? 0 : 0xff, sizeof client->protocols);
+      while (*p)
+        {
+          if (!hexdigitp (p) || !hexdigitp (p+1) || !(!p[2] || spacep (p+2)))
+            {
+              write_client (client, "ERR invalid protocol\n");
+              return;
+            }
+          client->protocols[xtoi_2 (p) / 8] |= 1 << (xtoi_2 (p) % 8);
+          for (p += 2; spacep (p); p++)
+            ;
+        }
+      client->subscribed = 1;
+      write_client (client, "OK\n");
+    }
+  else if (!ascii_strcasecmp (line, "UNSUBSCRIBE"))
+    {
+      client->subscribed = 0;
+      write_client (client, "OK\n");
+    }
+  else if (!ascii_strcasecmp (line, "QUERY"))
+    {
+      node_t node;
+
+      if (*p && (!hexdigitp (p) || !hexdigitp (p+1) || p[2] != ':'
+                 || !hexdigitp (p+3) || !hexdigitp (p+4) || p[5]))
+        {
+          write_client (client, "ERR invalid node - expecting SEG:NODE\n");
+          return;
+        }
+      for (node = node_list; node; node = node->next)
+        if (!*p || (node->addr_high == xtoi_2 (p)
+                    && node->addr_low == xtoi_2 (p+3)))
+          write_node (client, node);
+      write_client (client, "OK\n");
+    }
+  else if (!ascii_strcasecmp (line, "SEND"))
     {
+      for (msglen = 0; hexdigitp (p) && hexdigitp (p+1); p += 2)
+        {
+          if (msglen == sizeof msg)
+            break;
+          msg[msglen++] = xtoi_2 (p);
+        }
+      if (*p || !msglen)
+        errdesc = "invalid message";
+      else
+        errdesc = queue_msg (msg, msglen);
+      if (errdesc)
+        write_client (client, "ERR %s\n", errdesc);
+      else
+        write_client (client, "OK\n");
+    }
+  else
+    write_client (client, "ERR unknown command\n");
+}
+
+
+/* Read from CLIENT and process all complete lines.  */
+static void
+read_client (client_t client)
+{
+  ssize_t n;
+  char *p, *line;
+  size_t len;
+
+  n = read (client->fd, client->inbuf + client->inlen,
+            sizeof client->inbuf - client->inlen);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (n <= 0)
+    {
+      if (n < 0)
+        inf ("error reading from client %d: %s",
+             client->fd, strerror (errno));
+      client->dead = 1;
+      return;
+    }
+  client->inlen += n;
+
+  line = client->inbuf;
+  len = client->inlen;
+  while ((p = memchr (line, '\n', len)))
+    {
+      *p++ = 0;
+      len -= p - line;
+      if (p - line > 1 && p[-2] == '\r')
+        p[-2] = 0;
+      if (client->skip_line)
+        client->skip_line = 0;
+      else
+        client_command (client, line);
+      line = p;
+    }
+  if (len == sizeof client->inbuf)
+    {
+      if (!client->skip_line)
+        write_client (client, "ERR line too long\n");
+      client->skip_line = 1;
+      len = 0;
+    }
+  memmove (client->inbuf, line, len);
+  client->inlen = len;
+}
+
+
+/* Accept a new client on the listening socket.  */
+static void
+accept_client (void)
+{
+  int fd;
+  client_t client;
+
+  fd = accept (listen_fd, NULL, NULL);
+  if (fd == -1)
+    {
+      if (errno != EINTR && errno != EAGAIN)
+        err ("accept failed: %s", strerror (errno));
+      return;
+    }
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK))
+    die ("error setting client to non-blocking: %s", strerror (errno));
+
+  client = xmalloc (sizeof *client);
+  memset (client, 0, sizeof *client - sizeof client->outbuf);
+  client->fd = fd;
+  client->next = client_list;
+  client_list = client;
+  set_epoll (fd, EPOLLIN, client, 1);
+  inf ("client %d connected", fd);
+}
+
+
+/* Close and remove all dead clients.  */
+static void
+remove_dead_clients (void)
+{
+  client_t client, *clientp;
+
+  for (clientp = &client_list; (client = *clientp); )
+    if (client->dead)
+      {
+        inf ("client %d disconnected", client->fd);
+        close (client->fd);   /* This also removes it from epoll.  */
+        *clientp = client->next;
+        free (client);
+      }
+    else
+      clientp = &client->next;
+}
+
+
+/* Create our listening socket.  */
+static void
+create_socket (void)
+{
+  struct sockaddr_un addr;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_name) >= sizeof addr.sun_path)
+    die ("socket name `%s' is too long", socket_name);
+  strcpy (addr.sun_path, socket_name);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1)
+    die ("error creating socket: %s", strerror (errno));
+  /* Remove a stale socket.  */
+  if (remove (socket_name) && errno != ENOENT)
+    die ("error removing `%s': %s", socket_name, strerror (errno));
+  if (bind (listen_fd, (struct sockaddr *)&addr, sizeof addr)
+      || listen (listen_fd, 16))
+    die ("error binding socket to `%s': %s", socket_name, strerror (errno));
+  if (fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK))
+    die ("error setting socket to non-blocking: %s", strerror (errno));
+  inf ("listening on `%s'", socket_name);
+}
+
+
+/* The handlers for the protocols indexed by the first octet of a
+   frame.  All other protocols are ignored.  */
+static void (*protocol_handler[256]) (byte *msg, size_t msglen) =
+  {
+    [PROTOCOL_EBUS_BUSCTL] = process_ebus_busctl,
+    [PROTOCOL_EBUS_H61]    = process_ebus_h61,
+    [PROTOCOL_EBUS_DBGMSG] = process_ebus_dbgmsg,
+    [PROTOCOL_EBUS_TEST]   = process_ebus_test
+  };
+
+
+/* Process a complete frame in the buffer of DEC.  */
+static void
+process_frame (struct decoder_s *dec)
+{
+  byte *buffer = dec->buffer;
+  int msglen = dec->msglen;
+  unsigned int crc;
+  int crcok, i;
+
+  crc = compute_crc (buffer, msglen);
+  crcok = ((crc >> 8) == buffer[msglen]
+           && (crc&0xff) == buffer[msglen+1]);
+
+  if (debug)
+    {
+      for (i=0; i < msglen + 2; i++)
+        printf ("%s%02x", i? " ":"", buffer[i]);
+      fputs (crcok? " ok":" bad", stdout);
+      putchar ('\n');
+    }
+  if (crcok && protocol_handler[buffer[0]])
+    protocol_handler[buffer[0]] (buffer, msglen);
+  if (crcok)
+    {
+      cache_frame (buffer, msglen);
+      send_frame_to_clients (buffer, msglen);
+    }
+}
+
+
+/* Feed the LENGTH octets from DATA into the frame decoder DEC.  */
+static void
+decode (struct decoder_s *dec, const byte *data, size_t length)
+{
+  const byte *end = data + length;
+  int c;
+
+  for (; data < end; data++)
+    {
+      c = *data;
       if (c == FRAMESYNCBYTE)
         {
-          esc = 0;
-          synced = 1;
-          idx = 0;
+          dec->esc = 0;
+          dec->synced = 1;
+          dec->idx = 0;
         }
-      else if (c == FRAMEESCBYTE && !esc)
-        esc = 1;
-      else if (synced)
+      else if (c == FRAMEESCBYTE && !dec->esc)
+        dec->esc = 1;
+      else if (dec->synced)
         {
-          if (esc)
+          if (dec->esc)
             {
-              esc = 0;
+              dec->esc = 0;
               c ^= FRAMEESCMASK;
             }
 
-          if (!idx)
+          if (!dec->idx)
             {
               switch ((c & PROTOCOL_MSGLEN_MASK))
                 {
-                case PROTOCOL_MSGLEN_48: msglen = 48; break;
-                case PROTOCOL_MSGLEN_32: msglen = 32; break;
-                case PROTOCOL_MSGLEN_16: msglen = 16; break;
+                case PROTOCOL_MSGLEN_48: dec->msglen = 48; break;
+                case PROTOCOL_MSGLEN_32: dec->msglen = 32; break;
+                case PROTOCOL_MSGLEN_16: dec->msglen = 16; break;
                 default:
                   err ("reserved message length value encountered");
-                  synced = 0;
+                  dec->synced = 0;
                   continue;
                 }
-              buffer[idx++] = c;
+              dec->buffer[dec->idx++] = c;
             }
-          else if (idx < msglen + 2)
+          else if (dec->idx < dec->msglen + 2)
             {
-              buffer[idx++] = c;
-              if (idx == msglen + 2)
-                {
-                  unsigned int crc;
-                  int crcok;
+              dec->buffer[dec->idx++] = c;
+              if (dec->idx == dec->msglen + 2)
+                process_frame (dec);
+            }
+        }
+    }
+}
+
 
-                  crc = compute_crc (buffer, msglen);
-                  crcok = ((crc >> 8) == buffer[msglen]
-                           && (crc&0xff) == buffer[msglen+1]);
+/* Read frames from FD until EOF.  This is used to replay a captured
+   dump.  The data is read in blocks; stdout is flushed after each
+   block so that a replay is not slowed down by a flush for each
+   frame.  */
+static void
+process (int fd)
+{
+  struct decoder_s decoder;
+  byte buffer[4096];
+  ssize_t n;
+
+  memset (&decoder, 0, sizeof decoder);
+  for (;;)
+    {
+      n = read (fd, buffer, sizeof buffer);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          err ("error reading input: %s", strerror (errno));
+          break;
+        }
+      if (!n)
+        break;
+      decode (&decoder, buffer, n);
+      fflush (stdout);
+    }
+}
+
+
+/* Run the daemon: Decode the frames from the line, log them and
+   pass them to the subscribed clients, and send the messages queued
+   by the clients.  */
+static void
+run_daemon (void)
+{
+  struct decoder_s decoder;
+  struct epoll_event events[32];
+  byte buffer[4096];
+  ssize_t n;
+  int nevents, i, line_eof = 0;
+  client_t client;
+
+  memset (&decoder, 0, sizeof decoder);
+  signal (SIGPIPE, SIG_IGN);
+
+  if (fcntl (line_fd, F_SETFL, fcntl (line_fd, F_GETFL) | O_NONBLOCK))
+    die ("error setting line to non-blocking: %s", strerror (errno));
+  create_socket ();
+
+  epoll_fd = epoll_create (16);
+  if (epoll_fd == -1)
+    die ("epoll_create failed: %s", strerror (errno));
+  set_epoll (line_fd, EPOLLIN, &line_fd, 1);
+  set_epoll (listen_fd, EPOLLIN, &listen_fd, 1);
+
+  while (!line_eof)
+    {
+      nevents = epoll_wait (epoll_fd, events, DIM (events), -1);
+      if (nevents == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          die ("epoll_wait failed: %s", strerror (errno));
+        }
 
-                  if (debug)
+      for (i=0; i < nevents; i++)
+        {
+          if (events[i].data.ptr == &listen_fd)
+            accept_client ();
+          else if (events[i].data.ptr == &line_fd)
+            {
+              if ((events[i].events & EPOLLOUT))
+                flush_tx ();
+              if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                  n = read (line_fd, buffer, sizeof buffer);
+                  if (n < 0 && errno != EINTR && errno != EAGAIN)
                     {
-                      for (i=0; i < msglen + 2; i++)
-                        printf ("%s%02x", i? " ":"", buffer[i]);
-                      fputs (crcok? " ok":" bad", stdout);
-                      putchar ('\n');
-                      fflush (stdout);
+                      err ("error reading line: %s", strerror (errno));
+                      line_eof = 1;
                     }
-                  if (crcok)
+                  else if (!n)
                     {
-                      switch ((buffer[0] & 0xff))
-                        {
-                        case PROTOCOL_EBUS_BUSCTL:
-                          process_ebus_busctl (buffer, msglen);
-                          break;
-                        case PROTOCOL_EBUS_H61:
-                          process_ebus_h61 (buffer, msglen);
-                          break;
-                        case PROTOCOL_EBUS_DBGMSG:
-                          process_ebus_dbgmsg (buffer, msglen);
-                          break;
-                        case PROTOCOL_EBUS_TEST:
-                          process_ebus_test (buffer, msglen);
-                          break;
-                        default:
-                          /* Ignore all other protocols.  */
-                          break;
-                        }
+                      inf ("EOF on line");
+                      line_eof = 1;
                     }
+                  else if (n > 0)
+                    decode (&decoder, buffer, n);
                 }
             }
+          else
+            {
+              client = events[i].data.ptr;
+              if (client->dead)
+                continue;
+              if ((events[i].events & EPOLLOUT))
+                flush_client (client);
+              if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                read_client (client);
+            }
         }
+      remove_dead_clients ();
+      fflush (stdout);
     }
+
+  close (listen_fd);
+  remove (socket_name);
 }
 
 
@@ -636,9 +1372,10 @@ process (FILE *fp)
 static int
 show_usage (int ex)
 {
-  fputs ("Usage: " PGM " DEVICE\n"
-         "Control an attached ebus\n\n"
+  fputs ("Usage: " PGM " DEVICE|FILE|-\n"
+         "Control an attached ebus or replay a captured dump\n\n"
          "  --speed N      Use given speed\n"
+         "  --socket NAME  Listen on socket NAME [" HOUSED_SOCKET_NAME "]\n"
          "  --verbose      Enable extra informational output\n"
          "  --debug        Enable additional debug output\n"
          "  --help         Display this help and exit\n\n"
@@ -652,7 +1389,7 @@ int
 main (int argc, char **argv )
 {
   int last_argc = -1;
-  FILE *fp;
+  int fd;
 
   if (argc)
     {
@@ -684,6 +1421,14 @@ main (int argc, char **argv )
               argc--; argv++;
             }
         }
+      else if (!strcmp (*argv, "--socket"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage (1);
+          socket_name = *argv;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--verbose"))
         {
           verbose = 1;
@@ -701,11 +1446,16 @@ main (int argc, char **argv )
   if (argc != 1)
     show_usage (1);
 
-  setvbuf (stdout, NULL, _IOLBF, 0);
-
-  fp = open_line (*argv);
-  process (fp);
-  fclose (fp);
+  fd = open_line (*argv);
+  if (isatty (fd))
+    {
+      line_fd = fd;
+      run_daemon ();
+    }
+  else
+    process (fd);
+  if (fd)
+    close (fd);
 
   return any_error? 1:0;
 }
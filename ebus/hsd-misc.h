@@ -18,6 +18,8 @@
 #ifndef HSD_MISC_H
 #define HSD_MISC_H
 
+/* The default name of the socket used by housed.  */
+#define HOUSED_SOCKET_NAME "/var/run/housed.socket"
 
 void *xmalloc (size_t n);
 void *xstrdup (char const *string);
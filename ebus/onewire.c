@@ -32,18 +32,47 @@
 
 #define DBG_ONEWIRE 1
 
+
+/* State of the asynchronous temperature read out.  */
+static enum
+  {
+    TEMP_IDLE = 0,    /* Nothing to do.  */
+    TEMP_CONVERTING,  /* Waiting for the end of the conversion.  */
+    TEMP_READING      /* Reading the scratchpad.  */
+  } temp_state;
+
+/* Delay in 10ms ticks until the next step and the flag set when it
+   has been reached.  */
+static volatile byte temp_delay;
+static volatile byte temp_event;
+
+/* The scratchpad and the number of octets read so far.  */
+static byte temp_buf[9];
+static byte temp_idx;
+
+/* The last temperature read or 0x7fff for a read error.  */
+static int16_t temp_value;
+
+
+/* Reset the bus.  Returns true if a device sent a presence pulse.  */
 static int
 write_reset (void)
 {
+  int present;
+
   /* Drive low for 480us.  */
   OW_Bus_PORT &= ~_BV(OW_Bus_BIT);
   _delay_us (480);
   /* Drive high via pull-up for 480us.  */
   OW_Bus_PORT |= _BV(OW_Bus_BIT);  /* Enable pull-up.  */
   OW_Bus_DDR  &= ~_BV(OW_Bus_BIT); /* Configure as input.  */
-  _delay_us (480);
+  /* The presence pulse starts 15 to 60us after the rising edge and
+     lasts 60 to 240us.  */
+  _delay_us (70);
+  present = !bit_is_set (OW_Bus_PIN, OW_Bus_BIT);
+  _delay_us (410);
   OW_Bus_DDR  |= _BV(OW_Bus_BIT);  /* Configure as output.  */
-  return 0;
+  return present;
 }
 
 
@@ -100,6 +129,16 @@ onewire_enable (void)
 }
 
 
+/* Reset the bus and return true if a device is connected.  */
+byte
+onewire_check_presence (void)
+{
+  OW_Bus_PORT |= _BV(OW_Bus_BIT);  /* Set high.  */
+  OW_Bus_DDR  |= _BV(OW_Bus_BIT);  /* Configure as output.  */
+  return write_reset ();
+}
+
+
 /* Power down the bus etc.  */
 void
 onewire_disable (void)
@@ -162,6 +201,108 @@ onewire_wait_for_one (void)
 
 
 
+/* Start a temperature conversion of a single DS18S20 on the bus and
+   return immediately.  The result will be made available by
+   onewire_temp_process.  Nothing is done if a read out is already
+   in progress.  */
+void
+onewire_temp_start (void)
+{
+  if (temp_state != TEMP_IDLE)
+    return;
+
+  onewire_enable ();
+  onewire_write_byte (0xcc); /* Skip ROM.  */
+  onewire_write_byte (0x44); /* Convert T.  */
+
+  /* Now we need to wait at least 750ms to read the value from the
+     scratchpad.  */
+  temp_state = TEMP_CONVERTING;
+  temp_event = 0;
+  temp_delay = MILLISEC (900);
+}
+
+
+/* This needs to be called by the 10ms ticker.  */
+void
+onewire_ticker (void)
+{
+  if (temp_delay && !--temp_delay)
+    {
+      temp_event = 1;
+      wakeup_main = 1;
+    }
+}
+
+
+/* Run the next step of the temperature read out.  This needs to be
+   called by the main loop; each step only takes a few milliseconds.
+   Returns true if a new result is available via onewire_temp_value.  */
+byte
+onewire_temp_process (void)
+{
+  byte i, crc;
+  int16_t t;
+
+  if (!temp_event)
+    return 0;
+  temp_event = 0;
+
+  switch (temp_state)
+    {
+    case TEMP_CONVERTING:
+      onewire_enable ();         /* Reset */
+      onewire_write_byte (0xcc); /* Skip ROM.  */
+      onewire_write_byte (0xbe); /* Read scratchpad.  */
+      temp_idx = 0;
+      temp_state = TEMP_READING;
+      temp_delay = 1;
+      return 0;
+
+    case TEMP_READING:
+      /* There are no timing constraints between the octets, thus we
+         read only 3 octets per step.  */
+      for (i=0; i < 3 && temp_idx < 9; i++)
+        temp_buf[temp_idx++] = onewire_read_byte ();
+      if (temp_idx < 9)
+        {
+          temp_delay = 1;
+          return 0;
+        }
+      break;
+
+    default:
+      return 0;
+    }
+
+  crc = 0;
+  for (i=0; i < 8; i++)
+    crc = _crc_ibutton_update (crc, temp_buf[i]);
+
+  if (temp_buf[8] == crc)
+    {
+      t = (temp_buf[1] << 8) | temp_buf[0];
+      t = (t*100 - 25 + ((16 - temp_buf[6])*100 / 16)) / 20;
+    }
+  else
+    t = 0x7fff;  /* Read error */
+
+  temp_value = t;
+  temp_state = TEMP_IDLE;
+  onewire_disable ();
+  return 1;
+}
+
+
+/* Return the result of the last read out.  */
+int16_t
+onewire_temp_value (void)
+{
+  return temp_value;
+}
+
+
+
 /* Initialize the 1-Wire code.  This must be done after the
    initialization of the general hardware code.  Note that this will
    only prepare the machinery, for real use onewire_enable needs to be
@@ -113,6 +113,31 @@
   byte 7   - reserved
   byte 8..15 - name of the node
 
+* 0x07 := Query Statistics
+
+  byte 6     - Page number
+  byte 7..15 - rfu, must be 0.
+
+  Response format:
+
+  byte 6     - Page number
+  byte 7..14 - Four 16 bit values as given by the page number:
+               0 - frames received, frames sent, collisions, overflows
+               1 - retries, max. retries of one frame,
+                   number of octets seen on the bus (32 bit)
+               2 - send latency histogram:  < 10ms, < 20ms, < 40ms,
+                   < 80ms
+               3 - send latency histogram: < 160ms, < 320ms, < 640ms,
+                   >= 640ms
+  byte 15    - For page 1 the time for one octet on the bus in units
+               of 10us; 0 for the other pages.
+
+  All values are counted since startup and wrap around.  The send
+  latency is measured from queuing the frame to the end of its
+  successful transmission.  The product of the number of octets and
+  the octet time gives the time the bus was busy.  An unknown page
+  number yields all zero values.
+
 */
 
 #include "protocol.h"
@@ -124,5 +149,6 @@
 #define P_BUSCTL_SET_DEBUG   0x04 /* Set debug flags.  */
 #define P_BUSCTL_QRY_DEBUG   0x05 /* Query debug flags.  */
 #define P_BUSCTL_QRY_NAME    0x06 /* Query Name.  */
+#define P_BUSCTL_QRY_STATS   0x07 /* Query Statistics.  */
 
 #endif /*PROTO_BUSCTL_H*/
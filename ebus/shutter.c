@@ -119,10 +119,6 @@ static volatile byte key_s3_event;
 static volatile uint16_t motor_action_delay;
 static volatile uint16_t motor_action_event;
 
-/* Sensor action delay counter and its event flag.  */
-static volatile uint16_t sensor_action_delay;
-static volatile byte sensor_action_event;
-
 
 
 /*
@@ -132,6 +128,14 @@ static volatile byte sensor_action_event;
 /* Remember the last action time.  */
 static uint16_t schedule_last_tfound;
 
+/* A sorted copy of the schedule from the EEPROM.  This needs to be
+   rebuilt by load_schedule after the EEPROM has been changed.
+   SCHEDULE_NEXT is the index of the first entry later than the last
+   checked time.  */
+static uint16_t schedule[DIM (ee_data.u.shutterctl.schedule)];
+static byte schedule_count;
+static byte schedule_next;
+
 /* The current state of the motor state machine.  */
 static enum motor_state_values motor_state;
 
@@ -139,20 +143,34 @@ static enum motor_state_values motor_state;
    QueryShutterState response message.  */
 static byte shutter_state;
 
+/* The sensor value is refreshed in the background after that many
+   seconds if a sensor was found at startup.  Requests are answered
+   from the cache as long as the value is younger than SENSOR_MAX_AGE
+   seconds.  */
+#define SENSOR_REFRESH  60
+#define SENSOR_MAX_AGE 120
+
 /* A structure to control the sensor actions.  This is not used by an
    ISR thus no need for volatile.  */
 static struct
 {
-  /* If set a sensor read out has been requested.  The value gives the
-     number of read out tries left.  If it is down to zero an error
-     message will be returned.  */
+  /* If set a read out is running.  The value gives the number of read
+     out tries left.  If it is down to zero an error is returned.  */
   byte active;
+  /* If set a client waits for the result of the read out.  */
+  byte pending;
   /* The address to send the response to.  If a second client requests
      a readout, we won't record the address but broadcast th
      result.  */
   byte addr_hi;
   byte addr_lo;
-} sensor_ctrl;
+  /* The cached temperature and its age in seconds.  An age of 0xff
+     indicates that no value is available.  */
+  int16_t value;
+  byte age;
+  /* Set if a 1-Wire device answered at startup.  */
+  byte present;
+} sensor_ctrl = { 0, 0, 0, 0, 0, 0xff, 0 };
 
 
 
@@ -192,11 +210,7 @@ ticker_bottom (unsigned int clock)
       wakeup_main = 1;
     }
 
-  if (sensor_action_delay && !--sensor_action_delay)
-    {
-      sensor_action_event = 1;
-      wakeup_main = 1;
-    }
+  onewire_ticker ();
 }
 
 
@@ -357,6 +371,28 @@ motor_action (void)
 }
 
 
+/* Copy the schedule from the EEPROM into SCHEDULE and sort it.  */
+static void
+load_schedule (void)
+{
+  uint16_t t;
+  byte i, j;
+
+  for (i=0; i < DIM (schedule); i++)
+    {
+      t = eeprom_read_word (&ee_data.u.shutterctl.schedule[i]);
+      if (!t)
+        break;
+      /* Insertion sort - the table is short.  */
+      for (j=i; j && schedule[j-1] > t; j--)
+        schedule[j] = schedule[j-1];
+      schedule[j] = t;
+    }
+  schedule_count = i;
+  schedule_next = 0;
+}
+
+
 /* Process scheduled actions.  TIME is the current time.  If
    FORCED_TLOW is not 0 the scheduler will run the last action between
    FORCED_TLOW and TIME regardless on whether it has already been run.
@@ -394,15 +430,17 @@ process_schedule (uint16_t time, uint16_t forced_tlow)
   /* send_dbgmsg_fmt ("low=%u", tlow); */
   /* send_dbgmsg_fmt ("hig=%u", thigh); */
 
-  /* Walk the schedule and find the last entry. */
-  for (tfound=0, i=0; i < DIM (ee_data.u.shutterctl.schedule); i++)
-    {
-      t = eeprom_read_word (&ee_data.u.shutterctl.schedule[i]);
-      if (!t)
-        break;
-      if (t > tlow && t <= thigh)
-        tfound = t;
-    }
+  /* Move to the first entry after TLOW.  Start over if the time went
+     backwards.  */
+  if (schedule_next && schedule[schedule_next-1] > tlow)
+    schedule_next = 0;
+  while (schedule_next < schedule_count && schedule[schedule_next] <= tlow)
+    schedule_next++;
+
+  /* Find the last entry up to THIGH.  */
+  for (tfound=0, i=schedule_next;
+       i < schedule_count && (t = schedule[i]) <= thigh; i++)
+    tfound = t;
   if (tfound)
     {
       schedule_last_tfound = tfound;
@@ -546,6 +584,7 @@ process_shutter_cmd (byte *msg)
             val16 += SCHEDULE_ACTION_DOWN;
 
           eeprom_write_word (&ee_data.u.shutterctl.schedule[msg[10]], val16);
+          load_schedule ();
         }
       break;
 
@@ -556,6 +595,44 @@ process_shutter_cmd (byte *msg)
 
 
 
+/* Start a background read out of the sensor.  */
+static void
+start_sensor_readout (void)
+{
+  if (!sensor_ctrl.active)
+    {
+      sensor_ctrl.active = 5;    /* Number of tries.  */
+      onewire_temp_start ();
+    }
+}
+
+
+/* Send the temperature T to the node ADDR_HI,ADDR_LO.  */
+static void
+send_sensor_result (byte addr_hi, byte addr_lo, int16_t t)
+{
+  byte msg[16];
+
+  msg[0] = PROTOCOL_EBUS_H61;
+  msg[1] = addr_hi;
+  msg[2] = addr_lo;
+  msg[3] = config.nodeid_hi;
+  msg[4] = config.nodeid_lo;
+  msg[5] = (P_H61_SENSOR | P_H61_RESPMASK);
+  msg[6] = P_H61_SENSOR_TEMPERATURE;
+  msg[7] = (1 << 4 | 1); /* Group 1 of 1.  */
+  msg[8] = (t >> 8); /* Sensor no. 0.  */
+  msg[9] = t;
+  msg[10] = 0x80; /* No sensor no. 1.  */
+  msg[11] = 0;
+  msg[12] = 0x80; /* No sensor no. 2.  */
+  msg[13] = 0;
+  msg[14] = 0x80; /* No sensor no. 3.  */
+  msg[15] = 0;
+  csma_send_message (msg, MSGSIZE);
+}
+
+
 /* Process a sensor command.  */
 static void
 process_sensor_cmd (byte *msg)
@@ -563,7 +640,12 @@ process_sensor_cmd (byte *msg)
   switch (msg[6])
     {
     case P_H61_SENSOR_TEMPERATURE:
-      if (sensor_ctrl.active)
+      if (sensor_ctrl.age < SENSOR_MAX_AGE)
+        {
+          /* We have a recent value - return it right away.  */
+          send_sensor_result (msg[3], msg[4], sensor_ctrl.value);
+        }
+      else if (sensor_ctrl.pending)
         {
           /* A second client request, if it is a different one switch
              to broadcast mode.  */
@@ -575,19 +657,11 @@ process_sensor_cmd (byte *msg)
         }
       else
         {
-          sensor_ctrl.active = 5;    /* Number of tries.  */
+          sensor_ctrl.pending = 1;
           sensor_ctrl.addr_hi = msg[3];
           sensor_ctrl.addr_lo = msg[4];
-
-          /* Trigger the read out machinery.  */
-          onewire_enable ();
-          onewire_write_byte (0xcc); /* Skip ROM.  */
-          onewire_write_byte (0x44); /* Convert T.  */
-          /* Now we need to wait at least 750ms to read the value from
-             the scratchpad.  */
-          sensor_action_delay = MILLISEC (900);
-          sensor_action_event = 0;
-      }
+          start_sensor_readout ();
+        }
       break;
 
     default:
@@ -596,73 +670,36 @@ process_sensor_cmd (byte *msg)
 }
 
 
-/* Try to read the result from the sensor and send it back.  This
-   function shall be called at least 750ms after the first conversion
-   message.  */
+/* A sensor read out has been finished.  Update the cache and send the
+   result to a waiting client.  */
 static void
-send_sensor_result (void)
+process_sensor_result (void)
 {
-  byte i, crc;
   int16_t t;
-  byte msg[16]; /* Used to read the scratchpad and to build the message.  */
 
   if (!sensor_ctrl.active)
     return;
 
-  onewire_enable ();         /* Reset */
-  onewire_write_byte (0xcc); /* Skip ROM.  */
-  onewire_write_byte (0xbe); /* Read scratchpad.  */
-  for (i=0; i < 9; i++)
-    msg[i] = onewire_read_byte ();
-
-  crc = 0;
-  for (i=0; i < 8; i++)
-    crc = _crc_ibutton_update (crc, msg[i]);
-
-  if (msg[8] == crc)
-    {
-      t = (msg[1] << 8) | msg[0];
-      t = (t*100 - 25 + ((16 - msg[6])*100 / 16)) / 20;
-    }
-  else
+  t = onewire_temp_value ();
+  if (t == 0x7fff && --sensor_ctrl.active)
     {
-      t = 0x7fff;  /* Read error */
+      send_dbgmsg ("sens #4");
+      /* Try again ...  */
+      onewire_temp_start ();
+      return;
     }
 
-  if (t != 0x7fff || !--sensor_ctrl.active)
+  /* Success or read error with the counter at zero.  */
+  sensor_ctrl.active = 0;
+  if (t != 0x7fff)
     {
-      /* Success or read error with the counter at zero.  */
-      msg[0] = PROTOCOL_EBUS_H61;
-      msg[1] = sensor_ctrl.addr_hi;
-      msg[2] = sensor_ctrl.addr_lo;
-      msg[3] = config.nodeid_hi;
-      msg[4] = config.nodeid_lo;
-      msg[5] = (P_H61_SENSOR | P_H61_RESPMASK);
-      msg[6] = P_H61_SENSOR_TEMPERATURE;
-      msg[7] = (1 << 4 | 1); /* Group 1 of 1.  */
-      msg[8] = (t >> 8); /* Sensor no. 0.  */
-      msg[9] = t;
-      msg[10] = 0x80; /* No sensor no. 1.  */
-      msg[11] = 0;
-      msg[12] = 0x80; /* No sensor no. 2.  */
-      msg[13] = 0;
-      msg[14] = 0x80; /* No sensor no. 3.  */
-      msg[15] = 0;
-      csma_send_message (msg, MSGSIZE);
-
-      sensor_ctrl.active = 0;  /* Ready. */
-      onewire_disable ();
+      sensor_ctrl.value = t;
+      sensor_ctrl.age = 0;
     }
-  else
+  if (sensor_ctrl.pending)
     {
-      send_dbgmsg ("sens #4");
-      /* Better issue the read command again.  */
-      onewire_enable ();         /* Reset.     */
-      onewire_write_byte (0xcc); /* Skip ROM.  */
-      onewire_write_byte (0x44); /* Convert T. */
-      /* Try again ...  */
-      sensor_action_delay = MILLISEC (1100);
-      sensor_action_event = 0;
+      send_sensor_result (sensor_ctrl.addr_hi, sensor_ctrl.addr_lo, t);
+      sensor_ctrl.pending = 0;
     }
 }
 
@@ -703,6 +740,7 @@ process_ebus_busctl (byte *msg)
 {
   uint16_t val16;
   byte     val8;
+  byte     idx;
   char is_response = !!(msg[5] & P_BUSCTL_RESPMASK);
 
   if (is_response)
@@ -790,6 +828,23 @@ process_ebus_busctl (byte *msg)
       csma_send_message (msg, MSGSIZE);
       break;
 
+    case P_BUSCTL_QRY_STATS:
+      val8 = msg[6];
+      msg[1] = msg[3];
+      msg[2] = msg[4];
+      msg[3] = config.nodeid_hi;
+      msg[4] = config.nodeid_lo;
+      msg[5] |= P_BUSCTL_RESPMASK;
+      for (idx=0; idx < 4; idx++)
+        {
+          val16 = val8 < 4? csma_get_stats (val8 * 4 + idx + 1) : 0;
+          msg[7+2*idx] = val16 >> 8;
+          msg[8+2*idx] = val16;
+        }
+      msg[15] = val8 == 1? csma_get_stats (17) : 0;
+      csma_send_message (msg, MSGSIZE);
+      break;
+
     default:
       break;
     }
@@ -823,6 +878,8 @@ init_eeprom (byte force)
       for (; i < DIM (ee_data.u.shutterctl.schedule); i++)
         eeprom_write_word (&ee_data.u.shutterctl.schedule[i], 0);
     }
+
+  load_schedule ();
 }
 
 
@@ -845,6 +902,7 @@ main (void)
 
   csma_setup ();
   onewire_setup ();
+  sensor_ctrl.present = onewire_check_presence ();
 
   sei (); /* Enable interrupts.  */
 
@@ -885,11 +943,8 @@ main (void)
           motor_action_delay = motor_action ();
         }
 
-      if (sensor_action_event)
-        {
-          sensor_action_event = 0;
-          send_sensor_result ();
-        }
+      if (onewire_temp_process ())
+        process_sensor_result ();
 
       if (one_second_event)
         {
@@ -908,6 +963,9 @@ main (void)
                 LED_Collision |= _BV(LED_Collision_BIT);
             }
 
+          /* Age the cached sensor value.  */
+          if (sensor_ctrl.age < 0xfe)
+            sensor_ctrl.age++;
 
           if (++ten_seconds_counter == 10)
             {
@@ -917,6 +975,12 @@ main (void)
               uint16_t t;
 
               ten_seconds_counter = 0;
+
+              /* Refresh the cached sensor value in time.  Without a
+                 sensor we don't poll but only try on request.  */
+              if (sensor_ctrl.present && sensor_ctrl.age >= SENSOR_REFRESH)
+                start_sensor_readout ();
+
               t = get_current_time ();
               if (!(t % 6))
                 {
@@ -1,9 +1,144 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
 
 #define PGM "epoch2iso"
 
+#define BUFFER_SIZE 65536
+
+/* Only numbers with that many digits are converted in stream mode.
+   This is 1973-03-03 to 2286-11-20.  */
+#define MIN_DIGITS 9
+#define MAX_DIGITS 10
+
+#define digitp(p)  ((p) >= '0' && (p) <= '9')
+#define alnump(p)  (digitp (p) || ((p) >= 'A' && (p) <= 'Z')  \
+                    || ((p) >= 'a' && (p) <= 'z') || (p) == '_')
+
+static char outbuf[BUFFER_SIZE];
+static size_t outlen;
+
+
+static void
+flush_outbuf (void)
+{
+  if (outlen)
+    fwrite (outbuf, outlen, 1, stdout);
+  outlen = 0;
+}
+
+static void
+put_string (const char *s, size_t n)
+{
+  if (outlen + n > sizeof outbuf)
+    {
+      flush_outbuf ();
+      if (n > sizeof outbuf)
+        {
+          fwrite (s, n, 1, stdout);
+          return;
+        }
+    }
+  memcpy (outbuf + outlen, s, n);
+  outlen += n;
+}
+
+
+/* Store VALUE as "YYYY-MM-DD HH:MM:SS" at BUFFER which must have room
+   for 19 characters.  The date part is computed only if the day
+   changes.  */
+static void
+format_time (char *buffer, unsigned long value)
+{
+  static unsigned long cached_day = (unsigned long)(-1);
+  static char cached_date[40];
+  unsigned long day = value / 86400;
+  unsigned int secs = value % 86400;
+  unsigned int hour, min;
+  struct tm *tp;
+  time_t atime;
+
+  if (day != cached_day)
+    {
+      atime = value;
+      tp = gmtime (&atime);
+      snprintf (cached_date, sizeof cached_date, "%04d-%02d-%02d",
+                1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday);
+      cached_day = day;
+    }
+  memcpy (buffer, cached_date, 10);
+  hour = secs / 3600;
+  min  = secs / 60 % 60;
+  secs = secs % 60;
+  buffer[10] = ' ';
+  buffer[11] = '0' + hour / 10;
+  buffer[12] = '0' + hour % 10;
+  buffer[13] = ':';
+  buffer[14] = '0' + min / 10;
+  buffer[15] = '0' + min % 10;
+  buffer[16] = ':';
+  buffer[17] = '0' + secs / 10;
+  buffer[18] = '0' + secs % 10;
+}
+
+
+/* Copy stdin to stdout and replace all numbers looking like a time
+   stamp by an ISO date.  */
+static int
+convert_stream (void)
+{
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t n;
+  const char *s, *start, *end;
+  unsigned long value;
+  char buffer[19];
+
+  while ((n = getline (&line, &linesize, stdin)) != -1)
+    {
+      end = line + n;
+      for (s = start = line; s < end; )
+        {
+          const char *p;
+
+          if (!digitp (*s) || (s > line && alnump (s[-1])))
+            {
+              s++;
+              continue;
+            }
+          for (p = s, value = 0; p < end && digitp (*p); p++)
+            if (p - s < MAX_DIGITS)
+              value = value * 10 + (*p - '0');
+          if (p - s < MIN_DIGITS || p - s > MAX_DIGITS
+              || (p < end && alnump (*p)))
+            {
+              s = p;
+              continue;
+            }
+          put_string (start, s - start);
+          format_time (buffer, value);
+          put_string (buffer, sizeof buffer);
+          s = start = p;
+        }
+      put_string (start, end - start);
+    }
+  flush_outbuf ();
+  free (line);
+  if (ferror (stdin))
+    {
+      fprintf (stderr, PGM ": read error: %s\n", strerror (errno));
+      return 1;
+    }
+  if (fflush (stdout) || ferror (stdout))
+    {
+      fprintf (stderr, PGM ": write error: %s\n", strerror (errno));
+      return 1;
+    }
+  return 0;
+}
+
 
 int
 main (int argc, char **argv)
@@ -12,9 +147,15 @@ main (int argc, char **argv)
   struct tm *tp;
   time_t atime;
 
+  if (argc == 2 && !strcmp (argv[1], "-"))
+    return convert_stream ();
+
   if (argc != 2)
     {
-      fprintf (stderr, "usage: " PGM " seconds_since_Epoch\n");
+      fprintf (stderr, "usage: " PGM " seconds_since_Epoch\n"
+               "       " PGM " - < input\n"
+               "In the second form all time stamps in the input are"
+               " converted.\n");
       return 1;
     }
 
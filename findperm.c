@@ -2,6 +2,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define PGM "findperm"
+
+/* The index file has this layout; all numbers are 32 bit unsigned
+   integers in host byte order:
+
+     magic      "FPIDX1\n\0"
+     nbuckets   number of hash buckets (a power of 2)
+     nwords     number of words
+     buckets    nbuckets+1 indices into WORDS; the words of bucket I
+                are words[buckets[I]] up to words[buckets[I+1]-1]
+     words      nwords offsets of the words into the string pool
+     pool       the lowercased words, each terminated by a Nul
+ */
+#define INDEX_MAGIC "FPIDX1\n"   /* plus the terminating Nul */
+
+struct word_s
+{
+  uint32_t hash;
+  char *word;
+};
+
 
 void *
 xmalloc (size_t n)
@@ -22,6 +51,264 @@ strlwr (char *s)
 }
 
 
+static int
+cmp_char (const void *a, const void *b)
+{
+  return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+/* Store the signature of the lowercased WORD at SIG which must have
+   enough space for the word.  All permutations of a word have the
+   same signature.  */
+static void
+make_signature (char *sig, const char *word, size_t len)
+{
+  memcpy (sig, word, len+1);
+  qsort (sig, len, 1, cmp_char);
+}
+
+/* FNV-1a hash of a signature.  */
+static uint32_t
+hash_signature (const char *sig)
+{
+  uint32_t h = 2166136261u;
+
+  for (; *sig; sig++)
+    {
+      h ^= *(const unsigned char *)sig;
+      h *= 16777619;
+    }
+  return h;
+}
+
+
+/* Read a line from FP into LINE, strip the LF and lowercase it.
+   Returns its length or -1 at EOF.  Too long or incomplete lines are
+   skipped.  */
+static long
+read_word (FILE *fp, char *line, size_t linesize)
+{
+  size_t n;
+
+  while ( fgets (line, linesize , fp) )
+    {
+      n = strlen (line);
+      if (!n || line[n-1] != '\n')
+        {
+          /* Skip the rest of an overlong line.  */
+          while (n == linesize - 1 && line[n-1] != '\n'
+                 && fgets (line, linesize, fp))
+            n = strlen (line);
+          continue;
+        }
+      line[--n] = 0;
+      strlwr (line);
+      return n;
+    }
+  return -1;
+}
+
+
+static int
+cmp_words (const void *a, const void *b)
+{
+  const struct word_s *wa = a;
+  const struct word_s *wb = b;
+
+  return wa->hash < wb->hash? -1 : wa->hash > wb->hash;
+}
+
+/* Read the word list from stdin and write the index to FNAME.  */
+static int
+build_index (const char *fname)
+{
+  char line[1024];
+  char sig[1024];
+  struct word_s *words = NULL;
+  size_t nwords = 0, allocated = 0;
+  uint32_t nbuckets, i, j, off;
+  uint32_t hdr[2];
+  long n;
+  FILE *fp;
+
+  while ((n = read_word (stdin, line, sizeof line)) != -1)
+    {
+      if (!n)
+        continue;
+      if (nwords == allocated)
+        {
+          allocated = allocated? 2 * allocated : 4096;
+          words = realloc (words, allocated * sizeof *words);
+          if (!words)
+            abort ();
+        }
+      make_signature (sig, line, n);
+      words[nwords].hash = hash_signature (sig);
+      words[nwords].word = strcpy (xmalloc (n+1), line);
+      nwords++;
+    }
+  if (ferror (stdin))
+    {
+      fprintf (stderr, PGM ": read error: %s\n", strerror (errno));
+      return 1;
+    }
+  if (nwords > 0x7fffffff)
+    {
+      fprintf (stderr, PGM ": too many words\n");
+      return 1;
+    }
+
+  for (nbuckets = 1; nbuckets < nwords; nbuckets <<= 1)
+    ;
+  /* Sorting by the hash also sorts by the bucket.  We use the high
+     bits to select the bucket.  */
+  qsort (words, nwords, sizeof *words, cmp_words);
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    {
+      fprintf (stderr, PGM ": can't create `%s': %s\n",
+               fname, strerror (errno));
+      return 1;
+    }
+  fwrite (INDEX_MAGIC, sizeof INDEX_MAGIC, 1, fp);
+  hdr[0] = nbuckets;
+  hdr[1] = nwords;
+  fwrite (hdr, sizeof hdr, 1, fp);
+  for (i=j=0; i <= nbuckets; i++)
+    {
+      while (j < nwords
+             && (uint32_t)((uint64_t)words[j].hash * nbuckets >> 32) < i)
+        j++;
+      fwrite (&j, sizeof j, 1, fp);
+    }
+  for (j=off=0; j < nwords; j++)
+    {
+      fwrite (&off, sizeof off, 1, fp);
+      off += strlen (words[j].word) + 1;
+    }
+  for (j=0; j < nwords; j++)
+    fwrite (words[j].word, strlen (words[j].word) + 1, 1, fp);
+  if (fclose (fp))
+    {
+      fprintf (stderr, PGM ": error writing `%s': %s\n",
+               fname, strerror (errno));
+      return 1;
+    }
+
+  for (j=0; j < nwords; j++)
+    free (words[j].word);
+  free (words);
+  return 0;
+}
+
+
+/* The mapped index.  */
+static const uint32_t *idx_buckets;
+static const uint32_t *idx_words;
+static const char *idx_pool;
+static uint32_t idx_nbuckets, idx_nwords;
+static size_t idx_poolsize;
+
+static int
+open_index (const char *fname)
+{
+  struct stat st;
+  const char *map;
+  uint32_t hdr[2];
+  size_t hdrlen = sizeof INDEX_MAGIC + sizeof hdr;
+  int fd;
+
+  fd = open (fname, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st))
+    {
+      fprintf (stderr, PGM ": can't open `%s': %s\n",
+               fname, strerror (errno));
+      return -1;
+    }
+  if (st.st_size < hdrlen)
+    goto invalid;
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+      fprintf (stderr, PGM ": can't map `%s': %s\n",
+               fname, strerror (errno));
+      return -1;
+    }
+  if (memcmp (map, INDEX_MAGIC, sizeof INDEX_MAGIC))
+    goto invalid;
+  memcpy (hdr, map + sizeof INDEX_MAGIC, sizeof hdr);
+  idx_nbuckets = hdr[0];
+  idx_nwords = hdr[1];
+  if (idx_nbuckets > (st.st_size - hdrlen) / 4
+      || idx_nwords > (st.st_size - hdrlen) / 4
+      || (idx_nbuckets + 1 + (uint64_t)idx_nwords) * 4 > st.st_size - hdrlen)
+    goto invalid;
+  idx_buckets = (const uint32_t *)(map + hdrlen);
+  idx_words = idx_buckets + idx_nbuckets + 1;
+  idx_pool = (const char *)(idx_words + idx_nwords);
+  idx_poolsize = st.st_size - (idx_pool - map);
+  if (idx_poolsize && idx_pool[idx_poolsize-1])
+    goto invalid;
+  return 0;
+
+ invalid:
+  fprintf (stderr, PGM ": `%s' is not a valid index\n", fname);
+  return -1;
+}
+
+/* Print all words from the index which are a permutation of TARGET.
+   If PREFIX is true the target is printed in front of each match.  */
+static void
+query_index (char *target, int prefix)
+{
+  char *sig, *sig2;
+  const char *word;
+  size_t len;
+  uint32_t hash, i, end;
+
+  len = strlen (strlwr (target));
+  sig = xmalloc (len+1);
+  sig2 = xmalloc (len+1);
+  make_signature (sig, target, len);
+  hash = hash_signature (sig);
+
+  i = (uint64_t)hash * idx_nbuckets >> 32;
+  end = idx_buckets[i+1];
+  for (i = idx_buckets[i]; i < end && i < idx_nwords; i++)
+    {
+      if (idx_words[i] >= idx_poolsize)
+        continue;
+      word = idx_pool + idx_words[i];
+      if (strlen (word) != len)
+        continue;
+      make_signature (sig2, word, len);
+      if (!strcmp (sig, sig2))
+        {
+          if (prefix)
+            printf ("%s: %s\n", target, word);
+          else
+            printf ("%s\n", word);
+        }
+    }
+  free (sig2);
+  free (sig);
+}
+
+
+static int
+usage (void)
+{
+  fputs ("usage: " PGM " WORD < wordlist\n"
+         "       " PGM " --index INDEXFILE < wordlist\n"
+         "       " PGM " --query INDEXFILE [WORDS]\n"
+         "With --query and no WORDS the words are read from stdin.\n",
+         stderr);
+  return 1;
+}
+
+
 int
 main (int argc, char**argv)
 {
@@ -30,9 +317,32 @@ main (int argc, char**argv)
   char *target;
   char *flags1, *flags2;
   size_t targetlen;
+  int i;
 
-  if (argc != 2)
-    return 1;
+  if (argc == 3 && !strcmp (argv[1], "--index"))
+    return build_index (argv[2]);
+  if (argc >= 3 && !strcmp (argv[1], "--query"))
+    {
+      if (open_index (argv[2]))
+        return 1;
+      if (argc == 4)
+        query_index (argv[3], 0);
+      else if (argc > 4)
+        for (i=3; i < argc; i++)
+          query_index (argv[i], 1);
+      else
+        while (read_word (stdin, line, sizeof line) != -1)
+          if (*line)
+            query_index (line, 1);
+      if (fflush (stdout) || ferror (stdout))
+        {
+          fprintf (stderr, PGM ": write error: %s\n", strerror (errno));
+          return 1;
+        }
+      return 0;
+    }
+  if (argc != 2 || *argv[1] == '-')
+    return usage ();
 
   targetlen = strlen (argv[1]);
   target = xmalloc (targetlen+1);
@@ -47,6 +47,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <util/delay.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
@@ -89,194 +90,305 @@ typedef struct
   unsigned char mode;
 } timer_data_t;
 
+/* The number of characteristics we support; they are mapped one to
+   one to the operating modes.  */
+#define N_CHARACTERISTICS 3
+
+/* The maximum number of consumption log entries.  */
+#define MAX_LOGGING 250
+
 timer_data_t ee_timer[65] EEMEM;
 
+/* Toggled by the shift menu between 0 and 32. */
+unsigned char ee_shift_offset EEMEM;
+
+/* A ring buffer to store the consumption.  */
+unsigned char ee_consumption_buffer[MAX_LOGGING] EEMEM;
+
+/* A ring buffer to store the temperatures.  */
+unsigned char ee_temperature_buffer[MAX_LOGGING] EEMEM;
+
+/* The index to the next to use log item. */
+unsigned char ee_history_index EEMEM;
+
+signed int  ee_t_boiler_min[N_CHARACTERISTICS] EEMEM;
+signed int  ee_t_boiler_max[N_CHARACTERISTICS] EEMEM;
+
+/* Definitions of the characteristics curves.  */
+signed int  ee_t_curve_high[N_CHARACTERISTICS] EEMEM;
+signed int  ee_t_curve_low[N_CHARACTERISTICS] EEMEM;
+
+signed int  ee_t_pump_on[N_CHARACTERISTICS] EEMEM;
+
+/* A flag and a value to detect whether the eeprom has been setup.  */
+unsigned char e2_init_marker EEMEM;
+#define E2_INIT_MARKER_OKAY 0x3a
+
+
+/* A RAM copy of the above EEPROM variables.  The accessor functions
+   work only on this copy and thus the control loop does not need to
+   wait for the EEPROM.  Changes are written back by flush_eeprom a
+   few seconds after the last change so that the repeated changes
+   done in the menus result in only one write.  */
+struct
+{
+  timer_data_t timer[DIM (ee_timer)];
+  unsigned char shift_offset;
+  unsigned char history_index;
+  signed int t_boiler_min[N_CHARACTERISTICS];
+  signed int t_boiler_max[N_CHARACTERISTICS];
+  signed int t_curve_high[N_CHARACTERISTICS];
+  signed int t_curve_low[N_CHARACTERISTICS];
+  signed int t_pump_on[N_CHARACTERISTICS];
+} config;
+unsigned char consumption_buffer[MAX_LOGGING];
+unsigned char temperature_buffer[MAX_LOGGING];
+
+/* Flags telling which parts of the RAM copy need to be written back
+   and the number of main loop runs (35ms) to wait before doing so.  */
+#define DIRTY_CONFIG  1
+#define DIRTY_HISTORY 2
+unsigned char eeprom_dirty;
+unsigned int eeprom_flush_delay;
+#define EEPROM_FLUSH_DELAY (5000/35)
+
+static inline void
+mark_dirty (unsigned char what)
+{
+  eeprom_dirty |= what;
+  eeprom_flush_delay = EEPROM_FLUSH_DELAY;
+}
+
+
 static inline unsigned int
 get_timer_time (int idx)
 {
-  return (idx < 0 || idx >= DIM(ee_timer))
-    ? 0 : eeprom_read_word (&ee_timer[idx].time);
+  return (idx < 0 || idx >= DIM(config.timer))
+    ? 0 : config.timer[idx].time;
 }
 
 static inline unsigned char
 get_timer_mode (int idx)
 {
-  return (idx < 0 || idx >= DIM(ee_timer))
-    ? 0 : eeprom_read_byte (&ee_timer[idx].mode);
+  return (idx < 0 || idx >= DIM(config.timer))
+    ? 0 : config.timer[idx].mode;
 }
 
 static inline void
 put_timer_time (int idx, uint16_t value)
 {
-  if (idx >= 0 && idx < DIM (ee_timer))
-    eeprom_update_word (&ee_timer[idx].time, value);
+  if (idx >= 0 && idx < DIM (config.timer)
+      && config.timer[idx].time != value)
+    {
+      config.timer[idx].time = value;
+      mark_dirty (DIRTY_CONFIG);
+    }
 }
 
 static inline void
 put_timer_mode (int idx, uint8_t value)
 {
-  if (idx >= 0 && idx < DIM (ee_timer))
-    eeprom_update_byte (&ee_timer[idx].mode, value);
+  if (idx >= 0 && idx < DIM (config.timer)
+      && config.timer[idx].mode != value)
+    {
+      config.timer[idx].mode = value;
+      mark_dirty (DIRTY_CONFIG);
+    }
 }
 
 
-/* Toggled by the shift menu between 0 and 32. */
-unsigned char ee_shift_offset EEMEM;
 static inline uint8_t
 get_shift_offset (void)
 {
-  return eeprom_read_byte (&ee_shift_offset);
+  return config.shift_offset;
 }
 static inline void
 put_shift_offset (uint8_t value)
 {
-  eeprom_update_byte (&ee_shift_offset, value);
+  config.shift_offset = value;
+  mark_dirty (DIRTY_CONFIG);
 }
 
-/* The number of characteristics we support; they are mapped one to
-   one to the operating modes.  */
-#define N_CHARACTERISTICS 3
-
-/* The maximum number of consumption log entries.  */
-#define MAX_LOGGING 250
-
-/* A ring buffer to store the consumption.  */
-unsigned char ee_consumption_buffer[MAX_LOGGING] EEMEM;
 static inline uint8_t
 get_consumption (int idx)
 {
   return idx >= 0 && idx < MAX_LOGGING
-    ? eeprom_read_byte (&ee_consumption_buffer[idx]) : 0;
+    ? consumption_buffer[idx] : 0;
 }
 static inline void
 put_consumption (int idx, uint8_t value)
 {
   if (idx >= 0 && idx < MAX_LOGGING)
-    eeprom_update_byte (&ee_consumption_buffer[idx], value);
+    {
+      consumption_buffer[idx] = value;
+      mark_dirty (DIRTY_HISTORY);
+    }
 }
 
-/* A ring buffer to store the temperatures.  */
-unsigned char ee_temperature_buffer[MAX_LOGGING] EEMEM;
 static inline uint8_t
 get_temperature (int idx)
 {
   return idx >= 0 && idx < MAX_LOGGING
-    ? eeprom_read_byte (&ee_temperature_buffer[idx]) : 0;
+    ? temperature_buffer[idx] : 0;
 }
 static inline void
 put_temperature (int idx, uint8_t value)
 {
   if (idx >= 0 && idx < MAX_LOGGING)
-    eeprom_update_byte (&ee_temperature_buffer[idx], value);
+    {
+      temperature_buffer[idx] = value;
+      mark_dirty (DIRTY_HISTORY);
+    }
 }
 
-/* The index to the next to use log item. */
-unsigned char ee_history_index EEMEM;
 static inline uint8_t
 get_history_index (void)
 {
-  return eeprom_read_byte (&ee_history_index);
+  return config.history_index;
 }
 static inline void
 put_history_index (uint8_t value)
 {
-  eeprom_update_byte (&ee_history_index, value);
+  config.history_index = value;
+  mark_dirty (DIRTY_CONFIG);
 }
 
-signed int  ee_t_boiler_min[N_CHARACTERISTICS] EEMEM;
 static inline int16_t
 get_t_boiler_min (int idx)
 {
   return (idx >= 0 && idx < N_CHARACTERISTICS)
-    ? eeprom_read_word (&ee_t_boiler_min[idx]) : 0;
+    ? config.t_boiler_min[idx] : 0;
 }
 static inline void
 inc_t_boiler_min (int idx, int16_t value)
 {
   if (idx >= 0 && idx < N_CHARACTERISTICS)
     {
-      int16_t val = eeprom_read_word (&ee_t_boiler_min[idx]);
-      val += value;
-      eeprom_write_word (&ee_t_boiler_min[idx], val);
+      config.t_boiler_min[idx] += value;
+      mark_dirty (DIRTY_CONFIG);
     }
 }
 
-signed int  ee_t_boiler_max[N_CHARACTERISTICS] EEMEM;
 static inline int16_t
 get_t_boiler_max (int idx)
 {
   return (idx >= 0 && idx < N_CHARACTERISTICS)
-    ? eeprom_read_word (&ee_t_boiler_max[idx]) : 0;
+    ? config.t_boiler_max[idx] : 0;
 }
 static inline void
 inc_t_boiler_max (int idx, int16_t value)
 {
   if (idx >= 0 && idx < N_CHARACTERISTICS)
     {
-      int16_t val = eeprom_read_word (&ee_t_boiler_max[idx]);
-      val += value;
-      eeprom_write_word (&ee_t_boiler_max[idx], val);
+      config.t_boiler_max[idx] += value;
+      mark_dirty (DIRTY_CONFIG);
     }
 }
 
-/* Definitions of the characteristics curves.  */
-signed int  ee_t_curve_high[N_CHARACTERISTICS] EEMEM;
 static inline int16_t
 get_t_curve_high (int idx)
 {
   return (idx >= 0 && idx < N_CHARACTERISTICS)
-    ? eeprom_read_word (&ee_t_curve_high[idx]) : 0;
+    ? config.t_curve_high[idx] : 0;
 }
 static inline void
 inc_t_curve_high (int idx, int16_t value)
 {
   if (idx >= 0 && idx < N_CHARACTERISTICS)
     {
-      int16_t val = eeprom_read_word (&ee_t_curve_high[idx]);
-      val += value;
-      eeprom_write_word (&ee_t_curve_high[idx], val);
+      config.t_curve_high[idx] += value;
+      mark_dirty (DIRTY_CONFIG);
     }
 }
 
-signed int  ee_t_curve_low[N_CHARACTERISTICS] EEMEM;
 static inline int16_t
 get_t_curve_low (int idx)
 {
   return (idx >= 0 && idx < N_CHARACTERISTICS)
-    ? eeprom_read_word (&ee_t_curve_low[idx]) : 0;
+    ? config.t_curve_low[idx] : 0;
 }
 static inline void
 inc_t_curve_low (int idx, int16_t value)
 {
   if (idx >= 0 && idx < N_CHARACTERISTICS)
     {
-      int16_t val = eeprom_read_word (&ee_t_curve_low[idx]);
-      val += value;
-      eeprom_write_word (&ee_t_curve_low[idx], val);
+      config.t_curve_low[idx] += value;
+      mark_dirty (DIRTY_CONFIG);
     }
 }
 
-signed int  ee_t_pump_on[N_CHARACTERISTICS] EEMEM;
 static inline int16_t
 get_t_pump_on (int idx)
 {
   return (idx >= 0 && idx < N_CHARACTERISTICS)
-    ? eeprom_read_word (&ee_t_pump_on[idx]) : 0;
+    ? config.t_pump_on[idx] : 0;
 }
 static inline void
 inc_t_pump_on (int idx, int16_t value)
 {
   if (idx >= 0 && idx < N_CHARACTERISTICS)
     {
-      int16_t val = eeprom_read_word (&ee_t_pump_on[idx]);
-      val += value;
-      eeprom_write_word (&ee_t_pump_on[idx], val);
+      config.t_pump_on[idx] += value;
+      mark_dirty (DIRTY_CONFIG);
     }
 }
 
-/* A flag and a value to detect whether the eeprom has been setup.  */
-unsigned char e2_init_marker EEMEM;
-#define E2_INIT_MARKER_OKAY 0x3a
+
+/* Read the EEPROM into the RAM copy.  */
+static void
+load_eeprom (void)
+{
+  eeprom_read_block (config.timer, ee_timer, sizeof config.timer);
+  config.shift_offset = eeprom_read_byte (&ee_shift_offset);
+  config.history_index = eeprom_read_byte (&ee_history_index);
+  eeprom_read_block (config.t_boiler_min, ee_t_boiler_min,
+                     sizeof config.t_boiler_min);
+  eeprom_read_block (config.t_boiler_max, ee_t_boiler_max,
+                     sizeof config.t_boiler_max);
+  eeprom_read_block (config.t_curve_high, ee_t_curve_high,
+                     sizeof config.t_curve_high);
+  eeprom_read_block (config.t_curve_low, ee_t_curve_low,
+                     sizeof config.t_curve_low);
+  eeprom_read_block (config.t_pump_on, ee_t_pump_on,
+                     sizeof config.t_pump_on);
+  eeprom_read_block (consumption_buffer, ee_consumption_buffer,
+                     sizeof consumption_buffer);
+  eeprom_read_block (temperature_buffer, ee_temperature_buffer,
+                     sizeof temperature_buffer);
+  eeprom_dirty = 0;
+}
+
+
+/* Write the changed parts of the RAM copy back to the EEPROM.  The
+   update functions write only the actually changed bytes.  */
+static void
+flush_eeprom (void)
+{
+  if ((eeprom_dirty & DIRTY_CONFIG))
+    {
+      eeprom_update_block (config.timer, ee_timer, sizeof config.timer);
+      eeprom_update_byte (&ee_shift_offset, config.shift_offset);
+      eeprom_update_byte (&ee_history_index, config.history_index);
+      eeprom_update_block (config.t_boiler_min, ee_t_boiler_min,
+                           sizeof config.t_boiler_min);
+      eeprom_update_block (config.t_boiler_max, ee_t_boiler_max,
+                           sizeof config.t_boiler_max);
+      eeprom_update_block (config.t_curve_high, ee_t_curve_high,
+                           sizeof config.t_curve_high);
+      eeprom_update_block (config.t_curve_low, ee_t_curve_low,
+                           sizeof config.t_curve_low);
+      eeprom_update_block (config.t_pump_on, ee_t_pump_on,
+                           sizeof config.t_pump_on);
+    }
+  if ((eeprom_dirty & DIRTY_HISTORY))
+    {
+      eeprom_update_block (consumption_buffer, ee_consumption_buffer,
+                           sizeof consumption_buffer);
+      eeprom_update_block (temperature_buffer, ee_temperature_buffer,
+                           sizeof temperature_buffer);
+    }
+  eeprom_dirty = 0;
+}
 
 
 /* The current time measured in minutes.  */
@@ -436,17 +548,32 @@ void lcd_delay_ms(uint8_t ms) {  _delay_ms (ms); }
                          } while (0)
 
 /* Write a data byte to the display.  */
-#define lcd_putc(c)      do {                      \
+#define _lcd_putc(c)     do {                      \
                               _lcd_waitbusy ();    \
                               _lcd_write (c, 0);   \
                          } while (0)
 
 
+/* The size of the display.  */
+#define LCD_COLS 16
+#define LCD_ROWS 2
+
+/* All output goes to the frame buffer LCD_FB; lcd_update sends the
+   cells which differ from LCD_SHOWN, the current content of the
+   display, to the LCD.  This way a menu may redraw its screen as
+   often as it likes without writing the same data to the LCD.  */
+static char lcd_fb[LCD_ROWS][LCD_COLS];
+static char lcd_shown[LCD_ROWS][LCD_COLS];
+static uint8_t lcd_x, lcd_y;
+
 /* Clear the display.  */
-#define lcd_clear()  lcd_command (0x01);
+#define lcd_clear()  do {                                    \
+                          memset (lcd_fb, ' ', sizeof lcd_fb); \
+                          lcd_x = lcd_y = 0;                 \
+                     } while (0)
 
 /* Got to the home position.  */
-#define lcd_home()   lcd_command (0x02);
+#define lcd_home()   do { lcd_x = lcd_y = 0; } while (0)
 
 
 static uint8_t
@@ -592,6 +719,9 @@ lcd_init (void)
   lcd_command (0x08 | 4 );
 
   lcd_load_user_glyphs ();
+
+  memset (lcd_shown, ' ', sizeof lcd_shown);
+  lcd_clear ();
 }
 
 
@@ -661,25 +791,61 @@ lcd_load_user_glyphs (void)
       for (row=0; row < 8; row++)
         {
           lcd_command (g++);
-          lcd_putc (pgm_read_byte (&glyphs[idx][row]));
+          _lcd_putc (pgm_read_byte (&glyphs[idx][row]));
         }
     }
 }
 
 
+/* Send all changed cells of the frame buffer to the LCD.  */
+void
+lcd_update (void)
+{
+  uint8_t x, y;
+  char c;
+  uint8_t addr = 0xff;  /* The LCD's address counter or invalid.  */
+
+  for (y=0; y < LCD_ROWS; y++)
+    for (x=0; x < LCD_COLS; x++)
+      {
+        c = lcd_fb[y][x];
+        if (c == lcd_shown[y][x])
+          continue;
+        if (addr != (y? 0x40:0) + x)
+          {
+            addr = (y? 0x40:0) + x;
+            lcd_command (0x80 | addr);
+          }
+        _lcd_putc (c);
+        lcd_shown[y][x] = c;
+        addr++;
+      }
+}
+
+
 /* Set the next data write position to X,Y.  */
 void
 lcd_gotoxy (uint8_t x, uint8_t y)
 {
-  lcd_command (0x80 | ((y? 0x40:0) + x));
+  lcd_x = x;
+  lcd_y = y? 1:0;
+}
+
+
+/* Write C to the frame buffer.  Like the LCD does we ignore
+   characters written behind the end of the line.  */
+void
+lcd_putc (uint8_t c)
+{
+  if (lcd_x < LCD_COLS)
+    lcd_fb[lcd_y][lcd_x++] = c;
 }
 
 
 uint8_t
 lcd_getc (void)
 {
-  _lcd_waitbusy ();
-  return _lcd_read (0);
+  return lcd_x < LCD_COLS? lcd_fb[lcd_y][lcd_x++] : ' ';
 }
 
 void
@@ -1961,6 +2127,7 @@ init_eeprom (void)
   unsigned int aword = 0;
   unsigned char abyte = 0;
 
+  load_eeprom ();
   if (eeprom_read_byte (&e2_init_marker) == E2_INIT_MARKER_OKAY)
     return;
 
@@ -1988,6 +2155,7 @@ init_eeprom (void)
           aword = MK_TIME (22,00);
           abyte = NIGHT_MODE;
           lcd_putc ('.');
+          lcd_update ();
           break;
         }
 
@@ -2005,34 +2173,35 @@ init_eeprom (void)
       put_timer_mode (i, abyte);
     }
 
-  eeprom_update_word (&ee_t_curve_low[DAY_MODE], -100);
-  eeprom_update_word (&ee_t_boiler_max[DAY_MODE], 750);
-  eeprom_update_word (&ee_t_curve_high[DAY_MODE], 180);
-  eeprom_update_word (&ee_t_boiler_min[DAY_MODE], 380);
-  eeprom_update_word (&ee_t_pump_on[DAY_MODE], 400);
+  config.t_curve_low[DAY_MODE] = -100;
+  config.t_boiler_max[DAY_MODE] = 750;
+  config.t_curve_high[DAY_MODE] = 180;
+  config.t_boiler_min[DAY_MODE] = 380;
+  config.t_pump_on[DAY_MODE] = 400;
 
-  eeprom_update_word (&ee_t_curve_low[NIGHT_MODE], -150);
-  eeprom_update_word (&ee_t_boiler_max[NIGHT_MODE], 600);
-  eeprom_update_word (&ee_t_curve_high[NIGHT_MODE], 180);
-  eeprom_update_word (&ee_t_boiler_min[NIGHT_MODE], 380);
-  eeprom_update_word (&ee_t_pump_on[NIGHT_MODE], 450);
+  config.t_curve_low[NIGHT_MODE] = -150;
+  config.t_boiler_max[NIGHT_MODE] = 600;
+  config.t_curve_high[NIGHT_MODE] = 180;
+  config.t_boiler_min[NIGHT_MODE] = 380;
+  config.t_pump_on[NIGHT_MODE] = 450;
 
-  eeprom_update_word (&ee_t_boiler_max[ABSENT_MODE], 600);
-  eeprom_update_word (&ee_t_boiler_min[ABSENT_MODE], 350);
-  eeprom_update_word (&ee_t_curve_low[ABSENT_MODE], -150);
-  eeprom_update_word (&ee_t_curve_high[ABSENT_MODE], 200);
-  eeprom_update_word (&ee_t_pump_on[ABSENT_MODE], 440);
+  config.t_boiler_max[ABSENT_MODE] = 600;
+  config.t_boiler_min[ABSENT_MODE] = 350;
+  config.t_curve_low[ABSENT_MODE] = -150;
+  config.t_curve_high[ABSENT_MODE] = 200;
+  config.t_pump_on[ABSENT_MODE] = 440;
 
   put_shift_offset (0);
 
   for(i = 0 ; i < MAX_LOGGING ;i++)
     {
-      /* Fixme:  Replace using a block fucntion. */
-      eeprom_update_byte (&ee_consumption_buffer[i], 0xFF);
-      eeprom_update_byte (&ee_temperature_buffer[i], 0xFF);
+      consumption_buffer[i] = 0xFF;
+      temperature_buffer[i] = 0xFF;
     }
   put_history_index (0);
 
+  eeprom_dirty = DIRTY_CONFIG | DIRTY_HISTORY;
+  flush_eeprom ();
   eeprom_write_byte (&e2_init_marker, E2_INIT_MARKER_OKAY);
 }
 
@@ -2279,6 +2448,7 @@ main (void)
   lcd_gotoxy (0,1);
   lcd_puts_P ("W.Koch");
 
+  lcd_update ();
   delay_ms (1500);
 
   init_eeprom ();
@@ -2315,6 +2485,7 @@ main (void)
        operation_mode = tmp_mode;
 
      run_menu ();
+     lcd_update ();
      read_t_sensors (0);
      get_controlpoint ();
      relay_control ();
@@ -2330,6 +2501,9 @@ main (void)
          actionflags.day = 0;
        }
 
+     if (eeprom_dirty && !--eeprom_flush_delay)
+       flush_eeprom ();
+
      if (run_atcommand)
        {
          actionflags.output = SERIAL;
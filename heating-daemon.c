@@ -15,7 +15,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _GNU_SOURCE  /* We use asprintf */
+#define _GNU_SOURCE  /* We use asprintf and open_memstream */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +25,8 @@
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #define PGM           "heating-daemon"
 #define PGM_VERSION   "0.1"
@@ -59,6 +61,15 @@ struct state_s last_state, current_state;
 /* Name of the file with the HTML status page.  */
 static char *status_page_fname;
 
+/* The status page is written at most every PAGE_INTERVAL seconds.
+   PAGE_BUFFER holds the last written page and PAGE_DIRTY is set if
+   the state changed but the page has not yet been updated.  */
+static unsigned int page_interval = 30;
+static time_t page_time;
+static char *page_buffer;
+static size_t page_length;
+static int page_dirty;
+
 /* The time the burner has been started or stopped.  */
 static time_t burner_start_time, burner_stop_time;
 
@@ -72,6 +83,76 @@ static int boiler_dc_at_burner_start;
 static time_t burner_alert_time;
 
 
+/* The time-series log.  The samples are stored in the file
+   TS_FNAME; hourly and daily rollups are kept in files with the
+   suffixes ".hour" and ".day".  All files consist of fixed size
+   records in host byte order which are sorted by time.  */
+enum ts_levels
+  {
+    TS_RAW,
+    TS_HOUR,
+    TS_DAY,
+    TS_NLEVELS
+  };
+
+static const char *ts_suffix[TS_NLEVELS] = { "", ".hour", ".day" };
+static const uint32_t ts_span[TS_NLEVELS] = { 0, 3600, 86400 };
+
+/* The values of a sample.  */
+enum ts_values
+  {
+    TS_TARGET,
+    TS_BOILER,
+    TS_OUTSIDE,
+    TS_NVALUES
+  };
+
+static const char *ts_value_name[TS_NVALUES] =
+  { "Desired", "Boiler", "Outside" };
+
+/* A raw sample.  */
+struct ts_sample_s
+{
+  uint32_t time;
+  int16_t value[TS_NVALUES];   /* Temperatures in deci-Celsius.  */
+  uint8_t flags;               /* Bit 0: burner on, bit 1: pump on.  */
+  uint8_t mode;
+};
+
+/* The maximum number of samples in a rollup.  This keeps the sums
+   of the 16 bit values within 32 bits; an interval with more samples
+   is stored in several rollups.  */
+#define TS_MAX_COUNT 65536
+
+/* A rollup of all samples of an hour or day.  */
+struct ts_rollup_s
+{
+  uint32_t start;              /* Start of the interval.  */
+  uint32_t count;              /* Number of samples.  */
+  uint32_t burner_count;       /* Number of samples with burner on.  */
+  int16_t min[TS_NVALUES];
+  int16_t max[TS_NVALUES];
+  int32_t sum[TS_NVALUES];
+};
+
+/* The result of a query.  This is like a rollup but with sums large
+   enough for any range.  */
+struct ts_total_s
+{
+  uint32_t count;
+  uint32_t burner_count;
+  int16_t min[TS_NVALUES];
+  int16_t max[TS_NVALUES];
+  int64_t sum[TS_NVALUES];
+};
+
+static char *ts_fname;
+static FILE *ts_fp[TS_NLEVELS];
+
+/* The rollups of the current hour and day.  */
+static struct ts_rollup_s ts_acc[TS_NLEVELS];
+
+
 /* Print diagnostic message and exit with failure. */
 static void
 die (const char *format, ...)
@@ -215,17 +296,10 @@ day_to_weekday (int d)
 }
 
 
+/* Render the status page to FP.  */
 static void
-print_html_page (void)
+print_html_page (FILE *fp)
 {
-  FILE *fp;
-
-  fp = fopen (status_page_fname, "w");
-  if (!fp)
-    {
-      err ("can't create '%s': %s", status_page_fname, strerror (errno));
-      return;
-    }
   fputs ("<html>\n"
          "<head>\n"
          "<title>Heating system</title>\n"
@@ -274,8 +348,450 @@ print_html_page (void)
 
   fputs ("</body>\n"
          "</html>\n", fp);
+}
 
-  fclose (fp);
+
+/* Update the HTML status page.  The page is rendered into memory and
+   only written if it differs from the last written page.  To avoid
+   a steady stream of small writes, this is done at most every
+   PAGE_INTERVAL seconds; a pending update is written by a later call.
+   The file is replaced atomically so that readers never see a
+   partial page.  */
+static void
+update_html_page (time_t now)
+{
+  FILE *fp;
+  char *buffer, *tmpname;
+  size_t length;
+
+  if (now < page_time + page_interval)
+    {
+      page_dirty = 1;
+      return;
+    }
+  page_dirty = 0;
+
+  fp = open_memstream (&buffer, &length);
+  if (!fp)
+    {
+      err ("open_memstream failed: %s", strerror (errno));
+      return;
+    }
+  print_html_page (fp);
+  if (fclose (fp))
+    {
+      err ("error rendering status page: %s", strerror (errno));
+      return;
+    }
+
+  if (page_buffer && length == page_length
+      && !memcmp (buffer, page_buffer, length))
+    {
+      free (buffer);
+      return;  /* No visible change.  */
+    }
+
+  if (asprintf (&tmpname, "%s.tmp", status_page_fname) < 0)
+    die ("asprintf failed");
+  fp = fopen (tmpname, "w");
+  if (!fp)
+    {
+      err ("can't create '%s': %s", tmpname, strerror (errno));
+      free (tmpname);
+      free (buffer);
+      return;
+    }
+  if (fwrite (buffer, length, 1, fp) != 1 || fclose (fp))
+    {
+      err ("error writing '%s': %s", tmpname, strerror (errno));
+      remove (tmpname);
+      free (buffer);
+    }
+  else if (rename (tmpname, status_page_fname))
+    {
+      err ("error renaming '%s': %s", tmpname, strerror (errno));
+      remove (tmpname);
+      free (buffer);
+    }
+  else
+    {
+      free (page_buffer);
+      page_buffer = buffer;
+      page_length = length;
+      page_time = now;
+    }
+  free (tmpname);
+}
+
+
+/* Return the record size of the time-series file at LEVEL.  */
+static size_t
+ts_recsize (int level)
+{
+  return level == TS_RAW? sizeof (struct ts_sample_s)
+                        : sizeof (struct ts_rollup_s);
+}
+
+
+/* Open the time-series file at LEVEL using MODE.  Returns NULL if
+   the file does not exist and MODE is for reading.  A partial record
+   at the end of the file, as left over by a crash, is removed.  */
+static FILE *
+ts_open (int level, const char *mode)
+{
+  char *fname;
+  FILE *fp;
+  struct stat st;
+  size_t recsize = ts_recsize (level);
+
+  if (asprintf (&fname, "%s%s", ts_fname, ts_suffix[level]) < 0)
+    die ("asprintf failed");
+  fp = fopen (fname, mode);
+  if (!fp)
+    {
+      if (errno == ENOENT && *mode == 'r')
+        {
+          free (fname);
+          return NULL;
+        }
+      die ("can't open '%s': %s", fname, strerror (errno));
+    }
+  if (*mode != 'r' && !fstat (fileno (fp), &st) && st.st_size % recsize)
+    {
+      err ("removing partial record from '%s'", fname);
+      if (ftruncate (fileno (fp), st.st_size - st.st_size % recsize))
+        die ("error truncating '%s': %s", fname, strerror (errno));
+    }
+  free (fname);
+  return fp;
+}
+
+
+/* Return the number of records in the time-series file at LEVEL.  */
+static long
+ts_nrecords (int level)
+{
+  struct stat st;
+
+  if (!ts_fp[level])
+    return 0;
+  fflush (ts_fp[level]);
+  if (fstat (fileno (ts_fp[level]), &st))
+    die ("fstat failed: %s", strerror (errno));
+  return st.st_size / ts_recsize (level);
+}
+
+
+/* Read record IDX of the time-series file at LEVEL into BUFFER.  */
+static void
+ts_read (int level, long idx, void *buffer)
+{
+  size_t recsize = ts_recsize (level);
+
+  if (fseek (ts_fp[level], idx * recsize, SEEK_SET)
+      || fread (buffer, recsize, 1, ts_fp[level]) != 1)
+    die ("error reading time-series file: %s",
+         ferror (ts_fp[level])? strerror (errno) : "short file");
+}
+
+
+/* Return the time of record IDX at LEVEL.  The time is the first
+   field of all records.  */
+static uint32_t
+ts_time (int level, long idx)
+{
+  struct ts_rollup_s buffer;  /* The larger record.  */
+  uint32_t t;
+
+  ts_read (level, idx, &buffer);
+  memcpy (&t, &buffer, sizeof t);
+  return t;
+}
+
+
+/* Return the index of the first record at LEVEL with a time not
+   before T.  */
+static long
+ts_find (int level, uint32_t t)
+{
+  long lo = 0, hi = ts_nrecords (level), mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (ts_time (level, mid) < t)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+
+/* Convert sample S to a rollup R.  */
+static void
+ts_sample_to_rollup (const struct ts_sample_s *s, struct ts_rollup_s *r)
+{
+  int i;
+
+  r->start = s->time;
+  r->count = 1;
+  r->burner_count = (s->flags & 1);
+  for (i=0; i < TS_NVALUES; i++)
+    r->min[i] = r->max[i] = r->sum[i] = s->value[i];
+}
+
+
+/* Merge rollup R into ACC.  */
+static void
+ts_merge (struct ts_rollup_s *acc, const struct ts_rollup_s *r)
+{
+  int i;
+
+  if (!r->count)
+    return;
+  if (!acc->count)
+    {
+      uint32_t start = acc->start;
+      *acc = *r;
+      acc->start = start;
+      return;
+    }
+  acc->count += r->count;
+  acc->burner_count += r->burner_count;
+  for (i=0; i < TS_NVALUES; i++)
+    {
+      if (r->min[i] < acc->min[i])
+        acc->min[i] = r->min[i];
+      if (r->max[i] > acc->max[i])
+        acc->max[i] = r->max[i];
+      acc->sum[i] += r->sum[i];
+    }
+}
+
+
+/* Add the rollup R to the query result T.  */
+static void
+ts_total_add (struct ts_total_s *t, const struct ts_rollup_s *r)
+{
+  int i;
+
+  if (!r->count)
+    return;
+  for (i=0; i < TS_NVALUES; i++)
+    {
+      if (!t->count || r->min[i] < t->min[i])
+        t->min[i] = r->min[i];
+      if (!t->count || r->max[i] > t->max[i])
+        t->max[i] = r->max[i];
+      t->sum[i] += r->sum[i];
+    }
+  t->count += r->count;
+  t->burner_count += r->burner_count;
+}
+
+
+/* Add the rollup R of the next finer level to the rollup of the
+   current interval at LEVEL.  If R belongs to a new interval or the
+   rollup would get too many samples, the current rollup is written
+   and pushed up to the next level.  */
+static void
+ts_push (int level, const struct ts_rollup_s *r)
+{
+  struct ts_rollup_s *acc = &ts_acc[level];
+  uint32_t start = r->start - r->start % ts_span[level];
+
+  if (acc->count
+      && (acc->start != start || acc->count + r->count > TS_MAX_COUNT))
+    {
+      if (fseek (ts_fp[level], 0, SEEK_END)
+          || fwrite (acc, sizeof *acc, 1, ts_fp[level]) != 1
+          || fflush (ts_fp[level]))
+        err ("error writing time-series rollup: %s", strerror (errno));
+      if (level + 1 < TS_NLEVELS)
+        ts_push (level + 1, acc);
+      memset (acc, 0, sizeof *acc);
+    }
+  if (!acc->count)
+    acc->start = start;
+  ts_merge (acc, r);
+}
+
+
+/* Open the time-series files for appending and set up the rollups
+   of the current hour and day from the finer levels.  */
+static void
+ts_init (void)
+{
+  int level;
+  long idx, n;
+  struct ts_sample_s sample;
+  struct ts_rollup_s r;
+  uint32_t end;
+
+  for (level=0; level < TS_NLEVELS; level++)
+    ts_fp[level] = ts_open (level, "a+b");
+
+  /* Starting at the top, each level is rebuilt from the records of
+     the next finer level which are newer than its last record.  */
+  for (level = TS_NLEVELS - 1; level > TS_RAW; level--)
+    {
+      n = ts_nrecords (level);
+      end = n? ts_time (level, n - 1) + ts_span[level] : 0;
+      n = ts_nrecords (level - 1);
+      for (idx = ts_find (level - 1, end); idx < n; idx++)
+        {
+          if (level - 1 == TS_RAW)
+            {
+              ts_read (TS_RAW, idx, &sample);
+              ts_sample_to_rollup (&sample, &r);
+            }
+          else
+            ts_read (level - 1, idx, &r);
+          ts_push (level, &r);
+        }
+    }
+}
+
+
+/* Append the current state to the time-series log.  */
+static void
+ts_add_sample (void)
+{
+  struct ts_sample_s sample;
+  struct ts_rollup_s r;
+
+  memset (&sample, 0, sizeof sample);
+  sample.time = time (NULL);
+  sample.value[TS_TARGET]  = current_state.target_dc;
+  sample.value[TS_BOILER]  = current_state.boiler_dc;
+  sample.value[TS_OUTSIDE] = current_state.outside_dc;
+  sample.flags = (current_state.burner_on | (current_state.pump_on << 1));
+  sample.mode = current_state.mode;
+
+  /* The samples are flushed once a minute by run_loop.  */
+  if (fseek (ts_fp[TS_RAW], 0, SEEK_END)
+      || fwrite (&sample, sizeof sample, 1, ts_fp[TS_RAW]) != 1)
+    err ("error writing time-series sample: %s", strerror (errno));
+
+  ts_sample_to_rollup (&sample, &r);
+  ts_push (TS_HOUR, &r);
+}
+
+
+/* Add all records at LEVEL in the range [FROM,TO) to TOTAL.  The
+   coarsest level covering a part of the range is used.  */
+static void
+ts_query (int level, uint32_t from, uint32_t to, struct ts_total_s *total)
+{
+  uint32_t span = ts_span[level];
+  uint32_t a, b, end;
+  long idx, n;
+  struct ts_sample_s sample;
+  struct ts_rollup_s r;
+
+  if (from >= to)
+    return;
+
+  n = ts_nrecords (level);
+  if (level == TS_RAW)
+    {
+      for (idx = ts_find (level, from); idx < n; idx++)
+        {
+          ts_read (level, idx, &sample);
+          if (sample.time >= to)
+            break;
+          ts_sample_to_rollup (&sample, &r);
+          ts_total_add (total, &r);
+        }
+      return;
+    }
+
+  /* The full intervals inside the range, limited to those which
+     have already been rolled up.  */
+  a = from + (span - from % span) % span;
+  b = to - to % span;
+  end = n? ts_time (level, n - 1) + span : 0;
+  if (b > end)
+    b = end;
+  if (a >= b)
+    {
+      ts_query (level - 1, from, to, total);
+      return;
+    }
+
+  ts_query (level - 1, from, a, total);
+  for (idx = ts_find (level, a); idx < n; idx++)
+    {
+      ts_read (level, idx, &r);
+      if (r.start >= b)
+        break;
+      ts_total_add (total, &r);
+    }
+  ts_query (level - 1, b, to, total);
+}
+
+
+/* Parse a time given as seconds since the Epoch or as local time in
+   the format "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM".  Returns
+   (time_t)(-1) on error.  */
+static time_t
+parse_time (const char *string)
+{
+  struct tm tm;
+  char *endp;
+  unsigned long value;
+  int n;
+
+  if (*string >= '0' && *string <= '9' && !strchr (string, '-'))
+    {
+      value = strtoul (string, &endp, 10);
+      return *endp? (time_t)(-1) : (time_t)value;
+    }
+
+  memset (&tm, 0, sizeof tm);
+  n = sscanf (string, "%d-%d-%dT%d:%d", &tm.tm_year, &tm.tm_mon,
+              &tm.tm_mday, &tm.tm_hour, &tm.tm_min);
+  if (n != 3 && n != 5)
+    return (time_t)(-1);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  tm.tm_isdst = -1;
+  return mktime (&tm);
+}
+
+
+/* Print min, max and average of the logged values in the range
+   [FROM,TO).  */
+static void
+run_query (const char *from_string, const char *to_string)
+{
+  time_t from, to;
+  struct ts_total_s acc;
+  int level, i;
+
+  from = parse_time (from_string);
+  to = parse_time (to_string);
+  if (from == (time_t)(-1) || to == (time_t)(-1))
+    die ("invalid time given for --query");
+
+  for (level=0; level < TS_NLEVELS; level++)
+    ts_fp[level] = ts_open (level, "rb");
+  if (!ts_fp[TS_RAW])
+    die ("no time-series log '%s'", ts_fname);
+
+  memset (&acc, 0, sizeof acc);
+  ts_query (TS_NLEVELS - 1, from, to, &acc);
+
+  printf ("Samples: %u\n", (unsigned int)acc.count);
+  if (!acc.count)
+    return;
+  printf ("%-8s %7s %7s %7s\n", "", "min", "max", "avg");
+  for (i=0; i < TS_NVALUES; i++)
+    printf ("%-8s %7.1f %7.1f %7.1f\n", ts_value_name[i],
+            (float)acc.min[i]/10, (float)acc.max[i]/10,
+            (double)acc.sum[i]/acc.count/10);
+  printf ("Burner on: %.1f%%\n", 100.0 * acc.burner_count / acc.count);
 }
 
 
@@ -286,7 +802,12 @@ evaluate_state (void)
   time_t now;
 
   if (!memcmp (&last_state, &current_state, sizeof (current_state)))
-    return;  /* No change in state.  */
+    {
+      /* No change in state.  */
+      if (page_dirty)
+        update_html_page (time (NULL));
+      return;
+    }
 
   now = time (NULL);
 
@@ -315,7 +836,7 @@ evaluate_state (void)
       burner_alert_time = 0;
     }
 
-  print_html_page ();
+  update_html_page (now);
 
   /* Remember the state.  */
   last_state = current_state;
@@ -419,6 +940,8 @@ run_loop (FILE *fp)
             {
               lasttime = curtime;
               printf ("$:%lu:\n", (unsigned long)curtime);
+              if (ts_fp[TS_RAW] && fflush (ts_fp[TS_RAW]))
+                err ("error writing time-series log: %s", strerror (errno));
             }
 
           /* Print the line top stdout.  */
@@ -432,6 +955,8 @@ run_loop (FILE *fp)
             {
               process_t_line (line);
               evaluate_state ();
+              if (ts_fp[TS_RAW])
+                ts_add_sample ();
             }
 
         }
@@ -450,8 +975,12 @@ run_loop (FILE *fp)
 static int
 show_usage (int ex)
 {
-  fputs ("Usage: " PGM "\n"
+  fputs ("Usage: " PGM " [OPTIONS]\n"
+         "       " PGM " --log FILE --query FROM TO\n"
          "Control the heating controller and collect data.\n\n"
+         "  --page-interval N  update the status page at most every N s\n"
+         "  --log FILE     append samples to the time-series log FILE\n"
+         "  --query FROM TO  print statistics of the log and exit\n"
          "  --verbose      enable extra informational output\n"
          "  --debug        enable additional debug output\n"
          "  --help         display this help and exit\n\n"
@@ -467,6 +996,8 @@ main (int argc, char **argv)
   int last_argc = -1;
   FILE *fp;
   const char *s;
+  const char *query_from = NULL;
+  const char *query_to = NULL;
 
   if (argc)
     {
@@ -499,6 +1030,31 @@ main (int argc, char **argv)
           verbose = debug = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--log"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage (1);
+          ts_fname = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--query"))
+        {
+          argc--; argv++;
+          if (argc < 2)
+            show_usage (1);
+          query_from = argv[0];
+          query_to = argv[1];
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--page-interval"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage (1);
+          page_interval = strtoul (*argv, NULL, 10);
+          argc--; argv++;
+        }
       else if (!strncmp (*argv, "--", 2))
         show_usage (1);
     }
@@ -506,6 +1062,14 @@ main (int argc, char **argv)
   if (argc)
     show_usage (1);
 
+  if (query_from)
+    {
+      if (!ts_fname)
+        show_usage (1);
+      run_query (query_from, query_to);
+      return any_error? 1:0;
+    }
+
   setvbuf (stdout, NULL, _IOLBF, 0);
 
   s = getenv ("HOME");
@@ -516,6 +1080,9 @@ main (int argc, char **argv)
 
   burner_start_time = burner_stop_time = time (NULL);
 
+  if (ts_fname)
+    ts_init ();
+
   fp = open_line ();
   run_loop (fp);
   fclose (fp);
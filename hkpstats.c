@@ -15,6 +15,17 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+/* All requests are run concurrently from a single event loop: The
+   address lookups for all pools are submitted at once; as soon as
+   the addresses of a pool are known the reverse lookups and the
+   HTTP requests for the stats page of each host are started.  Each
+   request has its own timeout.
+
+   With --cache FILE the state of the hosts is kept between runs.
+   DNS answers are then reused until their TTL expires; with
+   --max-age N the stats of a host are only fetched again if they
+   are older than N seconds.  --delta prints only the differences to
+   the cached state.  */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +34,11 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -33,28 +49,101 @@
 #define PGM_VERSION   "0.0"
 #define PGM_BUGREPORT "wk@gnupg.org"
 
+/* The port and the request to get the stats from a keyserver.  */
+#define HKP_PORT      11371
+#define STATS_REQUEST "GET /pks/lookup?op=stats HTTP/1.0\r\n"
+#define STATS_KEYS    "Total number of keys:"
+
+/* We don't need more than this of the stats page.  */
+#define MAX_RESPONSE  65536
+
+
 /* Option flags. */
 static int verbose;
 static int debug;
+static int timeout = 20;  /* Per request timeout in seconds.  */
+static const char *cache_fname;
+static long max_age;      /* Don't refetch stats younger than this.  */
+static int delta_mode;
 
 /* Error counter.  */
 static int any_error;
 
+/* The states of the HTTP request.  */
+enum http_states
+  {
+    HTTP_NONE = 0,
+    HTTP_CONNECTING,
+    HTTP_SENDING,
+    HTTP_READING,
+    HTTP_DONE,
+    HTTP_FAILED
+  };
+
+/* The kind of object used as context for a DNS query.  */
+enum query_kinds
+  {
+    QUERY_POOL,
+    QUERY_HOST
+  };
+
 /* An object to keep track of each host. */
 struct host_s
 {
+  enum query_kinds kind; /* Always QUERY_HOST.  */
   struct host_s *next;
 
   const char *poolname;  /* Original poolname (e.g. "keys.gnupg.net") */
   struct in_addr addr;   /* Its IP address.  */
   char *addr_str;        /* Ditto but in human readabale format.  */
+  char *name;            /* The name from the PTR record or NULL.  */
+  time_t ptr_expires;    /* NAME is valid until then.  */
+  long nkeys;            /* The number of keys or -1 if not known.  */
+  time_t last_seen;      /* Time NKEYS has been fetched.  */
+  struct host_s *old;    /* The cached version of this host or NULL.  */
+  int seen;              /* Used to find cached hosts which vanished.  */
 
   struct {
-    adns_query query;    /* Active query.  */
+    adns_query query;    /* Active reverse lookup.  */
+    double dns_deadline; /* Time the reverse lookup is cancelled.  */
+    enum http_states http_state;
+    int fd;              /* The socket for the HTTP request.  */
+    double http_deadline;/* Time the HTTP request is aborted.  */
+    char *buffer;        /* The request or the response.  */
+    size_t buflen;       /* Used length of BUFFER.  */
+    size_t bufpos;       /* Bytes of the request already sent.  */
   } help;
 };
 typedef struct host_s *host_t;
 
+/* An object to keep track of each pool.  */
+struct pool_s
+{
+  enum query_kinds kind; /* Always QUERY_POOL.  */
+  struct pool_s *next;
+  const char *name;
+  host_t hosts;          /* The hosts of the pool.  */
+  time_t expires;        /* The addresses of HOSTS are valid until then.  */
+  struct pool_s *old;    /* The cached version of this pool or NULL.  */
+  int used;              /* This cached pool has been taken over.  */
+
+  struct {
+    adns_query query;    /* Active address lookup.  */
+    double dns_deadline;
+  } help;
+};
+typedef struct pool_s *pool_t;
+
+/* The list of pools in command line order.  */
+static pool_t poollist;
+
+/* The pools read from the cache.  */
+static pool_t cachelist;
+
+/* The number of active DNS queries and HTTP requests.  */
+static int dns_active;
+static int http_active;
+
 
 
 /* Print diagnostic message and exit with failure. */
@@ -101,7 +190,7 @@ inf (const char *format, ...)
   if (verbose)
     {
       fprintf (stderr, "%s: ", PGM);
-      
+
       va_start (arg_ptr, format);
       vfprintf (stderr, format, arg_ptr);
       va_end (arg_ptr);
@@ -110,102 +199,657 @@ inf (const char *format, ...)
 }
 
 
+static void *
+xcalloc (size_t n, size_t m)
+{
+  void *p = calloc (n, m);
+  if (!p)
+    die ("out of core: %s", strerror (errno));
+  return p;
+}
+
+
+static char *
+xstrdup (const char *string)
+{
+  char *p = strdup (string);
+  if (!p)
+    die ("out of core: %s", strerror (errno));
+  return p;
+}
+
 
+/* Return the current time in seconds.  */
+static double
+now_seconds (struct timeval *tv)
+{
+  gettimeofday (tv, NULL);
+  return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+
+
+/* Start the HTTP request for the stats page of HOST.  */
 static void
-process_one_pool (adns_state adns_ctx, const char *poolname)
+start_http (host_t host, double now)
 {
-  adns_answer *answer = NULL;
-  int rridx;
-  host_t host;
-  host_t hostlist = NULL;
-  in rc;
-
-  inf ("collecting data for `%s'", poolname);
-  
-  if (adns_synchronous (adns_ctx, poolname,
-                        adns_r_a, adns_qf_quoteok_query,
-                        &answer) )
+  struct sockaddr_in sockaddr;
+  int fd;
+
+  host->nkeys = -1;  /* The cached count is not used anymore.  */
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    {
+      err ("error creating socket for %s: %s",
+           host->addr_str, strerror (errno));
+      host->help.http_state = HTTP_FAILED;
+      return;
+    }
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK))
+    die ("error setting socket to non-blocking: %s", strerror (errno));
+
+  memset (&sockaddr, 0, sizeof sockaddr);
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons (HKP_PORT);
+  sockaddr.sin_addr = host->addr;
+  if (connect (fd, (struct sockaddr *)&sockaddr, sizeof sockaddr)
+      && errno != EINPROGRESS)
+    {
+      err ("error connecting %s: %s", host->addr_str, strerror (errno));
+      close (fd);
+      host->help.http_state = HTTP_FAILED;
+      return;
+    }
+
+  host->help.buffer = xcalloc (1, MAX_RESPONSE + 1);
+  snprintf (host->help.buffer, MAX_RESPONSE,
+            STATS_REQUEST "Host: %s:%d\r\n\r\n", host->poolname, HKP_PORT);
+  host->help.buflen = strlen (host->help.buffer);
+  host->help.bufpos = 0;
+  host->help.fd = fd;
+  host->help.http_state = HTTP_CONNECTING;
+  host->help.http_deadline = now + timeout;
+  http_active++;
+}
+
+
+/* Finish the HTTP request of HOST.  If FAILURE is not NULL the
+   request failed and FAILURE describes why.  */
+static void
+end_http (host_t host, const char *failure)
+{
+  const char *s;
+
+  close (host->help.fd);
+  host->help.fd = -1;
+  http_active--;
+  if (failure)
+    {
+      err ("error getting stats from %s: %s", host->addr_str, failure);
+      host->help.http_state = HTTP_FAILED;
+    }
+  else
+    {
+      host->help.buffer[host->help.buflen] = 0;
+      s = strstr (host->help.buffer, STATS_KEYS);
+      if (s)
+        {
+          host->nkeys = strtol (s + strlen (STATS_KEYS), NULL, 10);
+          host->last_seen = time (NULL);
+        }
+      else
+        err ("no key count in stats from %s", host->addr_str);
+      inf ("%s has %ld keys", host->addr_str, host->nkeys);
+      host->help.http_state = HTTP_DONE;
+    }
+  free (host->help.buffer);
+  host->help.buffer = NULL;
+}
+
+
+/* Continue the HTTP request of HOST after poll returned REVENTS.  */
+static void
+process_http (host_t host, int revents)
+{
+  int fd = host->help.fd;
+  ssize_t n;
+  int e;
+  socklen_t elen;
+
+  if (host->help.http_state == HTTP_CONNECTING)
+    {
+      elen = sizeof e;
+      if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &e, &elen))
+        e = errno;
+      if (e)
+        {
+          end_http (host, strerror (e));
+          return;
+        }
+      host->help.http_state = HTTP_SENDING;
+    }
+
+  if (host->help.http_state == HTTP_SENDING && (revents & POLLOUT))
+    {
+      n = write (fd, host->help.buffer + host->help.bufpos,
+                 host->help.buflen - host->help.bufpos);
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+        end_http (host, strerror (errno));
+      else if (n > 0 && (host->help.bufpos += n) == host->help.buflen)
+        {
+          host->help.http_state = HTTP_READING;
+          host->help.buflen = 0;
+        }
+    }
+  else if (host->help.http_state == HTTP_READING
+           && (revents & (POLLIN|POLLHUP|POLLERR)))
     {
-      err ("DNS query for `%s' failed: %s", poolname, strerror (errno));
+      n = read (fd, host->help.buffer + host->help.buflen,
+                MAX_RESPONSE - host->help.buflen);
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+        end_http (host, strerror (errno));
+      else if (!n || (n > 0 && (host->help.buflen += n) == MAX_RESPONSE))
+        end_http (host, NULL);
+    }
+}
+
+
+
+/* Submit the address lookup for POOL.  */
+static void
+submit_pool (adns_state adns_ctx, pool_t pool, double now)
+{
+  int rc;
+
+  inf ("collecting data for `%s'", pool->name);
+  rc = adns_submit (adns_ctx, pool->name, adns_r_a, adns_qf_quoteok_query,
+                    pool, &pool->help.query);
+  if (rc)
+    {
+      err ("DNS query for `%s' failed: %s", pool->name, strerror (rc));
       return;
     }
+  pool->help.dns_deadline = now + timeout;
+  dns_active++;
+}
+
+
+/* Create a new host with ADDR for POOL.  If the host is in the
+   cached version of the pool its cached data is taken over.  */
+static host_t
+new_host (pool_t pool, struct in_addr addr)
+{
+  host_t host, old;
+  const char *s;
+
+  host = xcalloc (1, sizeof *host);
+  host->kind = QUERY_HOST;
+  host->poolname = pool->name;
+  host->addr = addr;
+  host->nkeys = -1;
+  host->help.fd = -1;
+  s = inet_ntoa (host->addr);
+  host->addr_str = xstrdup (s?s:"[none]");
+
+  for (old = pool->old? pool->old->hosts : NULL; old; old = old->next)
+    if (old->addr.s_addr == addr.s_addr)
+      {
+        old->seen = 1;
+        host->old = old;
+        if (old->name)
+          host->name = xstrdup (old->name);
+        host->ptr_expires = old->ptr_expires;
+        host->nkeys = old->nkeys;
+        host->last_seen = old->last_seen;
+        break;
+      }
+
+  host->next = pool->hosts;
+  pool->hosts = host;
+  return host;
+}
+
+
+/* Start the reverse lookup and the HTTP request for HOST unless the
+   cached data is still valid.  */
+static void
+start_host (adns_state adns_ctx, host_t host, double now)
+{
+  struct sockaddr_in sockaddr;
+  int rc;
+
+  inf ("IP=%s", host->addr_str);
+
+  if (host->ptr_expires > (time_t)now)
+    inf ("using cached name of %s", host->addr_str);
+  else
+    {
+      memset (&sockaddr, 0, sizeof sockaddr);
+      sockaddr.sin_family = AF_INET;
+      sockaddr.sin_addr = host->addr;
+      rc = adns_submit_reverse (adns_ctx, (struct sockaddr *)&sockaddr,
+                                adns_r_ptr,
+                                adns_qf_quoteok_cname | adns_qf_cname_loose,
+                                host, &host->help.query);
+      if (rc)
+        {
+          err ("DNS reverse lookup of `%s', %s failed: %s",
+               host->poolname, host->addr_str, strerror (rc));
+          host->help.query = NULL;
+        }
+      else
+        {
+          host->help.dns_deadline = now + timeout;
+          dns_active++;
+        }
+    }
+
+  if (host->nkeys >= 0 && max_age && (time_t)now - host->last_seen < max_age)
+    inf ("using cached stats of %s", host->addr_str);
+  else
+    start_http (host, now);
+}
+
+
+/* Start collecting the data for POOL.  If the cached addresses are
+   still valid, the hosts are taken from the cache; if not the
+   address lookup is submitted.  */
+static void
+start_pool (adns_state adns_ctx, pool_t pool, double now)
+{
+  host_t old;
+
+  if (pool->old && pool->old->expires > (time_t)now)
+    {
+      inf ("using cached addresses for `%s'", pool->name);
+      pool->expires = pool->old->expires;
+      for (old = pool->old->hosts; old; old = old->next)
+        start_host (adns_ctx, new_host (pool, old->addr), now);
+    }
+  else
+    submit_pool (adns_ctx, pool, now);
+}
+
+
+/* Process the ANSWER of the address lookup for POOL.  This creates
+   the hosts and starts their reverse lookups and HTTP requests.  */
+static void
+pool_answer (adns_state adns_ctx, pool_t pool, adns_answer *answer,
+             double now)
+{
+  int rridx;
 
-  if (answer->status != adns_s_ok) 
+  pool->help.query = NULL;
+  if (answer->status != adns_s_ok)
     {
-      err ("DNS query for `%s' failed: %s (%s)", poolname, 
+      err ("DNS query for `%s' failed: %s (%s)", pool->name,
            adns_strerror (answer->status),
-           adns_errabbrev (answer->status)); 
-      free (answer); 
+           adns_errabbrev (answer->status));
       return;
     }
   assert (answer->type == adns_r_a);
 
+  pool->expires = answer->expires;
   for (rridx=0; rridx < answer->nrrs; rridx++)
+    start_host (adns_ctx, new_host (pool, answer->rrs.inaddr[rridx]), now);
+}
+
+
+/* Process the ANSWER of the reverse lookup for HOST.  */
+static void
+host_answer (host_t host, adns_answer *answer)
+{
+  host->help.query = NULL;
+  host->ptr_expires = answer->expires;
+  free (host->name);
+  host->name = NULL;
+  if (answer->status != adns_s_ok)
+    {
+      inf ("DNS reverse lookup of %s failed: %s (%s)", host->addr_str,
+           adns_strerror (answer->status),
+           adns_errabbrev (answer->status));
+      return;
+    }
+  assert (answer->type == adns_r_ptr);
+  if (answer->nrrs)
     {
-      struct sockaddr_in sockaddr;
-      struct in_addr addr = answer->rrs.inaddr[rridx];
-      const char *s;
-
-      host = calloc (1, sizeof *host);
-      if (!host)
-        die ("out of core: %s", strerror (errno));
-      host->poolname = poolname;
-      host->addr = addr;
-      s = inet_ntoa (addr);
-      host->addr_str = strdup (s?s:"[none]");
-      if (!host->addr_str)
-        die ("out of core: %s", strerror (errno));
-        
-      inf ("IP=%s", host->addr_str);
-
-      memset (&sockaddr, 0,sizeof sockaddr);
-      sockaddr.sin_family = AF_INET; 
-      memcpy (&sockaddr.sin_addr, &addr, sizeof addr);
-      if (adns_submit_reverse (adns_ctx, (struct sockaddr *)&sockaddr,
-                               adns_r_ptr, 
-                               adns_qf_quoteok_cname | adns_qf_cname_loose,
-                               host, &host->help.query))
+      host->name = xstrdup (answer->rrs.str[0]);
+      inf ("%s is %s", host->addr_str, host->name);
+    }
+}
+
+
+/* Cancel all requests which are beyond their deadline.  Returns the
+   time in milliseconds until the next deadline.  */
+static int
+check_deadlines (double now)
+{
+  pool_t pool;
+  host_t host;
+  double next = now + timeout;
+
+  for (pool = poollist; pool; pool = pool->next)
+    {
+      if (pool->help.query)
         {
-          err ("DNS reverse lookup of `%s', %s failed: %s (%s)",
-               poolname, host->addr_str,
-               adns_strerror (answer->status),
-               adns_errabbrev (answer->status)); 
-          /*fixme: release_host (host);*/
+          if (pool->help.dns_deadline <= now)
+            {
+              err ("DNS query for `%s' timed out", pool->name);
+              adns_cancel (pool->help.query);
+              pool->help.query = NULL;
+              dns_active--;
+            }
+          else if (pool->help.dns_deadline < next)
+            next = pool->help.dns_deadline;
         }
-      else
+      for (host = pool->hosts; host; host = host->next)
         {
-          host->next = hostlist;
-          hostlist = host;
+          if (host->help.query)
+            {
+              if (host->help.dns_deadline <= now)
+                {
+                  inf ("DNS reverse lookup of %s timed out", host->addr_str);
+                  adns_cancel (host->help.query);
+                  host->help.query = NULL;
+                  dns_active--;
+                }
+              else if (host->help.dns_deadline < next)
+                next = host->help.dns_deadline;
+            }
+          if (host->help.fd != -1)
+            {
+              if (host->help.http_deadline <= now)
+                end_http (host, "timeout");
+              else if (host->help.http_deadline < next)
+                next = host->help.http_deadline;
+            }
         }
     }
-  free (answer);
 
-  if (!hostlist)
-    return;
-    
-  /* Wait until all hosts are resolved. */
+  return (int)((next - now) * 1000) + 1;
+}
+
+
+/* Run the event loop until all requests are done.  */
+static void
+run_event_loop (adns_state adns_ctx)
+{
+  struct pollfd *fds = NULL;
+  host_t *fdhosts = NULL;
+  int fdssize = 0;
+  int nfds, nhttp, nadns, i, rc, tmo;
+  pool_t pool;
+  host_t host;
+  adns_query query;
+  adns_answer *answer;
+  void *context;
+  struct timeval tv;
+  double now;
+
+  now = now_seconds (&tv);
   for (;;)
     {
-      adns_query query = NULL;  
+      /* Process all DNS answers.  */
+      for (;;)
+        {
+          query = NULL;
+          rc = adns_check (adns_ctx, &query, &answer, &context);
+          if (rc == EAGAIN || rc == ESRCH)
+            break;
+          if (rc)
+            die ("adns_check failed: %s", strerror (rc));
+          dns_active--;
+          if (*(enum query_kinds *)context == QUERY_POOL)
+            pool_answer (adns_ctx, context, answer, now);
+          else
+            host_answer (context, answer);
+          free (answer);
+        }
+
+      tmo = check_deadlines (now);
+      if (!dns_active && !http_active)
+        break;
 
-      rc = adns_check(adns_ctx, &query, &answer, &host);
-      if (!rc)
+      /* Build the poll array: First our sockets, then those of
+         ADNS.  */
+      if (fdssize < http_active + ADNS_POLLFDS_RECOMMENDED)
+        {
+          fdssize = http_active + ADNS_POLLFDS_RECOMMENDED + 16;
+          free (fds);
+          free (fdhosts);
+          fds = xcalloc (fdssize, sizeof *fds);
+          fdhosts = xcalloc (fdssize, sizeof *fdhosts);
+        }
+      nhttp = 0;
+      for (pool = poollist; pool; pool = pool->next)
+        for (host = pool->hosts; host; host = host->next)
+          if (host->help.fd != -1)
+            {
+              fds[nhttp].fd = host->help.fd;
+              fds[nhttp].events = (host->help.http_state == HTTP_READING
+                                   ? POLLIN : POLLOUT);
+              fds[nhttp].revents = 0;
+              fdhosts[nhttp] = host;
+              nhttp++;
+            }
+      for (;;)
         {
+          nadns = fdssize - nhttp;
+          rc = adns_beforepoll (adns_ctx, fds + nhttp, &nadns, &tmo, &tv);
+          if (rc != ERANGE)
+            break;
+          fdssize = nhttp + nadns + 16;
+          fds = realloc (fds, fdssize * sizeof *fds);
+          fdhosts = realloc (fdhosts, fdssize * sizeof *fdhosts);
+          if (!fds || !fdhosts)
+            die ("out of core: %s", strerror (errno));
+        }
+      if (rc)
+        die ("adns_beforepoll failed: %s", strerror (rc));
+      nfds = nhttp + nadns;
+
+      if (debug)
+        inf ("polling %d fds, timeout %dms", nfds, tmo);
+      rc = poll (fds, nfds, tmo);
+      if (rc < 0 && errno != EINTR)
+        die ("poll failed: %s", strerror (errno));
+
+      now = now_seconds (&tv);
+      adns_afterpoll (adns_ctx, fds + nhttp, rc < 0? 0 : nadns, &tv);
+      if (rc > 0)
+        for (i=0; i < nhttp; i++)
+          if (fds[i].revents)
+            process_http (fdhosts[i], fds[i].revents);
+    }
+
+  free (fds);
+  free (fdhosts);
+}
 
 
+/* Print one line of the report for HOST.  PREFIX is NULL or the
+   change indicator for the delta report.  */
+static void
+print_host (const char *prefix, host_t host)
+{
+  if (prefix)
+    printf ("%s ", prefix);
+  printf ("%s %s %s ",
+          host->poolname, host->addr_str, host->name? host->name : "-");
+  if (host->nkeys < 0)
+    printf ("-");
+  else
+    printf ("%ld", host->nkeys);
+  if (prefix && *prefix == '~')
+    printf (" (%+ld)", host->nkeys - host->old->nkeys);
+  putchar ('\n');
+}
+
+
+/* Print the collected data.  In delta mode only new hosts ("+"),
+   vanished hosts ("-") and changed key counts ("~") are shown.  */
+static void
+print_report (void)
+{
+  pool_t pool;
+  host_t host;
+
+  for (pool = poollist; pool; pool = pool->next)
+    {
+      for (host = pool->hosts; host; host = host->next)
+        {
+          if (!delta_mode)
+            print_host (NULL, host);
+          else if (!host->old)
+            print_host ("+", host);
+          else if (host->nkeys >= 0 && host->old->nkeys >= 0
+                   && host->nkeys != host->old->nkeys)
+            print_host ("~", host);
         }
-      else if (err == EAGAIN) break;
-      if (err) {
-	fprintf(stderr, "%s: adns_wait/check: %s", progname, strerror(err));
-	exit(1);
-      }
+      if (delta_mode && pool->old && pool->expires)
+        for (host = pool->old->hosts; host; host = host->next)
+          if (!host->seen)
+            print_host ("-", host);
+    }
+}
+
+
 
+/* Return the cached pool NAME or NULL.  */
+static pool_t
+find_cached_pool (const char *name)
+{
+  pool_t pool;
+
+  for (pool = cachelist; pool; pool = pool->next)
+    if (!strcmp (pool->name, name))
+      return pool;
+  return NULL;
+}
 
-      for (host = hostlist; host; host = host->next)
+
+/* Read the cache file.  A missing file is not an error.  */
+static void
+load_cache (void)
+{
+  FILE *fp;
+  char line[1024];
+  char name[256], addr[64], ptrname[256];
+  long long expires, ptr_expires, last_seen;
+  long nkeys;
+  pool_t pool, *pooltail;
+  host_t host;
+  int lnr = 0;
+
+  fp = fopen (cache_fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        die ("can't open `%s': %s", cache_fname, strerror (errno));
+      return;
+    }
+
+  pooltail = &cachelist;
+  while (fgets (line, sizeof line, fp))
     {
-      if (!host->help.query)
+      lnr++;
+      if (*line == '#' || *line == '\n')
         continue;
+      if (sscanf (line, "pool %255s %lld", name, &expires) == 2)
+        {
+          pool = xcalloc (1, sizeof *pool);
+          pool->kind = QUERY_POOL;
+          pool->name = xstrdup (name);
+          pool->expires = expires;
+          *pooltail = pool;
+          pooltail = &pool->next;
+        }
+      else if (sscanf (line, "host %255s %63s %lld %255s %ld %lld", name,
+                       addr, &ptr_expires, ptrname, &nkeys, &last_seen) == 6
+               && (pool = find_cached_pool (name)))
+        {
+          host = xcalloc (1, sizeof *host);
+          host->kind = QUERY_HOST;
+          host->poolname = pool->name;
+          if (!inet_aton (addr, &host->addr))
+            {
+              err ("%s:%d: invalid address", cache_fname, lnr);
+              free (host);
+              continue;
+            }
+          host->addr_str = xstrdup (addr);
+          if (strcmp (ptrname, "-"))
+            host->name = xstrdup (ptrname);
+          host->ptr_expires = ptr_expires;
+          host->nkeys = nkeys;
+          host->last_seen = last_seen;
+          host->help.fd = -1;
+          host->next = pool->hosts;
+          pool->hosts = host;
+        }
+      else
+        err ("%s:%d: invalid line", cache_fname, lnr);
     }
+  if (ferror (fp))
+    die ("error reading `%s': %s", cache_fname, strerror (errno));
+  fclose (fp);
+}
+
+
+static void
+write_cached_pool (FILE *fp, pool_t pool)
+{
+  host_t host;
+
+  fprintf (fp, "pool %s %lld\n", pool->name, (long long)pool->expires);
+  for (host = pool->hosts; host; host = host->next)
+    {
+      /* Keep the old count if the stats could not be fetched.  */
+      if (host->nkeys < 0 && host->old)
+        {
+          host->nkeys = host->old->nkeys;
+          host->last_seen = host->old->last_seen;
+        }
+      fprintf (fp, "host %s %s %lld %s %ld %lld\n",
+               pool->name, host->addr_str, (long long)host->ptr_expires,
+               host->name? host->name : "-", host->nkeys,
+               (long long)host->last_seen);
+    }
+}
+
+
+/* Write the cache file.  Cached pools which have not been asked for
+   are kept.  */
+static void
+save_cache (void)
+{
+  char *tmpname;
+  FILE *fp;
+  pool_t pool;
+
+  tmpname = xcalloc (1, strlen (cache_fname) + 5);
+  strcpy (tmpname, cache_fname);
+  strcat (tmpname, ".tmp");
+  fp = fopen (tmpname, "w");
+  if (!fp)
+    die ("can't create `%s': %s", tmpname, strerror (errno));
+  fputs ("# " PGM " cache\n"
+         "# pool NAME EXPIRES\n"
+         "# host POOL ADDR PTR_EXPIRES PTRNAME KEYS LAST_SEEN\n", fp);
+  for (pool = poollist; pool; pool = pool->next)
+    if (pool->expires)
+      write_cached_pool (fp, pool);
+    else if (pool->old)
+      write_cached_pool (fp, pool->old); /* Lookup failed.  */
+  for (pool = cachelist; pool; pool = pool->next)
+    if (!pool->used)
+      write_cached_pool (fp, pool);
+  if (ferror (fp) || fclose (fp) || rename (tmpname, cache_fname))
+    {
+      err ("error writing `%s': %s", cache_fname, strerror (errno));
+      remove (tmpname);
+    }
+  free (tmpname);
 }
 
 
@@ -214,6 +858,10 @@ show_usage (int ex)
 {
   fputs ("Usage: " PGM " {pool}\n"
          "Generate a report for all keyservers in the POOLs.\n\n"
+         "  --timeout N    timeout for each request in seconds\n"
+         "  --cache FILE   keep the state of the hosts in FILE\n"
+         "  --max-age N    don't refetch stats younger than N seconds\n"
+         "  --delta        report only changes to the cached state\n"
          "  --verbose      enable extra informational output\n"
          "  --debug        enable additional debug output\n"
          "  --help         display this help and exit\n\n"
@@ -224,11 +872,14 @@ show_usage (int ex)
 }
 
 
-int 
+int
 main (int argc, char **argv)
 {
   int last_argc = -1;
   adns_state adns_ctx = NULL;
+  pool_t pool, *pooltail;
+  struct timeval tv;
+  double now;
 
   if (argc)
     {
@@ -261,23 +912,71 @@ main (int argc, char **argv)
           verbose = debug = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--timeout"))
+        {
+          argc--; argv++;
+          if (!argc || (timeout = atoi (*argv)) < 1)
+            show_usage (1);
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--cache"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage (1);
+          cache_fname = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--max-age"))
+        {
+          argc--; argv++;
+          if (!argc || (max_age = atol (*argv)) < 0)
+            show_usage (1);
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--delta"))
+        {
+          delta_mode = 1;
+          argc--; argv++;
+        }
       else if (!strncmp (*argv, "--", 2))
         show_usage (1);
-    }          
+    }
 
   if (argc < 1)
     show_usage (1);
+  if ((max_age || delta_mode) && !cache_fname)
+    show_usage (1);
+
+  if (cache_fname)
+    load_cache ();
 
   if (adns_init (&adns_ctx, adns_if_none, stderr))
     die ("error initializing ADNS: %s", strerror (errno));
 
-  /* Note: Firther own we keep shallow copies of argv; thus don't
+  /* Note: Further on we keep shallow copies of argv; thus don't
      modify them. */
+  now = now_seconds (&tv);
+  pooltail = &poollist;
   for (; argc; argc--, argv++)
-    process_one_pool (adns_ctx, *argv);
-  
+    {
+      pool = xcalloc (1, sizeof *pool);
+      pool->kind = QUERY_POOL;
+      pool->name = *argv;
+      pool->old = find_cached_pool (pool->name);
+      if (pool->old)
+        pool->old->used = 1;
+      *pooltail = pool;
+      pooltail = &pool->next;
+      start_pool (adns_ctx, pool, now);
+    }
+
+  run_event_loop (adns_ctx);
   adns_finish (adns_ctx);
 
+  print_report ();
+  if (cache_fname)
+    save_cache ();
 
   return any_error? 1:0;
 }
@@ -285,6 +984,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "gcc -Wall -W -O2 -g -o hkpstats -ladns hkpstats.c"
+compile-command: "gcc -Wall -W -O2 -g -o hkpstats hkpstats.c -ladns"
 End:
 */
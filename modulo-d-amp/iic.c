@@ -8,9 +8,108 @@ Version:   16.02.09
 Compiler:  AVR-GCC
 **************************************************************************/
 
+#include <avr/interrupt.h>
 #include <util/twi.h>
 #include "iic.h"
 
+//The queued writes; one entry per key
+typedef struct{
+   U8 Adr;
+   U8 Len;
+   U8 Data[2];
+}IIC_MSG_t;
+
+static IIC_MSG_t IicMsg[IIC_KEYS];
+static BOOL IicPending[IIC_KEYS];
+static U8 IicRing[IIC_KEYS];  //Keys in the order of queueing
+static U8 IicHead, IicCount;
+static IIC_MSG_t IicCur;       //The message on the bus
+static U8 IicIdx;              //Next data byte of IicCur
+static U8 IicTries;
+static volatile BOOL IicActive;
+
+
+/*************************************************************************/
+static void startNextMsg(U8 Twcr){
+/*************************************************************************/
+   //Called with interrupts disabled; sends START or STOP+START
+   U8 Key = IicRing[IicHead];
+   if(++IicHead == IIC_KEYS)
+      IicHead = 0;
+   IicCount--;
+   IicPending[Key] = FALSE;
+   IicCur = IicMsg[Key];
+   IicIdx = 0;
+   IicTries = MAX_ITER;
+   IicActive = TRUE;
+   TWCR = Twcr | (1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE);
+}
+
+/*************************************************************************/
+void iic_queue(U8 Key, U8 Adr, U8 Len, U8 Data0, U8 Data1){
+/*************************************************************************/
+   U8 Sreg = SREG;
+   cli();
+   IicMsg[Key].Adr = Adr;
+   IicMsg[Key].Len = Len;
+   IicMsg[Key].Data[0] = Data0;
+   IicMsg[Key].Data[1] = Data1;
+   if(!IicPending[Key]){
+      U8 Tail = IicHead + IicCount;
+      if(Tail >= IIC_KEYS)
+         Tail -= IIC_KEYS;
+      IicRing[Tail] = Key;
+      IicCount++;
+      IicPending[Key] = TRUE;
+   }
+   if(!IicActive)
+      startNextMsg(0);
+   SREG = Sreg;
+}
+
+/*************************************************************************/
+BOOL iic_busy(void){
+/*************************************************************************/
+   return IicActive;
+}
+
+/*************************************************************************/
+SIGNAL (SIG_2WIRE_SERIAL){
+/*************************************************************************/
+   switch(TW_STATUS & 0xF8){
+   case TW_START:
+   case TW_REP_START:
+      TWDR = IicCur.Adr;
+      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
+      return;
+
+   case TW_MT_SLA_ACK:
+   case TW_MT_DATA_ACK:
+      if(IicIdx < IicCur.Len){
+         TWDR = IicCur.Data[IicIdx++];
+         TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
+         return;
+      }
+      break;
+
+   default:  //NACK, arbitration lost or bus error: try again
+      if(--IicTries){
+         IicIdx = 0;
+         TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE);
+         return;
+      }
+      break;
+   }
+
+   //Message done or given up
+   if(IicCount)
+      startNextMsg(1<<TWSTO);
+   else{
+      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
+      IicActive = FALSE;
+   }
+}
+
 
 /*************************************************************************/
 void init_iic(U16 Khz){
@@ -14,6 +14,20 @@ Compiler:  AVR-GCC
 
 #define MAX_ITER 10       // Cancel if slave not responds
 
+//Keys for iic_queue(); for each key only the latest data is sent
+enum{
+   IIC_KEY_MAX9744_MODE,
+   IIC_KEY_MAX9744_VOL,
+   IIC_KEY_TDA7449_INP_SEL,
+   IIC_KEY_TDA7449_INP_GAIN,
+   IIC_KEY_TDA7449_VOLUME,
+   IIC_KEY_TDA7449_BASS,
+   IIC_KEY_TDA7449_TREBLE,
+   IIC_KEY_TDA7449_ATT_RIGHT,
+   IIC_KEY_TDA7449_ATT_LEFT,
+   IIC_KEYS
+};
+
 //////////////////////////////////////////////////////////////////////////
 void init_iic(U16 Khz);
 //////////////////////////////////////////////////////////////////////////
@@ -29,6 +43,14 @@ U8 read_iic_ack(void);
 //////////////////////////////////////////////////////////////////////////
 U8 read_iic_nack(void);
 //////////////////////////////////////////////////////////////////////////
+// Queue a write of Len (1 or 2) data bytes to the slave Adr.  The transfer
+// is done by the TWI interrupt.  If a write with the same Key is still
+// queued only its data is replaced.  Do not mix with the blocking
+// functions above while iic_busy() is TRUE.
+void iic_queue(U8 Key, U8 Adr, U8 Len, U8 Data0, U8 Data1);
+//////////////////////////////////////////////////////////////////////////
+BOOL iic_busy(void);
+//////////////////////////////////////////////////////////////////////////
 
 
 #endif//IIC_DEF
@@ -9,11 +9,21 @@ Compiler:  AVR-GCC
 **************************************************************************/
 
 #include <inttypes.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "lcd.h"
 
 
+/*
+** The frame buffer: what we want to show and what is shown.
+*/
+static CHAR LcdFb[LCD_LINES][LCD_DISP_LENGTH];
+static CHAR LcdShown[LCD_LINES][LCD_DISP_LENGTH];
+static U8   LcdX, LcdY;                  //Cursor position in the frame buffer
+static U8   LcdUpdY;                     //Line to continue lcd_update()
+
+
 /*
 ** local functions
 */
@@ -206,6 +216,56 @@ static void lcd_define_char(void){
 */
 
 
+/*************************************************************************
+Set the DDRAM address of the display to position x,y
+*************************************************************************/
+static void lcd_setaddr(uint8_t x, uint8_t y)
+{
+   if ( y==0 )
+      lcd_command((1<<LCD_DDRAM)+LCD_START_LINE1+x);
+   else if ( y==1)
+      lcd_command((1<<LCD_DDRAM)+LCD_START_LINE2+x);
+#if LCD_LINES == 3
+   else  /*y==2*/
+      lcd_command((1<<LCD_DDRAM)+LCD_START_LINE3+x);
+#endif
+}
+
+
+/*************************************************************************
+Send changed characters to the display; at most LCD_UPDATE_MAX per call
+Returns:  TRUE if there are more changes to send
+*************************************************************************/
+BOOL lcd_update(void)
+{
+   U8 x, y, n, Cnt = 0;
+   BOOL AddrValid;
+
+   for(n = 0; n < LCD_LINES; n++){
+      y = LcdUpdY;
+      AddrValid = FALSE;
+      for(x = 0; x < LCD_DISP_LENGTH; x++){
+         if(LcdFb[y][x] == LcdShown[y][x]){
+            AddrValid = FALSE;
+            continue;
+         }
+         if(Cnt == LCD_UPDATE_MAX)
+            return TRUE;
+         if(!AddrValid){
+            lcd_setaddr(x, y);
+            AddrValid = TRUE;
+         }
+         lcd_data(LcdFb[y][x]);
+         LcdShown[y][x] = LcdFb[y][x];
+         Cnt++;
+      }
+      if(++LcdUpdY == LCD_LINES)
+         LcdUpdY = 0;
+   }
+   return FALSE;
+}
+
+
 /*************************************************************************
 Set cursor to specified position
 Input:    x  horizontal position  (0: left most position)
@@ -215,14 +275,8 @@ Returns:  none
 void lcd_gotoxy(uint8_t x, uint8_t y)
 {
    if(y<LCD_LINES){
-      if ( y==0 )
-         lcd_command((1<<LCD_DDRAM)+LCD_START_LINE1+x);
-      else if ( y==1)
-         lcd_command((1<<LCD_DDRAM)+LCD_START_LINE2+x);
-#if LCD_LINES == 3
-      else  /*y==2*/
-         lcd_command((1<<LCD_DDRAM)+LCD_START_LINE3+x);
-#endif
+      LcdX = x;
+      LcdY = y;
    }
 }
 
@@ -233,7 +287,8 @@ Clear display and set cursor to home position
 *************************************************************************/
 void lcd_clrscr(void)
 {
-   lcd_command(1<<LCD_CLR);
+   memset(LcdFb, ' ', sizeof(LcdFb));
+   LcdX = LcdY = 0;
 }
 
 
@@ -242,7 +297,7 @@ Set cursor to home position
 *************************************************************************/
 void lcd_home(void)
 {
-   lcd_command(1<<LCD_HOME);
+   LcdX = LcdY = 0;
 }
 
 
@@ -253,8 +308,14 @@ Returns:  none
 *************************************************************************/
 void lcd_putc(char c)
 {
-   lcd_waitbusy();
-   lcd_write(c, 1);
+   /* The lines are contiguous in DDRAM; thus continue on the next line */
+   if(LcdX >= LCD_DISP_LENGTH){
+      if(LcdY+1 >= LCD_LINES)
+         return;
+      LcdX = 0;
+      LcdY++;
+   }
+   LcdFb[LcdY][LcdX++] = c;
 }
 
 
@@ -332,7 +393,9 @@ void lcd_init(uint8_t dispAttr)
    lcd_define_char();
    
    lcd_command(LCD_DISP_OFF);              /* display off                  */
-   lcd_clrscr();                           /* display clear                */ 
+   lcd_command(1<<LCD_CLR);                /* display clear                */
+   memset(LcdShown, ' ', sizeof(LcdShown));
+   lcd_clrscr();
    lcd_command(LCD_MODE_DEFAULT);          /* set entry mode               */
    lcd_command(dispAttr);                  /* display/cursor control       */
 }
@@ -38,6 +38,13 @@ Added:   Function lcdBar(..) - a bargraph visualization
  *  Change these definitions to adapt setting to your display
  */
 #define LCD_LINES          3        /**< number of visible lines of the display */
+#define LCD_DISP_LENGTH   16        /**< visible characters per line of the display */
+
+/**
+ *  @name  Definitions for the frame buffer
+ *  Maximum number of characters lcd_update() sends to the display per call
+ */
+#define LCD_UPDATE_MAX     4
 
 /** 
  *  @name  Definitions for connection 
@@ -180,6 +187,17 @@ extern void lcd_puts(const char *s);
 */
 extern void lcd_puts_p(const char *progmem_s);
 
+/**
+ @brief    Send changed characters of the frame buffer to the display
+
+ All output functions only write to a frame buffer in RAM; this function
+ sends up to LCD_UPDATE_MAX characters which differ from the display
+ content.  Call it periodically, e.g. from the 10ms tick.
+ @param    void
+ @return   TRUE if there are more changes to send
+*/
+extern BOOL lcd_update(void);
+
 /**
  @brief    Shows a bargraph -100..+100% 
  
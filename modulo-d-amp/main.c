@@ -229,6 +229,7 @@ AGAIN2:
       
       if(Flag10ms){
          Flag10ms = FALSE;
+         lcd_update();
          if(Showtime){
             Showtime--;
             if(Showtime == 0){
@@ -16,10 +16,8 @@ Compiler:  AVR-GCC
 static U8 Volume;
 
 //////////////////////////////////////////////////////////////////////////
-static void writeByteMax(uint8_t Val){
-   start_iic(MAX9744_WR_ADR);
-   write_iic(Val);
-   stop_iic();
+static void writeByteMax(U8 Key, uint8_t Val){
+   iic_queue(Key, MAX9744_WR_ADR, 1, Val, 0);
 }
 //////////////////////////////////////////////////////////////////////////
 void max9744init(U8 Mode){
@@ -30,10 +28,10 @@ void max9744init(U8 Mode){
    _delay_ms(5);
 
    Mode &= 0x01;  //Mode must not exceed 1
-   writeByteMax(MAX9744_MODULATION | Mode);
+   writeByteMax(IIC_KEY_MAX9744_MODE, MAX9744_MODULATION | Mode);
 
    Volume = 0;
-   writeByteMax(MAX9744_VOLUME_ABS | Volume);
+   writeByteMax(IIC_KEY_MAX9744_VOL, MAX9744_VOLUME_ABS | Volume);
    
 }
 //////////////////////////////////////////////////////////////////////////
@@ -47,7 +45,7 @@ void max9744setVol(U8 Vol){
       Volume = 0;
    else if(Volume > 63) //for catching increment if Volume==63 like this: max9744setVol(max9744getVol()+1)
       Volume = 63;
-   writeByteMax(MAX9744_VOLUME_ABS | Volume);
+   writeByteMax(IIC_KEY_MAX9744_VOL, MAX9744_VOLUME_ABS | Volume);
 }
 //////////////////////////////////////////////////////////////////////////
 U8   max9744getVol(void){
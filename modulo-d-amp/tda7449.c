@@ -24,10 +24,14 @@ static U8 Gain;
 
 //////////////////////////////////////////////////////////////////////////
 static void writeByteTda(U8 Sub, U8 Val){
-   start_iic(TDA7449_WR_ADR);
-   write_iic(Sub);
-   write_iic(Val);
-   stop_iic();
+   //The subaddresses are 0..7 except 3 and map to our keys
+   static const U8 Key[8] = {
+      IIC_KEY_TDA7449_INP_SEL,  IIC_KEY_TDA7449_INP_GAIN,
+      IIC_KEY_TDA7449_VOLUME,   IIC_KEY_TDA7449_VOLUME,
+      IIC_KEY_TDA7449_BASS,     IIC_KEY_TDA7449_TREBLE,
+      IIC_KEY_TDA7449_ATT_RIGHT,IIC_KEY_TDA7449_ATT_LEFT
+   };
+   iic_queue(Key[Sub & 0x07], TDA7449_WR_ADR, 2, Sub, Val);
 }
 //////////////////////////////////////////////////////////////////////////
 static S8 convertSoundNative2dB(U8 Native){
@@ -25,38 +25,68 @@
 #include <assert.h>
 #include <ctype.h>
 #include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#ifdef __linux__
+# include <linux/fs.h>  /* For FICLONE.  */
+#endif
 
 #define PGM           "readgnusmarks"
 #define PGM_VERSION   "0.0"
 #define PGM_BUGREPORT "wk@gnupg.org"
 
+#define DIM(v)        (sizeof(v)/sizeof((v)[0]))
+
 /* Option flags. */
 static int verbose;
 static int debug;
 static const char *outputdir;
+static int do_rename;
+static int do_link;
+static int show_progress;
+static int jobs = 1;
+
+/* Statistics shared by all worker processes.  */
+struct stats_s
+{
+  unsigned long files;
+  unsigned long long bytes;  /* Bytes we had to copy.  */
+};
+static volatile struct stats_s *stats;
+static double start_time;
 
 /* Error counter.  */
 static int any_error;
 
 
+/* An interval of nnml file numbers.  */
 typedef struct
 {
-  unsigned int in_use:1;
-  unsigned int seen:1;
-  unsigned int replied:1;
-  unsigned int passed:1;
-  unsigned int flagged:1;
-} flags_t;
+  unsigned long from;
+  unsigned long to;
+} range_t;
 
-/* Number of flags we currently support.  If one ever needs to process
-   messages with nnnml file number higher an additional data structure
-   is required.  */
-#define MAX_FLAGS 300000
+/* A list of intervals.  While reading the marks the intervals are
+   appended in any order; finish_ranges sorts and merges them so that
+   has_mark can use a binary search.  */
+typedef struct
+{
+  range_t *ranges;
+  size_t nranges;
+  size_t allocated;
+} rangelist_t;
 
-/* An array of flags and a value indicating the allocated numer of
-   elements.  */
-static flags_t *flagarray;
-static size_t flagarraysize;
+/* The marks we support.  The order is the order of the flags in a
+   Maildir file name.  */
+#define MARK_FLAGS "FPRS"
+static rangelist_t marklist[4];
 
 
 
@@ -115,27 +145,144 @@ inf (const char *format, ...)
 
 
 
+static void *
+xrealloc (void *p, size_t n)
+{
+  p = realloc (p, n);
+  if (!p)
+    die ("out of core: %s", strerror (errno));
+  return p;
+}
+
+
+/* Add the interval FROM to TO to the list for ACTION.  */
 static void
-set_mark (int num, int action)
+add_range (int action, unsigned long from, unsigned long to)
 {
-  if (!action)
+  rangelist_t *list;
+  range_t *r;
+  const char *s;
+
+  if (!action || !(s = strchr (MARK_FLAGS, action)))
     return;
+  list = marklist + (s - MARK_FLAGS);
 
-  if (num < 0 || (size_t)num >= flagarraysize)
-    die ("nnml file number %d too high; maximum is %lu", 
-         num, (unsigned long)flagarraysize);
+  /* Extend the last interval if possible.  This is the common case
+     because Gnus writes the intervals in ascending order.  */
+  if (list->nranges)
+    {
+      r = list->ranges + list->nranges - 1;
+      if (from >= r->from && from <= r->to + 1)
+        {
+          if (to > r->to)
+            r->to = to;
+          return;
+        }
+    }
 
-  flagarray[num].in_use = 1;
-  switch (action)
+  if (list->nranges == list->allocated)
     {
-    case 'S': flagarray[num].seen = 1; break;
-    case 'R': flagarray[num].replied = 1; break;
-    case 'P': flagarray[num].passed = 1; break;
-    case 'F': flagarray[num].flagged = 1; break;
+      list->allocated = list->allocated? 2 * list->allocated : 64;
+      list->ranges = xrealloc (list->ranges,
+                               list->allocated * sizeof *list->ranges);
     }
+  r = list->ranges + list->nranges++;
+  r->from = from;
+  r->to = to;
+}
+
+
+static int
+cmp_range (const void *a_arg, const void *b_arg)
+{
+  const range_t *a = a_arg;
+  const range_t *b = b_arg;
+
+  return a->from < b->from? -1 : a->from > b->from;
 }
 
 
+/* Sort and merge all interval lists.  */
+static void
+finish_ranges (void)
+{
+  rangelist_t *list;
+  size_t idx, i, n;
+
+  for (idx=0; idx < DIM (marklist); idx++)
+    {
+      list = marklist + idx;
+      if (!list->nranges)
+        continue;
+      qsort (list->ranges, list->nranges, sizeof *list->ranges, cmp_range);
+      for (n=0, i=1; i < list->nranges; i++)
+        {
+          if (list->ranges[i].from <= list->ranges[n].to + 1)
+            {
+              if (list->ranges[i].to > list->ranges[n].to)
+                list->ranges[n].to = list->ranges[i].to;
+            }
+          else
+            list->ranges[++n] = list->ranges[i];
+        }
+      list->nranges = n + 1;
+      inf ("mark %c: %lu intervals",
+           MARK_FLAGS[idx], (unsigned long)list->nranges);
+    }
+}
+
+
+/* Release all interval lists.  */
+static void
+release_ranges (void)
+{
+  size_t idx;
+
+  for (idx=0; idx < DIM (marklist); idx++)
+    {
+      free (marklist[idx].ranges);
+      memset (marklist + idx, 0, sizeof *marklist);
+    }
+}
+
+
+/* Return true if NUM is in the interval list LIST.  */
+static int
+has_mark (const rangelist_t *list, unsigned long num)
+{
+  size_t lo, hi, mid;
+
+  lo = 0;
+  hi = list->nranges;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (num < list->ranges[mid].from)
+        hi = mid;
+      else if (num > list->ranges[mid].to)
+        lo = mid + 1;
+      else
+        return 1;
+    }
+  return 0;
+}
+
+
+/* Parse the nnml file number from TOKEN.  Returns 0 on error.  */
+static unsigned long
+parse_number (const char *token)
+{
+  unsigned long num;
+  char *endp;
+
+  if (!isdigit (*(const unsigned char *)token))
+    return 0;
+  errno = 0;
+  num = strtoul (token, &endp, 10);
+  if (*endp || errno)
+    return 0;
+  return num;
+}
 
 
 
@@ -149,13 +296,16 @@ read_marks (const char *fname)
   char token[50];
   size_t tokenidx = 0;
   int action = 0;
-  int num, n_from, n_to, cons_state;
+  int cons_state = 0;
+  unsigned long num, n_from = 0, n_to;
 
   fp = fopen (fname, "r");
   if (!fp)
     die ("failed to open `%s': %s", fname, strerror (errno));
 
-  while ((c = getc (fp)) != EOF)
+  /* We are the only user of FP and thus don't need the locking of
+     getc.  */
+  while ((c = getc_unlocked (fp)) != EOF)
     {
       if (!isascii (c))
         die ("non ascii character found in `%s' - can't proceed", fname);
@@ -216,11 +366,11 @@ read_marks (const char *fname)
             }
           else if (level == 2)
             {
-              num = atoi (token);
+              num = parse_number (token);
               if (num < 1)
                 err ("bad number `%s' in `%s' - skipped", token, fname);
               else
-                set_mark (num, action);
+                add_range (action, num, num);
             }
           else if (level == 3)
             {
@@ -228,7 +378,7 @@ read_marks (const char *fname)
                 cons_state++;
               else
                 {
-                  num = atoi (token);
+                  num = parse_number (token);
                   if (num < 1)
                     err ("bad number `%s' in `%s' - skipped", token, fname);
                   else if (!cons_state)
@@ -242,8 +392,8 @@ read_marks (const char *fname)
                       n_to = num;
                       if (n_to < n_from)
                         err ("invalid range in `%s'", fname);
-                      for (num = n_from; num <= n_to; num++)
-                        set_mark (num, action);
+                      else
+                        add_range (action, n_from, n_to);
                     }
                   else
                     err ("too many numbers in cons `%s' - skipped", fname);
@@ -257,6 +407,199 @@ read_marks (const char *fname)
     die ("failed to read `%s': %s", fname, strerror (errno));
 
   fclose (fp);
+
+  finish_ranges ();
+}
+
+
+/* Store the Maildir name for the nnml file NUM below OUTDIR at
+   NEWNAME which has a size of NEWNAMESIZE.  The process id and the
+   host name are part of the name because with --jobs several
+   processes create names in the same second, each with its own
+   counter; rename would silently replace a message on a clash.  */
+static void
+make_newname (char *newname, size_t newnamesize,
+              const char *outdir, unsigned long num)
+{
+  static int counter;
+  static char hostname[64];
+  size_t idx, n;
+  char *p;
+
+  if (!*hostname)
+    {
+      if (gethostname (hostname, sizeof hostname - 1) || !*hostname)
+        strcpy (hostname, "localhost");
+      hostname[sizeof hostname - 1] = 0;
+      /* The Maildir specs don't allow a slash or colon here.  */
+      for (p = hostname; *p; p++)
+        if (*p == '/' || *p == ':')
+          *p = '_';
+    }
+
+  snprintf (newname, newnamesize - 10, "%s/cur/%lu.%lu-%d_%lu.%s",
+            outdir, (unsigned long)time (NULL), num, ++counter,
+            (unsigned long)getpid (), hostname);
+  strcat (newname, ":2,");
+  n = strlen (newname);
+  for (idx=0; idx < DIM (marklist); idx++)
+    if (has_mark (marklist + idx, num))
+      newname[n++] = MARK_FLAGS[idx];
+  newname[n] = 0;
+}
+
+
+/* Return the current time in seconds.  */
+static double
+now_seconds (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/* Print the progress or, if FINAL is set, the summary.  */
+static void
+print_progress (int final)
+{
+  static double last;
+  double now, elapsed;
+
+  now = now_seconds ();
+  if (!final && now - last < 1.0)
+    return;
+  last = now;
+  elapsed = now - start_time;
+  if (elapsed <= 0)
+    elapsed = 0.001;
+
+  fprintf (stderr, "%s: %lu files (%.0f/s), %.1f MiB copied (%.1f MiB/s)%s",
+           PGM, stats->files, stats->files / elapsed,
+           stats->bytes / 1048576.0, stats->bytes / 1048576.0 / elapsed,
+           final? "\n" : "\r");
+}
+
+
+/* Copy OLDNAME to the new file NEWNAME.  If possible the data blocks
+   are shared using a reflink.  Returns 0 on success.  */
+static int
+copy_file (const char *oldname, const char *newname)
+{
+  int src, dst;
+  char buffer[65536];
+  ssize_t nread, nwritten, n;
+  struct stat st;
+  int rc = -1;
+
+  src = open (oldname, O_RDONLY);
+  if (src == -1)
+    return -1;
+  dst = open (newname, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (dst == -1)
+    {
+      close (src);
+      return -1;
+    }
+
+#ifdef FICLONE
+  if (!ioctl (dst, FICLONE, src))
+    {
+      rc = 0;
+      goto leave;
+    }
+#endif
+
+  while ((nread = read (src, buffer, sizeof buffer)))
+    {
+      if (nread == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          goto leave;
+        }
+      for (n=0; n < nread; n += nwritten)
+        {
+          nwritten = write (dst, buffer + n, nread - n);
+          if (nwritten == -1)
+            {
+              if (errno != EINTR)
+                goto leave;
+              nwritten = 0;
+            }
+        }
+      if (stats)
+        __sync_fetch_and_add (&stats->bytes, nread);
+    }
+  rc = 0;
+
+ leave:
+  if (!fstat (src, &st))
+    {
+      /* Keep the time stamp of the message.  */
+      struct timespec ts[2];
+
+      ts[0] = st.st_atim;
+      ts[1] = st.st_mtim;
+      futimens (dst, ts);
+    }
+  close (src);
+  if (close (dst))
+    rc = -1;
+  if (rc)
+    {
+      n = errno;
+      remove (newname);
+      errno = n;
+    }
+  return rc;
+}
+
+
+/* Move OLDNAME to NEWNAME or print the shell command to do this.
+   With --link the file is hard linked, reflinked or copied instead.
+   Returns true on success.  */
+static int
+move_file (const char *oldname, const char *newname)
+{
+  if (!strcmp (oldname, newname))
+    {
+      inf ("file `%s' not moved", oldname);
+      return 0;
+    }
+  if (!do_rename)
+    printf ("mv '%s' '%s'\n", oldname, newname);
+  else if (do_link)
+    {
+      if (link (oldname, newname)
+          && ((errno != EXDEV && errno != EPERM && errno != EMLINK)
+              || copy_file (oldname, newname)))
+        {
+          err ("linking `%s' to `%s' failed: %s",
+               oldname, newname, strerror (errno));
+          return 0;
+        }
+    }
+  else if (rename (oldname, newname))
+    {
+      if (errno != EXDEV || copy_file (oldname, newname))
+        {
+          err ("renaming `%s' to `%s' failed: %s",
+               oldname, newname, strerror (errno));
+          return 0;
+        }
+      if (remove (oldname))
+        err ("error removing `%s': %s", oldname, strerror (errno));
+    }
+
+  if (stats)
+    {
+      __sync_fetch_and_add (&stats->files, 1);
+      if (show_progress && jobs < 2)
+        print_progress (0);
+    }
+  return 1;
 }
 
 
@@ -264,66 +607,233 @@ static void
 process_input (void)
 {
   char oldname[1024];
-  char newname[1024+50];
+  char newname[1024+128];
   size_t n;
-  const char *s;
-  char *endp;
-  int num;
-  int counter = 0;
+  unsigned long num;
+  unsigned long count = 0;
 
   while (fgets (oldname, sizeof oldname, stdin))
     {
       n = strlen (oldname);
       if (n && oldname[n-1] == '\n')
         oldname[--n] = 0;
-      s = oldname;
-      num = (int)strtol (s, &endp, 10);
-      if (num < 1 || *endp != '\0')
+      num = parse_number (oldname);
+      if (num < 1)
         {
           err ("bad file name structure '%s' - skipped", oldname);
           continue;
         }
-      if (num < 0 || (size_t)num >= flagarraysize)
+
+      make_newname (newname, sizeof newname, outputdir, num);
+      if (move_file (oldname, newname))
+        count++;
+    }
+  if (ferror (stdin))
+    die ("error reading from stdin: %s", strerror (errno));
+  if (do_rename)
+    inf ("%lu files moved to `%s'", count, outputdir);
+}
+
+
+/* Create the Maildir DIR if it does not yet exist.  */
+static void
+create_maildir (const char *dir)
+{
+  static const char *subdirs[] = { "", "/tmp", "/cur", "/new" };
+  char name[1024];
+  size_t i;
+
+  for (i=0; i < DIM (subdirs); i++)
+    {
+      snprintf (name, sizeof name, "%s%s", dir, subdirs[i]);
+      if (mkdir (name, 0700) && errno != EEXIST)
+        die ("error creating `%s': %s", name, strerror (errno));
+    }
+}
+
+
+/* Move all messages of the nnml folder DIR to the Maildir NEWDIR.  */
+static void
+process_folder (const char *dir, const char *newdir)
+{
+  char oldname[1024];
+  char newname[1024+128];
+  DIR *dp;
+  struct dirent *de;
+  struct stat st;
+  unsigned long num;
+  unsigned long count = 0;
+
+  snprintf (oldname, sizeof oldname, "%s/.marks", dir);
+  if (access (oldname, F_OK) && errno == ENOENT)
+    inf ("no marks for `%s'", dir);
+  else
+    read_marks (oldname);
+  create_maildir (newdir);
+
+  dp = opendir (dir);
+  if (!dp)
+    die ("error opening directory `%s': %s", dir, strerror (errno));
+  while ((de = readdir (dp)))
+    {
+      num = parse_number (de->d_name);
+      if (num < 1)
+        continue;  /* Not an nnml message file.  */
+      snprintf (oldname, sizeof oldname, "%s/%s", dir, de->d_name);
+      if (stat (oldname, &st) || !S_ISREG (st.st_mode))
+        continue;  /* E.g. a subfolder with a numeric name.  */
+      make_newname (newname, sizeof newname, newdir, num);
+      if (move_file (oldname, newname))
+        count++;
+    }
+  closedir (dp);
+
+  inf ("%lu files moved from `%s' to `%s'", count, dir, newdir);
+  release_ranges ();
+}
+
+
+/* Wait for one child process and record its failure.  With
+   --progress the progress is shown while waiting.  */
+static void
+wait_child (void)
+{
+  int status;
+  pid_t pid;
+
+  while (show_progress && !(pid = waitpid (-1, &status, WNOHANG)))
+    {
+      print_progress (0);
+      usleep (100000);
+    }
+  if ((!show_progress && wait (&status) == -1)
+      || (show_progress && pid == (pid_t)(-1)))
+    die ("waiting for child failed: %s", strerror (errno));
+  if (!WIFEXITED (status) || WEXITSTATUS (status))
+    any_error = 1;
+}
+
+
+/* Process the ARGC/2 pairs of nnml folders and Maildirs given by
+   ARGV.  Up to JOBS folders are processed in parallel.  */
+static void
+process_folders (int argc, char **argv)
+{
+  int running = 0;
+  pid_t pid;
+
+  for (; argc >= 2; argc -= 2, argv += 2)
+    {
+      if (jobs < 2)
         {
-          err ("nnml file number %d in `%s' too high - skipped", num, oldname);
+          process_folder (argv[0], argv[1]);
           continue;
         }
 
-      snprintf (newname, sizeof newname-50, "%s/cur/%lu.%d-%d", 
-                outputdir,
-                (unsigned long)time (NULL), num, ++counter);
-
-      strcat (newname, ":2,");
-      if (flagarray[num].in_use)
+      while (running >= jobs)
         {
-           if (flagarray[num].flagged)
-             strcat (newname, "F");
-           if (flagarray[num].passed)
-             strcat (newname, "P");
-           if (flagarray[num].replied)
-             strcat (newname, "R");
-           if (flagarray[num].seen)
-             strcat (newname, "S");
+          wait_child ();
+          running--;
         }
-      if ( !strcmp (oldname, newname) )
+      fflush (NULL);
+      pid = fork ();
+      if (pid == (pid_t)(-1))
+        die ("fork failed: %s", strerror (errno));
+      if (!pid)
         {
-          inf ("file `%s' not moved", oldname);
-          continue;
+          process_folder (argv[0], argv[1]);
+          exit (any_error? 1:0);
         }
-      printf ("mv '%s' '%s'\n", oldname, newname); 
+      running++;
     }
-  if (ferror (stdin))
-    die ("error reading from stdin: %s", strerror (errno));
+
+  for (; running; running--)
+    wait_child ();
 }
 
 
+/* A list of folder pairs suitable for process_folders.  */
+static char **folderlist;
+static size_t nfolderlist, folderlistsize;
+
+
+static void
+add_folder (const char *dir, const char *newdir)
+{
+  if (nfolderlist + 2 > folderlistsize)
+    {
+      folderlistsize = folderlistsize? 2 * folderlistsize : 64;
+      folderlist = xrealloc (folderlist, folderlistsize * sizeof *folderlist);
+    }
+  folderlist[nfolderlist++] = strdup (dir);
+  folderlist[nfolderlist++] = strdup (newdir);
+  if (!folderlist[nfolderlist-2] || !folderlist[nfolderlist-1])
+    die ("out of core: %s", strerror (errno));
+}
+
+
+/* Walk the nnml tree at DIR and add all folders to FOLDERLIST.  The
+   Maildir++ folder is named by the directory names in PREFIX below
+   the Maildir ROOT; an empty PREFIX denotes the root.  */
+static void
+collect_folders (const char *dir, const char *root, const char *prefix)
+{
+  DIR *dp;
+  struct dirent *de;
+  struct stat st;
+  char name[1024];
+  char newprefix[1024];
+  int is_folder = 0;
+  int is_dir;
+
+  dp = opendir (dir);
+  if (!dp)
+    {
+      err ("error opening directory `%s': %s", dir, strerror (errno));
+      return;
+    }
+  while ((de = readdir (dp)))
+    {
+      snprintf (name, sizeof name, "%s/%s", dir, de->d_name);
+      is_dir = (de->d_type == DT_DIR
+                || (de->d_type == DT_UNKNOWN
+                    && !stat (name, &st) && S_ISDIR (st.st_mode)));
+      if (!strcmp (de->d_name, ".marks")
+          || (!is_dir && parse_number (de->d_name)))
+        {
+          is_folder = 1;
+          continue;
+        }
+      if (!is_dir || *de->d_name == '.' || strchr (de->d_name, '.'))
+        continue;  /* Skip files, hidden and names we can't map.  */
+      snprintf (newprefix, sizeof newprefix, "%s.%s", prefix, de->d_name);
+      collect_folders (name, root, newprefix);
+    }
+  closedir (dp);
+
+  if (is_folder)
+    {
+      snprintf (name, sizeof name, "%s%s%s", root, *prefix? "/":"", prefix);
+      add_folder (dir, name);
+    }
+}
 
 
 static int
 show_usage (int ex)
 {
   fputs ("Usage: " PGM " <MARKSFILE> [OUTDIR]\n"
+         "       " PGM " --folders {<NNMLDIR> <MAILDIR>}\n"
+         "       " PGM " --tree <NNMLROOT> <MAILDIR>\n"
          "Read an nnml .marks file and rename Maildir files from stdin\n\n"
+         "  --rename       rename the files instead of printing mv commands\n"
+         "  --folders      move all messages of the given nnml folders;\n"
+         "                 implies --rename\n"
+         "  --tree         convert all folders below NNMLROOT to Maildir++\n"
+         "                 folders of MAILDIR; implies --rename\n"
+         "  --link         keep the nnml files; link or copy the messages\n"
+         "  --jobs N       process up to N folders in parallel\n"
+         "  --progress     show progress and throughput\n"
          "  --verbose      enable extra informational output\n"
          "  --debug        enable additional debug output\n"
          "  --help         display this help and exit\n\n"
@@ -338,6 +848,8 @@ int
 main (int argc, char **argv)
 {
   int last_argc = -1;
+  int folder_mode = 0;
+  int tree_mode = 0;
 
   if (argc)
     {
@@ -370,10 +882,69 @@ main (int argc, char **argv)
           verbose = debug = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--rename"))
+        {
+          do_rename = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--folders"))
+        {
+          folder_mode = do_rename = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--tree"))
+        {
+          tree_mode = do_rename = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--link"))
+        {
+          do_link = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--progress"))
+        {
+          show_progress = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--jobs"))
+        {
+          argc--; argv++;
+          if (!argc)
+            show_usage (1);
+          jobs = atoi (*argv);
+          argc--; argv++;
+        }
       else if (!strncmp (*argv, "--", 2))
         show_usage (1);
     }          
 
+  if (folder_mode || tree_mode)
+    {
+      if (tree_mode? argc != 2 : (!argc || (argc % 2)))
+        show_usage (1);
+
+      stats = mmap (NULL, sizeof *stats, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+      if (stats == MAP_FAILED)
+        die ("mmap failed: %s", strerror (errno));
+      start_time = now_seconds ();
+
+      if (tree_mode)
+        {
+          create_maildir (argv[1]);
+          collect_folders (argv[0], argv[1], "");
+          inf ("%lu folders found", (unsigned long)nfolderlist/2);
+          process_folders (nfolderlist, folderlist);
+        }
+      else
+        process_folders (argc, argv);
+
+      if (show_progress || verbose)
+        print_progress (1);
+      return any_error? 1:0;
+    }
+
   if (argc < 1 || argc > 2 )
     show_usage (1);
   if (argc == 2)
@@ -381,16 +952,11 @@ main (int argc, char **argv)
   else
     outputdir = ".";
 
-  flagarraysize = MAX_FLAGS;
-  flagarray = calloc (flagarraysize, sizeof *flagarray);
-  if (!flagarray)
-    die ("out of core: %s", strerror (errno));
-
   read_marks (*argv);
   
   process_input ();
 
-  free (flagarray);
+  release_ranges ();
 
   return any_error? 1:0;
 }
@@ -36,6 +36,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -52,7 +53,10 @@ enum token_type
   tSPECIAL
 };
 
-/* For now we directly use our TOKEN as the parse context */
+/* For now we directly use our TOKEN as the parse context.  DATA has
+   room for a second copy of the string right after its terminating
+   nul; it is used for a lowercased version of a parameter value so
+   that the cached token list keeps the original value.  */
 typedef struct rfc822parse_field_context *TOKEN;
 struct rfc822parse_field_context
 {
@@ -60,21 +64,38 @@ struct rfc822parse_field_context
   enum token_type type;
   struct {
     unsigned int cont:1;
-    unsigned int lowered:1;
+    unsigned int lowered:1;    /* DATA has been lowercased. */
+    unsigned int lower_copy:1; /* The second copy is valid. */
   } flags;
-  /*TOKEN owner_pantry; */
   char data[1];
 };
 
 struct hdr_line
 {
   struct hdr_line *next;
+  struct hdr_line *next_same; /* Next line with the same name.  Only
+                                 valid if the part has an index. */
   int cont;     /* This is a continuation of the previous line. */
+  int parsed;   /* TOKENS is valid. */
+  struct rfc822parse_field_context *tokens; /* The parsed field. */
   unsigned char line[1];
 };
 
 typedef struct hdr_line *HDR_LINE;
 
+/* An entry of the hash table mapping field names to header lines. */
+struct hdr_index
+{
+  struct hdr_index *next;   /* Next entry of the same bucket. */
+  unsigned int hash;
+  size_t namelen;
+  HDR_LINE first;           /* The name is the start of its line. */
+  HDR_LINE last;
+};
+typedef struct hdr_index *HDR_INDEX;
+
+#define MIN_INDEX_SIZE 32  /* Must be a power of 2. */
+
 
 struct part
 {
@@ -82,10 +103,39 @@ struct part
   struct part *down;      /* A contained part. */
   HDR_LINE hdr_lines;       /* Header lines os that part. */
   HDR_LINE *hdr_lines_tail; /* Helper for adding lines. */
+  HDR_LINE last_field;      /* First line of the last field. */
   char *boundary;           /* Only used in the first part. */
+  size_t boundary_len;      /* Length of BOUNDARY. */
+  HDR_INDEX *index;         /* Hash table of the field names or NULL. */
+  unsigned int index_size;  /* Number of buckets in INDEX. */
+  unsigned int index_count; /* Number of entries in INDEX. */
 };
 typedef struct part *part_t;
 
+/* All header lines, tokens and parts of a message are allocated from
+   an arena which is released at once when the message is closed.
+   Large objects get a block of their own.  */
+#define ARENA_BLOCKSIZE 8192
+
+typedef union
+{
+  void *p;
+  long l;
+  double d;
+} arena_align_t;
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;                 /* Allocated size of DATA. */
+  size_t used;                 /* Used bytes of DATA. */
+  arena_align_t data[1];
+};
+typedef struct arena_block *ARENA_BLOCK;
+
+#define ARENA_ALIGN(n) (((n) + sizeof (arena_align_t) - 1) \
+                        & ~(sizeof (arena_align_t) - 1))
+
 struct rfc822parse_context
 {
   rfc822parse_cb_t callback;
@@ -95,11 +145,21 @@ struct rfc822parse_context
   int in_preamble;      /* Wether we are before the first boundary. */
   part_t parts;         /* The tree of parts. */
   part_t current_part;  /* Whom we are processing (points into parts). */
+  part_t *parents;      /* Stack of the multiparts containing
+                           CURRENT_PART; the innermost is the last. */
+  size_t nparents;
+  size_t parents_size;
   const char *boundary; /* Current boundary. */
+  size_t boundary_len;  /* Length of BOUNDARY. */
+  ARENA_BLOCK arena;    /* The current block is the first one. */
+  unsigned char *pending;  /* Incomplete line given to rfc822parse_feed. */
+  size_t pending_len;
+  size_t pending_size;
 };
 
 static HDR_LINE find_header (rfc822parse_t msg, const char *name,
 			     int which, HDR_LINE * rprev);
+static int index_header (rfc822parse_t msg, part_t part, HDR_LINE hdr);
 
 
 /* This function is non-static to avoid conflicts with a stpcpy in
@@ -139,6 +199,91 @@ length_sans_trailing_ws (const unsigned char *line, size_t len)
 }
 
 
+/* Allocate N bytes from the arena of MSG.  Returns NULL with errno
+   set on memory failure. */
+static void *
+arena_alloc (rfc822parse_t msg, size_t n)
+{
+  ARENA_BLOCK b = msg->arena;
+  void *p;
+
+  n = ARENA_ALIGN (n);
+  if (b && b->size - b->used >= n)
+    {
+      p = (char*)b->data + b->used;
+      b->used += n;
+      return p;
+    }
+
+  b = malloc (offsetof (struct arena_block, data)
+              + (n > ARENA_BLOCKSIZE/2? n : ARENA_BLOCKSIZE));
+  if (!b)
+    return NULL;
+  if (n > ARENA_BLOCKSIZE/2)
+    {
+      /* Put a large object behind the current block so that the
+         remaining space of that one may still be used. */
+      b->size = b->used = n;
+      if (msg->arena)
+        {
+          b->next = msg->arena->next;
+          msg->arena->next = b;
+        }
+      else
+        {
+          b->next = NULL;
+          msg->arena = b;
+        }
+    }
+  else
+    {
+      b->size = ARENA_BLOCKSIZE;
+      b->used = n;
+      b->next = msg->arena;
+      msg->arena = b;
+    }
+  return b->data;
+}
+
+
+/* Resize the object P of OLDSIZE bytes allocated from the arena to
+   NEWSIZE bytes.  This is done in place if P is the last object of
+   the current block. */
+static void *
+arena_resize (rfc822parse_t msg, void *p, size_t oldsize, size_t newsize)
+{
+  ARENA_BLOCK b = msg->arena;
+  void *newp;
+
+  if (!p)
+    return arena_alloc (msg, newsize);
+  if (b && (char*)p + ARENA_ALIGN (oldsize) == (char*)b->data + b->used
+      && b->size - (b->used - ARENA_ALIGN (oldsize)) >= ARENA_ALIGN (newsize))
+    {
+      b->used += ARENA_ALIGN (newsize) - ARENA_ALIGN (oldsize);
+      return p;
+    }
+  newp = arena_alloc (msg, newsize);
+  if (newp)
+    memcpy (newp, p, oldsize < newsize? oldsize : newsize);
+  return newp;
+}
+
+
+static void
+arena_release (rfc822parse_t msg)
+{
+  ARENA_BLOCK b, b2;
+
+  for (b = msg->arena; b; b = b2)
+    {
+      b2 = b->next;
+      free (b);
+    }
+  msg->arena = NULL;
+}
+
+
 static void
 lowercase_string (unsigned char *string)
 {
@@ -186,47 +331,31 @@ do_callback (rfc822parse_t msg, rfc822parse_event_t event)
 }
 
 static part_t
-new_part (void)
+new_part (rfc822parse_t msg)
 {
   part_t part;
 
-  part = calloc (1, sizeof *part);
+  part = arena_alloc (msg, sizeof *part);
   if (part)
     {
+      memset (part, 0, sizeof *part);
       part->hdr_lines_tail = &part->hdr_lines;
     }
   return part;
 }
 
 
-static void
-release_part (part_t part)
-{
-  part_t tmp;
-  HDR_LINE hdr, hdr2;
-
-  for (; part; part = tmp)
-    {
-      tmp = part->right;
-      if (part->down)
-        release_part (part->down);
-      for (hdr = part->hdr_lines; hdr; hdr = hdr2)
-        {
-          hdr2 = hdr->next;
-          free (hdr);
-        }
-      free (part->boundary);
-      free (part);
-    }
-}
-
-
 static void
 release_handle_data (rfc822parse_t msg)
 {
-  release_part (msg->parts);
+  arena_release (msg);
+  free (msg->pending);
+  msg->pending = NULL;
+  msg->pending_len = msg->pending_size = 0;
   msg->parts = NULL;
   msg->current_part = NULL;
+  msg->parents = NULL;
+  msg->nparents = msg->parents_size = 0;
   msg->boundary = NULL;
 }
 
@@ -240,7 +369,7 @@ rfc822parse_open (rfc822parse_cb_t cb, void *cb_value)
   rfc822parse_t msg = calloc (1, sizeof *msg);
   if (msg)
     {
-      msg->parts = msg->current_part = new_part ();
+      msg->parts = msg->current_part = new_part (msg);
       if (!msg->parts)
         {
           free (msg);
@@ -285,48 +414,40 @@ rfc822parse_close (rfc822parse_t msg)
     }
 }
 
-static part_t
-find_parent (part_t tree, part_t target)
+/* Push PART onto the stack of parents.  Returns 0 on success. */
+static int
+push_parent (rfc822parse_t msg, part_t part)
 {
-  part_t part;
-
-  for (part = tree->down; part; part = part->right)
+  if (msg->nparents == msg->parents_size)
     {
-      if (part == target)
-        return tree; /* Found. */
-      if (part->down)
-        {
-          part_t tmp = find_parent (part, target);
-          if (tmp)
-            return tmp;
-        }
+      size_t n = msg->parents_size? 2 * msg->parents_size : 8;
+      part_t *p;
+
+      p = arena_resize (msg, msg->parents, msg->parents_size * sizeof *p,
+                        n * sizeof *p);
+      if (!p)
+        return -1;
+      msg->parents = p;
+      msg->parents_size = n;
     }
-  return NULL;
+  msg->parents[msg->nparents++] = part;
+  return 0;
 }
 
+
 static void
 set_current_part_to_parent (rfc822parse_t msg)
 {
   part_t parent;
 
   assert (msg->current_part);
-  parent = find_parent (msg->parts, msg->current_part);
-  if (!parent)
+  if (!msg->nparents)
     return; /* Already at the top. */
 
-#ifndef NDEBUG
-  {
-    part_t part;
-    for (part = parent->down; part; part = part->right)
-      if (part == msg->current_part)
-        break;
-    assert (part);
-  }
-#endif
-  msg->current_part = parent;
-
-  parent = find_parent (msg->parts, parent);
+  msg->current_part = msg->parents[--msg->nparents];
+  parent = msg->nparents? msg->parents[msg->nparents - 1] : NULL;
   msg->boundary = parent? parent->boundary: NULL;
+  msg->boundary_len = parent? parent->boundary_len : 0;
 }
 
 
@@ -359,21 +480,19 @@ transition_to_body (rfc822parse_t msg)
               if (s)
                 {
                   assert (!msg->current_part->boundary);
-                  msg->current_part->boundary = malloc (strlen (s) + 1);
+                  msg->current_part->boundary = arena_alloc (msg,
+                                                             strlen (s) + 1);
                   if (msg->current_part->boundary)
                     {
                       part_t part;
 
                       strcpy (msg->current_part->boundary, s);
+                      msg->current_part->boundary_len = strlen (s);
                       msg->boundary = msg->current_part->boundary;
-                      part = new_part ();
-                      if (!part)
-                        {
-                          int save_errno = errno;
-                          rfc822parse_release_field (ctx);
-                          errno = save_errno;
-                          return -1;
-                        }
+                      msg->boundary_len = msg->current_part->boundary_len;
+                      part = new_part (msg);
+                      if (!part || push_parent (msg, msg->current_part))
+                        return -1;
                       rc = do_callback (msg, RFC822PARSE_LEVEL_DOWN);
                       assert (!msg->current_part->down);
                       msg->current_part->down = part;
@@ -399,7 +518,7 @@ transition_to_header (rfc822parse_t msg)
   assert (msg->current_part);
   assert (!msg->current_part->right);
 
-  part = new_part ();
+  part = new_part (msg);
   if (!part)
     return -1;
 
@@ -425,20 +544,35 @@ insert_header (rfc822parse_t msg, const unsigned char *line, size_t length)
     do_callback (msg, RFC822PARSE_BEGIN_HEADER);
 
   length = length_sans_trailing_ws (line, length);
-  hdr = malloc (sizeof (*hdr) + length);
+  hdr = arena_alloc (msg, sizeof (*hdr) + length);
   if (!hdr)
     return -1;
   hdr->next = NULL;
+  hdr->next_same = NULL;
+  hdr->parsed = 0;
+  hdr->tokens = NULL;
   hdr->cont = (*line == ' ' || *line == '\t');
   memcpy (hdr->line, line, length);
   hdr->line[length] = 0; /* Make it a string. */
 
   /* Transform a field name into canonical format. */
-  if (!hdr->cont && strchr (line, ':'))
+  if (!hdr->cont && strchr (hdr->line, ':'))
      capitalize_header_name (hdr->line);
 
+  /* A continuation line makes the tokens of its field stale; they
+     may have been parsed early by the RCVD_SEEN callback.  */
+  if (!hdr->cont)
+    msg->current_part->last_field = hdr;
+  else if (msg->current_part->last_field)
+    {
+      msg->current_part->last_field->parsed = 0;
+      msg->current_part->last_field->tokens = NULL;
+    }
+
   *msg->current_part->hdr_lines_tail = hdr;
   msg->current_part->hdr_lines_tail = &hdr->next;
+  if (msg->current_part->index && index_header (msg, msg->current_part, hdr))
+    return -1;
 
   /* Lets help the caller to prevent mail loops and issue an event for
    * every Received header. */
@@ -458,7 +592,7 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
 
   if (length > 2 && *line == '-' && line[1] == '-' && msg->boundary)
     {
-      size_t blen = strlen (msg->boundary);
+      size_t blen = msg->boundary_len;
 
       if (length == blen + 2
           && !memcmp (line+2, msg->boundary, blen))
@@ -475,6 +609,7 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
         {
           rc = do_callback (msg, RFC822PARSE_LAST_BOUNDARY);
           msg->boundary = NULL; /* No current boundary anymore. */
+          msg->boundary_len = 0;
           set_current_part_to_parent (msg);
 
           /* Fixme: The next should acctually be sent right before the
@@ -500,6 +635,87 @@ rfc822parse_insert (rfc822parse_t msg, const unsigned char *line, size_t length)
 }
 
 
+/* Append LENGTH bytes of BUFFER to the pending line of MSG.  */
+static int
+append_pending (rfc822parse_t msg, const unsigned char *buffer, size_t length)
+{
+  if (msg->pending_len + length > msg->pending_size)
+    {
+      size_t n = msg->pending_size? msg->pending_size : 256;
+      unsigned char *p;
+
+      while (n < msg->pending_len + length)
+        n *= 2;
+      p = realloc (msg->pending, n);
+      if (!p)
+        return -1;
+      msg->pending = p;
+      msg->pending_size = n;
+    }
+  memcpy (msg->pending + msg->pending_len, buffer, length);
+  msg->pending_len += length;
+  return 0;
+}
+
+
+static int
+feed_line (rfc822parse_t msg, const unsigned char *line, size_t length)
+{
+  if (length && line[length-1] == '\r')
+    length--;
+  return rfc822parse_insert (msg, line, length);
+}
+
+
+/* Insert LENGTH bytes of BUFFER into the parser.  The data may be
+   split at arbitrary places and may contain binary zeroes; lines are
+   terminated by a LF and a CR right before the LF is removed.  An
+   incomplete last line is kept until more data is fed or until
+   BUFFER is passed as NULL to indicate the end of the input.  Return
+   0 on success or true on error with errno set appropriately. */
+int
+rfc822parse_feed (rfc822parse_t msg, const void *buffer, size_t length)
+{
+  const unsigned char *s = buffer;
+  const unsigned char *end, *eol;
+  size_t n;
+  int rc;
+
+  if (!buffer)
+    {
+      rc = 0;
+      if (msg->pending_len)
+        {
+          rc = feed_line (msg, msg->pending, msg->pending_len);
+          msg->pending_len = 0;
+        }
+      return rc;
+    }
+
+  end = s + length;
+  if (msg->pending_len)
+    {
+      if (!(eol = memchr (s, '\n', length)))
+        return append_pending (msg, s, length);
+      if (append_pending (msg, s, eol - s))
+        return -1;
+      n = msg->pending_len;
+      msg->pending_len = 0;
+      if ((rc = feed_line (msg, msg->pending, n)))
+        return rc;
+      s = eol + 1;
+    }
+
+  for (; s < end && (eol = memchr (s, '\n', end - s)); s = eol + 1)
+    if ((rc = feed_line (msg, s, eol - s)))
+      return rc;
+
+  if (s < end)
+    return append_pending (msg, s, end - s);
+  return 0;
+}
+
+
 /* Tell the parser that we have finished the message. */
 int
 rfc822parse_finish (rfc822parse_t msg)
@@ -610,6 +826,116 @@ rfc822parse_enum_header_lines (rfc822parse_t msg, void **context)
 
 
 
+static unsigned int
+hash_header_name (const unsigned char *name, size_t namelen)
+{
+  unsigned int hash = 0;
+
+  for (; namelen; namelen--, name++)
+    hash = hash * 31 + *name;
+  return hash;
+}
+
+
+/* Return the index entry for the field NAME of length NAMELEN or
+   NULL if there is none.  */
+static HDR_INDEX
+lookup_index (part_t part, const unsigned char *name, size_t namelen,
+              unsigned int hash)
+{
+  HDR_INDEX e;
+
+  for (e = part->index[hash & (part->index_size - 1)]; e; e = e->next)
+    if (e->hash == hash && e->namelen == namelen
+        && !memcmp (e->first->line, name, namelen))
+      return e;
+  return NULL;
+}
+
+
+/* Create or double the size of the index of PART.  Returns 0 on
+   success. */
+static int
+grow_index (rfc822parse_t msg, part_t part)
+{
+  HDR_INDEX *table, e, e2;
+  unsigned int i, size;
+
+  size = part->index_size? 2 * part->index_size : MIN_INDEX_SIZE;
+  table = arena_alloc (msg, size * sizeof *table);
+  if (!table)
+    return -1;
+  memset (table, 0, size * sizeof *table);
+  for (i = 0; i < part->index_size; i++)
+    for (e = part->index[i]; e; e = e2)
+      {
+        e2 = e->next;
+        e->next = table[e->hash & (size - 1)];
+        table[e->hash & (size - 1)] = e;
+      }
+  part->index = table;
+  part->index_size = size;
+  return 0;
+}
+
+
+/* Add the header line HDR to the index of PART.  Returns 0 on
+   success. */
+static int
+index_header (rfc822parse_t msg, part_t part, HDR_LINE hdr)
+{
+  unsigned char *p;
+  unsigned int hash;
+  size_t n;
+  HDR_INDEX e;
+
+  if (hdr->cont || !(p = strchr (hdr->line, ':')) || p == hdr->line)
+    return 0;  /* Not a valid field. */
+  n = p - hdr->line;
+  hash = hash_header_name (hdr->line, n);
+
+  e = lookup_index (part, hdr->line, n, hash);
+  if (e)
+    {
+      e->last->next_same = hdr;
+      e->last = hdr;
+      return 0;
+    }
+
+  if (part->index_count >= part->index_size && grow_index (msg, part))
+    return -1;
+  e = arena_alloc (msg, sizeof *e);
+  if (!e)
+    return -1;
+  e->hash = hash;
+  e->namelen = n;
+  e->first = e->last = hdr;
+  e->next = part->index[hash & (part->index_size - 1)];
+  part->index[hash & (part->index_size - 1)] = e;
+  part->index_count++;
+  return 0;
+}
+
+
+/* Build the index of PART.  Returns 0 on success. */
+static int
+build_index (rfc822parse_t msg, part_t part)
+{
+  HDR_LINE hdr;
+
+  if (grow_index (msg, part))
+    return -1;
+  for (hdr = part->hdr_lines; hdr; hdr = hdr->next)
+    if (index_header (msg, part, hdr))
+      {
+        part->index = NULL;
+        part->index_size = part->index_count = 0;
+        return -1;
+      }
+  return 0;
+}
+
+
 /****************
  * Find a header field.  If the Name does end in an asterisk this is meant
  * to be a wildcard.
@@ -641,6 +967,25 @@ find_header (rfc822parse_t msg, const char *name, int which, HDR_LINE *rprev)
       glob = 1;
     }
 
+  /* Use the index for plain names.  It is created on the first
+     lookup; if that fails we fall back to a linear search.  */
+  if (!glob && namelen && !rprev
+      && (msg->current_part->index || !build_index (msg, msg->current_part)))
+    {
+      HDR_INDEX e;
+
+      e = lookup_index (msg->current_part, name, namelen,
+                        hash_header_name (name, namelen));
+      if (!e || (which != -1 && which < 1))
+        return NULL;
+      if (which == -1)
+        hdr = e->last;
+      else
+        for (hdr = e->first; hdr && --which; hdr = hdr->next_same)
+          ;
+      return hdr;
+    }
+
   hdr = msg->current_part->hdr_lines;
   if (rprev && *rprev)
     {
@@ -690,28 +1035,13 @@ skip_ws (const char *s)
 }
 
 
-static void
-release_token_list (TOKEN t)
-{
-  while (t)
-    {
-      TOKEN t2 = t->next;
-      /* fixme: If we have owner_pantry, put the token back to
-       * this pantry so that it can be reused later */
-      free (t);
-      t = t2;
-    }
-}
-
-
 static TOKEN
-new_token (enum token_type type, const char *buf, size_t length)
+new_token (rfc822parse_t msg, enum token_type type,
+           const char *buf, size_t length)
 {
   TOKEN t;
 
-  /* fixme: look through our pantries to find a suitable
-   * token for reuse */
-  t = malloc (sizeof *t + length);
+  t = arena_alloc (msg, sizeof *t + 2 * length + 1);
   if (t)
     {
       t->next = NULL;
@@ -730,22 +1060,17 @@ new_token (enum token_type type, const char *buf, size_t length)
 }
 
 static TOKEN
-append_to_token (TOKEN old, const char *buf, size_t length)
+append_to_token (rfc822parse_t msg, TOKEN old, const char *buf, size_t length)
 {
   size_t n = strlen (old->data);
   TOKEN t;
 
-  t = malloc (sizeof *t + n + length);
+  t = arena_resize (msg, old, sizeof *t + 2 * n + 1,
+                    sizeof *t + 2 * (n + length) + 1);
   if (t)
     {
-      t->next = old->next;
-      t->type = old->type;
-      t->flags = old->flags;
-      memcpy (t->data, old->data, n);
       memcpy (t->data + n, buf, length);
       t->data[n + length] = 0;
-      old->next = NULL;
-      release_token_list (old);
     }
   return t;
 }
@@ -756,7 +1081,7 @@ append_to_token (TOKEN old, const char *buf, size_t length)
    Parse a field into tokens as defined by rfc822.
  */
 static TOKEN
-parse_field (HDR_LINE hdr)
+parse_field (rfc822parse_t msg, HDR_LINE hdr)
 {
   static const char specials[] = "<>@.,;:\\[]\"()";
   static const char specials2[] = "<>@.,;:";
@@ -875,10 +1200,11 @@ parse_field (HDR_LINE hdr)
 		}
 
 	      t = (t
-                   ? append_to_token (t, s, s2 - s)
-                   : new_token (term == '\"'? tQUOTED : tDOMAINLIT, s, s2 - s));
+                   ? append_to_token (msg, t, s, s2 - s)
+                   : new_token (msg, term == '\"'? tQUOTED : tDOMAINLIT,
+                                s, s2 - s));
               if (!t)
-                goto failure;
+                return NULL;
 
 	      if (*s2 || !hdr->next || !hdr->next->cont)
 		break;
@@ -894,9 +1220,9 @@ parse_field (HDR_LINE hdr)
       else if ((s2 = strchr (delimiters2, *s)))
 	{ /* Special characters which are not handled above. */
 	  invalid = 0;
-	  t = new_token (tSPECIAL, s, 1);
+	  t = new_token (msg, tSPECIAL, s, 1);
           if (!t)
-            goto failure;
+            return NULL;
 	  *tok_tail = t;
 	  tok_tail = &t->next;
 	  s++;
@@ -912,9 +1238,9 @@ parse_field (HDR_LINE hdr)
 	  for (s2 = s + 1; *s2 > 0x20
 	       && !(*s2 & 128) && !strchr (delimiters, *s2); s2++)
 	    ;
-	  t = new_token (tATOM, s, s2 - s);
+	  t = new_token (msg, tATOM, s, s2 - s);
           if (!t)
-            goto failure;
+            return NULL;
 	  *tok_tail = t;
 	  tok_tail = &t->next;
 	  s = s2;
@@ -923,9 +1249,9 @@ parse_field (HDR_LINE hdr)
 	{ /* Invalid character. */
 	  if (!invalid)
 	    { /* For parsing we assume only one space. */
-	      t = new_token (tSPACE, NULL, 0);
+	      t = new_token (msg, tSPACE, NULL, 0);
               if (!t)
-                goto failure;
+                return NULL;
 	      *tok_tail = t;
 	      tok_tail = &t->next;
 	      invalid = 1;
@@ -935,14 +1261,6 @@ parse_field (HDR_LINE hdr)
     }
 
   return tok;
-
- failure:
-  {
-    int save = errno;
-    release_token_list (tok);
-    errno = save;
-  }
-  return NULL;
 }
 
 
@@ -956,7 +1274,10 @@ parse_field (HDR_LINE hdr)
  *   0 := Reserved
  *   n := Take the n-th one.
  * Returns a handle for further operations on the parse context of the field
- * or NULL if the field was not found.
+ * or NULL if the field was not found.  The handle is valid until the
+ * message is closed.  The field is parsed only once; later calls
+ * return the same handle unless a continuation line has been
+ * inserted meanwhile.
  */
 rfc822parse_field_t
 rfc822parse_parse_field (rfc822parse_t msg, const char *name, int which)
@@ -969,14 +1290,28 @@ rfc822parse_parse_field (rfc822parse_t msg, const char *name, int which)
   hdr = find_header (msg, name, which, NULL);
   if (!hdr)
     return NULL;
-  return parse_field (hdr);
+  if (!hdr->parsed)
+    {
+      hdr->tokens = parse_field (msg, hdr);
+      if (!hdr->tokens && errno)
+        return NULL;  /* Don't cache a memory failure.  */
+      hdr->parsed = 1;
+    }
+  errno = 0;
+  return hdr->tokens;
 }
 
+/* Release the handle CTX obtained from rfc822parse_parse_field.  The
+   tokens are allocated from the arena of the message and shared by
+   all callers asking for the same field; they are released along
+   with the message.  Thus there is nothing to do here and CTX stays
+   valid until the message is closed, even after this call.  This
+   function is kept so that callers may still pair each parse with a
+   release.  */
 void
 rfc822parse_release_field (rfc822parse_field_t ctx)
 {
-  if (ctx)
-    release_token_list (ctx);
+  (void)ctx;
 }
 
 
@@ -1044,8 +1379,15 @@ rfc822parse_query_parameter (rfc822parse_field_t ctx, const char *attr,
 
               if ( lower_value && t && !t->flags.lowered )
                 {
-                  lowercase_string (t->data);
-                  t->flags.lowered = 1;
+                  char *copy = t->data + strlen (t->data) + 1;
+
+                  if (!t->flags.lower_copy)
+                    {
+                      strcpy (copy, t->data);
+                      lowercase_string (copy);
+                      t->flags.lower_copy = 1;
+                    }
+                  return copy;
                 }
 	      return t ? t->data : "";
 	    }
@@ -1225,7 +1567,7 @@ msg_cb (void *dummy_arg, rfc822parse_event_t event, rfc822parse_t msg)
 int
 main (int argc, char **argv)
 {
-  char line[5000];
+  static char buffer[65536];
   size_t length;
   rfc822parse_t msg;
 
@@ -1233,16 +1575,11 @@ main (int argc, char **argv)
   if (!msg)
     abort ();
 
-  while (fgets (line, sizeof (line), stdin))
-    {
-      length = strlen (line);
-      if (length && line[length - 1] == '\n')
-	line[--length] = 0;
-      if (length && line[length - 1] == '\r')
-	line[--length] = 0;
-      if (rfc822parse_insert (msg, line, length))
-	abort ();
-    }
+  while ((length = fread (buffer, 1, sizeof buffer, stdin)))
+    if (rfc822parse_feed (msg, buffer, length))
+      abort ();
+  if (rfc822parse_feed (msg, NULL, 0))
+    abort ();
 
   dump_structure (msg, NULL, 0);
 
@@ -60,6 +60,8 @@ int rfc822parse_finish (rfc822parse_t msg);
 int rfc822parse_insert (rfc822parse_t msg,
                         const unsigned char *line, size_t length);
 
+int rfc822parse_feed (rfc822parse_t msg, const void *buffer, size_t length);
+
 char *rfc822parse_get_field (rfc822parse_t msg, const char *name, int which,
                              size_t *valueoff);
 
@@ -69,6 +71,10 @@ rfc822parse_field_t rfc822parse_parse_field (rfc822parse_t msg,
                                              const char *name,
                                              int which);
 
+/* The handle returned by rfc822parse_parse_field is shared and valid
+   until the message is closed; releasing it is a no-op.  A handle
+   taken before all continuation lines of the field were inserted
+   does not see those lines; parse the field again to get them.  */
 void rfc822parse_release_field (rfc822parse_field_t field);
 
 const char *rfc822parse_query_parameter (rfc822parse_field_t ctx,
@@ -19,22 +19,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#define BUFFER_SIZE 65536
+
+/* Maps letters to their rot13 capital, white space to 0 and all
+ * other characters to 1.  */
+static unsigned char rottbl[256];
+
+static unsigned char inbuf[BUFFER_SIZE];
+static unsigned char outbuf[BUFFER_SIZE+64];
+static size_t outlen;
+
+
 static void
-rot13 ( char *block )
+init_table (void)
 {
-    int i, c; 
+    int c;
 
-    for (i = 0; i < 5; i++ ) {
-        c = (block[i] + 13) % 26;
-        putchar ( 'A'+c );
-    }
+    for (c = 0; c < 256; c++ )
+        rottbl[c] = 1;
+    for (c = 0; c < 26; c++ )
+        rottbl['a'+c] = rottbl['A'+c] = 'A' + (c + 13) % 26;
+    rottbl[' '] = rottbl['\t'] = rottbl['\n'] = 0;
+}
+
+static void
+flush_outbuf (void)
+{
+    if ( outlen )
+        fwrite ( outbuf, outlen, 1, stdout );
+    outlen = 0;
 }
 
 
 int
 main (int argc, char **argv )
 {
-    char block[5];
+    size_t nread, i;
     int n=0, c, idx=0;
 
     if ( argc > 1 ) {
@@ -43,32 +63,37 @@ main (int argc, char **argv )
     }
     
 
-    while ( (c=getchar ()) != EOF ) {
-        if ( c >= 'a' && c <= 'z' )
-            block[idx++] = c - 'a';
-        else if ( c >= 'A' && c <= 'Z' ) 
-            block[idx++] = c - 'A';
-        else if ( c != ' ' && c != '\t' && c != '\n' )
-            fprintf (stderr, "rot13: ignoring character 0x%02X\n", c );
-        if ( idx >= 5 ) {
-            if ( n )
-                putchar (' ');
-            rot13 (block);
-            idx = 0;
-            if ( ++n == 10 ) {
-                putchar ('\n');
-                n = 0;
+    init_table ();
+    while ( (nread = fread ( inbuf, 1, sizeof inbuf, stdin )) ) {
+        for (i = 0; i < nread; i++ ) {
+            c = rottbl[inbuf[i]];
+            if ( c > 1 ) {
+                /* We write the separator before the first letter of
+                 * a block.  */
+                if ( !idx && n )
+                    outbuf[outlen++] = ' ';
+                outbuf[outlen++] = c;
+                if ( ++idx == 5 ) {
+                    idx = 0;
+                    if ( ++n == 10 ) {
+                        outbuf[outlen++] = '\n';
+                        n = 0;
+                    }
+                    if ( outlen >= BUFFER_SIZE )
+                        flush_outbuf ();
+                }
             }
+            else if ( c )
+                fprintf (stderr, "rot13: ignoring character 0x%02X\n",
+                         inbuf[i] );
         }
     }
     if ( idx ) {
-        while ( idx < 5 )
-            block[idx++] = 'X' - 'A';
-        if ( n )
-            putchar (' ');
-        rot13 (block);
-        putchar ('\n');
+        while ( idx++ < 5 )
+            outbuf[outlen++] = 'K';  /* rot13 of the padding 'X' */
+        outbuf[outlen++] = '\n';
     }
+    flush_outbuf ();
 
     return 0;
 }
@@ -30,13 +30,20 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "rfc822parse.h"
 
 
 #define PGM "scrutmime"
 #define VERSION "1.0"
+#define MAX_JOBS 64
 
 /* Option flags. */
 static int verbose;
@@ -45,6 +52,8 @@ static int debug;
 static int opt_match_zip;
 static int opt_match_exe;
 static int opt_match_html;
+static int opt_batch;
+static int opt_jobs = 1;
 
 
 enum mime_types 
@@ -62,6 +71,12 @@ enum transfer_encodings
     TE_BASE64
   };
 
+/* The things we found in a message.  */
+#define FOUND_ZIP   1
+#define FOUND_EXE   2
+#define FOUND_HTML  4
+#define FOUND_MATCH 8  /* One of the --match options matched.  */
+
 
 /* Structure used to communicate with the parser callback. */
 struct parse_info_s {
@@ -72,6 +87,34 @@ struct parse_info_s {
   int no_mime;    /* Set if this is not a MIME message. */
   int top_seen;
   int wk_seen;
+  unsigned int found; /* FOUND_ flags. */
+};
+
+
+/* Number of base64 characters of a part we look at.  */
+#define PROBE_CHARS 999
+
+/* State of the base64 decoder for the start of a part.  */
+struct probe_s {
+  size_t nchars;     /* Number of characters fed so far. */
+  int state;
+  int value;
+  size_t buflen;     /* Valid bytes in BUFFER. */
+  unsigned char buffer[(PROBE_CHARS * 3) / 4 + 1];
+};
+
+/* Buffer used to read the lines of a message.  */
+#define READ_BUFFER_SIZE 65536
+
+struct reader_s {
+  FILE *fp;          /* The stream or NULL to read from SRC. */
+  const unsigned char *src;
+  size_t srclen;
+  unsigned char *buffer;
+  size_t size;       /* Allocated size of BUFFER minus one. */
+  size_t start;      /* Start of the unread data in BUFFER. */
+  size_t end;        /* End of the data in BUFFER. */
+  int eof;
 };
 
 
@@ -174,44 +217,152 @@ lowercase_string (unsigned char *string)
 }
 
 
-/* Inplace Base64 decoder. Returns the length of the valid databytes
-   in BUFFER. Note, that BUFFER should initially be a C-string. */
-static size_t
-decode_base64 (unsigned char *buffer)
+/* Reset the base64 decoder PROBE. */
+static void
+init_probe (struct probe_s *probe)
 {
-  int state, c, value=0;
-  unsigned char *d, *s;
-  
-  for (state=0, d=s=buffer; *s; s++)
+  probe->nchars = 0;
+  probe->state = 0;
+  probe->value = 0;
+  probe->buflen = 0;
+}
+
+
+/* Decode the LENGTH base64 characters at S into PROBE.  Only the
+   first PROBE_CHARS characters of a part are used; true is returned
+   if we got more than that.  */
+static int
+feed_probe (struct probe_s *probe, const unsigned char *s, size_t length)
+{
+  int state = probe->state;
+  int value = probe->value;
+  unsigned char *d = probe->buffer + probe->buflen;
+  int full = 0;
+  int c;
+
+  if (length > PROBE_CHARS - probe->nchars)
+    {
+      length = PROBE_CHARS - probe->nchars;
+      full = 1;
+    }
+  probe->nchars += length;
+
+  for (; length; length--, s++)
     {
+      if (!*s)
+        break; /* We used to handle the data as a string.  */
       if ((c = asctobin[*s]) == 255 )
         continue;  /* Simply skip invalid base64 characters. */
-      
+
       switch (state)
         {
-        case 0: 
+        case 0:
           value = c << 2;
           break;
         case 1:
           value |= (c>>4)&3;
           *d++ = value;
           value = (c<<4)&0xf0;
-          break; 
+          break;
         case 2:
           value |= (c>>2)&15;
           *d++ = value;
           value = (c<<6)&0xc0;
-          break; 
+          break;
         case 3:
           value |= c&0x3f;
           *d++ = value;
-          break; 
+          break;
         }
       state++;
       state = state & 3;
     }
 
-  return d - buffer;
+  probe->state = state;
+  probe->value = value;
+  probe->buflen = d - probe->buffer;
+  return full;
+}
+
+
+/* Prepare RD to read from FP or, if FP is NULL, from the SRCLEN bytes
+   at SRC.  */
+static void
+init_reader (struct reader_s *rd, FILE *fp,
+             const unsigned char *src, size_t srclen)
+{
+  rd->fp = fp;
+  rd->src = src;
+  rd->srclen = srclen;
+  rd->size = READ_BUFFER_SIZE;
+  rd->buffer = malloc (rd->size + 1);
+  if (!rd->buffer)
+    die ("out of core: %s", strerror (errno));
+  rd->start = rd->end = 0;
+  rd->eof = 0;
+}
+
+
+/* Return the next line from RD at R_LINE with its length at R_LENGTH.
+   The line is not limited in length, may contain binary zeroes and
+   has the LF replaced by a nul.  R_LF is set to true if an LF was
+   found.  Returns false at EOF.  */
+static int
+read_line (struct reader_s *rd, unsigned char **r_line, size_t *r_length,
+           int *r_lf)
+{
+  unsigned char *lf;
+  size_t n;
+
+  for (;;)
+    {
+      lf = memchr (rd->buffer + rd->start, '\n', rd->end - rd->start);
+      if (lf || rd->eof)
+        break;
+
+      /* Make room for more data.  */
+      if (rd->start)
+        {
+          memmove (rd->buffer, rd->buffer + rd->start, rd->end - rd->start);
+          rd->end -= rd->start;
+          rd->start = 0;
+        }
+      if (rd->end == rd->size)
+        {
+          unsigned char *p = realloc (rd->buffer, 2 * rd->size + 1);
+          if (!p)
+            die ("out of core: %s", strerror (errno));
+          rd->buffer = p;
+          rd->size *= 2;
+        }
+      if (rd->fp)
+        n = fread (rd->buffer + rd->end, 1, rd->size - rd->end, rd->fp);
+      else
+        {
+          n = rd->size - rd->end < rd->srclen? rd->size - rd->end : rd->srclen;
+          memcpy (rd->buffer + rd->end, rd->src, n);
+          rd->src += n;
+          rd->srclen -= n;
+        }
+      if (!n)
+        {
+          if (rd->fp && ferror (rd->fp))
+            die ("read error: %s", strerror (errno));
+          rd->eof = 1;
+        }
+      rd->end += n;
+    }
+
+  if (!lf && rd->start == rd->end)
+    return 0;
+  if (!lf)
+    lf = rd->buffer + rd->end; /* Last line not terminated.  */
+  *r_line = rd->buffer + rd->start;
+  *r_length = lf - *r_line;
+  *r_lf = lf < rd->buffer + rd->end;
+  rd->start = *r_lf? lf - rd->buffer + 1 : rd->end;
+  *lf = 0;
+  return 1;
 }
 
 
@@ -231,25 +382,38 @@ is_windows_pe (const unsigned char *buffer, size_t buflen)
 }
 
 
-/* See whether we can identify the binary data in BUFFER. */
+/* Record that we found WHAT described by TEXT.  If MATCH is set, a
+   match option asked for it.  Except for batch mode, this is printed
+   and a match terminates the process successfully. */
 static void
-identify_binary (const unsigned char *buffer, size_t buflen)
+report_found (struct parse_info_s *info, unsigned int what,
+              const char *text, int match)
 {
-  if (buflen > 5 && !memcmp (buffer, "PK\x03\x04", 4))
+  info->found |= what;
+  if (match)
+    info->found |= FOUND_MATCH;
+  if (opt_batch)
+    return;
+  if (!quiet)
     {
-      if (!quiet)
-        fputs ("ZIP\n", stdout);
-      if (opt_match_zip)
-        exit (0);
+      fputs (text, stdout);
+      putc ('\n', stdout);
     }
+  if (match)
+    exit (0);
+}
+
+
+/* See whether we can identify the binary data in BUFFER. */
+static void
+identify_binary (struct parse_info_s *info,
+                 const unsigned char *buffer, size_t buflen)
+{
+  if (buflen > 5 && !memcmp (buffer, "PK\x03\x04", 4))
+    report_found (info, FOUND_ZIP, "ZIP", opt_match_zip);
   else if (buflen > 132 && buffer[0] == 'M' && buffer[1] == 'Z' 
            && is_windows_pe (buffer, buflen))
-    {
-      if (!quiet)
-        fputs ("EXE (Windows PE)\n", stdout);
-      if (opt_match_exe)
-        exit (0);
-    }
+    report_found (info, FOUND_EXE, "EXE (Windows PE)", opt_match_exe);
 }
 
 
@@ -406,12 +570,8 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
           && info->transfer_encoding == TE_BASE64)
         info->test_base64 = 1;
       else if (info->mime_type == MT_TEXT_HTML)
-        {
-          if (!quiet)
-            fputs ("HTML\n", stdout);
-          if (opt_match_html && !info->wk_seen)
-            exit (0);
-        }
+        report_found (info, FOUND_HTML, "HTML",
+                      opt_match_html && !info->wk_seen);
 
     }
   else if (event == RFC822PARSE_PREAMBLE)
@@ -430,14 +590,35 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
 }
 
 
-/* Read a message from FP and process it according to the global
-   options. */
+/* Identify the data decoded into PROBE.  */
 static void
-parse_message (FILE *fp)
+check_probe (struct parse_info_s *info, struct probe_s *probe)
 {
-  char line[2000];
-  unsigned char buffer[1000]; 
-  size_t buflen = 0;   
+  if (debug)
+    {
+      int i;
+
+      printf ("# %4d bytes base64:", (int)probe->buflen);
+      for (i=0; i < probe->buflen; i++)
+        {
+          if (i && !(i % 16))
+            printf ("\n#            0x%04X:", i);
+          printf (" %02X", probe->buffer[i]);
+        }
+      putchar ('\n');
+    }
+  identify_binary (info, probe->buffer, probe->buflen);
+  probe->nchars = 0;
+}
+
+
+/* Read a message from READER and process it according to the global
+   options.  Returns the FOUND_ flags.  */
+static unsigned int
+parse_message (struct reader_s *reader)
+{
+  unsigned char *line;
+  struct probe_s probe;
   size_t length;
   rfc822parse_t msg;
   unsigned int lineno = 0;
@@ -445,27 +626,27 @@ parse_message (FILE *fp)
   struct parse_info_s info;
   int body_lines = 0;
   int skip_leading_empty_lines = 0;
+  int lf;
+  unsigned int found = 0;
+
+  init_probe (&probe);
 
  restart:
   memset (&info, 0, sizeof info);
+  info.found = found;
 
   msg = rfc822parse_open (message_cb, &info);
   if (!msg)
     die ("can't open parser: %s", strerror (errno));
 
-  /* Fixme: We should not use fgets because it can't cope with
-     embedded nul characters. */
-  while (fgets (line, sizeof (line), fp))
+  while (read_line (reader, &line, &length, &lf))
     {
       lineno++;
       if (lineno == 1 && !strncmp (line, "From ", 5))
         continue;  /* We better ignore a leading From line. */
 
-      length = strlen (line);
-      if (length && line[length - 1] == '\n')
-	line[--length] = 0;
-      else if (verbose)
-        err ("line number %u too long or last line not terminated", lineno);
+      if (!lf && verbose)
+        err ("last line not terminated (line %u)", lineno);
       if (length && line[length - 1] == '\r')
 	line[--length] = 0;
       else if (verbose && !no_cr_reported)
@@ -505,52 +686,29 @@ parse_message (FILE *fp)
               skip_leading_empty_lines = 1;
               body_lines = 500; /* Avoid going here a second time. */
               rfc822parse_close (msg);
+              found = info.found;
               goto restart;
             }
         }
 
-      
-      if (info.got_probe && buflen)
+
+      if (info.got_probe && probe.nchars)
         {
           info.got_probe = 0;
-          buffer[buflen] = 0;
-          buflen = decode_base64 (buffer);
-          if (debug)
-            {
-              int i;
-              
-              printf ("# %4d bytes base64:", (int)buflen);
-              for (i=0; i < buflen; i++)
-                {
-                  if (i && !(i % 16))
-                    printf ("\n#            0x%04X:", i);
-                  printf (" %02X", buffer[i]);
-                }
-              putchar ('\n'); 
-            }
-          identify_binary (buffer, buflen);
+          check_probe (&info, &probe);
         }
 
+      /* Only the start of a base64 part is decoded; the rest is
+         merely passed to the parser.  */
       if (info.test_base64)
         {
           if (info.test_base64 == 1)
-            { 
-              /* This is the empty marker line. */
-              buflen = 0;
-            }
-          else
             {
-              if (length > sizeof buffer - 1 - buflen)
-                {
-                  length = sizeof buffer - 1 - buflen;
-                  info.got_probe = 1;  /* We got enough. */
-                }
-              if (length)
-                {
-                  memcpy (buffer+buflen, line, length);
-                  buflen += length;
-                }
+              /* This is the empty marker line. */
+              init_probe (&probe);
             }
+          else if (feed_probe (&probe, line, length))
+            info.got_probe = 1;  /* We got enough. */
           if (info.got_probe)
             info.test_base64 = 0;
           else
@@ -558,7 +716,332 @@ parse_message (FILE *fp)
         }
     }
 
+  /* Check a part which ended with the message.  */
+  if ((info.got_probe || info.test_base64 > 1) && probe.nchars)
+    check_probe (&info, &probe);
+
   rfc822parse_close (msg);
+  return info.found;
+}
+
+
+/* Batch mode.  Each message is an item with its name; messages of an
+   mbox are given by their data in the mapped file.  */
+struct batch_item_s {
+  char *name;
+  const unsigned char *data; /* NULL to read the file NAME. */
+  size_t datalen;
+  unsigned long msgno;       /* Number of the message in an mbox. */
+  int done;                  /* The item has been processed.  */
+  int error;                 /* The file could not be read.  */
+  unsigned int found;        /* The FOUND_ flags for the item.  */
+};
+
+static struct batch_item_s *batch_items;
+static size_t batch_nitems;
+static size_t batch_size;
+
+
+static char *
+xstrdup (const char *string)
+{
+  char *p = malloc (strlen (string)+1);
+  if (!p)
+    die ("out of core: %s", strerror (errno));
+  strcpy (p, string);
+  return p;
+}
+
+
+static struct batch_item_s *
+add_batch_item (const char *name)
+{
+  struct batch_item_s *item;
+
+  if (batch_nitems == batch_size)
+    {
+      batch_size = batch_size? 2 * batch_size : 1024;
+      batch_items = realloc (batch_items, batch_size * sizeof *batch_items);
+      if (!batch_items)
+        die ("out of core: %s", strerror (errno));
+    }
+  item = batch_items + batch_nitems++;
+  memset (item, 0, sizeof *item);
+  item->name = xstrdup (name);
+  return item;
+}
+
+
+/* Add the messages of the mbox FNAME which is mapped at DATA.  A new
+   message starts with a "From " line at the begin of the file or
+   after an empty line.  */
+static void
+add_mbox (const char *fname, const unsigned char *data, size_t datalen)
+{
+  const unsigned char *s = data;
+  const unsigned char *end = data + datalen;
+  const unsigned char *lf;
+  struct batch_item_s *item = NULL;
+  unsigned long msgno = 0;
+  int empty = 1;
+
+  for (; s < end; s = lf + 1)
+    {
+      if (empty && end - s >= 5 && !memcmp (s, "From ", 5))
+        {
+          if (item)
+            item->datalen = s - item->data;
+          item = add_batch_item (fname);
+          item->data = s;
+          item->msgno = ++msgno;
+        }
+      if (!(lf = memchr (s, '\n', end - s)))
+        lf = end - 1;
+      empty = (lf == s || (lf == s + 1 && *s == '\r'));
+    }
+  if (item)
+    item->datalen = end - item->data;
+}
+
+
+static int
+compare_strings (const void *a, const void *b)
+{
+  return strcmp (*(char *const *)a, *(char *const *)b);
+}
+
+
+/* Add all regular files of the directory DNAME in sorted order.  */
+static void
+add_directory (const char *dname)
+{
+  DIR *dir;
+  struct dirent *de;
+  char **names = NULL;
+  size_t nnames = 0, size = 0, i;
+  char *fname;
+  struct stat st;
+
+  dir = opendir (dname);
+  if (!dir)
+    {
+      err ("can't open directory `%s': %s", dname, strerror (errno));
+      return;
+    }
+  while ((de = readdir (dir)))
+    {
+      if (*de->d_name == '.')
+        continue;
+      if (nnames == size)
+        {
+          size = size? 2 * size : 256;
+          names = realloc (names, size * sizeof *names);
+          if (!names)
+            die ("out of core: %s", strerror (errno));
+        }
+      fname = malloc (strlen (dname) + strlen (de->d_name) + 2);
+      if (!fname)
+        die ("out of core: %s", strerror (errno));
+      strcpy (stpcpy (stpcpy (fname, dname), "/"), de->d_name);
+      names[nnames++] = fname;
+    }
+  closedir (dir);
+
+  if (nnames)
+    qsort (names, nnames, sizeof *names, compare_strings);
+  for (i = 0; i < nnames; i++)
+    {
+      if (!stat (names[i], &st) && S_ISREG (st.st_mode))
+        add_batch_item (names[i]);
+      free (names[i]);
+    }
+  free (names);
+}
+
+
+/* Add the file or directory FNAME to the batch.  A directory with a
+   "cur" or "new" subdirectory is taken as a Maildir, an ordinary
+   directory is scanned for files and a file starting with "From " is
+   taken as an mbox.  The mbox files are mapped until the process
+   exits.  */
+static void
+add_batch_path (const char *fname)
+{
+  char *sub;
+  struct stat st;
+  int fd, is_maildir = 0;
+  void *p;
+
+  if (stat (fname, &st))
+    {
+      err ("can't stat `%s': %s", fname, strerror (errno));
+      return;
+    }
+  if (S_ISDIR (st.st_mode))
+    {
+      sub = malloc (strlen (fname) + 5);
+      if (!sub)
+        die ("out of core: %s", strerror (errno));
+      strcpy (stpcpy (sub, fname), "/cur");
+      if (!access (sub, F_OK))
+        {
+          add_directory (sub);
+          is_maildir = 1;
+        }
+      strcpy (stpcpy (sub, fname), "/new");
+      if (!access (sub, F_OK))
+        {
+          add_directory (sub);
+          is_maildir = 1;
+        }
+      free (sub);
+      if (!is_maildir)
+        add_directory (fname);
+      return;
+    }
+
+  if (S_ISREG (st.st_mode) && st.st_size >= 5
+      && st.st_size == (size_t)st.st_size
+      && (fd = open (fname, O_RDONLY)) != -1)
+    {
+      p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close (fd);
+      if (p != MAP_FAILED)
+        {
+          if (!memcmp (p, "From ", 5))
+            {
+              add_mbox (fname, p, st.st_size);
+              return;
+            }
+          munmap (p, st.st_size);
+        }
+    }
+  add_batch_item (fname);
+}
+
+
+static void
+process_batch_item (struct batch_item_s *item)
+{
+  struct reader_s reader;
+  FILE *fp = NULL;
+
+  if (!item->data)
+    {
+      fp = fopen (item->name, "rb");
+      if (!fp)
+        {
+          err ("can't open `%s': %s", item->name, strerror (errno));
+          item->error = 1;
+          return;
+        }
+    }
+  init_reader (&reader, fp, item->data, item->datalen);
+  item->found = parse_message (&reader);
+  free (reader.buffer);
+  if (fp)
+    fclose (fp);
+}
+
+
+/* Print the verdict for ITEM and release its name.  Returns true if
+   it matched.  */
+static int
+print_batch_item (struct batch_item_s *item)
+{
+  int any_match = (opt_match_zip || opt_match_exe || opt_match_html);
+
+  if (!any_match || (item->found & FOUND_MATCH))
+    {
+      if (item->data)
+        printf ("%s:%lu:", item->name, item->msgno);
+      else
+        printf ("%s:", item->name);
+      if (item->error)
+        fputs (" ERROR", stdout);
+      else if (!(item->found & (FOUND_ZIP|FOUND_EXE|FOUND_HTML)))
+        fputs (" -", stdout);
+      if ((item->found & FOUND_ZIP))
+        fputs (" ZIP", stdout);
+      if ((item->found & FOUND_EXE))
+        fputs (" EXE", stdout);
+      if ((item->found & FOUND_HTML))
+        fputs (" HTML", stdout);
+      putchar ('\n');
+    }
+  free (item->name);
+  item->name = NULL;
+  return !!(item->found & FOUND_MATCH);
+}
+
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static size_t batch_next;  /* Index of the next item to process.  */
+
+static void *
+batch_thread (void *arg)
+{
+  struct batch_item_s *item;
+
+  (void)arg;
+  for (;;)
+    {
+      pthread_mutex_lock (&batch_lock);
+      item = batch_next < batch_nitems? batch_items + batch_next++ : NULL;
+      pthread_mutex_unlock (&batch_lock);
+      if (!item)
+        break;
+      process_batch_item (item);
+      pthread_mutex_lock (&batch_lock);
+      item->done = 1;
+      pthread_cond_broadcast (&batch_cond);
+      pthread_mutex_unlock (&batch_lock);
+    }
+  return NULL;
+}
+#endif /*HAVE_PTHREAD*/
+
+
+/* Process all items of the batch and print their verdicts in order.
+   Returns true if any item matched.  */
+static int
+run_batch (void)
+{
+  size_t i;
+  int matched = 0;
+
+#ifdef HAVE_PTHREAD
+  if (opt_jobs > 1 && batch_nitems > 1)
+    {
+      pthread_t threads[MAX_JOBS];
+      int nthreads, n;
+
+      nthreads = opt_jobs < batch_nitems? opt_jobs : batch_nitems;
+      for (n = 0; n < nthreads; n++)
+        if (pthread_create (&threads[n], NULL, batch_thread, NULL))
+          die ("error creating thread: %s", strerror (errno));
+      for (i = 0; i < batch_nitems; i++)
+        {
+          pthread_mutex_lock (&batch_lock);
+          while (!batch_items[i].done)
+            pthread_cond_wait (&batch_cond, &batch_lock);
+          pthread_mutex_unlock (&batch_lock);
+          matched |= print_batch_item (batch_items + i);
+        }
+      for (n = 0; n < nthreads; n++)
+        pthread_join (threads[n], NULL);
+      return matched;
+    }
+#endif /*HAVE_PTHREAD*/
+
+  for (i = 0; i < batch_nitems; i++)
+    {
+      process_batch_item (batch_items + i);
+      matched |= print_batch_item (batch_items + i);
+    }
+  return matched;
 }
 
 
@@ -585,14 +1068,21 @@ main (int argc, char **argv)
         {
           puts (
                 "Usage: " PGM " [OPTION] [FILE]\n"
+                "       " PGM " --batch [OPTION] FILE...\n"
                 "Scrutinize a mail message.\n\n"
                 "  --match-zip  return true if a ZIP body was found\n"
                 "  --match-exe  return true if an EXE body was found\n"
                 "  --match-html return true if a HTML body was found\n"
+                "  --batch      print a verdict for each message\n"
+                "  --jobs N     use N threads in batch mode\n"
                 "  --verbose    enable extra informational output\n"
                 "  --debug      enable additional debug output\n"
                 "  --help       display this help and exit\n\n"
-                "With no FILE, or when FILE is -, read standard input.\n\n"
+                "With no FILE, or when FILE is -, read standard input.\n"
+                "In batch mode each FILE may be a message, an mbox, a\n"
+                "Maildir or a directory of messages; with - the names\n"
+                "are read from standard input.  With --match options\n"
+                "only the matching messages are listed.\n\n"
                 "Report bugs to <bugs@g10code.com>.");
           exit (0);
         }
@@ -638,9 +1128,32 @@ main (int argc, char **argv)
           any_match = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--batch"))
+        {
+          opt_batch = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--jobs"))
+        {
+          argc--; argv++;
+          if (!argc)
+            die ("option --jobs requires an argument");
+          opt_jobs = atoi (*argv);
+          if (opt_jobs < 1 || opt_jobs > MAX_JOBS)
+            die ("number of jobs must be 1 to %d", MAX_JOBS);
+          argc--; argv++;
+        }
     }          
  
-  if (argc > 1)
+  if (opt_batch)
+    {
+      if (!argc)
+        die ("usage: " PGM " --batch [OPTION] FILE... "
+             "(try --help for more information)\n");
+      /* The diagnostics would be mixed up.  */
+      verbose = debug = 0;
+    }
+  else if (argc > 1)
     die ("usage: " PGM " [OPTION] [FILE] (try --help for more information)\n");
 
   signal (SIGPIPE, SIG_IGN);
@@ -657,16 +1170,47 @@ main (int argc, char **argv)
   }
 
   /* Start processing. */
-  if (argc && strcmp (*argv, "-"))
+  if (opt_batch)
     {
-      FILE *fp = fopen (*argv, "rb");
-      if (!fp)
-        die ("can't open `%s': %s", *argv, strerror (errno));
-      parse_message (fp);
-      fclose (fp);
+      for (; argc; argc--, argv++)
+        {
+          if (strcmp (*argv, "-"))
+            add_batch_path (*argv);
+          else
+            {
+              char *line = NULL;
+              size_t size = 0;
+              ssize_t n;
+
+              while ((n = getline (&line, &size, stdin)) > 0)
+                {
+                  if (line[n-1] == '\n')
+                    line[--n] = 0;
+                  if (n)
+                    add_batch_path (line);
+                }
+              free (line);
+            }
+        }
+      return run_batch ()? 0 : any_match? 1:0;
     }
   else
-    parse_message (stdin);
+    {
+      struct reader_s reader;
+      FILE *fp = stdin;
+
+      if (argc && strcmp (*argv, "-"))
+        {
+          fp = fopen (*argv, "rb");
+          if (!fp)
+            die ("can't open `%s': %s", *argv, strerror (errno));
+        }
+      init_reader (&reader, fp, NULL, 0);
+      parse_message (&reader);
+      free (reader.buffer);
+      if (fp != stdin)
+        fclose (fp);
+    }
 
   /* If any match option was used and we reach this here we return
      false.  True is returned immediately on a match. */
@@ -676,6 +1220,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "gcc -Wall -Wno-pointer-sign -g -o scrutmime rfc822parse.c scrutmime.c"
+compile-command: "gcc -Wall -Wno-pointer-sign -g -DHAVE_PTHREAD -o scrutmime rfc822parse.c scrutmime.c -lpthread"
 End:
 */
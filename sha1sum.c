@@ -19,6 +19,8 @@
 /* 
    To build this tool as md5sum    use -DBUILD_MD5SUM
    To build this tool as sha256sum use -DBUILD_SHA256SUM
+   This sets the name and the default algorithm; all algorithms are
+   available with option -o.
 
    SHA-1 code taken from gnupg 1.3.92. 
    MD-5 and SHA-256 code taken from libgcrypt 1.5.0.
@@ -30,6 +32,19 @@
    2009-10-21 wk  Added -c option.  Switch to GPL-3.  Escape filenames.
    2009-10-22 wk  Support MD5 and SHA256.
    2010-04-16 wk  Add option -0.
+
+   SHA-1 and SHA-256 use the x86 SHA extensions if available.
+
+   Option -o ALGO=FILE writes the checksums for ALGO to FILE.  It may
+   be given for several algorithms to compute them all while reading
+   the files only once.
+
+   Option --cache FILE keeps the computed digests in FILE.  With -c
+   files whose device, inode, size and mtime did not change are then
+   not read again unless --rehash-all is also given.
+
+   If build with -DHAVE_PTHREAD option -j N may be used to hash N
+   files in parallel; the output is still printed in input order.
 */
 
 #include <stdio.h>
@@ -40,16 +55,47 @@
 #ifdef _WIN32
 # include <fcntl.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#ifndef _WIN32
+# define USE_POSIX_IO 1
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <time.h>
+#endif
+
+/* On x86 we use the SHA extensions if the CPU supports them.  Build
+   with -DDISABLE_SHA_NI to use only the portable code.  */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(DISABLE_SHA_NI)
+# define USE_SHA_NI 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
 
 #define VERSION "1.2"
+
+/* The supported algorithms.  */
+#define ALGO_MD5    0
+#define ALGO_SHA1   1
+#define ALGO_SHA256 2
+#define N_ALGOS     3
+#define MAX_DIGEST_LENGTH 32
+
 #if defined(BUILD_MD5SUM)
 # define PGM "md5sum"
+# define DEFAULT_ALGO ALGO_MD5
 # define DIGEST_LENGTH 16
 #elif defined(BUILD_SHA256SUM)
 # define PGM "sha256sum"
+# define DEFAULT_ALGO ALGO_SHA256
 # define DIGEST_LENGTH 32
 #else /* default  */
 # define PGM "sha1sum"
+# define DEFAULT_ALGO ALGO_SHA1
 # define DIGEST_LENGTH 20
 #endif
 
@@ -57,6 +103,15 @@
 /* Offset where the name starts in the file.  */
 #define NAME_OFFSET (DIGEST_LENGTH*2+2)
 
+/* Max. number of threads for option -j.  */
+#define MAX_JOBS 64
+
+/* Size of the buffer used to read the files.  */
+#define READ_BUFFER_SIZE 65536
+
+/* Number of hash buckets of the verification cache.  */
+#define CACHE_BUCKETS 4096
+
 
 /* Figure out a 32 bit unsigned integer type.  */
 #if (defined __STDC_VERSION__ && __STDC_VERSION__ >= 199901L)
@@ -87,7 +142,6 @@ rol( u32 x, int n)
 #define rol(x,n) ( ((x) << (n)) | ((x) >> (32-(n))) )
 #endif
 
-#ifdef BUILD_SHA256SUM
 #if defined(__GNUC__) && defined(__i386__)
 static inline u32
 ror(u32 x, int n)
@@ -100,55 +154,68 @@ ror(u32 x, int n)
 #else
 #define ror(x,n) ( ((x) >> (n)) | ((x) << (32-(n))) )
 #endif
-#endif /*BUILD_SHA256SUM*/
 
 
+/* The context for all algorithms; MD5 uses only H0 to H3 and SHA-1
+   only H0 to H4.  */
 typedef struct 
 {
-#if defined(BUILD_MD5SUM)
-  u32 A,B,C,D;
-#elif defined(BUILD_SHA256SUM)
   u32  h0,h1,h2,h3,h4,h5,h6,h7;
-#else /*BUILD_SHA1SUM*/
-  u32  h0,h1,h2,h3,h4;
-#endif
   u32  nblocks;
   unsigned char buf[64];
   int  count;
+  int  algo;
 } DIGEST_CONTEXT;
 
 
+/* The names and digest lengths of the algorithms.  */
+static const struct
+{
+  const char *name;
+  int length;
+} algo_table[N_ALGOS] =
+  {
+    { "md5",    16 },
+    { "sha1",   20 },
+    { "sha256", 32 }
+  };
+
+
 
 static void
-digest_init (DIGEST_CONTEXT *hd)
+digest_init (DIGEST_CONTEXT *hd, int algo)
 {
-#if defined(BUILD_MD5SUM)
-  hd->A = 0x67452301;
-  hd->B = 0xefcdab89;
-  hd->C = 0x98badcfe;
-  hd->D = 0x10325476;
-#elif defined(BUILD_SHA256SUM)
-  hd->h0 = 0x6a09e667;
-  hd->h1 = 0xbb67ae85;
-  hd->h2 = 0x3c6ef372;
-  hd->h3 = 0xa54ff53a;
-  hd->h4 = 0x510e527f;
-  hd->h5 = 0x9b05688c;
-  hd->h6 = 0x1f83d9ab;
-  hd->h7 = 0x5be0cd19;
-#else /*BUILD_SHA1SUM*/
-  hd->h0 = 0x67452301;
-  hd->h1 = 0xefcdab89;
-  hd->h2 = 0x98badcfe;
-  hd->h3 = 0x10325476;
-  hd->h4 = 0xc3d2e1f0;
-#endif
-  hd->nblocks = 0;
-  hd->count = 0;
+  memset (hd, 0, sizeof *hd);
+  hd->algo = algo;
+  switch (algo)
+    {
+    case ALGO_MD5:
+      hd->h0 = 0x67452301;
+      hd->h1 = 0xefcdab89;
+      hd->h2 = 0x98badcfe;
+      hd->h3 = 0x10325476;
+      break;
+    case ALGO_SHA256:
+      hd->h0 = 0x6a09e667;
+      hd->h1 = 0xbb67ae85;
+      hd->h2 = 0x3c6ef372;
+      hd->h3 = 0xa54ff53a;
+      hd->h4 = 0x510e527f;
+      hd->h5 = 0x9b05688c;
+      hd->h6 = 0x1f83d9ab;
+      hd->h7 = 0x5be0cd19;
+      break;
+    default: /*ALGO_SHA1*/
+      hd->h0 = 0x67452301;
+      hd->h1 = 0xefcdab89;
+      hd->h2 = 0x98badcfe;
+      hd->h3 = 0x10325476;
+      hd->h4 = 0xc3d2e1f0;
+      break;
+    }
 }
 
 
-#if defined(BUILD_MD5SUM)
 /*
  * MD5 transform the message X which consists of 16 32-bit-words
  */
@@ -161,19 +228,20 @@ digest_init (DIGEST_CONTEXT *hd)
 #define FH(b, c, d) (b ^ c ^ d)
 #define FI(b, c, d) (c ^ (b | ~d))
 static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data )
+md5_transform (DIGEST_CONTEXT *hd, const unsigned char *data )
 {
   u32 correct_words[16];
-  u32 A = hd->A;
-  u32 B = hd->B;
-  u32 C = hd->C;
-  u32 D = hd->D;
+  u32 A = hd->h0;
+  u32 B = hd->h1;
+  u32 C = hd->h2;
+  u32 D = hd->h3;
   u32 *cwp = correct_words;
     
   if (big_endian_host)
     { 
       int i;
-      unsigned char *p2, *p1;
+      const unsigned char *p1;
+      unsigned char *p2;
       for(i=0, p1=data, p2=(unsigned char*)correct_words;
           i < 16; i++, p2 += 4 )
         {
@@ -284,13 +352,18 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
   OP (FI, B, C, D, A,  9, 21, 0xeb86d391);
 
   /* Put checksum in context given as argument.  */
-  hd->A += A;
-  hd->B += B;
-  hd->C += C;
-  hd->D += D;
+  hd->h0 += A;
+  hd->h1 += B;
+  hd->h2 += C;
+  hd->h3 += D;
 }
+#undef OP
+#undef FF
+#undef FG
+#undef FH
+#undef FI
+
 
-#elif defined(BUILD_SHA256SUM)
 /*
  * SHA-256 transform the message X which consists of 16 32-bit-words.
  * See FIPS-180-2 for details.
@@ -314,10 +387,7 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
             b = a;                                                \
             a = t1 + t2;                                          \
           } while (0)
-static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data)
-{
-  static const u32 K[64] = {
+static const u32 sha256_k[64] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
     0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -336,6 +406,10 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data)
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
   };
 
+static void
+sha256_transform (DIGEST_CONTEXT *hd, const unsigned char *data)
+{
+  const u32 *K = sha256_k;
   u32 a,b,c,d,e,f,g,h,t1,t2;
   u32 x[16];
   u32 w[64];
@@ -390,12 +464,12 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data)
 # undef S1
 # undef R
 
-#else /*BUILD_SHA1SUM*/
+
 /*
  * SHA-1 transform the message X which consists of 16 32-bit-words
  */
 static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data )
+sha1_transform (DIGEST_CONTEXT *hd, const unsigned char *data )
 {
   u32 a,b,c,d,e,tm;
   u32 x[16];
@@ -531,8 +605,216 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
   hd->h3 += d;
   hd->h4 += e;
 }
+#undef K1
+#undef K2
+#undef K3
+#undef K4
+#undef F1
+#undef F2
+#undef F3
+#undef F4
+#undef M
+#undef R
+
+
+/* Process NBLOCKS blocks of 64 bytes at DATA using the portable
+   transforms.  */
+static void
+transform_generic (DIGEST_CONTEXT *hd, const unsigned char *data,
+                   size_t nblocks)
+{
+  void (*fnc) (DIGEST_CONTEXT *, const unsigned char *);
 
-#endif /*BUILD_SHA1SUM*/
+  if (hd->algo == ALGO_MD5)
+    fnc = md5_transform;
+  else if (hd->algo == ALGO_SHA256)
+    fnc = sha256_transform;
+  else
+    fnc = sha1_transform;
+  for (; nblocks; nblocks--, data += 64)
+    fnc (hd, data);
+}
+
+
+#ifdef USE_SHA_NI
+# define SHA_NI_TARGET __attribute__ ((target ("sha,sse4.1")))
+# define LOADMSG(n) _mm_shuffle_epi8 (_mm_loadu_si128                   \
+                                      ((const __m128i *)(data+16*(n))), \
+                                      mask)
+
+/* Four rounds of SHA-256.  G is the constant group number 0..15;
+   MSG[G%4] holds the message words for the group.  The message
+   schedule for the later groups is computed on the fly.  */
+# define SHA256_ROUNDS4(g) do                                          \
+    {                                                                   \
+      tmp = _mm_add_epi32 (msg[(g)&3],                                 \
+                           _mm_loadu_si128 ((const __m128i *)           \
+                                            (sha256_k + 4*(g))));       \
+      state1 = _mm_sha256rnds2_epu32 (state1, state0, tmp);             \
+      if ((g) >= 3 && (g) < 15)                                         \
+        {                                                               \
+          msg[((g)+1)&3] = _mm_add_epi32                                \
+            (msg[((g)+1)&3],                                            \
+             _mm_alignr_epi8 (msg[(g)&3], msg[((g)+3)&3], 4));          \
+          msg[((g)+1)&3] = _mm_sha256msg2_epu32 (msg[((g)+1)&3],        \
+                                                  msg[(g)&3]);          \
+        }                                                               \
+      tmp = _mm_shuffle_epi32 (tmp, 0x0e);                              \
+      state0 = _mm_sha256rnds2_epu32 (state0, state1, tmp);             \
+      if ((g) >= 1 && (g) < 13)                                         \
+        msg[((g)+3)&3] = _mm_sha256msg1_epu32 (msg[((g)+3)&3],          \
+                                                msg[(g)&3]);            \
+    } while (0)
+
+/* SHA-256 transform of NBLOCKS blocks using the SHA extensions.  */
+static SHA_NI_TARGET void
+sha256_transform_ni (DIGEST_CONTEXT *hd, const unsigned char *data,
+                     size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0, state1, save0, save1, tmp;
+  __m128i msg[4];
+
+  /* The instructions want the state as ABEF and CDGH.  */
+  tmp    = _mm_set_epi32 (hd->h0, hd->h1, hd->h2, hd->h3);
+  state1 = _mm_set_epi32 (hd->h4, hd->h5, hd->h6, hd->h7);
+  state0 = _mm_unpackhi_epi64 (state1, tmp);
+  state1 = _mm_unpacklo_epi64 (state1, tmp);
+
+  for (; nblocks; nblocks--, data += 64)
+    {
+      save0 = state0;
+      save1 = state1;
+      msg[0] = LOADMSG (0);
+      msg[1] = LOADMSG (1);
+      msg[2] = LOADMSG (2);
+      msg[3] = LOADMSG (3);
+      SHA256_ROUNDS4 (0);  SHA256_ROUNDS4 (1);
+      SHA256_ROUNDS4 (2);  SHA256_ROUNDS4 (3);
+      SHA256_ROUNDS4 (4);  SHA256_ROUNDS4 (5);
+      SHA256_ROUNDS4 (6);  SHA256_ROUNDS4 (7);
+      SHA256_ROUNDS4 (8);  SHA256_ROUNDS4 (9);
+      SHA256_ROUNDS4 (10); SHA256_ROUNDS4 (11);
+      SHA256_ROUNDS4 (12); SHA256_ROUNDS4 (13);
+      SHA256_ROUNDS4 (14); SHA256_ROUNDS4 (15);
+      state0 = _mm_add_epi32 (state0, save0);
+      state1 = _mm_add_epi32 (state1, save1);
+    }
+
+  hd->h0 = _mm_extract_epi32 (state0, 3);
+  hd->h1 = _mm_extract_epi32 (state0, 2);
+  hd->h4 = _mm_extract_epi32 (state0, 1);
+  hd->h5 = _mm_extract_epi32 (state0, 0);
+  hd->h2 = _mm_extract_epi32 (state1, 3);
+  hd->h3 = _mm_extract_epi32 (state1, 2);
+  hd->h6 = _mm_extract_epi32 (state1, 1);
+  hd->h7 = _mm_extract_epi32 (state1, 0);
+}
+# undef SHA256_ROUNDS4
+
+
+/* Four rounds of SHA-1.  G is the constant group number 0..19;
+   MSG[G%4] holds the message words for the group and E[G%2] receives
+   the E value for the next group.  */
+# define SHA1_ROUNDS4(g) do                                            \
+    {                                                                   \
+      if (!(g))                                                         \
+        e[0] = _mm_add_epi32 (e[0], msg[0]);                            \
+      else                                                              \
+        e[(g)&1] = _mm_sha1nexte_epu32 (e[(g)&1], msg[(g)&3]);         \
+      e[((g)+1)&1] = abcd;                                              \
+      if ((g) >= 3 && (g) < 19)                                         \
+        msg[((g)+1)&3] = _mm_sha1msg2_epu32 (msg[((g)+1)&3],            \
+                                              msg[(g)&3]);              \
+      abcd = _mm_sha1rnds4_epu32 (abcd, e[(g)&1], (g)/5);               \
+      if ((g) >= 1 && (g) < 17)                                         \
+        msg[((g)+3)&3] = _mm_sha1msg1_epu32 (msg[((g)+3)&3],            \
+                                              msg[(g)&3]);              \
+      if ((g) >= 2 && (g) < 18)                                         \
+        msg[((g)+2)&3] = _mm_xor_si128 (msg[((g)+2)&3], msg[(g)&3]);    \
+    } while (0)
+
+/* SHA-1 transform of NBLOCKS blocks using the SHA extensions.  */
+static SHA_NI_TARGET void
+sha1_transform_ni (DIGEST_CONTEXT *hd, const unsigned char *data,
+                   size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, save_abcd, save_e;
+  __m128i e[2];
+  __m128i msg[4];
+
+  abcd = _mm_set_epi32 (hd->h0, hd->h1, hd->h2, hd->h3);
+  e[0] = _mm_set_epi32 (hd->h4, 0, 0, 0);
+  e[1] = e[0];
+
+  for (; nblocks; nblocks--, data += 64)
+    {
+      save_abcd = abcd;
+      save_e = e[0];
+      msg[0] = LOADMSG (0);
+      msg[1] = LOADMSG (1);
+      msg[2] = LOADMSG (2);
+      msg[3] = LOADMSG (3);
+      SHA1_ROUNDS4 (0);  SHA1_ROUNDS4 (1);  SHA1_ROUNDS4 (2);
+      SHA1_ROUNDS4 (3);  SHA1_ROUNDS4 (4);  SHA1_ROUNDS4 (5);
+      SHA1_ROUNDS4 (6);  SHA1_ROUNDS4 (7);  SHA1_ROUNDS4 (8);
+      SHA1_ROUNDS4 (9);  SHA1_ROUNDS4 (10); SHA1_ROUNDS4 (11);
+      SHA1_ROUNDS4 (12); SHA1_ROUNDS4 (13); SHA1_ROUNDS4 (14);
+      SHA1_ROUNDS4 (15); SHA1_ROUNDS4 (16); SHA1_ROUNDS4 (17);
+      SHA1_ROUNDS4 (18); SHA1_ROUNDS4 (19);
+      e[0] = _mm_sha1nexte_epu32 (e[0], save_e);
+      abcd = _mm_add_epi32 (abcd, save_abcd);
+    }
+
+  hd->h0 = _mm_extract_epi32 (abcd, 3);
+  hd->h1 = _mm_extract_epi32 (abcd, 2);
+  hd->h2 = _mm_extract_epi32 (abcd, 1);
+  hd->h3 = _mm_extract_epi32 (abcd, 0);
+  hd->h4 = _mm_extract_epi32 (e[0], 3);
+}
+# undef SHA1_ROUNDS4
+# undef LOADMSG
+
+
+/* Return true if the CPU supports the SHA extensions and SSE4.1.  */
+static int
+have_sha_ni (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return 0;
+  __cpuid (1, eax, ebx, ecx, edx);
+  if (!(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    return 0;
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return !!(ebx & bit_SHA);
+}
+#endif /*USE_SHA_NI*/
+
+
+/* The functions used to process full blocks indexed by algorithm.  */
+static void (*transform_blocks[N_ALGOS]) (DIGEST_CONTEXT *hd,
+                                          const unsigned char *data,
+                                          size_t nblocks)
+  = { transform_generic, transform_generic, transform_generic };
+
+
+/* Select the fastest transform function supported by the CPU.  */
+static void
+select_transform (void)
+{
+#ifdef USE_SHA_NI
+  if (have_sha_ni ())
+    {
+      transform_blocks[ALGO_SHA1] = sha1_transform_ni;
+      transform_blocks[ALGO_SHA256] = sha256_transform_ni;
+    }
+#endif
+}
 
 
 /* Update the message digest with the contents of (DATA,DATALEN).  */
@@ -540,10 +822,11 @@ static void
 digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
 {
   unsigned char *inbuf = data;
+  size_t n;
 
   if (hd->count == 64) /* Flush the buffer.  */
     {
-      transform ( hd, hd->buf );
+      transform_blocks[hd->algo] (hd, hd->buf, 1);
       hd->count = 0;
       hd->nblocks++;
     }
@@ -558,13 +841,15 @@ digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
         return;
     }
   
-  while( datalen >= 64 ) 
+  if (datalen >= 64)
     {
-      transform( hd, inbuf );
+      /* Pass all full blocks at once.  */
+      n = datalen / 64;
+      transform_blocks[hd->algo] (hd, inbuf, n);
       hd->count = 0;
-      hd->nblocks++;
-      datalen -= 64;
-      inbuf += 64;
+      hd->nblocks += n;
+      datalen -= n * 64;
+      inbuf += n * 64;
     }
   for( ; datalen && hd->count < 64; datalen-- )
     hd->buf[hd->count++] = *inbuf++;
@@ -575,7 +860,7 @@ digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
  * returns the digest.
  * The handle is prepared for a new cycle, but adding bytes to the
  * handle will the destroy the returned buffer.
- * Returns: DIGEST_LENGTH bytes representing the digest.
+ * Returns: The digest in the first bytes of HD->BUF.
  */
 
 static void
@@ -615,50 +900,58 @@ digest_final(DIGEST_CONTEXT *hd)
       memset(hd->buf, 0, 56 );     /* Fill next block with zeroes.  */
     }
   /* Append the 64 bit count. */
-#if defined(BUILD_MD5SUM)
-  hd->buf[56] = lsb;
-  hd->buf[57] = lsb >>  8;
-  hd->buf[58] = lsb >> 16;
-  hd->buf[59] = lsb >> 24;
-  hd->buf[60] = msb;
-  hd->buf[61] = msb >>  8;
-  hd->buf[62] = msb >> 16;
-  hd->buf[63] = msb >> 24;
-#else
-  hd->buf[56] = msb >> 24;
-  hd->buf[57] = msb >> 16;
-  hd->buf[58] = msb >>  8;
-  hd->buf[59] = msb;
-  hd->buf[60] = lsb >> 24;
-  hd->buf[61] = lsb >> 16;
-  hd->buf[62] = lsb >>  8;
-  hd->buf[63] = lsb;
-#endif
+  if (hd->algo == ALGO_MD5)
+    {
+      hd->buf[56] = lsb;
+      hd->buf[57] = lsb >>  8;
+      hd->buf[58] = lsb >> 16;
+      hd->buf[59] = lsb >> 24;
+      hd->buf[60] = msb;
+      hd->buf[61] = msb >>  8;
+      hd->buf[62] = msb >> 16;
+      hd->buf[63] = msb >> 24;
+    }
+  else
+    {
+      hd->buf[56] = msb >> 24;
+      hd->buf[57] = msb >> 16;
+      hd->buf[58] = msb >>  8;
+      hd->buf[59] = msb;
+      hd->buf[60] = lsb >> 24;
+      hd->buf[61] = lsb >> 16;
+      hd->buf[62] = lsb >>  8;
+      hd->buf[63] = lsb;
+    }
 
-  transform( hd, hd->buf );
+  transform_blocks[hd->algo] (hd, hd->buf, 1);
   p = hd->buf;
-#if defined(BUILD_MD5SUM)
-#define X(a) do { *p++ = hd->a      ; *p++ = hd->a >> 8;      \
-	          *p++ = hd->a >> 16; *p++ = hd->a >> 24; } while(0)
-  X(A);
-  X(B);
-  X(C);
-  X(D);
-#else /* Not MD5 */
-# define X(a) do { *p++ = hd->h##a >> 24; *p++ = hd->h##a >> 16;         \
+  if (hd->algo == ALGO_MD5)
+    {
+#define X(a) do { *p++ = hd->h##a      ; *p++ = hd->h##a >> 8;      \
+	          *p++ = hd->h##a >> 16; *p++ = hd->h##a >> 24; } while(0)
+      X(0);
+      X(1);
+      X(2);
+      X(3);
+#undef X
+    }
+  else
+    {
+#define X(a) do { *p++ = hd->h##a >> 24; *p++ = hd->h##a >> 16;         \
 		   *p++ = hd->h##a >> 8;  *p++ = hd->h##a; } while(0)
-  X(0);
-  X(1);
-  X(2);
-  X(3);
-  X(4);
-# if defined(BUILD_SHA256SUM) 
-  X(5);
-  X(6);
-  X(7);
-# endif /*BUILD_SHA256SUM*/
-#endif /*BUILD_SHA1SUM*/
+      X(0);
+      X(1);
+      X(2);
+      X(3);
+      X(4);
+      if (hd->algo == ALGO_SHA256)
+        {
+          X(5);
+          X(6);
+          X(7);
+        }
 #undef X
+    }
 }
 
 
@@ -668,6 +961,17 @@ static unsigned int readerrors;
 static unsigned int checkcount;
 static unsigned int matcherrors;
 
+/* The checksum outputs as requested with option -o.  Without that
+   option the default algorithm is printed to stdout.  */
+struct output_s
+{
+  int algo;
+  const char *fname;  /* NULL for stdout.  */
+  FILE *fp;
+};
+static struct output_s outputs[N_ALGOS];
+static int noutputs;
+
 /* We need to escape the fname so that included linefeeds etc don't
    mess up the the output file.  On windows we also turn backslashes
    into slashes so that we don't get into conflicts with the escape
@@ -769,78 +1073,668 @@ unescapefname (char *fname)
 
 
 
+/* The outcome of hashing one file.  */
+#define FAILED_OPEN 1
+#define FAILED_READ 2
+#ifdef USE_POSIX_IO
+/* The attributes identifying the version of a file for the cache.  */
+struct file_key_s
+{
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long mtime;
+  long mtime_nsec;
+};
+#endif /*USE_POSIX_IO*/
+
+struct hash_result_s
+{
+  int failure;    /* 0, FAILED_OPEN or FAILED_READ.  */
+  int err;        /* The errno value for a failure.  */
+  unsigned char digest[N_ALGOS][MAX_DIGEST_LENGTH];  /* Per output.  */
+#ifdef USE_POSIX_IO
+  int have_key;   /* KEY is valid.  */
+  struct file_key_s key;
+#endif
+};
+
+
+/* The verification cache as requested by option --cache.  It is
+   loaded at startup and only accessed by the main thread.  */
+static const char *cache_fname;
+static int opt_rehash_all;
+
+#ifdef USE_POSIX_IO
+struct cache_entry_s
+{
+  struct cache_entry_s *next;
+  int algo;
+  struct file_key_s key;
+  unsigned char digest[MAX_DIGEST_LENGTH];
+};
+static struct cache_entry_s *cache_table[CACHE_BUCKETS];
+static int cache_dirty;
+static time_t cache_start_time;
+
+
+static void
+stat_to_key (const struct stat *st, struct file_key_s *key)
+{
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->size = st->st_size;
+#if defined(HAVE_ST_MTIM) \
+    || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L)
+  key->mtime = st->st_mtim.tv_sec;
+  key->mtime_nsec = st->st_mtim.tv_nsec;
+#else
+  key->mtime = st->st_mtime;
+  key->mtime_nsec = 0;
+#endif
+}
+
+
 static int
-hash_file (const char *fname, const char *expected)
+key_equal (const struct file_key_s *a, const struct file_key_s *b)
+{
+  return (a->dev == b->dev && a->ino == b->ino && a->size == b->size
+          && a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec);
+}
+
+
+/* Return the cache entry for the file KEY and ALGO or NULL.  The
+   entry may be for an older version of the file.  */
+static struct cache_entry_s *
+cache_find (int algo, const struct file_key_s *key)
+{
+  struct cache_entry_s *e;
+
+  for (e = cache_table[(key->dev * 31 + key->ino) % CACHE_BUCKETS];
+       e; e = e->next)
+    if (e->algo == algo && e->key.dev == key->dev && e->key.ino == key->ino)
+      return e;
+  return NULL;
+}
+
+
+/* Store DIGEST as the ALGO digest of the file KEY.  Files modified
+   in the last two seconds are not stored: With a coarse timestamp
+   resolution they might be changed again without a change of the
+   mtime.  */
+static void
+cache_put (int algo, const struct file_key_s *key,
+           const unsigned char *digest)
+{
+  struct cache_entry_s *e;
+  unsigned int bucket;
+
+  if (key->mtime + 2 > cache_start_time)
+    return;
+  e = cache_find (algo, key);
+  if (!e)
+    {
+      e = malloc (sizeof *e);
+      if (!e)
+        {
+          fprintf (stderr, PGM": can't allocate buffer: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      e->algo = algo;
+      bucket = (key->dev * 31 + key->ino) % CACHE_BUCKETS;
+      e->next = cache_table[bucket];
+      cache_table[bucket] = e;
+    }
+  else if (key_equal (&e->key, key)
+           && !memcmp (e->digest, digest, algo_table[algo].length))
+    return;  /* Unchanged.  */
+  e->key = *key;
+  memcpy (e->digest, digest, algo_table[algo].length);
+  cache_dirty = 1;
+}
+
+
+/* Read the cache file.  A missing file is not an error; lines which
+   can't be parsed are ignored.  */
+static void
+load_cache (void)
 {
   FILE *fp;
-  char buffer[4096];
-  size_t n;
-  DIGEST_CONTEXT ctx;
-  int i;
-  char *fnamebuf;
-  int escaped;
+  char line[256];
+  char name[16], hex[2*MAX_DIGEST_LENGTH+1];
+  struct file_key_s key;
+  unsigned char digest[MAX_DIGEST_LENGTH];
+  int algo, i, c;
+
+  cache_start_time = time (NULL);
+  fp = fopen (cache_fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        fprintf (stderr, PGM": can't open `%s': %s\n",
+                 cache_fname, strerror (errno));
+      return;
+    }
+  memset (&key, 0, sizeof key);
+  while (fgets (line, sizeof line, fp))
+    {
+      if (*line == '#'
+          || sscanf (line, "%15s %llu %llu %llu %lld.%ld %64s", name,
+                     &key.dev, &key.ino, &key.size, &key.mtime,
+                     &key.mtime_nsec, hex) != 7)
+        continue;
+      for (algo=0; algo < N_ALGOS; algo++)
+        if (!strcmp (name, algo_table[algo].name))
+          break;
+      if (algo == N_ALGOS || strlen (hex) != 2*algo_table[algo].length)
+        continue;
+      for (i=0; i < algo_table[algo].length; i++)
+        {
+          if (sscanf (hex+2*i, "%2x", &c) != 1)
+            break;
+          digest[i] = c;
+        }
+      if (i == algo_table[algo].length)
+        cache_put (algo, &key, digest);
+    }
+  fclose (fp);
+  cache_dirty = 0;
+}
 
-  filecount++;
-  if (!expected && *fname == '-' && !fname[1])
+
+/* Write the cache back if it has been changed.  The file is replaced
+   atomically.  */
+static int
+save_cache (void)
+{
+  char *tmpname;
+  FILE *fp;
+  struct cache_entry_s *e;
+  char hex[2*MAX_DIGEST_LENGTH+1];
+  int i, j, err;
+
+  if (!cache_dirty)
+    return 0;
+  tmpname = malloc (strlen (cache_fname) + 5);
+  if (!tmpname)
     {
-      /* Not in check mode and asked to read from stdin.  */
-      fp = stdin;
-#ifdef _WIN32
-      setmode (fileno (fp), O_BINARY);
-#endif
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
     }
-  else
-    fp = fopen (fname, "rb");
+  strcpy (tmpname, cache_fname);
+  strcat (tmpname, ".tmp");
+  fp = fopen (tmpname, "w");
   if (!fp)
     {
-      fprintf (stderr, PGM": can't open `%s': %s\n",
-               fname, strerror (errno));
-      if (expected)
-        printf ("%s: FAILED open\n", fname);
-      readerrors++;
+      fprintf (stderr, PGM": can't create `%s': %s\n",
+               tmpname, strerror (errno));
+      free (tmpname);
       return -1;
     }
-  digest_init (&ctx);
+  fputs ("# " PGM " cache - ALGO DEV INODE SIZE MTIME DIGEST\n", fp);
+  for (i=0; i < CACHE_BUCKETS; i++)
+    for (e = cache_table[i]; e; e = e->next)
+      {
+        for (j=0; j < algo_table[e->algo].length; j++)
+          sprintf (hex+2*j, "%02x", e->digest[j]);
+        fprintf (fp, "%s %llu %llu %llu %lld.%09ld %s\n",
+                 algo_table[e->algo].name, e->key.dev, e->key.ino,
+                 e->key.size, e->key.mtime, e->key.mtime_nsec, hex);
+      }
+  err = ferror (fp);
+  if (fclose (fp))
+    err = 1;
+  if (err || rename (tmpname, cache_fname))
+    {
+      fprintf (stderr, PGM": error writing `%s': %s\n",
+               cache_fname, strerror (errno));
+      remove (tmpname);
+      free (tmpname);
+      return -1;
+    }
+  free (tmpname);
+  return 0;
+}
+
+
+/* Try to get the digest for FNAME from the cache and store it in RES.
+   Returns true on success.  */
+static int
+lookup_cache (const char *fname, struct hash_result_s *res)
+{
+  struct stat st;
+  struct cache_entry_s *e;
+
+  if (!cache_fname || opt_rehash_all || stat (fname, &st)
+      || !S_ISREG (st.st_mode))
+    return 0;
+  memset (res, 0, sizeof *res);
+  stat_to_key (&st, &res->key);
+  e = cache_find (outputs[0].algo, &res->key);
+  if (!e || !key_equal (&e->key, &res->key))
+    return 0;
+  memcpy (res->digest[0], e->digest, algo_table[e->algo].length);
+  res->have_key = 1;
+  return 1;
+}
+#endif /*USE_POSIX_IO*/
+
+
+/* Compute the digests for all outputs of FNAME and store them in
+   RES; the data is read only once.  If USE_STDIN is
+   set a FNAME of "-" is taken as stdin.  This function neither
+   prints nor updates the stats and may thus be run by several
+   threads at once.  */
+static void
+compute_hash (const char *fname, int use_stdin, struct hash_result_s *res)
+{
+  unsigned char buffer[READ_BUFFER_SIZE];
+  size_t n;
+  DIGEST_CONTEXT ctx[N_ALGOS];
+  int i;
+#ifdef USE_POSIX_IO
+  int fd;
+  ssize_t nread;
+#endif
+  FILE *fp;
+
+  res->failure = 0;
+  res->err = 0;
+#ifdef USE_POSIX_IO
+  res->have_key = 0;
+#endif
+  for (i=0; i < noutputs; i++)
+    digest_init (ctx+i, outputs[i].algo);
+  if (use_stdin && *fname == '-' && !fname[1])
+    fp = stdin;
+  else
+    {
+#ifdef USE_POSIX_IO
+      /* Read regular files directly into a large buffer; if the
+         buffer is filled up only full blocks are passed to
+         digest_write and thus nothing needs to be copied.  We do not
+         use mmap because a file truncated while we hash it would
+         then crash us instead of giving a read error.  */
+      fd = open (fname, O_RDONLY);
+      if (fd == -1)
+        {
+          res->failure = FAILED_OPEN;
+          res->err = errno;
+          return;
+        }
+      if (cache_fname)
+        {
+          /* Take the key before reading so that a concurrent change
+             won't go unnoticed next time.  */
+          struct stat st;
+
+          if (!fstat (fd, &st) && S_ISREG (st.st_mode))
+            {
+              stat_to_key (&st, &res->key);
+              res->have_key = 1;
+            }
+        }
+# ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+# endif
+      do
+        {
+          for (n = 0; n < sizeof buffer; n += nread)
+            {
+              nread = read (fd, buffer + n, sizeof buffer - n);
+              if (nread < 0 && errno == EINTR)
+                nread = 0;
+              else if (nread < 0)
+                {
+                  res->failure = FAILED_READ;
+                  res->err = errno;
+                  close (fd);
+                  return;
+                }
+              else if (!nread)
+                break;
+            }
+          for (i=0; i < noutputs; i++)
+            digest_write (ctx+i, buffer, n);
+        }
+      while (n == sizeof buffer);
+      close (fd);
+      goto leave;
+#else /*!USE_POSIX_IO*/
+      fp = fopen (fname, "rb");
+      if (!fp)
+        {
+          res->failure = FAILED_OPEN;
+          res->err = errno;
+          return;
+        }
+#endif /*!USE_POSIX_IO*/
+    }
+
+#ifdef _WIN32
+  if (fp == stdin)
+    setmode (fileno (fp), O_BINARY);
+#endif
   while ( (n = fread (buffer, 1, sizeof buffer, fp)))
-    digest_write (&ctx, buffer, n);
+    for (i=0; i < noutputs; i++)
+      digest_write (ctx+i, buffer, n);
   if (ferror (fp))
     {
-      fprintf (stderr, PGM": error reading `%s': %s\n",
-               fname, strerror (errno));
+      res->failure = FAILED_READ;
+      res->err = errno;
       if (fp != stdin)
         fclose (fp);
+      return;
+    }
+  if (fp != stdin)
+    fclose (fp);
+
+#ifdef USE_POSIX_IO
+ leave:
+#endif
+  for (i=0; i < noutputs; i++)
+    {
+      digest_final (ctx+i);
+      memcpy (res->digest[i], ctx[i].buf, algo_table[outputs[i].algo].length);
+    }
+}
+
+
+/* Store the LENGTH bytes at DATA as a Nul terminated lowercase hex
+   string at BUFFER.  This is used instead of snprintf because for
+   many small files the formatting would take longer than hashing.  */
+static void
+bin2hex (const unsigned char *data, int length, char *buffer)
+{
+  static const char hexdigits[] = "0123456789abcdef";
+
+  for (; length; length--, data++)
+    {
+      *buffer++ = hexdigits[*data >> 4];
+      *buffer++ = hexdigits[*data & 15];
+    }
+  *buffer = 0;
+}
+
+
+/* Print the result RES of hashing FNAME to all outputs and update
+   the stats.  If EXPECTED is not NULL it is the expected digest in
+   lowercase hex and the first digest of RES is checked against it.  */
+static int
+report_hash (const char *fname, const char *expected,
+             const struct hash_result_s *res)
+{
+  char buffer[2*MAX_DIGEST_LENGTH+1];
+  int j;
+  char *fnamebuf;
+  int escaped;
+  int rc = 0;
+
+  filecount++;
+  if (res->failure)
+    {
+      if (res->failure == FAILED_OPEN)
+        fprintf (stderr, PGM": can't open `%s': %s\n",
+                 fname, strerror (res->err));
+      else
+        fprintf (stderr, PGM": error reading `%s': %s\n",
+                 fname, strerror (res->err));
       if (expected)
-        printf ("%s: FAILED read\n", fname);
+        printf ("%s: FAILED %s\n", fname,
+                res->failure == FAILED_OPEN? "open":"read");
       readerrors++;
       return -1;
     }
-  digest_final (&ctx);
-  if (fp != stdin)
-    fclose (fp);
-  
+
+#ifdef USE_POSIX_IO
+  if (res->have_key)
+    for (j=0; j < noutputs; j++)
+      cache_put (outputs[j].algo, &res->key, res->digest[j]);
+#endif
+
   fnamebuf = escapefname (fname, &escaped);
   fname = fnamebuf;
 
   checkcount++;
-  for (i=0; i < DIGEST_LENGTH; i++)
-    snprintf (buffer+2*i, 10, "%02x", ctx.buf[i]);
+  for (j=0; j < noutputs; j++)
+    {
+      bin2hex (res->digest[j], algo_table[outputs[j].algo].length, buffer);
+      if (expected)
+        break;
+      fprintf (outputs[j].fp, "%s%s  %s\n", escaped? "\\":"", buffer, fname);
+    }
   if (expected)
     {
       if (strcmp (buffer, expected))
         {
           printf ("%s: FAILED\n", fname);
           matcherrors++;
-          return -1;
+          rc = -1;
         }
-      printf ("%s: OK\n", fname);
+      else
+        printf ("%s: OK\n", fname);
     }
-  else
-    printf ("%s%s  %s\n", escaped? "\\":"", buffer, fname);
   free (fnamebuf);
-  return 0;
+  return rc;
+}
+
+
+static int
+hash_file (const char *fname, const char *expected)
+{
+  struct hash_result_s res;
+
+  compute_hash (fname, !expected, &res);
+  return report_hash (fname, expected, &res);
+}
+
+
+/* The number of files to hash in parallel as set with option -j.  */
+static int opt_jobs = 1;
+
+#ifdef HAVE_PTHREAD
+/* A file queued for hashing.  */
+struct job_s
+{
+  char *fname;
+  char *expected;
+  int done;
+  struct hash_result_s res;
+};
+
+/* The jobs are kept in a ring buffer indexed by free running
+   counters: The jobs from QHEAD up to QNEXT have been taken by a
+   worker but not yet been reported, those from QNEXT up to QTAIL are
+   waiting for a worker.  Only the main thread reports jobs so that
+   the output is in input order.  */
+static struct job_s *queue;
+static unsigned int queue_size;
+static unsigned int qhead, qnext, qtail;
+static int queue_stop;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[MAX_JOBS];
+static int nworkers;
+
+
+static char *
+xstrdup (const char *string)
+{
+  char *p = malloc (strlen (string)+1);
+  if (!p)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  return strcpy (p, string);
+}
+
+
+static void *
+hash_worker (void *arg)
+{
+  struct job_s *job;
+
+  (void)arg;
+  pthread_mutex_lock (&queue_lock);
+  for (;;)
+    {
+      while (qnext == qtail && !queue_stop)
+        pthread_cond_wait (&queue_work, &queue_lock);
+      if (qnext == qtail)
+        break;
+      job = queue + qnext++ % queue_size;
+      if (job->done)
+        continue;  /* Answered from the cache.  */
+      pthread_mutex_unlock (&queue_lock);
+      compute_hash (job->fname, !job->expected, &job->res);
+      pthread_mutex_lock (&queue_lock);
+      job->done = 1;
+      pthread_cond_signal (&queue_done);
+    }
+  pthread_mutex_unlock (&queue_lock);
+  return NULL;
+}
+
+
+/* Start N worker threads.  If not even one thread can be created we
+   silently fall back to sequential mode.  */
+static void
+start_workers (int n)
+{
+  queue_size = 4 * n;
+  queue = calloc (queue_size, sizeof *queue);
+  if (!queue)
+    return;
+  for (nworkers = 0; nworkers < n; nworkers++)
+    if (pthread_create (&workers[nworkers], NULL, hash_worker, NULL))
+      break;
 }
 
 
+/* Report the finished jobs in order.  If ALL is set, wait until all
+   queued jobs have been reported; if not, wait only as long as the
+   queue is full.  Must be called with QUEUE_LOCK held.  Returns -1
+   if one of the reported files failed.  */
+static int
+report_jobs (int all)
+{
+  struct job_s *job;
+  int rc = 0;
+
+  while (qhead != qtail)
+    {
+      job = queue + qhead % queue_size;
+      if (!job->done)
+        {
+          if (!all && qtail - qhead < queue_size)
+            break;
+          pthread_cond_wait (&queue_done, &queue_lock);
+          continue;
+        }
+      /* A job answered from the cache may not yet have been passed
+         by the workers; take it from them so that QHEAD never gets
+         ahead of QNEXT.  */
+      if (qnext == qhead)
+        qnext++;
+      pthread_mutex_unlock (&queue_lock);
+      if (report_hash (job->fname, job->expected, &job->res))
+        rc = -1;
+      free (job->fname);
+      free (job->expected);
+      pthread_mutex_lock (&queue_lock);
+      qhead++;
+    }
+  return rc;
+}
+
+
+/* Wait for all queued files and report them.  */
+static int
+flush_jobs (void)
+{
+  int rc;
+
+  if (!nworkers)
+    return 0;
+  pthread_mutex_lock (&queue_lock);
+  rc = report_jobs (1);
+  pthread_mutex_unlock (&queue_lock);
+  return rc;
+}
+
+
+static void
+stop_workers (void)
+{
+  int i;
+
+  if (!nworkers)
+    return;
+  pthread_mutex_lock (&queue_lock);
+  queue_stop = 1;
+  pthread_cond_broadcast (&queue_work);
+  pthread_mutex_unlock (&queue_lock);
+  for (i=0; i < nworkers; i++)
+    pthread_join (workers[i], NULL);
+  nworkers = 0;
+  free (queue);
+  queue = NULL;
+}
+#endif /*HAVE_PTHREAD*/
+
+
+/* Hash the file FNAME like hash_file but if worker threads are
+   running merely queue it.  The return value then reflects only
+   those earlier files which have been reported meanwhile; the
+   remaining ones are covered by flush_jobs.  */
+static int
+queue_file (const char *fname, const char *expected)
+{
+  struct hash_result_s cached;
+  int have_cached = 0;
+#ifdef HAVE_PTHREAD
+  struct job_s *job;
+  int rc;
+#endif
+
+#ifdef USE_POSIX_IO
+  if (expected)
+    have_cached = lookup_cache (fname, &cached);
+#endif
+#ifdef HAVE_PTHREAD
+  if (nworkers)
+    {
+      pthread_mutex_lock (&queue_lock);
+      rc = report_jobs (0);
+      job = queue + qtail % queue_size;
+      job->fname = xstrdup (fname);
+      job->expected = expected? xstrdup (expected) : NULL;
+      job->done = have_cached;
+      if (have_cached)
+        job->res = cached;
+      qtail++;
+      if (!have_cached)
+        pthread_cond_signal (&queue_work);
+      pthread_mutex_unlock (&queue_lock);
+      return rc;
+    }
+#endif /*HAVE_PTHREAD*/
+  if (have_cached)
+    return report_hash (fname, expected, &cached);
+  return hash_file (fname, expected);
+}
+
+#ifndef HAVE_PTHREAD
+static int
+flush_jobs (void)
+{
+  return 0;
+}
+#endif /*!HAVE_PTHREAD*/
+
 static int
 check_file (const char *fname)
 {
@@ -870,6 +1764,8 @@ check_file (const char *fname)
       n = strlen(line);
       if (!n || line[n-1] != '\n')
         {
+          if (flush_jobs ())
+            rc = -1;
           fprintf (stderr, PGM": error reading `%s': %s\n", fname,
                    feof (fp)? "last linefeed missing":"line too long");
           rc = -1;
@@ -882,6 +1778,8 @@ check_file (const char *fname)
         continue;  /* Ignore empty lines.  */
       if (n < NAME_OFFSET || line[NAME_OFFSET-2] != ' ')
         {
+          if (flush_jobs ())
+            rc = -1;
           fprintf (stderr, PGM": error parsing `%s': %s\n", fname,
                    "invalid line");
           rc = -1;
@@ -906,10 +1804,12 @@ check_file (const char *fname)
       if (escaped)
         unescapefname (line+NAME_OFFSET);
       /* Hash the file.  */
-      if (hash_file (line+NAME_OFFSET, line))
+      if (queue_file (line+NAME_OFFSET, line))
         rc = -1;
     }
 
+  if (flush_jobs ())
+    rc = -1;
   if (ferror (fp))
     {
       fprintf (stderr, PGM":error reading `%s': %s\n",
@@ -943,6 +1843,8 @@ hash_list (void)
         {
           if (ferror (stdin))
             {
+              if (flush_jobs ())
+                rc = -1;
               fprintf (stderr, PGM":error reading `%s' at offset %lu: %s\n",
                        "[stdin]", off, strerror (errno));
               rc = -1;
@@ -954,6 +1856,8 @@ hash_list (void)
         }
       if (n >= sizeof namebuf)
         {
+          if (flush_jobs ())
+            rc = -1;
           fprintf (stderr, PGM": error reading `%s': "
                    "filename at offset %lu too long\n",
                    "[stdin]", lastoff);
@@ -964,22 +1868,82 @@ hash_list (void)
       off++;
       if (!c)
         {
-          if (*namebuf && hash_file (namebuf, NULL))
+          if (*namebuf && queue_file (namebuf, NULL))
             rc = -1;
           n = 0;
           lastoff = off;
         }
     }
   while (!ready);
+  if (flush_jobs ())
+    rc = -1;
   
   return rc;
 }
 
 
+/* Add an output for the option argument SPEC which has the form
+   ALGO=FILE; a FILE of "-" denotes stdout.  The file is created
+   later by open_outputs.  */
+static void
+add_output (const char *spec)
+{
+  const char *fname;
+  int algo, i;
+
+  fname = strchr (spec, '=');
+  for (algo=0; algo < N_ALGOS; algo++)
+    if (fname && strlen (algo_table[algo].name) == fname - spec
+        && !strncmp (spec, algo_table[algo].name, fname - spec))
+      break;
+  if (algo == N_ALGOS || !*++fname)
+    {
+      fprintf (stderr, PGM": invalid output `%s' - use md5, sha1 or sha256"
+               " followed by `=FILE'\n", spec);
+      exit (1);
+    }
+  for (i=0; i < noutputs; i++)
+    if (outputs[i].algo == algo)
+      {
+        fprintf (stderr, PGM": output for `%s' given twice\n",
+                 algo_table[algo].name);
+        exit (1);
+      }
+
+  outputs[noutputs].algo = algo;
+  outputs[noutputs].fname = strcmp (fname, "-")? fname : NULL;
+  outputs[noutputs].fp = stdout;
+  noutputs++;
+}
+
+
+/* Create the output files.  This is done only after all options have
+   been checked so that a usage error does not truncate them.  */
+static void
+open_outputs (void)
+{
+  int i;
+
+  for (i=0; i < noutputs; i++)
+    if (outputs[i].fname)
+      {
+        outputs[i].fp = fopen (outputs[i].fname, "w");
+        if (!outputs[i].fp)
+          {
+            fprintf (stderr, PGM": can't create `%s': %s\n",
+                     outputs[i].fname, strerror (errno));
+            exit (2);
+          }
+      }
+}
+
+
 static void
 usage (void)
 {
-  fprintf (stderr, "usage: sha1sum [-c|-0] [--] FILENAMES|-\n");
+  fprintf (stderr, "usage: " PGM " [-c|-0] [-j N] [-o ALGO=FILE]"
+           " [--cache FILE [--rehash-all]]\n"
+           "       [--] FILENAMES|-\n");
   exit (1);
 }
 
@@ -989,6 +1953,7 @@ main (int argc, char **argv)
   int check = 0;
   int filelist = 0;
   int rc = 0;
+  int i;
 
   assert (sizeof (u32) == 4);
   {
@@ -996,6 +1961,7 @@ main (int argc, char **argv)
     foo.u = 32;
     big_endian_host = !foo.b[0];
   }
+  select_transform ();
 
   if (argc)
     {
@@ -1020,6 +1986,29 @@ main (int argc, char **argv)
         check = 1;
       else if (argc && !strcmp (*argv, "-0"))
         filelist = 1;
+      else if (!strcmp (*argv, "-j") && argc > 1)
+        {
+          argc--; argv++;
+          opt_jobs = atoi (*argv);
+          if (opt_jobs < 1 || opt_jobs > MAX_JOBS)
+            {
+              fprintf (stderr, PGM": number of jobs must be 1 to %d\n",
+                       MAX_JOBS);
+              exit (1);
+            }
+        }
+      else if (!strcmp (*argv, "-o") && argc > 1)
+        {
+          argc--; argv++;
+          add_output (*argv);
+        }
+      else if (!strcmp (*argv, "--cache") && argc > 1)
+        {
+          argc--; argv++;
+          cache_fname = *argv;
+        }
+      else if (!strcmp (*argv, "--rehash-all"))
+        opt_rehash_all = 1;
       else if (!strcmp (*argv, "--"))
         {
           argc--; argv++;
@@ -1032,14 +2021,39 @@ main (int argc, char **argv)
 
   if (filelist && check)
     usage ();
+  if (check && noutputs)
+    usage ();
   if (!argc)
     usage ();
+  if (opt_rehash_all && !cache_fname)
+    usage ();
+  /* With option -0 a dash must be given as filename.  */
+  if (filelist && (argc != 1 || strcmp (argv[0], "-")))
+    usage ();
+  if (!noutputs)
+    {
+      outputs[0].algo = DEFAULT_ALGO;
+      outputs[0].fp = stdout;
+      noutputs = 1;
+    }
+  open_outputs ();
+  if (cache_fname)
+    {
+#ifdef USE_POSIX_IO
+      load_cache ();
+#else
+      fprintf (stderr, PGM": option --cache is not supported here\n");
+      exit (1);
+#endif
+    }
+
+#ifdef HAVE_PTHREAD
+  if (opt_jobs > 1)
+    start_workers (opt_jobs);
+#endif
 
   if (filelist)
     {
-      /* With option -0 a dash must be given as filename.  */
-      if (argc != 1 || strcmp (argv[0], "-"))
-        usage ();
       if (hash_list ())
         rc = 1;
     }
@@ -1054,11 +2068,29 @@ main (int argc, char **argv)
             }
           else
             {
-              if (hash_file (*argv, NULL))
+              if (queue_file (*argv, NULL))
                 rc = 1;
             }
         }
+      if (flush_jobs ())
+        rc = 1;
     }
+#ifdef HAVE_PTHREAD
+  stop_workers ();
+#endif
+
+#ifdef USE_POSIX_IO
+  if (cache_fname && save_cache ())
+    rc = 2;
+#endif
+
+  for (i=0; i < noutputs; i++)
+    if (outputs[i].fname && fclose (outputs[i].fp))
+      {
+        fprintf (stderr, PGM": error writing `%s': %s\n",
+                 outputs[i].fname, strerror (errno));
+        rc = 2;
+      }
 
   if (check && readerrors)
     fprintf (stderr, PGM": WARNING: %u of %u listed files "
@@ -1072,6 +2104,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "cc -Wall -g -o sha1sum sha1sum.c"
+compile-command: "cc -Wall -g -DHAVE_PTHREAD -o sha1sum sha1sum.c -lpthread"
 End:
 */
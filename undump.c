@@ -35,16 +35,68 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define digitp(p)   ((p) >= '0' && (p) <= '9')
-#define hexdigitp(a) (digitp (a)                     \
-                      || ((a) >= 'A' && (a) <= 'F')  \
-                      || ((a) >= 'a' && (a) <= 'f'))
+#define BUFFER_SIZE 65536
+
+#define hexdigitp(a) ((a) != EOF && hexval[(a)] >= 0)
 #define ascii_isspace(a) ((a)==' ' || (a)=='\n' || (a)=='\r' || (a)=='\t')
-#define xtoi_1(p)   ((p) <= '9'? ((p)- '0'): \
-                     (p) <= 'F'? ((p)-'A'+10):((p)-'a'+10))
+#define xtoi_1(p)   (hexval[(p)])
+
+/* The value of a hex digit, -2 for white space other than LF or -1. */
+static signed char hexval[256];
+
+static unsigned char inbuf[BUFFER_SIZE];
+static size_t inpos, inlen;
+static unsigned char outbuf[BUFFER_SIZE];
+static size_t outlen;
+
+#define my_getc() (inpos < inlen? inbuf[inpos++] : fill_inbuf ())
+#define my_putc(a) do { if (outlen == BUFFER_SIZE) flush_outbuf ();  \
+                        outbuf[outlen++] = (a); } while (0)
+
+
+static void
+init_tables (void)
+{
+  int i;
+
+  memset (hexval, -1, sizeof hexval);
+  for (i=0; i < 10; i++)
+    hexval['0'+i] = i;
+  for (i=0; i < 6; i++)
+    hexval['A'+i] = hexval['a'+i] = 10 + i;
+  hexval[' '] = hexval['\t'] = hexval['\r'] = -2;
+}
+
+
+/* Refill the input buffer and return the next octet or EOF.  */
+static int
+fill_inbuf (void)
+{
+  inpos = 0;
+  inlen = fread (inbuf, 1, sizeof inbuf, stdin);
+  if (!inlen)
+    return EOF;
+  return inbuf[inpos++];
+}
+
+/* Push back the octet C which has just been read by my_getc.  */
+static void
+my_ungetc (int c)
+{
+  if (c != EOF)
+    inpos--;
+}
 
 
+static void
+flush_outbuf (void)
+{
+  if (outlen)
+    fwrite (outbuf, outlen, 1, stdout);
+  outlen = 0;
+}
 
 
 int
@@ -62,14 +114,53 @@ main (int argc, char **argv )
     }
 
 
+  init_tables ();
+  atexit (flush_outbuf);  /* Also write the output in the error case.  */
   last_lf = 1;
   in_offset = 0;
   dump_mode = 0;
   skip_to_eol = 0;
   lnr = 1;
   off = 0;
-  while ( (c1=getchar ()) != EOF )
+  for (;;)
     {
+      if (skip_to_eol)
+        {
+          /* Fast path: Skip the rest in the buffer.  */
+          const unsigned char *p;
+
+          p = memchr (inbuf + inpos, '\n', inlen - inpos);
+          c1 = p? (p - inbuf) : inlen;
+          off += c1 - inpos;
+          inpos = c1;
+        }
+      else if (!last_lf && !in_offset)
+        {
+          /* Fast path: Convert runs of hex digits, in standard mode
+           * separated by white space.  */
+          int v1, v2;
+
+          while (inpos + 1 < inlen)
+            {
+              v1 = hexval[inbuf[inpos]];
+              if (v1 == -2 && !dump_mode)
+                {
+                  inpos++;
+                  off++;
+                  continue;
+                }
+              if (v1 < 0 || (v2 = hexval[inbuf[inpos+1]]) < 0)
+                break;
+              my_putc (v1 * 16 + v2);
+              inpos += 2;
+              off += 2;
+              if (dump_mode)
+                dump_mode = 1;
+            }
+        }
+
+      if ((c1 = my_getc ()) == EOF)
+        break;
       off++;
       if (c1 == '\n')
         {
@@ -87,14 +178,14 @@ main (int argc, char **argv )
           last_lf = 0;
           if (c1 == 'D')
             {
-              c2 = getchar ();
+              c2 = my_getc ();
               if (c2 == '[')
                 {
                   in_offset = 1;
                   dump_mode = 1;
                   continue;
                 }
-              ungetc (c2, stdin);
+              my_ungetc (c2);
             }
         }
 
@@ -123,7 +214,7 @@ main (int argc, char **argv )
       if (c1 == '\\')
         {
           /* Assume the hex digits are prefixed with \x.  */
-          c1 = getchar ();
+          c1 = my_getc ();
           off++;
           if (c1 == '\n')
             {
@@ -135,7 +226,7 @@ main (int argc, char **argv )
             {
               /* backslash followed by space - see whether this
                * can also be considered as a trailing backslash.  */
-              while ((c1 = getchar ()) != EOF && ++off && c1 != '\n')
+              while ((c1 = my_getc ()) != EOF && ++off && c1 != '\n')
                 {
                   if (!ascii_isspace (c1))
                     {
@@ -154,7 +245,7 @@ main (int argc, char **argv )
             }
           if (c1 != EOF)
             {
-              c2 = getchar ();
+              c2 = my_getc ();
               off++;
             }
           if (c1 != 'x' || c2 == EOF)
@@ -172,7 +263,7 @@ main (int argc, char **argv )
                    lnr, off);
           return 1;
         }
-      if ( (c2=getchar ()) == EOF )
+      if ( (c2=my_getc ()) == EOF )
         {
           fprintf (stderr,
                    "undump: error reading second nibble at line %lu, off %lu\n",
@@ -187,11 +278,11 @@ main (int argc, char **argv )
           if (c1 == '0' && c2 == 'x')
             {
               /* Assume the hex digits are prefixed with 0x.  */
-              c1 = getchar ();
+              c1 = my_getc ();
               off++;
               if (c1 != EOF)
                 {
-                  c2 = getchar ();
+                  c2 = my_getc ();
                   off++;
                 }
               if (c1 == EOF || c2 == EOF || !hexdigitp (c1) || !hexdigitp (c2))
@@ -209,14 +300,15 @@ main (int argc, char **argv )
             }
         }
       value = xtoi_1 (c1) * 16 + xtoi_1 (c2);
-      putchar (value);
+      my_putc (value);
     }
+  flush_outbuf ();
   if (ferror (stdin))
     {
       fprintf (stderr, "undump: read error at line %lu, off %lu\n", lnr, off);
       return 1;
     }
-  if (ferror (stdout))
+  if (fflush (stdout) || ferror (stdout))
     {
       fprintf (stderr, "undump: write error at input line %lu, off %lu\n",
                lnr, off);
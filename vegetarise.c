@@ -45,8 +45,49 @@
  *
  *     vegetarise -L veg-files.list spam-files.list oldwords >words
  *
+ *  Learning uses one thread per CPU if threads are supported; the mbox
+ *  files are split into equal parts and the files from the lists are
+ *  distributed to the threads.  VEGETARISE_THREADS=1 disables this.
+ *
  *  It can either be run standalone (usually slow) or in auto server
- *  mode (using option -s).
+ *  mode (using option -s).  The server checks messages with one thread
+ *  per CPU; set VEGETARISE_THREADS to use another number of threads.
+ *  If more than one message or the -T option is given in server mode,
+ *  all messages are sent over one connection:
+ *
+ *     vegetarise -s -T words message-file-list
+ *
+ *  A running server may learn single messages using
+ *
+ *     vegetarise -s -S words spam-message
+ *     vegetarise -s -V words vegetarian-message
+ *
+ *  Only the words of these messages get their probabilities updated.
+ *  Every 5 minutes and on SIGTERM the server writes the updated word
+ *  table back to its wordlist.
+ *
+ *  The spam level is computed from the 15 most interesting words of a
+ *  message; set VEGETARISE_WORDS to use up to 100 words instead.
+ *
+ *  To measure the speed of the checks, use
+ *
+ *     vegetarise --bench words some.mbox
+ *
+ *  which checks all messages of the mbox files and prints the number
+ *  of messages and tokens per second and the latency of the checks.
+ *  A running server prints its request counters, the size of the word
+ *  table and the number of probes needed to find a word with
+ *
+ *     vegetarise -s --stats words
+ *
+ *  Large word lists load much faster when they are converted to the
+ *  binary format which is directly mapped into memory:
+ *
+ *     vegetarise -cb words >words.bin
+ *
+ *  All commands taking a wordlist detect the binary format; "-c" without
+ *  "-b" converts it back to text.  The binary format uses the native
+ *  byte order and is thus not portable between architectures.
  **/
 
 
@@ -59,19 +100,26 @@
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
-#ifdef HAVE_PTH /* In theory we could use sockets without Pth but it
-                   does not make much sense to we require it. */
-#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD /* In theory we could use sockets without threads
+                       but it does not make much sense so we require
+                       them. */
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <pth.h>
-#endif /*HAVE_PTH*/
+#include <pthread.h>
+#endif /*HAVE_PTHREAD*/
 
 #define PGMNAME "vegetarise"
 
 #define MAX_WORDLENGTH 50 /* max. length of a word */
-#define MAX_WORDS 15      /* max. number of words to look at. */
+#define MAX_WORDS 15      /* default number of words to look at. */
+#define MAX_WORDS_LIMIT 100 /* VEGETARISE_WORDS may not exceed this. */
+#define READ_BUFFER_SIZE 65536 /* size of the tokenizer's input blocks. */
 
 
 /* A list of token characters.  There is explicit code for 8bit
@@ -98,20 +146,31 @@
 
 
 
-#ifdef HAVE_PTH
-# define my_read(a,b,c) pth_read ((a),(b),(c))
-# define my_write(a,b,c) pth_write ((a),(b),(c))
-# define YIELD  do { if (running_as_server) pth_yield (NULL); } while (0)
-#else
-# define my_read(a,b,c) read ((a),(b),(c))
-# define my_write(a,b,c) write ((a),(b),(c))
-# define YIELD  do { ; } while (0)
-#endif
-
 #define xtoi_1(a)   ((a) <= '9'? ((a)- '0'): \
                      (a) <= 'F'? ((a)-'A'+10):((a)-'a'+10))
 #define xtoi_2(a,b) ((xtoi_1(a) * 16) + xtoi_1(b))
 
+/* Classes of characters as used by the tokenizer.  Note that EOF maps
+   to 255 and thus is a token character like all 8 bit characters.  */
+#define CC_TOKEN  1
+#define CC_ALNUM  2
+#define CC_XDIGIT 4
+#define char_class_p(c,cls) (char_class[(unsigned char)(c)] & (cls))
+#define is_token_char(c) char_class_p ((c), CC_TOKEN)
+
+
+/* The input source of the tokenizer.  It either reads blocks from FP
+   into BUF or, if FP is NULL, walks over a memory area.  */
+struct reader_s {
+  FILE *fp;
+  const unsigned char *ptr;  /* Next byte to deliver.  */
+  const unsigned char *end;  /* End of the valid bytes.  */
+  unsigned char buf[READ_BUFFER_SIZE];
+};
+typedef struct reader_s READER;
+
+#define read_byte(rd) ((rd)->ptr < (rd)->end? *(rd)->ptr++ : fill_reader (rd))
+
 
 struct pushback_s {
   int buflen;
@@ -121,12 +180,14 @@ struct pushback_s {
   int base64_nl;
   int base64_val;
   int qp1;
+  int outlen;         /* Number of decoded bytes in OUT ... */
+  int outpos;         /* ... and the next one to deliver.  */
+  unsigned char out[3];
 };
 typedef struct pushback_s PUSHBACK;
 
 
 struct hash_entry_s {
-  struct hash_entry_s *next;
   unsigned int veg_count; 
   unsigned int spam_count; 
   unsigned int hit_ref; /* reference to the hit table. */
@@ -135,36 +196,135 @@ struct hash_entry_s {
 };
 typedef struct hash_entry_s *HASH_ENTRY;
 
+/* A slot of the word table.  We keep the full hash value in the slot
+   so that probing and resizing don't need to touch the entries. */
+struct hash_slot_s {
+  unsigned int hash;
+  HASH_ENTRY entry;  /* NULL for an empty slot. */
+};
+typedef struct hash_slot_s HASH_SLOT;
+
+/* The entries of the word table are allocated from large slabs; this
+   saves the malloc overhead of several million small allocations and
+   allows to release the entire table at once. */
+#define WORD_SLAB_SIZE (256*1024)
+struct word_slab_s {
+  struct word_slab_s *next;
+  size_t size;  /* Allocated size of MEM. */
+  size_t used;  /* Number of bytes used in MEM. */
+  union {
+    void *p;
+    unsigned int u;
+    char c[1];
+  } mem;
+};
+typedef struct word_slab_s *WORD_SLAB;
+
+/* The header of a binary wordlist.  It is followed by TABLE_SIZE
+   slots of struct bin_slot_s and the entries, each being laid out as
+   a struct hash_entry_s padded to a multiple of BIN_ENTRY_ALIGN.  */
+#define BIN_MAGIC "VEGWORDS"
+#define BIN_VERSION 1
+#define BIN_ENTRY_ALIGN (sizeof (unsigned int))
+struct bin_header_s {
+  char magic[8];
+  unsigned int version;
+  unsigned int byteorder;  /* 0x01020304 in the native order.  */
+  unsigned int ngood;
+  unsigned int nbad;
+  unsigned int nwords;
+  unsigned int table_size; /* Number of slots; a power of 2.  */
+};
+
+struct bin_slot_s {
+  unsigned int hash;
+  unsigned int offset;  /* Offset of the entry or 0 for an empty slot.  */
+};
+
+/* A table with words.  This is an open addressing hash table using
+   linear probing.  Its size is always a power of 2 and it is enlarged
+   as soon as more than 3/4 of the slots are used. */
+#define MIN_HASH_TABLE_SIZE 4096
+struct word_table_s {
+  size_t size;     /* Number of slots.  */
+  size_t used;     /* Number of used slots.  */
+  HASH_SLOT *slots;
+  WORD_SLAB slabs; /* The slabs holding the entries.  */
+  /* When storing a new word, we assign a hit reference id to it, so
+     that we can index a hit table.  This keeps tracks of the used
+     reference numbers. */
+  unsigned int next_hit_ref;
+};
+typedef struct word_table_s *WORD_TABLE;
+
+/* The words selected for the computation of the spam level.  */
+struct selected_word_s {
+  const char *word;
+  unsigned int d;
+  double prob;
+};
+
+/* The state of checking one message.  SEEN is indexed by the hit
+   reference of the words and tells the generation in which a word
+   has last been seen; thus starting a new message only requires to
+   bump GENERATION.  SEL is a min-heap on the distance of the NSEL
+   most interesting words seen so far.  Words not in the table are
+   not stored but collected in UNKNOWN.  Thus the word table is not
+   modified while checking and may be shared by several threads, each
+   using its own hit array.  */
 struct hit_array_s {
-  size_t size; /* Allocated size. */
-  unsigned int *hits;  
+  size_t size; /* Allocated size of SEEN. */
+  unsigned int *seen;
+  unsigned int generation;
+  int nsel;
+  struct selected_word_s *sel;
+  int nunknown;
+  char (*unknown)[MAX_WORDLENGTH+1];
+  unsigned long ntokens; /* Total number of words looked up.  */
 };
 typedef struct hit_array_s *HIT_ARRAY;
 
 
 /* Option flags. */
 static int verbose;
+static int max_words = MAX_WORDS;
 static int name_only;
 
-/* Flag to indicate that we are running as a server. */
-static int running_as_server;
-
-/* Keep track of memory used for debugging. */
+/* Keep track of memory used for debugging.  Use the macros to update
+   it because several threads may allocate memory while learning. */
 static size_t total_memory_used;
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+# define add_memory_used(n) __sync_add_and_fetch (&total_memory_used, (n))
+# define sub_memory_used(n) __sync_sub_and_fetch (&total_memory_used, (n))
+#else
+# define add_memory_used(n) (total_memory_used += (n))
+# define sub_memory_used(n) (total_memory_used -= (n))
+#endif
 
 
-/* The global table with the words and its size. */ 
-static int hash_table_size; 
-static HASH_ENTRY *word_table;
+/* The global table with the words.  */
+static struct word_table_s word_table;
 
-/* When storing a new word, we assign a hit reference id to it, so
-   that we can index a hit table.  The variable keeps tracks of the
-   used reference numbers. */
-static unsigned int next_hit_ref;
+/* A binary wordlist mapped into memory.  Its entries are looked up
+   before those in WORD_TABLE.  The mapping is private, thus the
+   server may update the counts of its entries without changing the
+   file.  */
+static const char *mapped_table;
+static size_t mapped_len;
+static const struct bin_slot_s *mapped_slots;
+static unsigned int mapped_table_size;
+static size_t mapped_entries_off;
 
 /* Number of good and bad messages the word table is made up. */
 static unsigned int srvr_veg_count, srvr_spam_count;
 
+/* The wordlist of the server and a flag telling that it has learned
+   new messages since the last snapshot.  */
+#ifdef HAVE_PTHREAD
+static const char *srvr_wordlist;
+static int srvr_table_dirty;
+#endif /*HAVE_PTHREAD*/
+
 
 
 /* Base64 conversion tables. */
@@ -173,6 +333,9 @@ static unsigned char bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 			          "0123456789+/";
 static unsigned char asctobin[256]; /* runtime initialized */
 
+/* The CC_ flags for each character.  */
+static unsigned char char_class[256]; /* runtime initialized */
+
 
 
 /* Prototypes. */
@@ -228,7 +391,7 @@ xmalloc (size_t n)
   void *p = malloc (n);
   if (!p)
     die ("out of core\n");
-  total_memory_used += n;
+  add_memory_used (n);
   return p;
 }
 
@@ -238,25 +401,54 @@ xcalloc (size_t n, size_t k)
   void *p = calloc (n, k);
   if (!p)
     die ("out of core\n");
-  total_memory_used += n * k;
+  add_memory_used (n * k);
   return p;
 }
 
 
+/* Return a hash value for the string S.  This is FNV-1a which
+   distributes well enough to use the low bits as the table index. */
 static inline unsigned int
 hash_string (const char *s)
 {
-  unsigned int h = 0;
-  unsigned int g;
+  unsigned int h = 2166136261U;
   
   while (*s)
     {
-      h = (h << 4) + *s++;
-      if ((g = (h & (unsigned int) 0xf0000000)))
-        h = (h ^ (g >> 24)) ^ g;
+      h ^= *(const unsigned char *)s++;
+      h *= 16777619U;
     }
 
-  return (h % hash_table_size);
+  return h;
+}
+
+
+/* Prepare RD to read from FP or, if FP is NULL, from the LEN bytes at
+   DATA.  */
+static void
+init_reader (READER *rd, FILE *fp, const void *data, size_t len)
+{
+  rd->fp = fp;
+  rd->ptr = fp? rd->buf : data;
+  rd->end = rd->ptr + (fp? 0 : len);
+}
+
+
+/* Refill the buffer of RD and return the next byte or EOF.  This is
+   the slow path of read_byte.  */
+static int
+fill_reader (READER *rd)
+{
+  size_t n;
+
+  if (!rd->fp)
+    return EOF;
+  n = fread (rd->buf, 1, sizeof rd->buf, rd->fp);
+  if (!n)
+    return EOF;
+  rd->ptr = rd->buf;
+  rd->end = rd->buf + n;
+  return *rd->ptr++;
 }
 
 
@@ -271,7 +463,7 @@ pushback (PUSHBACK *pb, int c)
 
 
 static inline int 
-basic_next_char (FILE *fp, PUSHBACK *pb)
+basic_next_char (READER *rd, PUSHBACK *pb)
 {
   int c;
 
@@ -283,7 +475,7 @@ basic_next_char (FILE *fp, PUSHBACK *pb)
     }
   else
     {
-      c = getc (fp);
+      c = read_byte (rd);
       if (c == EOF)
         return c;
     }
@@ -292,12 +484,12 @@ basic_next_char (FILE *fp, PUSHBACK *pb)
      "<!--" ... "-->" */
   while (c == '<')
     {
-      if ((c=getc (fp)) == EOF)
+      if ((c=read_byte (rd)) == EOF)
           return c; 
       pushback (pb, c);
       if ( c != '!' )
         return '<';
-      if ((c=getc (fp)) == EOF)
+      if ((c=read_byte (rd)) == EOF)
         {
           pb->buflen = 0;;
           return EOF; /* This misses the last chars but who cares. */
@@ -305,7 +497,7 @@ basic_next_char (FILE *fp, PUSHBACK *pb)
       pushback (pb, c);
       if ( c != '-' )
         return '<';
-      if ((c=getc (fp)) == EOF)
+      if ((c=read_byte (rd)) == EOF)
         {
           pb->buflen = 0;
           return EOF; /* This misses the last chars but who cares. */
@@ -317,34 +509,61 @@ basic_next_char (FILE *fp, PUSHBACK *pb)
       /* found html comment - skip to end */
       do
         {
-          while ( (c = getc (fp)) != '-')
+          while ( (c = read_byte (rd)) != '-')
             {
               if (c == EOF)
                 return EOF;
             }
-          if ( (c=getc (fp)) == EOF)
+          if ( (c=read_byte (rd)) == EOF)
             return EOF;
         }
       while ( c != '-' ); 
       
-      while ( (c = getc (fp)) != '>')
+      while ( (c = read_byte (rd)) != '>')
         {
           if (c == EOF)
             return EOF;
         }
-      c = getc (fp);
+      c = read_byte (rd);
     }
   return c;
 }
 
 
 static inline int 
-next_char (FILE *fp, PUSHBACK *pb)
+next_char (READER *rd, PUSHBACK *pb)
 {
   int c, c2;
 
+  if (pb->outpos < pb->outlen)
+    return pb->out[pb->outpos++];
+
+  /* Decode whole base64 quadruples straight from the input buffer as
+     long as they consist only of valid characters; everything else
+     is left to the state machine below.  */
+  if (pb->state == 3 && !pb->buflen && rd->end - rd->ptr >= 4)
+    {
+      const unsigned char *s = rd->ptr;
+      int a = asctobin[s[0]];
+      int b = asctobin[s[1]];
+      int d = asctobin[s[2]];
+      int e = asctobin[s[3]];
+
+      if ((a | b | d | e) < 64)
+        {
+          rd->ptr += 4;
+          pb->base64_nl = 0;
+          pb->out[0] = (a << 2) | (b >> 4);
+          pb->out[1] = ((b << 4) & 0xf0) | (d >> 2);
+          pb->out[2] = ((d << 6) & 0xc0) | e;
+          pb->outlen = 3;
+          pb->outpos = 1;
+          return pb->out[0];
+        }
+    }
+
  next:
-  if ((c=basic_next_char (fp, pb)) == EOF)
+  if ((c=basic_next_char (rd, pb)) == EOF)
     return c;
   switch (pb->state)
     {
@@ -357,7 +576,7 @@ next_char (FILE *fp, PUSHBACK *pb)
         }
       break;
     case 2:
-      if (!strchr (bintoasc, c))
+      if (asctobin[c] == 255)
         break;
       pb->nl_seen = 0;
       pb->base64_nl = 0;
@@ -434,7 +653,7 @@ next_char (FILE *fp, PUSHBACK *pb)
         }
       break;
     case 103:
-      if ( isxdigit (c) )
+      if ( char_class_p (c, CC_XDIGIT) )
         {
           pb->qp1 = c;
           pb->state = 104;
@@ -443,7 +662,7 @@ next_char (FILE *fp, PUSHBACK *pb)
       pb->state = 102;
       break;
     case 104:
-      if ( isxdigit (c) )
+      if ( char_class_p (c, CC_XDIGIT) )
         c = xtoi_2 (pb->qp1, c);
       pb->state = 102;
       break;
@@ -469,20 +688,23 @@ next_char (FILE *fp, PUSHBACK *pb)
   return c;
 }
 
+/* Enlarge the hit array HA so that it has a slot for HIT_REF.  */
 static void
-enlarge_hit_array (HIT_ARRAY ha)
+enlarge_hit_array (HIT_ARRAY ha, unsigned int hit_ref)
 {
   unsigned int *arr;
   size_t i, n;
 
   n = ha->size + 100;
+  if (n <= hit_ref)
+    n = word_table.next_hit_ref + 1000;
   arr = xmalloc (n * sizeof *arr);
   for (i=0; i < ha->size; i++)
-    arr[i] = ha->hits[i];
+    arr[i] = ha->seen[i];
   for (; i < n; i++)
     arr[i] = 0;
-  free (ha->hits);
-  ha->hits = arr;
+  free (ha->seen);
+  ha->seen = arr;
   ha->size = n;
 }
 
@@ -491,8 +713,14 @@ new_hit_array (void)
 {
   HIT_ARRAY ha = xmalloc (sizeof *ha);
   /* Create the array with space for extra 1000 words */
-  ha->size = next_hit_ref + 1000;
-  ha->hits = xcalloc (ha->size, sizeof *ha->hits);
+  ha->size = word_table.next_hit_ref + 1000;
+  ha->seen = xcalloc (ha->size, sizeof *ha->seen);
+  ha->generation = 1;
+  ha->nsel = 0;
+  ha->sel = xmalloc (max_words * sizeof *ha->sel);
+  ha->nunknown = 0;
+  ha->unknown = xmalloc (max_words * sizeof *ha->unknown);
+  ha->ntokens = 0;
   return ha;
 }
 
@@ -501,7 +729,9 @@ release_hit_array (HIT_ARRAY ha)
 {
   if (ha)
     {
-      free (ha->hits);
+      free (ha->seen);
+      free (ha->sel);
+      free (ha->unknown);
       free (ha);
     }
 }
@@ -511,39 +741,251 @@ release_hit_array (HIT_ARRAY ha)
    real processing stuff
 */
 
+/* Resize the table TBL so that it has at least NSLOTS slots.  NSLOTS
+   is rounded up to the next power of 2. */
+static void
+resize_word_table (WORD_TABLE tbl, size_t nslots)
+{
+  HASH_SLOT *old_slots = tbl->slots;
+  size_t old_size = tbl->size;
+  size_t n, idx, mask;
+
+  for (n = MIN_HASH_TABLE_SIZE; n < nslots; n <<= 1)
+    ;
+  if (n <= tbl->size)
+    return;
+
+  tbl->slots = xcalloc (n, sizeof *tbl->slots);
+  tbl->size = n;
+  mask = n - 1;
+  for (n=0; n < old_size; n++)
+    {
+      if (!old_slots[n].entry)
+        continue;
+      for (idx = old_slots[n].hash & mask; tbl->slots[idx].entry;
+           idx = (idx + 1) & mask)
+        ;
+      tbl->slots[idx] = old_slots[n];
+    }
+  if (old_slots)
+    {
+      free (old_slots);
+      sub_memory_used (old_size * sizeof *old_slots);
+    }
+}
+
+
+/* Allocate N bytes for an entry of the table TBL.  */
+static void *
+alloc_word_mem (WORD_TABLE tbl, size_t n)
+{
+  WORD_SLAB slab = tbl->slabs;
+  void *p;
+
+  n = (n + sizeof slab->mem - 1) / sizeof slab->mem * sizeof slab->mem;
+  if (!slab || slab->used + n > slab->size)
+    {
+      size_t size = n > WORD_SLAB_SIZE? n : WORD_SLAB_SIZE;
+
+      slab = xmalloc (offsetof (struct word_slab_s, mem) + size);
+      slab->size = size;
+      slab->used = 0;
+      slab->next = tbl->slabs;
+      tbl->slabs = slab;
+    }
+  p = slab->mem.c + slab->used;
+  slab->used += n;
+  return p;
+}
+
+
+/* Release the table TBL and all its entries.  */
+static void
+release_word_table (WORD_TABLE tbl)
+{
+  WORD_SLAB slab, tmp;
+
+  for (slab = tbl->slabs; slab; slab = tmp)
+    {
+      tmp = slab->next;
+      sub_memory_used (offsetof (struct word_slab_s, mem) + slab->size);
+      free (slab);
+    }
+  if (tbl->slots)
+    {
+      free (tbl->slots);
+      sub_memory_used (tbl->size * sizeof *tbl->slots);
+    }
+  memset (tbl, 0, sizeof *tbl);
+}
+
+
+/* Make sure that the table TBL is large enough to hold NWORDS words
+   without another resize.  */
+static void
+reserve_word_table (WORD_TABLE tbl, size_t nwords)
+{
+  resize_word_table (tbl, nwords + nwords/3 + 1);
+}
+
+
+/* Return the number of bytes an entry for a word of length LEN
+   takes in a binary wordlist.  */
+static inline size_t
+bin_entry_size (size_t len)
+{
+  size_t n = offsetof (struct hash_entry_s, word) + len + 1;
+
+  return (n + BIN_ENTRY_ALIGN - 1) / BIN_ENTRY_ALIGN * BIN_ENTRY_ALIGN;
+}
+
+
+/* Return the entry for WORD or NULL if WORD is not known.  */
 static HASH_ENTRY
-store_word (const char *word, int *is_new)
+find_word (const char *word)
 {
   unsigned int hash = hash_string (word);
   HASH_ENTRY entry;
+  size_t idx, mask;
 
-  if (is_new)
-    *is_new = 0;
-  for (entry = word_table[hash];
-       entry && strcmp (entry->word, word); entry = entry->next)
-    ;
-  if (!entry)
+  if (mapped_table)
     {
-      size_t n = sizeof *entry + strlen (word);
-      entry = xmalloc (n);
+      mask = mapped_table_size - 1;
+      for (idx = hash & mask; mapped_slots[idx].offset;
+           idx = (idx + 1) & mask)
+        if (mapped_slots[idx].hash == hash)
+          {
+            entry = (HASH_ENTRY)(mapped_table + mapped_slots[idx].offset);
+            if (!strcmp (entry->word, word))
+              return entry;
+          }
+    }
+
+  if (!word_table.size)
+    return NULL;
+  mask = word_table.size - 1;
+  for (idx = hash & mask; (entry = word_table.slots[idx].entry);
+       idx = (idx + 1) & mask)
+    if (word_table.slots[idx].hash == hash && !strcmp (entry->word, word))
+      return entry;
+  return NULL;
+}
+
+
+/* Enumerate all entries of the mapped table and the word table.
+   *ITER must be initialized to 0; NULL is returned after the last
+   entry.  */
+static HASH_ENTRY
+enum_words (size_t *iter)
+{
+  HASH_ENTRY entry;
+  size_t n;
 
-      strcpy (entry->word, word);
-      entry->veg_count = 0;
-      entry->spam_count = 0;
-      entry->hit_ref = next_hit_ref++;
-      entry->prob = 0;
-      entry->next = word_table[hash];
-      word_table[hash] = entry;
-      if (is_new)
-        *is_new = 1;
+  if (*iter < mapped_len)
+    {
+      if (*iter < mapped_entries_off)
+        *iter = mapped_entries_off;
+      if (*iter < mapped_len)
+        {
+          entry = (HASH_ENTRY)(mapped_table + *iter);
+          *iter += bin_entry_size (strlen (entry->word));
+          return entry;
+        }
     }
+  for (n = *iter - mapped_len; n < word_table.size; n++)
+    if (word_table.slots[n].entry)
+      {
+        *iter = mapped_len + n + 1;
+        return word_table.slots[n].entry;
+      }
+  *iter = mapped_len + word_table.size;
+  return NULL;
+}
+
+
+/* Insert WORD into the table TBL and return its entry.  If the word
+   is already in the table, return the existing entry.  */
+static HASH_ENTRY
+store_word (WORD_TABLE tbl, const char *word, int *is_new)
+{
+  unsigned int hash = hash_string (word);
+  HASH_ENTRY entry;
+  size_t idx, mask;
+
+  if (is_new)
+    *is_new = 0;
+  if (tbl->used >= tbl->size / 4 * 3)
+    resize_word_table (tbl, tbl->size * 2);
+
+  mask = tbl->size - 1;
+  for (idx = hash & mask; (entry = tbl->slots[idx].entry);
+       idx = (idx + 1) & mask)
+    if (tbl->slots[idx].hash == hash && !strcmp (entry->word, word))
+      return entry;
+
+  entry = alloc_word_mem (tbl, sizeof *entry + strlen (word));
+  strcpy (entry->word, word);
+  entry->veg_count = 0;
+  entry->spam_count = 0;
+  entry->hit_ref = tbl->next_hit_ref++;
+  entry->prob = 0;
+  tbl->slots[idx].hash = hash;
+  tbl->slots[idx].entry = entry;
+  tbl->used++;
+  if (is_new)
+    *is_new = 1;
   return entry;
 }
 
 
+/* Add WORD with probability PROB to the selected words of HA if it is
+   more interesting than the least interesting of them.  */
+static void
+select_word (HIT_ARRAY ha, const char *word, int prob)
+{
+  struct selected_word_s *sel = ha->sel;
+  struct selected_word_s tmp;
+  unsigned int dist;
+  int i, j;
+
+  if (!prob)
+    dist = 10; /* 50 - 40 */
+  else
+    dist = prob < 50? (50 - prob):(prob - 50);
+
+  if (ha->nsel < max_words)
+    {
+      /* Append and sift up.  */
+      for (i = ha->nsel++; i && sel[(i-1)/2].d > dist; i = (i-1)/2)
+        sel[i] = sel[(i-1)/2];
+    }
+  else if (dist > sel[0].d)
+    {
+      /* Replace the least interesting word and sift down.  */
+      for (i=0; (j = 2*i+1) < ha->nsel; i = j)
+        {
+          if (j+1 < ha->nsel && sel[j+1].d < sel[j].d)
+            j++;
+          if (sel[j].d >= dist)
+            break;
+          sel[i] = sel[j];
+        }
+    }
+  else
+    return;
+
+  tmp.word = word;
+  tmp.d = dist;
+  tmp.prob = prob? (double)prob/100 : 0.4;
+  sel[i] = tmp;
+}
+
+
+/* Process WORD.  In checking mode HA is used to select the words,
+   otherwise the counts of the word in the table TBL are updated.  */
 static void
 check_one_word ( const char *word, int left_anchored, int is_spam,
-                 HIT_ARRAY ha)
+                 HIT_ARRAY ha, WORD_TABLE tbl)
 {
   size_t wordlen = strlen (word);
   const char *p;
@@ -593,26 +1035,46 @@ check_one_word ( const char *word, int left_anchored, int is_spam,
 
   if (ha)
     { /* we are in checking mode */
-      int is_new;
-      HASH_ENTRY e = store_word (word, &is_new);
+      HASH_ENTRY e = find_word (word);
+
+      ha->ntokens++;
+      if (!e)
+        {
+          int i;
+
+          for (i=0; i < ha->nunknown; i++)
+            if (!strcmp (ha->unknown[i], word))
+              return;
+          if (ha->nunknown < max_words)
+            {
+              strcpy (ha->unknown[ha->nunknown], word);
+              select_word (ha, ha->unknown[ha->nunknown++], 0);
+            }
+          return;
+        }
       if (ha->size <= e->hit_ref)
         {
-          assert (e->hit_ref < next_hit_ref);
-          enlarge_hit_array (ha);
+          assert (e->hit_ref < word_table.next_hit_ref);
+          enlarge_hit_array (ha, e->hit_ref);
+        }
+      if (ha->seen[e->hit_ref] != ha->generation)
+        {
+          ha->seen[e->hit_ref] = ha->generation;
+          select_word (ha, e->word, e->prob);
         }
-      ha->hits[e->hit_ref]++;
     }
   else if (is_spam)
-    store_word (word, NULL)->spam_count++;
+    store_word (tbl, word, NULL)->spam_count++;
   else
-    store_word (word, NULL)->veg_count++;
+    store_word (tbl, word, NULL)->veg_count++;
 }
 
-/* Parse a message and return the number of messages in case it is an
-   mbox message as indicated by IS_MBOX passed as true. */
+/* Parse a message read from RD and return the number of messages in
+   case it is an mbox message as indicated by IS_MBOX passed as true.
+   The words are recorded in HA if given or learned into TBL. */
 static unsigned int
-parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
-               HIT_ARRAY ha)
+parse_reader (const char *fname, READER *rd, int is_spam, int is_mbox,
+              HIT_ARRAY ha, WORD_TABLE tbl)
 {
   int c;
   char aword[MAX_WORDLENGTH+1];
@@ -622,20 +1084,14 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
   int maybe_base64 = 0;
   PUSHBACK pbbuf;
   unsigned int msgcount = 0;
-  int count = 0;
 
   memset (&pbbuf, 0, sizeof pbbuf);
-  while ( (c=next_char (fp, &pbbuf)) != EOF)
+  while ( (c=next_char (rd, &pbbuf)) != EOF)
     {
-      if ( ++count > 20000 )
-        {
-          count = 0;
-          YIELD;
-        }
     again:
       if (in_token)
         {
-          if ((c & 0x80) || strchr (TOKENCHARS, c))
+          if (is_token_char (c))
             {
               if (idx < MAX_WORDLENGTH)
                 aword[idx++] = c;
@@ -677,7 +1133,7 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
 
                   do
                     {
-                      while ( (c = next_char (fp, &pbbuf)) != '\n')
+                      while ( (c = next_char (rd, &pbbuf)) != '\n')
                         {
                           if (c == EOF)
                             goto leave;
@@ -697,19 +1153,19 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
                     }
                   maybe_base64 = 1;
                 }
-              else if (c == '.' && idx && !(aword[idx-1] & 0x80)
-                       && isalnum (aword[idx-1]) )
+              else if (c == '.' && idx
+                       && char_class_p (aword[idx-1], CC_ALNUM))
                 {
                   /* Assume an IP address or a hostname if a dot is
                      followed by a letter or digit. */
-                  c = next_char (fp, &pbbuf);
-                  if ( !(c & 0x80) && isalnum (c) && idx < MAX_WORDLENGTH)
+                  c = next_char (rd, &pbbuf);
+                  if (char_class_p (c, CC_ALNUM) && idx < MAX_WORDLENGTH)
                     {
                       aword[idx++] = '.';
                       in_token = 1;
                     }
                   else
-                    check_one_word (aword, left_anchored, is_spam, ha);
+                    check_one_word (aword, left_anchored, is_spam, ha, tbl);
                   pbbuf.nl_seen = (c == '\n');
                   goto again;
                 }
@@ -718,23 +1174,23 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
                 {
                   /* Assume an QP encoded character if followed by an
                      hexdigit */
-                  c = next_char (fp, &pbbuf);
+                  c = next_char (rd, &pbbuf);
                   if ( !(c & 0x80) && (isxdigit (c)) && idx < MAX_WORDLENGTH)
                     {
                       aword[idx++] = '=';
                       in_token = 1;
                     }
                   else
-                    check_one_word (aword, left_anchored, is_spam, ha);
+                    check_one_word (aword, left_anchored, is_spam, ha, tbl);
                   pbbuf.nl_seen = (c == '\n');
                   goto again;
                 }
 #endif
               else
-                check_one_word (aword, left_anchored, is_spam, ha);
+                check_one_word (aword, left_anchored, is_spam, ha, tbl);
             }
         }
-      else if ( (c & 0x80) || strchr (TOKENCHARS, c))
+      else if (is_token_char (c))
         {
           in_token = 1;
           idx = 0;
@@ -744,7 +1200,7 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
       pbbuf.nl_seen = (c == '\n');
     }
  leave:
-  if (ferror (fp))
+  if (rd->fp && ferror (rd->fp))
       die ("error reading `%s': %s\n", fname, strerror (errno));
 
   msgcount++;
@@ -752,6 +1208,31 @@ parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
 }
 
 
+/* Same as parse_reader but read the message from FP.  */
+static unsigned int
+parse_message (const char *fname, FILE *fp, int is_spam, int is_mbox,
+               HIT_ARRAY ha, WORD_TABLE tbl)
+{
+  READER rd;
+
+  init_reader (&rd, fp, NULL, 0);
+  return parse_reader (fname, &rd, is_spam, is_mbox, ha, tbl);
+}
+
+
+/* Same as parse_reader but take the message from the LEN bytes at
+   DATA.  */
+static unsigned int
+parse_buffer (const char *fname, const void *data, size_t len, int is_spam,
+              int is_mbox, HIT_ARRAY ha, WORD_TABLE tbl)
+{
+  READER rd;
+
+  init_reader (&rd, NULL, data, len);
+  return parse_reader (fname, &rd, is_spam, is_mbox, ha, tbl);
+}
+
+
 static unsigned int
 calc_prob (unsigned int g, unsigned int b,
            unsigned int ngood, unsigned int nbad)
@@ -783,7 +1264,7 @@ calc_prob (unsigned int g, unsigned int b,
 static void
 calc_probability (unsigned int ngood, unsigned int nbad)
 {
-  int n;
+  size_t n;
   HASH_ENTRY entry;
   unsigned int g, b; 
 
@@ -792,15 +1273,14 @@ calc_probability (unsigned int ngood, unsigned int nbad)
   if (!nbad)
     die ("no spam mails available - stop\n");
 
-  for (n=0; n < hash_table_size; n++)
+  for (n=0; n < word_table.size; n++)
     {
-      for (entry = word_table[n]; entry; entry = entry->next)
-        {
-          g = entry->veg_count * 2;
-          b = entry->spam_count;
-          if (g + b >= 5)
-            entry->prob = calc_prob (g, b, ngood, nbad);
-        }
+      if (!(entry = word_table.slots[n].entry))
+        continue;
+      g = entry->veg_count * 2;
+      b = entry->spam_count;
+      if (g + b >= 5)
+        entry->prob = calc_prob (g, b, ngood, nbad);
     }
 }
 
@@ -808,74 +1288,13 @@ calc_probability (unsigned int ngood, unsigned int nbad)
 static unsigned int
 check_spam (unsigned int ngood, unsigned int nbad, HIT_ARRAY ha)
 {
-  unsigned int n;
-  HASH_ENTRY entry;
-  unsigned int dist, min_dist;
-  struct {
-    HASH_ENTRY e;
-    unsigned int d;
-    double prob;
-  } st[MAX_WORDS];
-  int nst = 0;
+  struct selected_word_s *st = ha->sel;
+  int nst = ha->nsel;
   int i;
   double prod, inv_prod, taste;
 
-  for (i=0; i < MAX_WORDS; i++)
-    {
-      st[i].e = NULL;
-      st[i].d = 0;
-    }
-
-  min_dist = 100;
-  for (n=0; n < hash_table_size; n++)
-    {
-      for (entry = word_table[n]; entry; entry = entry->next)
-        {
-          if (entry->hit_ref && ha->hits[entry->hit_ref])
-            {
-              if (!entry->prob)
-                dist = 10; /* 50 - 40 */
-              else
-                dist = entry->prob < 50? (50 - entry->prob):(entry->prob - 50);
-              if (nst < MAX_WORDS)
-                {
-                  st[nst].e = entry;
-                  st[nst].d = dist;
-                  st[nst].prob = entry->prob? (double)entry->prob/100 : 0.4;
-                  if (dist < min_dist)
-                    min_dist = dist;
-                  nst++;
-                }
-              else if (dist > min_dist)
-                { 
-                  unsigned int tmp = 100;
-                  int tmpidx = -1;
-                  
-                  for (i=0; i < MAX_WORDS; i++)
-                    {
-                      if (st[i].d < tmp)
-                        {
-                          tmp = st[i].d;
-                          tmpidx = i;
-                        }
-                    }
-                  assert (tmpidx != -1);
-                  st[tmpidx].e = entry;
-                  st[tmpidx].d = dist;
-                  st[tmpidx].prob = entry->prob? (double)entry->prob/100 : 0.4;
-                  
-                  min_dist = 100;
-                  for (i=0; i < MAX_WORDS; i++)
-                    {
-                      if (st[i].d < min_dist)
-                        min_dist = dist;
-                    }
-                }
-            }
-        }
-    }
-
-  /* ST has now the NST most intersting words */
+  /* The words have already been selected while parsing the message;
+     ST has the NST most intersting words */
   if (!nst)
     {
       info ("not enough words - assuming goodness\n");
@@ -886,7 +1305,7 @@ check_spam (unsigned int ngood, unsigned int nbad, HIT_ARRAY ha)
     {
       for (i=0; i < nst; i++)
         info ("prob %3.2f dist %3d for `%s'\n",
-              st[i].prob, st[i].d, st[i].e->word);
+              st[i].prob, st[i].d, st[i].word);
     }
 
   prod = 1;
@@ -908,42 +1327,247 @@ check_spam (unsigned int ngood, unsigned int nbad, HIT_ARRAY ha)
 static void
 reset_hits (HIT_ARRAY ha)
 {
-  int i;
-
-  for (i=0; i < ha->size; i++)
-    ha->hits[i] = 0;
+  if (!++ha->generation)
+    {
+      memset (ha->seen, 0, ha->size * sizeof *ha->seen);
+      ha->generation = 1;
+    }
+  ha->nsel = 0;
+  ha->nunknown = 0;
 }
 
+/* Compute the average and maximum number of extra probes needed to
+   find the words of the heap and the mapped table.  */
 static void
-write_table (unsigned int ngood, unsigned int nbad)
+probe_stats (double *r_avg, unsigned int *r_max)
 {
-  int n;
+  size_t n, mask, nwords = 0;
+  unsigned long sum = 0;
+  unsigned int d, max = 0;
+
+  mask = word_table.size - 1;
+  for (n=0; n < word_table.size; n++)
+    if (word_table.slots[n].entry)
+      {
+        d = (n - (word_table.slots[n].hash & mask)) & mask;
+        sum += d;
+        if (d > max)
+          max = d;
+        nwords++;
+      }
+  mask = mapped_table_size - 1;
+  for (n=0; n < mapped_table_size; n++)
+    if (mapped_slots[n].offset)
+      {
+        d = (n - (mapped_slots[n].hash & mask)) & mask;
+        sum += d;
+        if (d > max)
+          max = d;
+        nwords++;
+      }
+  *r_avg = nwords? (double)sum / nwords : 0.0;
+  *r_max = max;
+}
+
+
+/* Write the table to FP.  Returns 0 on success.  */
+static int
+write_table (FILE *fp, unsigned int ngood, unsigned int nbad)
+{
+  size_t iter;
+  HASH_ENTRY entry;
+
+  fprintf (fp, "#\t0\t0\t0\t%u\t%u\n", ngood, nbad);
+  for (iter=0; (entry = enum_words (&iter)); )
+    {
+      if (entry->prob)
+        fprintf (fp, "%s\t%d\t%u\t%u\n", entry->word, entry->prob,
+                 entry->veg_count, entry->spam_count);
+    }
+  return fflush (fp) || ferror (fp)? -1 : 0;
+}
+
+
+/* Write the table in the binary format to FP.  Returns 0 on
+   success.  */
+static int
+write_bin_table (FILE *fp, unsigned int ngood, unsigned int nbad)
+{
+  struct bin_header_s hdr;
+  struct bin_slot_s *slots;
+  size_t iter, idx, mask, offset, n;
+  unsigned int nwords, size, hash;
   HASH_ENTRY entry;
+  struct hash_entry_s *buf;
+
+  for (nwords=0, iter=0; (entry = enum_words (&iter)); )
+    if (entry->prob)
+      nwords++;
+  for (size = MIN_HASH_TABLE_SIZE; size < nwords + nwords/3 + 1; size <<= 1)
+    ;
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, BIN_MAGIC, sizeof hdr.magic);
+  hdr.version = BIN_VERSION;
+  hdr.byteorder = 0x01020304;
+  hdr.ngood = ngood;
+  hdr.nbad = nbad;
+  hdr.nwords = nwords;
+  hdr.table_size = size;
+
+  /* Build the index; the entries are written in the order of
+     enumeration right after the slots.  */
+  slots = xcalloc (size, sizeof *slots);
+  mask = size - 1;
+  offset = sizeof hdr + size * sizeof *slots;
+  for (iter=0; (entry = enum_words (&iter)); )
+    {
+      if (!entry->prob)
+        continue;
+      hash = hash_string (entry->word);
+      for (idx = hash & mask; slots[idx].offset; idx = (idx + 1) & mask)
+        ;
+      if (offset > (unsigned int)(-1))
+        die ("wordlist too large for the binary format\n");
+      slots[idx].hash = hash;
+      slots[idx].offset = offset;
+      offset += bin_entry_size (strlen (entry->word));
+    }
+
+  if (fwrite (&hdr, sizeof hdr, 1, fp) != 1
+      || fwrite (slots, sizeof *slots, size, fp) != size)
+    {
+      free (slots);
+      sub_memory_used (size * sizeof *slots);
+      return -1;
+    }
+  free (slots);
+  sub_memory_used (size * sizeof *slots);
 
-  printf ("#\t0\t0\t0\t%u\t%u\n", ngood, nbad);
-  for (n=0; n < hash_table_size; n++)
+  buf = xmalloc (bin_entry_size (MAX_WORDLENGTH));
+  for (nwords=0, iter=0; (entry = enum_words (&iter)); )
     {
-      for (entry = word_table[n]; entry; entry = entry->next)
-        if (entry->prob)
-          printf ("%s\t%d\t%u\t%u\n", entry->word, entry->prob,
-                  entry->veg_count, entry->spam_count);
+      if (!entry->prob)
+        continue;
+      n = bin_entry_size (strlen (entry->word));
+      memset (buf, 0, n);
+      buf->veg_count = entry->veg_count;
+      buf->spam_count = entry->spam_count;
+      buf->hit_ref = ++nwords; /* 0 is never counted as a hit.  */
+      buf->prob = entry->prob;
+      strcpy (buf->word, entry->word);
+      if (fwrite (buf, n, 1, fp) != 1)
+        break;
     }
+  free (buf);
+  sub_memory_used (bin_entry_size (MAX_WORDLENGTH));
+  return fflush (fp) || ferror (fp)? -1 : 0;
+}
+
+
+/* Map the binary wordlist from file descriptor FD into memory.  */
+static void
+map_table (const char *fname, int fd, unsigned int *ngood, unsigned int *nbad,
+           unsigned int *nwords)
+{
+  struct stat st;
+  const struct bin_header_s *hdr;
+  void *p;
+
+  if (fstat (fd, &st))
+    die ("can't stat wordlist `%s': %s\n", fname, strerror (errno));
+  if (st.st_size < sizeof *hdr)
+    die ("binary wordlist `%s' is too short\n", fname);
+  p = mmap (NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    die ("can't map wordlist `%s': %s\n", fname, strerror (errno));
+  hdr = p;
+  if (hdr->version != BIN_VERSION || hdr->byteorder != 0x01020304)
+    die ("binary wordlist `%s' has an unsupported version"
+         " or byte order\n", fname);
+  if (!hdr->table_size || (hdr->table_size & (hdr->table_size - 1))
+      || (sizeof *hdr + (size_t)hdr->table_size * sizeof *mapped_slots
+          > st.st_size)
+      || ((const char*)p)[st.st_size - 1])
+    die ("binary wordlist `%s' is corrupted\n", fname);
+
+  mapped_table = p;
+  mapped_len = st.st_size;
+  mapped_slots = (const struct bin_slot_s *)(hdr + 1);
+  mapped_table_size = hdr->table_size;
+  mapped_entries_off = sizeof *hdr + hdr->table_size * sizeof *mapped_slots;
+  if (word_table.next_hit_ref <= hdr->nwords)
+    word_table.next_hit_ref = hdr->nwords + 1;
+
+  *ngood = hdr->ngood;
+  *nbad = hdr->nbad;
+  *nwords = hdr->nwords;
+  if (verbose > 1)
+    info ("mapped binary wordlist `%s' with %u words\n", fname, *nwords);
+}
+
+
+/* Release a mapped wordlist.  */
+static void
+unmap_table (void)
+{
+  if (mapped_table)
+    munmap ((void*)mapped_table, mapped_len);
+  mapped_table = NULL;
+  mapped_len = 0;
+  mapped_slots = NULL;
+  mapped_table_size = 0;
+  mapped_entries_off = 0;
 }
 
+/* Read the wordlist FNAME.  A binary wordlist is mapped into memory
+   unless WRITABLE is set, in which case it is copied to the word
+   table.  */
 static void
-read_table (const char *fname,
+read_table (const char *fname, int writable,
             unsigned int *ngood, unsigned int *nbad, unsigned int *nwords)
 {
   FILE *fp;
   char line[MAX_WORDLENGTH + 100]; 
   unsigned int lineno = 0;
   char *p;
+  struct stat st;
 
   *nwords = 0;
   fp = fopen (fname, "r");
   if (!fp)
     die ("can't open wordlist `%s': %s\n", fname, strerror (errno));
 
+  if (fread (line, sizeof BIN_MAGIC - 1, 1, fp) == 1
+      && !memcmp (line, BIN_MAGIC, sizeof BIN_MAGIC - 1))
+    {
+      map_table (fname, fileno (fp), ngood, nbad, nwords);
+      fclose (fp);
+      if (writable)
+        {
+          HASH_ENTRY entry, e;
+          size_t iter;
+
+          reserve_word_table (&word_table, word_table.used + *nwords);
+          for (iter=0; iter < mapped_len && (entry = enum_words (&iter)); )
+            {
+              e = store_word (&word_table, entry->word, NULL);
+              e->prob = entry->prob;
+              e->veg_count = entry->veg_count;
+              e->spam_count = entry->spam_count;
+            }
+          unmap_table ();
+        }
+      return;
+    }
+  rewind (fp);
+
+  /* Size the table for the expected number of words so that we don't
+     need to rehash while loading.  A typical line takes about 16
+     bytes.  */
+  if (!fstat (fileno (fp), &st))
+    reserve_word_table (&word_table, word_table.used + st.st_size / 16);
+
   while ( fgets (line, sizeof line, fp) )
     {
       lineno++;
@@ -975,7 +1599,7 @@ read_table (const char *fname,
             goto invalid_line;
           if (prob > 99)
             goto invalid_line;
-          e = store_word (line, &is_new);
+          e = store_word (&word_table, line, &is_new);
           if (!is_new)
             die ("duplicate entry at line %u in `%s'\n", lineno, fname);
 
@@ -1043,26 +1667,379 @@ open_next_file (FILE *listfp, char *fname, size_t fnamelen)
 
 
 static void
-check_and_print (unsigned int veg_count, unsigned int spam_count,
-                 const char *filename, HIT_ARRAY ha)
+print_result (unsigned int spamicity, const char *filename)
 {
-  int spamicity = check_spam (veg_count, spam_count, ha);
   if (name_only > 0 && spamicity > 90)
     puts (filename); /* contains spam */
   else if (name_only < 0 && spamicity <= 90)
     puts (filename); /* contains valuable blurbs */
   else if (!name_only)
     printf ("%s: %2u\n", filename, spamicity);
+}
+
+
+static void
+check_and_print (unsigned int veg_count, unsigned int spam_count,
+                 const char *filename, HIT_ARRAY ha)
+{
+  print_result (check_spam (veg_count, spam_count, ha), filename);
   reset_hits (ha);
 }
 
 
+/* Return the time in microseconds from an arbitrary start.  */
+static double
+timestamp (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+/* Check all messages of the mbox files in ARGV using the hit array HA
+   and print the throughput and latency.  */
+static void
+run_bench (int argc, char **argv, unsigned int veg_count,
+           unsigned int spam_count, HIT_ARRAY ha)
+{
+  double *lat = NULL;
+  size_t nlat = 0, allocated = 0;
+  double start, t, total;
+  unsigned long ntokens = ha->ntokens;
+  unsigned long nbytes = 0;
+
+  start = timestamp ();
+  for (; argc; argc--, argv++)
+    {
+      int fd;
+      struct stat st;
+      const char *data, *p, *end, *next;
+
+      fd = open (argv[0], O_RDONLY);
+      if (fd == -1 || fstat (fd, &st))
+        die ("can't open `%s': %s\n", argv[0], strerror (errno));
+      if (!st.st_size)
+        {
+          close (fd);
+          continue;
+        }
+      data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        die ("can't map `%s': %s\n", argv[0], strerror (errno));
+      close (fd);
+      nbytes += st.st_size;
+
+      end = data + st.st_size;
+      for (p = data; p < end; p = next)
+        {
+          for (next = p; (next = memchr (next, '\n', end - next)); next++)
+            if (end - next > 5 && !memcmp (next+1, "From ", 5))
+              break;
+          next = next? next + 1 : end;
+
+          if (nlat == allocated)
+            {
+              allocated += 1000;
+              lat = realloc (lat, allocated * sizeof *lat);
+              if (!lat)
+                die ("out of core\n");
+            }
+          t = timestamp ();
+          parse_buffer (argv[0], p, next - p, -1, 0, ha, NULL);
+          check_spam (veg_count, spam_count, ha);
+          reset_hits (ha);
+          lat[nlat++] = timestamp () - t;
+        }
+      munmap ((void*)data, st.st_size);
+    }
+  total = (timestamp () - start) / 1e6;
+  ntokens = ha->ntokens - ntokens;
+
+  if (!nlat)
+    die ("no messages found\n");
+  qsort (lat, nlat, sizeof *lat, compare_doubles);
+  printf ("%lu messages, %lu tokens, %lu kb in %.3f s\n",
+          (unsigned long)nlat, ntokens, nbytes/1024, total);
+  printf ("%.0f messages/s, %.0f tokens/s, %.1f mb/s\n",
+          nlat / total, ntokens / total, nbytes / total / (1024*1024));
+  printf ("latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+          lat[nlat/2], lat[(nlat*99)/100], lat[nlat-1]);
+  if (verbose)
+    {
+      double probe_avg;
+      unsigned int probe_max;
+
+      probe_stats (&probe_avg, &probe_max);
+      printf ("probes avg %.2f, max %u\n", probe_avg, probe_max);
+    }
+  free (lat);
+}
+
+
 
+/*
+   Learning
+*/
+
+#ifdef HAVE_PTHREAD
+
+/* The maximum number of threads.  */
+#define MAX_THREADS 64
+
+/* Return the number of threads to use.  This is one per CPU unless
+   VEGETARISE_THREADS is set.  */
+static int
+get_thread_count (void)
+{
+  const char *s = getenv ("VEGETARISE_THREADS");
+  int n;
+
+  n = s? atoi (s) : (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  else if (n > MAX_THREADS)
+    n = MAX_THREADS;
+  return n;
+}
+
+
+/* A job for a learning thread.  Each thread learns into its own word
+   table; they are merged after all threads have finished.  */
+struct learn_job_s {
+  pthread_t thread;
+  struct word_table_s tbl;
+  int is_spam;
+  const char *fname;
+  const char *data;     /* A part of an mapped mbox or NULL.  */
+  size_t datalen;
+  FILE *listfp;         /* The file list shared by all jobs.  */
+  pthread_mutex_t *listlock;
+  unsigned int count;   /* Number of messages learned.  */
+};
+
+
+static void *
+learn_thread (void *arg)
+{
+  struct learn_job_s *job = arg;
+  char fnamebuf[1000];
+  FILE *fp;
+
+  if (job->data)
+    {
+      job->count = parse_buffer (job->fname, job->data, job->datalen,
+                                 job->is_spam, 1, NULL, &job->tbl);
+      return NULL;
+    }
+
+  for (;;)
+    {
+      pthread_mutex_lock (job->listlock);
+      fp = open_next_file (job->listfp, fnamebuf, sizeof fnamebuf);
+      pthread_mutex_unlock (job->listlock);
+      if (!fp)
+        break;
+      job->count += parse_message (fnamebuf, fp, job->is_spam, 0,
+                                   NULL, &job->tbl);
+      fclose (fp);
+    }
+  return NULL;
+}
+
+
+/* Add the counts from the table SRC to the global word table.  */
+static void
+merge_word_table (WORD_TABLE src)
+{
+  HASH_ENTRY e, entry;
+  size_t n;
+
+  for (n=0; n < src->size; n++)
+    if ((entry = src->slots[n].entry))
+      {
+        e = store_word (&word_table, entry->word, NULL);
+        e->veg_count += entry->veg_count;
+        e->spam_count += entry->spam_count;
+      }
+}
+
+
+/* Learn in parallel from the mbox or file list FP using NTHREADS
+   threads.  An mbox is mapped into memory and split at message
+   boundaries.  Returns the number of messages or 0 if the file can't
+   be processed in parallel.  */
+static unsigned int
+learn_parallel (const char *fname, FILE *fp, int is_spam, int indirect,
+                int nthreads)
+{
+  struct learn_job_s jobs[MAX_THREADS];
+  pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
+  const char *map = NULL, *p, *start, *end;
+  struct stat st;
+  unsigned int count = 0;
+  int i, njobs, err;
+
+  if (!indirect)
+    {
+      if (fstat (fileno (fp), &st) || !S_ISREG (st.st_mode) || !st.st_size)
+        return 0;
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (fp), 0);
+      if (map == MAP_FAILED)
+        return 0;
+    }
+
+  memset (jobs, 0, sizeof jobs);
+  for (njobs=0, start=map; njobs < nthreads; njobs++)
+    {
+      jobs[njobs].is_spam = is_spam;
+      jobs[njobs].fname = fname;
+      if (indirect)
+        {
+          jobs[njobs].listfp = fp;
+          jobs[njobs].listlock = &listlock;
+          continue;
+        }
+
+      /* Assign the messages up to the next "From " line after an
+         equal share of the file.  All but the first part start with
+         the LF of the previous line so that the "From " line is
+         detected; the message counted for it is subtracted later.  */
+      if (start == map + st.st_size)
+        break;
+      end = map + st.st_size;
+      if (njobs + 1 < nthreads)
+        {
+          p = map + st.st_size / nthreads * (njobs + 1);
+          if (p < start)
+            p = start;
+          while ((p = memchr (p, '\n', end - p)) && end - p > 5
+                 && memcmp (p, "\nFrom ", 6))
+            p++;
+          if (p && end - p > 5)
+            end = p + 1;
+        }
+      jobs[njobs].data = start;
+      jobs[njobs].datalen = end - start;
+      start = end == map + st.st_size? end : end - 1;
+    }
+
+  for (i=0; i < njobs; i++)
+    if ((err = pthread_create (&jobs[i].thread, NULL,
+                               learn_thread, jobs + i)))
+      die ("error creating learning thread: %s\n", strerror (err));
+  for (i=0; i < njobs; i++)
+    {
+      pthread_join (jobs[i].thread, NULL);
+      merge_word_table (&jobs[i].tbl);
+      release_word_table (&jobs[i].tbl);
+      count += jobs[i].count;
+      if (i && !indirect)
+        count--;
+    }
+  if (verbose)
+    info ("learned from %u messages using %d threads\n", count, njobs);
+
+  if (map)
+    munmap ((void*)map, st.st_size);
+  return count;
+}
+#endif /*HAVE_PTHREAD*/
+
+
+/* Learn from the mbox FP or, if INDIRECT is set, from the files
+   listed in FP.  Returns the number of messages.  */
+static unsigned int
+learn_messages (const char *fname, FILE *fp, int is_spam, int indirect)
+{
+  char fnamebuf[1000];
+  unsigned int count = 0;
+  FILE *fp2;
+
+#ifdef HAVE_PTHREAD
+  int nthreads = get_thread_count ();
+
+  if (nthreads > 1
+      && (count = learn_parallel (fname, fp, is_spam, indirect, nthreads)))
+    return count;
+#endif /*HAVE_PTHREAD*/
+
+  if (indirect)
+    {
+      while ((fp2 = open_next_file (fp, fnamebuf, sizeof fnamebuf)))
+        {
+          count += parse_message (fnamebuf, fp2, is_spam, 0,
+                                  NULL, &word_table);
+          fclose (fp2);
+        }
+    }
+  else
+    count = parse_message (fname, fp, is_spam, 1, NULL, &word_table);
+  return count;
+}
+
+
+
 /*
    Server code and startup 
 */
 
-#ifdef HAVE_PTH
+#ifdef HAVE_PTHREAD
+
+/* A client sends this line to start a batch of messages.  Each
+   message is then sent as a line with its length in decimal followed
+   by the message itself.  The server replies with one line per
+   message in the same order.  The batch ends when the client closes
+   its side of the connection.  For compatibility, a connection not
+   starting with this line is taken as a single message.  */
+#define BATCH_MAGIC "#vegetarise-batch-1\n"
+
+/* A client sends one of these lines followed by a message to have
+   the server learn the message.  The server replies with the number
+   of messages learned.  */
+#define LEARN_SPAM_CMD "#vegetarise-learn-spam\n"
+#define LEARN_VEG_CMD  "#vegetarise-learn-veg\n"
+
+/* A client sends this line to ask for the statistics of the server
+   which replies with lines of names and values.  */
+#define STATS_CMD "#vegetarise-stats\n"
+
+/* If the server learned new messages, it writes the word table back
+   to its wordlist every that many seconds and on SIGTERM.  */
+#define SNAPSHOT_INTERVAL 300
+
+/* Learning takes this lock for writing, checking for reading.  */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The maximum number of batched messages a client sends before it
+   reads the reply for the first of them.  */
+#define MAX_INFLIGHT 32
+
+/* The queue of accepted connections waiting for a worker.  */
+static int queue_fds[128];
+static unsigned int queue_head, queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+/* Statistics of the server.  They are protected by STATS_LOCK.  */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t srvr_started;
+static unsigned long srvr_connections;
+static unsigned long srvr_checked, srvr_learned;
+static double srvr_check_time; /* In microseconds.  */
+
 
 /* Write NBYTES of BUF to file descriptor FD. */
 static int
@@ -1073,7 +2050,7 @@ writen (int fd, const void *buf, size_t nbytes)
   
   while (nleft > 0)
     {
-      nwritten = my_write( fd, buf, nleft );
+      nwritten = write (fd, buf, nleft);
       if (nwritten < 0)
         {
           if (errno == EINTR)
@@ -1102,7 +2079,7 @@ readline (int fd, char *buf, size_t buflen)
 
   while (nleft > 0)
     {
-      int n = my_read (fd, buf, nleft);
+      int n = read (fd, buf, nleft);
       if (n < 0)
         {
           if (errno == EINTR)
@@ -1172,6 +2149,60 @@ find_socket (const char *name)
   return fd;
 }
 
+/* Write the word table back to the wordlist if it has changed.  The
+   new wordlist is written to a temporary file which is then renamed,
+   so that a mapped wordlist is not affected.  */
+static void
+snapshot_table (void)
+{
+  char *tmpname;
+  FILE *fp;
+  int rc;
+
+  pthread_rwlock_rdlock (&table_lock);
+  if (!srvr_table_dirty)
+    {
+      pthread_rwlock_unlock (&table_lock);
+      return;
+    }
+  tmpname = malloc (strlen (srvr_wordlist) + 5);
+  if (!tmpname)
+    {
+      pthread_rwlock_unlock (&table_lock);
+      error ("out of core while writing a snapshot\n");
+      return;
+    }
+  strcpy (stpcpy (tmpname, srvr_wordlist), ".tmp");
+  fp = fopen (tmpname, "w");
+  if (!fp)
+    rc = -1;
+  else
+    {
+      if (mapped_table)
+        rc = write_bin_table (fp, srvr_veg_count, srvr_spam_count);
+      else
+        rc = write_table (fp, srvr_veg_count, srvr_spam_count);
+      if (fclose (fp))
+        rc = -1;
+    }
+  if (!rc && rename (tmpname, srvr_wordlist))
+    rc = -1;
+  if (rc)
+    {
+      error ("error writing snapshot `%s': %s\n", tmpname, strerror (errno));
+      remove (tmpname);
+    }
+  else
+    {
+      srvr_table_dirty = 0;
+      if (verbose)
+        info ("snapshot written to `%s'\n", srvr_wordlist);
+    }
+  pthread_rwlock_unlock (&table_lock);
+  free (tmpname);
+}
+
+
 static void
 handle_signal (int signo)
 {
@@ -1195,6 +2226,7 @@ handle_signal (int signo)
 
     case SIGTERM:
       info ("SIGTERM received - shutting down ...\n");
+      snapshot_table ();
       exit (0);
       break;
         
@@ -1209,77 +2241,359 @@ handle_signal (int signo)
 }
 
 
-/* Handle a request */
-static void *
-handle_request (void *arg)
+/* Check the message read from RD and return its spam level.  The
+   table is locked while parsing, thus RD must read from memory.  */
+static unsigned int
+check_message (READER *rd, HIT_ARRAY ha)
 {
-  static HIT_ARRAY hit_arrays[10];
-  HIT_ARRAY ha;
-  int fd = (int)arg;
-  int i;
-  FILE *fp;
-  char *p, buf[100];
-  
+  unsigned int level;
+  double t = timestamp ();
+
+  pthread_rwlock_rdlock (&table_lock);
+  parse_reader ("[net]", rd, -1, 0, ha, NULL);
+  level = check_spam (srvr_veg_count, srvr_spam_count, ha);
+  pthread_rwlock_unlock (&table_lock);
+  reset_hits (ha);
+
+  t = timestamp () - t;
+  pthread_mutex_lock (&stats_lock);
+  srvr_checked++;
+  srvr_check_time += t;
+  pthread_mutex_unlock (&stats_lock);
+  return level;
+}
+
+
+/* Learn the message read from RD as spam or, if IS_SPAM is false, as
+   vegetarian.  The message is first parsed into a table of its own;
+   only the words of that table are then updated in the word table and
+   get their probability recomputed.  Returns the number of messages
+   learned.  */
+static unsigned int
+learn_message (READER *rd, int is_spam)
+{
+  struct word_table_s tbl;
+  HASH_ENTRY entry, e;
+  unsigned int count, g, b;
+  size_t n;
+
+  memset (&tbl, 0, sizeof tbl);
+  count = parse_reader ("[net]", rd, is_spam, 0, NULL, &tbl);
+
+  pthread_rwlock_wrlock (&table_lock);
+  if (is_spam)
+    srvr_spam_count += count;
+  else
+    srvr_veg_count += count;
+  for (n=0; n < tbl.size; n++)
+    {
+      if (!(entry = tbl.slots[n].entry))
+        continue;
+      if (!(e = find_word (entry->word)))
+        e = store_word (&word_table, entry->word, NULL);
+      e->veg_count += entry->veg_count;
+      e->spam_count += entry->spam_count;
+      g = e->veg_count * 2;
+      b = e->spam_count;
+      if (g + b >= 5 && srvr_veg_count && srvr_spam_count)
+        e->prob = calc_prob (g, b, srvr_veg_count, srvr_spam_count);
+    }
+  srvr_table_dirty = 1;
+  pthread_rwlock_unlock (&table_lock);
+
+  pthread_mutex_lock (&stats_lock);
+  srvr_learned += count;
+  pthread_mutex_unlock (&stats_lock);
+
   if (verbose > 1)
-    info ("handler for fd %d started\n", fd);
-  /* See whether we can use a hit_array from our attic */
-  for (ha=NULL, i=0; i < DIM (hit_arrays); i++ )
+    info ("learned %u %s message(s) with %lu words\n", count,
+          is_spam? "spam":"vegetarian", (unsigned long)tbl.used);
+  release_word_table (&tbl);
+  return count;
+}
+
+
+/* Write the statistics of the server to FD.  */
+static void
+write_stats (int fd)
+{
+  char buf[1000];
+  unsigned long connections, checked, learned;
+  double check_time, probe_avg;
+  unsigned int probe_max, queued, nmapped, veg_count, spam_count;
+  size_t nwords, table_size;
+
+  pthread_mutex_lock (&stats_lock);
+  connections = srvr_connections;
+  checked = srvr_checked;
+  learned = srvr_learned;
+  check_time = srvr_check_time;
+  pthread_mutex_unlock (&stats_lock);
+
+  pthread_mutex_lock (&queue_lock);
+  queued = queue_len;
+  pthread_mutex_unlock (&queue_lock);
+
+  pthread_rwlock_rdlock (&table_lock);
+  nmapped = mapped_table? ((const struct bin_header_s *)mapped_table)->nwords : 0;
+  nwords = word_table.used + nmapped;
+  table_size = word_table.size + mapped_table_size;
+  probe_stats (&probe_avg, &probe_max);
+  veg_count = srvr_veg_count;
+  spam_count = srvr_spam_count;
+  pthread_rwlock_unlock (&table_lock);
+
+  snprintf (buf, sizeof buf,
+            "uptime %lu\n"
+            "connections %lu\n"
+            "queued %u\n"
+            "checked %lu\n"
+            "check_time_avg_us %.1f\n"
+            "learned %lu\n"
+            "vegetarian %u\n"
+            "spam %u\n"
+            "words %lu\n"
+            "mapped_words %u\n"
+            "table_size %lu\n"
+            "probe_avg %.2f\n"
+            "probe_max %u\n"
+            "memory_kb %lu\n",
+            (unsigned long)(time (NULL) - srvr_started), connections,
+            queued, checked, checked? check_time / checked : 0.0,
+            learned, veg_count, spam_count,
+            (unsigned long)nwords, nmapped, (unsigned long)table_size,
+            probe_avg, probe_max,
+            (unsigned long)total_memory_used/1024);
+  writen (fd, buf, strlen (buf));
+}
+
+
+/* Read the rest of the message from FP into a malloced buffer and
+   return it; its length is stored at R_LEN.  Returns NULL on error.  */
+static char *
+read_message (FILE *fp, size_t *r_len)
+{
+  char *buf = NULL, *p;
+  size_t size = 0, len = 0, n;
+
+  do
+    {
+      if (len == size)
+        {
+          size = size? size * 2 : 65536;
+          if (!(p = realloc (buf, size)))
+            {
+              error ("out of core while reading a message\n");
+              free (buf);
+              return NULL;
+            }
+          buf = p;
+        }
+      n = fread (buf + len, 1, size - len, fp);
+      len += n;
+    }
+  while (n);
+  if (ferror (fp))
+    {
+      free (buf);
+      return NULL;
+    }
+  *r_len = len;
+  return buf;
+}
+
+
+/* Check the message read from FP and store the response line in BUF
+   which must have space for 20 characters.  The message is read into
+   memory first so that a slow client does not keep the table locked
+   and thus block the learning.  */
+static void
+check_stream (FILE *fp, READER *rd, HIT_ARRAY ha, char *buf)
+{
+  char *msg;
+  size_t len;
+
+  if (!(msg = read_message (fp, &len)))
+    {
+      strcpy (buf, "0 read_error\n");
+      return;
+    }
+  init_reader (rd, NULL, msg, len);
+  sprintf (buf, "%u\n", check_message (rd, ha));
+  free (msg);
+}
+
+
+/* Process a batch of messages read from FP and write the results to
+   FD.  RD is used to parse the messages from memory.  */
+static void
+handle_batch (int fd, FILE *fp, READER *rd, HIT_ARRAY ha)
+{
+  char line[50], *endp, *buf = NULL;
+  size_t buflen = 0;
+  unsigned long len;
+
+  while (fgets (line, sizeof line, fp))
     {
-      if (hit_arrays[i])
+      len = strtoul (line, &endp, 10);
+      if (endp == line || *endp != '\n')
         {
-          ha = hit_arrays[i];
-          hit_arrays[i] = NULL;
+          writen (fd, "0 bad_request\n", 14);
           break;
         }
+      if (len + 1 > buflen)
+        {
+          free (buf);
+          buflen = len + 1;
+          if (!(buf = malloc (buflen)))
+            {
+              error ("out of core while reading a batch\n");
+              writen (fd, "0 out_of_core\n", 14);
+              return;
+            }
+        }
+      if (fread (buf, 1, len, fp) != len)
+        break;
+      init_reader (rd, NULL, buf, len);
+      sprintf (line, "%u\n", check_message (rd, ha));
+      if (writen (fd, line, strlen (line)))
+        break;
     }
-  if (!ha) /* no - create a new one */
-     ha = new_hit_array ();
+  free (buf);
+}
+
+
+/* Handle a request on the connection FD using the hit array HA.  */
+static void
+handle_request (int fd, HIT_ARRAY ha)
+{
+  FILE *fp;
+  char *p, buf[100];
+  int c;
+  READER rd;
+  
+  if (verbose > 1)
+    info ("handler for fd %d started\n", fd);
 
-  fp = fdopen (fd, "rw");
+  fp = fdopen (fd, "r");
   if (!fp)
+    p = "0 fd_open_failed\n";
+  else if ((c = getc (fp)) == '#')
     {
-      p = "0 fd_open_failed\n";
-      writen (fd, p, strlen (p));
+      /* A mail never starts with the hash mark, thus we don't mind
+         to lose the first line if it isn't a command after all.  */
+      if (!fgets (buf, sizeof buf, fp))
+        *buf = 0;
+      p = buf;
+      if (!strcmp (buf, BATCH_MAGIC+1))
+        {
+          handle_batch (fd, fp, &rd, ha);
+          p = NULL;
+        }
+      else if (!strcmp (buf, STATS_CMD+1))
+        {
+          write_stats (fd);
+          p = NULL;
+        }
+      else if (!strcmp (buf, LEARN_SPAM_CMD+1))
+        {
+          init_reader (&rd, fp, NULL, 0);
+          sprintf (buf, "%u\n", learn_message (&rd, 1));
+        }
+      else if (!strcmp (buf, LEARN_VEG_CMD+1))
+        {
+          init_reader (&rd, fp, NULL, 0);
+          sprintf (buf, "%u\n", learn_message (&rd, 0));
+        }
+      else
+        check_stream (fp, &rd, ha, buf);
     }
   else
     {
-      parse_message ("[net]", fp, -1, 0, ha);
-      sprintf (buf, "%u\n", check_spam (srvr_veg_count, srvr_spam_count, ha));
+      if (c != EOF)
+        ungetc (c, fp);
+      check_stream (fp, &rd, ha, buf);
       p = buf;
     }
-  writen (fd, p, strlen (p));
+  if (p)
+    writen (fd, p, strlen (p));
 
   if (fp)
     fclose (fp);
   else
     close (fd);
-  reset_hits (ha);
-  /* See whether we can put the array back into our attic */
-  for (i=0; i < DIM (hit_arrays); i++ )
-    {
-      if (!hit_arrays[i])
-        {
-          hit_arrays[i] = ha;
-          ha = NULL;
-          break;
-        }
-    }
-  if (ha)
-    release_hit_array (ha);
 
   if (verbose > 1)
     info ("handler for fd %d terminated\n", fd);
+}
+
+
+/* A worker thread.  It takes connections from the queue and runs the
+   handler with its own hit array ARG.  */
+static void *
+worker_thread (void *arg)
+{
+  HIT_ARRAY ha = arg;
+  int fd;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&queue_lock);
+      while (!queue_len)
+        pthread_cond_wait (&queue_not_empty, &queue_lock);
+      fd = queue_fds[queue_head];
+      queue_head = (queue_head + 1) % DIM (queue_fds);
+      queue_len--;
+      pthread_cond_signal (&queue_not_full);
+      pthread_mutex_unlock (&queue_lock);
+
+      pthread_mutex_lock (&stats_lock);
+      srvr_connections++;
+      pthread_mutex_unlock (&stats_lock);
+
+      handle_request (fd, ha);
+    }
+  /*NOTREACHED*/
+  return NULL;
+}
+
+
+/* A thread to process the signals which are blocked in all other
+   threads.  It also takes the periodic snapshots.  */
+static void *
+signal_thread (void *arg)
+{
+  sigset_t *sigs = arg;
+  struct timespec timeout;
+  int signo;
+
+  for (;;)
+    {
+      timeout.tv_sec = SNAPSHOT_INTERVAL;
+      timeout.tv_nsec = 0;
+      signo = sigtimedwait (sigs, NULL, &timeout);
+      if (signo != -1)
+        handle_signal (signo);
+      else if (errno == EAGAIN)
+        snapshot_table ();
+    }
+  /*NOTREACHED*/
   return NULL;
 }
 
+
 /* Send a request to check for spam to the server process.  Return the
-   spam level. */
+   spam level.  If CMD is not NULL, it is sent before the message and
+   the result of the command is returned.  */
 static unsigned int
-transact_request (int fd, const char *fname, FILE *fp)
+transact_request (int fd, const char *cmd, const char *fname, FILE *fp)
 {
   char buf[4096];
   size_t n;
 
+  if (cmd)
+    writen (fd, cmd, strlen (cmd));
+
   do
     {
       n = fread (buf, 1, sizeof buf, fp);
@@ -1295,6 +2609,138 @@ transact_request (int fd, const char *fname, FILE *fp)
 }
 
 
+/* Ask the server at FD for its statistics and print them.  */
+static void
+transact_stats (int fd)
+{
+  char buf[4096];
+  ssize_t n;
+
+  writen (fd, STATS_CMD, strlen (STATS_CMD));
+  shutdown (fd, 1);
+  while ((n = read (fd, buf, sizeof buf)) > 0)
+    fwrite (buf, 1, n, stdout);
+  if (n == -1)
+    die ("error reading from server: %s\n", strerror (errno));
+}
+
+
+/* Read the entire file FP into a malloced buffer and return it; its
+   length is stored at R_LEN.  */
+static char *
+slurp_file (const char *fname, FILE *fp, size_t *r_len)
+{
+  char *buf = NULL;
+  size_t size = 0, len = 0, n;
+
+  do
+    {
+      if (len == size)
+        {
+          size = size? size * 2 : 65536;
+          if (!(buf = realloc (buf, size)))
+            die ("out of core\n");
+        }
+      n = fread (buf + len, 1, size - len, fp);
+      len += n;
+    }
+  while (n);
+  if (ferror (fp))
+    die ("error reading `%s': %s\n", fname, strerror (errno));
+  *r_len = len;
+  return buf;
+}
+
+
+/* Send the messages named by ARGV or, if INDIRECT is set, listed in
+   the files ARGV (or stdin if ARGC is 0) as one batch to the server
+   at FD and print the results.  */
+static void
+transact_batch (int fd, int indirect, int argc, char **argv)
+{
+  char *names[MAX_INFLIGHT];
+  unsigned int head = 0, ninflight = 0;
+  char fnamebuf[1000], line[100];
+  FILE *listfp = NULL, *fp, *replyfp;
+  char *buf;
+  size_t len;
+  int rfd;
+
+  if ((rfd = dup (fd)) == -1 || !(replyfp = fdopen (rfd, "r")))
+    die ("can't fdopen the server connection: %s\n", strerror (errno));
+  writen (fd, BATCH_MAGIC, strlen (BATCH_MAGIC));
+  if (indirect && !argc)
+    listfp = stdin;
+
+  for (;;)
+    {
+      /* Get the next message.  */
+      if (indirect)
+        {
+          while (!listfp || !(fp = open_next_file (listfp, fnamebuf,
+                                                   sizeof fnamebuf)))
+            {
+              if (listfp && listfp != stdin)
+                fclose (listfp);
+              listfp = NULL;
+              if (!argc)
+                break;
+              if (!(listfp = fopen (argv[0], "r")))
+                error ("can't open `%s': %s\n", argv[0], strerror (errno));
+              argc--; argv++;
+            }
+          if (!listfp)
+            break;
+        }
+      else
+        {
+          if (!argc)
+            break;
+          strncpy (fnamebuf, argv[0], sizeof fnamebuf - 1);
+          fnamebuf[sizeof fnamebuf - 1] = 0;
+          argc--; argv++;
+          if (!(fp = fopen (fnamebuf, "r")))
+            {
+              error ("can't open `%s': %s\n", fnamebuf, strerror (errno));
+              continue;
+            }
+        }
+
+      /* Wait for a result if too many messages are pending.  */
+      if (ninflight == MAX_INFLIGHT)
+        {
+          if (!fgets (line, sizeof line, replyfp))
+            die ("error reading from server: %s\n", strerror (errno));
+          print_result (atoi (line), names[head]);
+          free (names[head]);
+          head = (head + 1) % MAX_INFLIGHT;
+          ninflight--;
+        }
+
+      buf = slurp_file (fnamebuf, fp, &len);
+      fclose (fp);
+      sprintf (line, "%lu\n", (unsigned long)len);
+      if (writen (fd, line, strlen (line)) || writen (fd, buf, len))
+        die ("error writing to server\n");
+      free (buf);
+      if (!(names[(head + ninflight) % MAX_INFLIGHT] = strdup (fnamebuf)))
+        die ("out of core\n");
+      ninflight++;
+    }
+
+  shutdown (fd, 1);
+  for (; ninflight; ninflight--)
+    {
+      if (!fgets (line, sizeof line, replyfp))
+        die ("error reading from server: %s\n", strerror (errno));
+      print_result (atoi (line), names[head]);
+      free (names[head]);
+      head = (head + 1) % MAX_INFLIGHT;
+    }
+  fclose (replyfp);
+}
+
+
 /* Start a server process to listen on socket NAME. */
 static void
 start_server (const char *name)
@@ -1304,10 +2750,10 @@ start_server (const char *name)
   size_t len;
   struct sigaction sa;
   pid_t pid;
-  pth_attr_t tattr;
-  pth_event_t ev;
-  sigset_t sigs;
-  int signo;
+  pthread_attr_t tattr;
+  pthread_t thread;
+  static sigset_t sigs;
+  int i, nthreads, err;
 
   fflush (NULL);
   pid = fork ();
@@ -1320,6 +2766,7 @@ start_server (const char *name)
       return; /* we are the parent */
     }
   /* this is the child */
+  srvr_started = time (NULL);
   sa.sa_handler = SIG_IGN;
   sigemptyset (&sa.sa_mask);
   sa.sa_flags = 0;
@@ -1332,57 +2779,64 @@ start_server (const char *name)
       die ("error binding socket to `%s': %s\n", name, strerror (errno));
     }
   
-  if (listen (srvr_fd, 5 ) == -1)
+  if (listen (srvr_fd, 64) == -1)
     die ("listen on `%s' failed: %s\n", name, strerror (errno));
   if (verbose)
     info ("listening on socket `%s'\n", name );
 
-  if (!pth_init ())
-    die ("failed to initialize the Pth library\n");
-
-  tattr = pth_attr_new ();
-  pth_attr_set (tattr, PTH_ATTR_JOINABLE, 0);
-  pth_attr_set (tattr, PTH_ATTR_STACK_SIZE, 32*1024);
-  pth_attr_set (tattr, PTH_ATTR_NAME, PGMNAME);
+  nthreads = get_thread_count ();
 
+  /* Block the signals so that only the signal thread receives them. */
   sigemptyset (&sigs );
   sigaddset (&sigs, SIGHUP);
   sigaddset (&sigs, SIGUSR1);
   sigaddset (&sigs, SIGUSR2);
   sigaddset (&sigs, SIGINT);
   sigaddset (&sigs, SIGTERM);
-  ev = pth_event (PTH_EVENT_SIGS, &sigs, &signo);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+  pthread_attr_init (&tattr);
+  pthread_attr_setdetachstate (&tattr, PTHREAD_CREATE_DETACHED);
+  if ((err = pthread_create (&thread, &tattr, signal_thread, &sigs)))
+    die ("error creating signal thread: %s\n", strerror (err));
+  for (i=0; i < nthreads; i++)
+    {
+      err = pthread_create (&thread, &tattr, worker_thread, new_hit_array ());
+      if (err)
+        die ("error creating worker thread: %s\n", strerror (err));
+    }
+  pthread_attr_destroy (&tattr);
+  if (verbose)
+    info ("started %d worker threads\n", nthreads);
 
-  running_as_server = 1; /* enable pth_yield(). */
   for (;;)
     {
       int fd;
       struct sockaddr_un paddr;
       socklen_t plen = sizeof (paddr);
 
-      fd = pth_accept_ev (srvr_fd, (struct sockaddr *)&paddr, &plen, ev);
+      fd = accept (srvr_fd, (struct sockaddr *)&paddr, &plen);
       if (fd == -1)
         {
-          if (pth_event_occurred (ev))
-            {
-              handle_signal (signo);
-              continue;
-	    }
+          if (errno == EINTR)
+            continue;
           error ("accept failed: %s - waiting 1s\n", strerror (errno));
-          pth_sleep(1);
+          sleep (1);
           continue;
 	}
 
-      if (!pth_spawn (tattr, handle_request, (void*)fd))
-        {
-          error ("error spawning connection handler: %s\n", strerror (errno));
-          close (fd);
-	}
+      pthread_mutex_lock (&queue_lock);
+      while (queue_len == DIM (queue_fds))
+        pthread_cond_wait (&queue_not_full, &queue_lock);
+      queue_fds[(queue_head + queue_len) % DIM (queue_fds)] = fd;
+      queue_len++;
+      pthread_cond_signal (&queue_not_empty);
+      pthread_mutex_unlock (&queue_lock);
     }
   /*NOTREACHED*/
 }
 
-#endif /*HAVE_PTH*/
+#endif /*HAVE_PTHREAD*/
 
 static void
 usage (void)
@@ -1390,9 +2844,15 @@ usage (void)
   fputs (
    "usage: " PGMNAME " [-t] wordlist [messages]\n"
    "       " PGMNAME "  -T  wordlist [messages-file-list]\n"
-   "       " PGMNAME "  -s  wordlist [message]\n"
+   "       " PGMNAME "  -s  wordlist [messages]\n"
+   "       " PGMNAME "  -sT wordlist [messages-file-list]\n"
    "       " PGMNAME "  -l  veg.mbox spam.mbox [initial-wordlist]\n"
    "       " PGMNAME "  -L  veg-file-list spam-file-list [initial-wordlist]\n"
+   "       " PGMNAME "  -sS wordlist [message]\n"
+   "       " PGMNAME "  -sV wordlist [message]\n"
+   "       " PGMNAME "  -c  wordlist\n"
+   "       " PGMNAME " --bench wordlist mbox-files\n"
+   "       " PGMNAME " -s --stats wordlist\n"
          "\n"
    "  -v      be more verbose\n"
    "  -l      learn mode (mbox)\n"
@@ -1400,6 +2860,12 @@ usage (void)
    "  -n      print only the names of spam files\n"
    "  -N      print only the names of vegetarian files\n"
    "  -s      auto server mode\n"
+   "  -S      have the server learn the message as spam\n"
+   "  -V      have the server learn the message as vegetarian\n"
+   "  -c      convert the wordlist\n"
+   "  -b      write the wordlist in binary format\n"
+   "  --bench check all messages and print the throughput\n"
+   "  --stats print the statistics of the server\n"
    , stderr );
   exit (1);
 }
@@ -1414,6 +2880,11 @@ main (int argc, char **argv)
   int learn = 0;
   int indirect = 0;
   int server = 0;
+  int convert = 0;
+  int binary = 0;
+  int feed = 0;
+  int bench = 0;
+  int stats = 0;
   unsigned int veg_count=0, spam_count=0;
   FILE *fp;
   char fnamebuf[1000];
@@ -1426,6 +2897,25 @@ main (int argc, char **argv)
   for (s=bintoasc, i=0; *s; s++, i++)
     asctobin[*s] = i;
 
+  if (getenv ("VEGETARISE_WORDS") && *getenv ("VEGETARISE_WORDS"))
+    {
+      max_words = atoi (getenv ("VEGETARISE_WORDS"));
+      if (max_words < 1 || max_words > MAX_WORDS_LIMIT)
+        die ("VEGETARISE_WORDS must be in the range 1 to %d\n",
+             MAX_WORDS_LIMIT);
+    }
+
+  /* And the character classes for the tokenizer.  */
+  for (i=0; i < 256; i++)
+    {
+      if ((i & 0x80) || strchr (TOKENCHARS, i))
+        char_class[i] |= CC_TOKEN;
+      if (i < 128 && isalnum (i))
+        char_class[i] |= CC_ALNUM;
+      if (i < 128 && isxdigit (i))
+        char_class[i] |= CC_XDIGIT;
+    }
+
   if (argc < 1)
     usage ();  /* Hey, read how to use exec*(2) */
   argv++; argc--;
@@ -1439,6 +2929,16 @@ main (int argc, char **argv)
             skip = 1;
             continue;
           }
+          if (!strcmp (s, "-bench"))
+            {
+              bench = 1;
+              continue;
+            }
+          if (!strcmp (s, "-stats"))
+            {
+              stats = 1;
+              continue;
+            }
           if (*s == '-' || !*s) 
             usage();
 
@@ -1488,6 +2988,26 @@ main (int argc, char **argv)
                   server = 1;
                   s++;
                 }
+              else if (*s=='c')
+                {
+                  convert = 1;
+                  s++;
+                }
+              else if (*s=='S')
+                {
+                  feed = 1;
+                  s++;
+                }
+              else if (*s=='V')
+                {
+                  feed = -1;
+                  s++;
+                }
+              else if (*s=='b')
+                {
+                  binary = 1;
+                  s++;
+                }
               else if (*s)
                 usage();
             }
@@ -1497,6 +3017,19 @@ main (int argc, char **argv)
         break;
     }
 
+  if (convert)
+    {
+      unsigned int nwords;
+
+      if (argc != 1 || learn || server)
+        usage ();
+      read_table (argv[0], 0, &veg_count, &spam_count, &nwords);
+      if (binary? write_bin_table (stdout, veg_count, spam_count)
+          /**/  : write_table (stdout, veg_count, spam_count))
+        die ("error writing wordlist: %s\n", strerror (errno));
+      return 0;
+    }
+
   if (server)
     {
       char namebuf[80];
@@ -1504,8 +3037,8 @@ main (int argc, char **argv)
 
       if (learn)
         die ("learn mode can't be combined with server mode\n");
-#ifndef HAVE_PTH
-      die ("not compiled with GNU Pth support - can't run in server mode\n");
+#ifndef HAVE_PTHREAD
+      die ("not compiled with thread support - can't run in server mode\n");
 #else
 
       if (argc < 1)
@@ -1530,16 +3063,14 @@ main (int argc, char **argv)
           int tries;
           unsigned int nwords;
 
-          hash_table_size = 4999;
-          word_table = xcalloc (hash_table_size, sizeof *word_table);
-
-          read_table (argv[0], &veg_count, &spam_count, &nwords);
+          read_table (argv[0], 0, &veg_count, &spam_count, &nwords);
           info ("starting server with "
                 "%u vegetarian, %u spam, %u words, %lu kb memory\n",
                 veg_count, spam_count, nwords,
                 (unsigned long int)total_memory_used/1024);
           srvr_veg_count = veg_count;
           srvr_spam_count = spam_count;
+          srvr_wordlist = argv[0];
 
           /* fixme: don't use sleep */
           start_server (name);
@@ -1552,9 +3083,15 @@ main (int argc, char **argv)
           error ("failed to start server - disabling server mode\n");
           server = 0;
         }
-#endif /*HAVE_PTH*/
+#endif /*HAVE_PTHREAD*/
     }
 
+  if (feed && !server)
+    die ("feeding messages requires the server mode\n");
+  if (stats && !server)
+    die ("--stats requires the server mode\n");
+  if (bench && (learn || server || convert || argc < 2))
+    usage ();
   
   if (learn && !server)
     {
@@ -1564,9 +3101,6 @@ main (int argc, char **argv)
       if (argc != 2 && argc != 3)
         usage ();
 
-      hash_table_size = 4999;
-      word_table = xcalloc (hash_table_size, sizeof *word_table);
-
       if ( strcmp (argv[0], "-") )
         {
           veg_fp = fopen (argv[0], "r");
@@ -1583,7 +3117,7 @@ main (int argc, char **argv)
       if (argc == 3)
         { 
           info ("loading initial wordlist\n");
-          read_table (argv[2], &veg_count, &spam_count, &nwords);
+          read_table (argv[2], 1, &veg_count, &spam_count, &nwords);
           info ("%u vegetarian, %u spam, %u words, %lu kb memory used\n",
                 veg_count, spam_count, nwords,
                 (unsigned long int)total_memory_used/1024);
@@ -1592,56 +3126,62 @@ main (int argc, char **argv)
       if (veg_fp)
         {
           info ("scanning vegetarian mail\n");
-          if (indirect)
-            {
-              while ((fp = open_next_file (veg_fp, fnamebuf, sizeof fnamebuf)))
-                {
-                  veg_count += parse_message (fnamebuf, fp, 0, 0, ha);
-                  fclose (fp);
-                }
-            }
-          else
-            veg_count += parse_message (argv[0], veg_fp, 0, 1, ha);
+          veg_count += learn_messages (argv[0], veg_fp, 0, indirect);
           fclose (veg_fp);
         }
 
       if (spam_fp)
         {
           info ("scanning spam mail\n");
-          if (indirect)
-            {
-              while ((fp = open_next_file (spam_fp, fnamebuf, sizeof fnamebuf)))
-                {
-                  spam_count += parse_message (fnamebuf, fp, 1, 0, ha);
-                  fclose (fp);
-                }
-            }
-          else
-            spam_count += parse_message (argv[1], spam_fp, 1, 1, ha);
+          spam_count += learn_messages (argv[1], spam_fp, 1, indirect);
           fclose (spam_fp);
         }
       info ("computing probabilities\n");
       calc_probability (veg_count, spam_count);
       
-      write_table (veg_count, spam_count);
+      if (binary? write_bin_table (stdout, veg_count, spam_count)
+          /**/  : write_table (stdout, veg_count, spam_count))
+        die ("error writing wordlist: %s\n", strerror (errno));
 
       info ("%u vegetarian, %u spam, %lu kb memory used\n",
             veg_count, spam_count,
             (unsigned long int)total_memory_used/1024);
+      release_word_table (&word_table);
     }
-#ifdef HAVE_PTH
+#ifdef HAVE_PTHREAD
   else if (server_fd != -1)
     { /* server mode */
+      unsigned int n;
 
       argc--; argv++; /* ignore the wordlist */
       
-      if (argc > 1)
+      if (stats)
+        {
+          transact_stats (server_fd);
+          close (server_fd);
+          exit (0);
+        }
+      if (feed && (argc > 1 || indirect))
         usage ();
+      if (argc > 1 || indirect)
+        {
+          transact_batch (server_fd, indirect, argc, argv);
+          close (server_fd);
+          exit (0);
+        }
                     
       fp = argc? fopen (argv[0], "r") : stdin;
       if (!fp)
         die ("can't open `%s': %s\n", argv[0], strerror (errno));
-      if (transact_request (server_fd, argc? argv[0]:"-", fp) > 90)
+      if (feed)
+        {
+          n = transact_request (server_fd,
+                                feed > 0? LEARN_SPAM_CMD : LEARN_VEG_CMD,
+                                argc? argv[0]:"-", fp);
+          close (server_fd);
+          exit (n? 0 : 1);
+        }
+      if (transact_request (server_fd, NULL, argc? argv[0]:"-", fp) > 90)
         {
           close (server_fd);
           if (verbose)
@@ -1653,7 +3193,7 @@ main (int argc, char **argv)
                    system error does not lead false
                    positives */
     }
-#endif /*HAVE_PTH*/
+#endif /*HAVE_PTHREAD*/
   else
     {
       unsigned int nwords;
@@ -1661,10 +3201,7 @@ main (int argc, char **argv)
       if (argc < 1)
         usage ();
 
-      hash_table_size = 4999;
-      word_table = xcalloc (hash_table_size, sizeof *word_table);
-
-      read_table (argv[0], &veg_count, &spam_count, &nwords);
+      read_table (argv[0], 0, &veg_count, &spam_count, &nwords);
       argc--; argv++;
       if (verbose)
         info ("%u vegetarian, %u spam, %u words, %lu kb memory used\n",
@@ -1673,20 +3210,22 @@ main (int argc, char **argv)
       
       ha = new_hit_array ();
 
-      if (!argc)
+      if (bench)
+        run_bench (argc, argv, veg_count, spam_count, ha);
+      else if (!argc)
         {
           if (indirect)
             {
               while ((fp = open_next_file (stdin, fnamebuf, sizeof fnamebuf)))
                 {
-                  parse_message (fnamebuf, fp, 0, 0, ha);
+                  parse_message (fnamebuf, fp, 0, 0, ha, NULL);
                   fclose (fp);
                   check_and_print (veg_count, spam_count, fnamebuf, ha);
                 }
             }
           else
             {
-              parse_message ("-", stdin, -1, 0, ha);
+              parse_message ("-", stdin, -1, 0, ha, NULL);
               if ( check_spam (veg_count, spam_count, ha) > 90)
                 {
                   if (verbose)
@@ -1714,14 +3253,14 @@ main (int argc, char **argv)
                   FILE *fp2;
                   while ((fp2 = open_next_file (fp,fnamebuf, sizeof fnamebuf)))
                     {
-                      parse_message (fnamebuf, fp2, 0, 0, ha);
+                      parse_message (fnamebuf, fp2, 0, 0, ha, NULL);
                       fclose (fp2);
                       check_and_print (veg_count, spam_count, fnamebuf, ha);
                     }
                 }
               else
                 {
-                  parse_message (argv[0], fp, -1, 0, ha);
+                  parse_message (argv[0], fp, -1, 0, ha, NULL);
                   check_and_print (veg_count, spam_count, argv[0], ha);
                 }
               fclose (fp);
@@ -1734,6 +3273,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "gcc -Wall -g -DHAVE_PTH -o vegetarise vegetarise.c -lpth"
+compile-command: "gcc -Wall -g -DHAVE_PTHREAD -o vegetarise vegetarise.c -lpthread"
 End:
 */
@@ -18,13 +18,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 65536
+
+static unsigned char buffer[BUFFER_SIZE];
+
+
+/* XOR the N bytes at BUF with the key stream at KS.  */
+static void
+xor_block (unsigned char *buf, const unsigned char *ks, size_t n)
+{
+  uint64_t a, b;
+
+  /* The memcpy is the portable way to do unaligned accesses; any
+     decent compiler turns this into plain loads and stores and is
+     also able to vectorize it.  */
+  for (; n >= 8; buf += 8, ks += 8, n -= 8)
+    {
+      memcpy (&a, buf, 8);
+      memcpy (&b, ks, 8);
+      a ^= b;
+      memcpy (buf, &a, 8);
+    }
+  for (; n; n--)
+    *buf++ ^= *ks++;
+}
+
 
 int
 main (int argc, char **argv )
 {
   const unsigned char *key;
-  int c, keyidx, keylen;
-  unsigned char val;
+  unsigned char *keystream;
+  size_t i, n, keyidx, keylen;
 
   if ( argc != 2 )
     {
@@ -36,23 +63,33 @@ main (int argc, char **argv )
   keylen = strlen ((const char*)key);
   keyidx = 0;
 
-  while ( (c=getchar ()) != EOF )
+  /* Replicate the key so that we can process a full buffer starting
+     at any key offset in one go.  */
+  keystream = malloc (BUFFER_SIZE + keylen);
+  if (!keystream)
+    {
+      fputs ("xor: out of core\n", stderr);
+      return 1;
+    }
+  for (i=0; keylen && i < BUFFER_SIZE + keylen; i++)
+    keystream[i] = key[i % keylen];
+
+  while ( (n = fread (buffer, 1, sizeof buffer, stdin)) )
     {
-      val = (c & 0xff);
       if (keylen)
         {
-          val ^= key[keyidx++];
-          if (keyidx >= keylen)
-            keyidx = 0;
+          xor_block (buffer, keystream + keyidx, n);
+          keyidx = (keyidx + n) % keylen;
         }
-      putchar (val);
+      if (fwrite (buffer, n, 1, stdout) != 1)
+        break;
     }
   if (ferror (stdin))
     {
       fputs ("xor: read error\n", stderr);
       return 1;
     }
-  if (fflush (stderr) || ferror (stdout))
+  if (fflush (stdout) || ferror (stdout))
     {
       fputs ("xor: write error\n", stderr);
       return 1;
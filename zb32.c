@@ -1,4 +1,4 @@
-/* zb32.c - z-base-32 encoder
+/* zb32.c - z-base-32 encoder and decoder
  * Copyright (C) 2014, 2015  Werner Koch
  *
  * This file is part of GnuPG.
@@ -28,35 +28,46 @@
 #define PGM "zb32"
 
 
+/* The z-base-32 alphabet and a table to map it back.  */
+static char const zb32asc[32] = {'y','b','n','d','r','f','g','8',
+                                 'e','j','k','m','c','p','q','x',
+                                 'o','t','1','u','w','i','s','z',
+                                 'a','3','4','5','h','7','6','9' };
+static signed char zb32val[256];  /* -2 for white space, -1 invalid. */
+
+/* The number of characters required to encode N octets and the
+   number of octets encoded by N characters.  */
+#define ZB32_ENCODED_LEN(n)  (((n) * 8 + 4) / 5)
+#define ZB32_DECODED_LEN(n)  ((n) * 5 / 8)
+
+/* The size of the I/O buffers; a multiple of 5 and 8.  */
+#define BUFFER_SIZE (5 * 8 * 1024)
+
+
+static void
+init_tables (void)
+{
+  int i;
+
+  memset (zb32val, -1, sizeof zb32val);
+  for (i=0; i < 32; i++)
+    zb32val[(unsigned char)zb32asc[i]] = i;
+  zb32val[' '] = zb32val['\t'] = zb32val['\r'] = zb32val['\n'] = -2;
+}
+
+
 /* Zooko's base32 variant. See RFC-6189 and
    http://philzimmermann.com/docs/human-oriented-base-32-encoding.txt
-   Caller must xfree the returned string.  Returns NULL and sets ERRNO
-   on error.  To avoid integer overflow DATALEN is limited to 2^16
-   bytes.  Note, that DATABITS is measured in bits!.  */
-static char *
-zb32_encode (const void *data, unsigned int databits)
+   Encode DATALEN octets from DATA into the buffer OUTPUT which must
+   have a length of at least ZB32_ENCODED_LEN(DATALEN).  The output is
+   not Nul terminated.  Returns the number of characters stored.  If
+   DATALEN is a multiple of 5 the function may be called repeatedly
+   to encode a stream.  */
+static size_t
+zb32_encode_buffer (const void *data, size_t datalen, char *output)
 {
-  static char const zb32asc[32] = {'y','b','n','d','r','f','g','8',
-                                   'e','j','k','m','c','p','q','x',
-                                   'o','t','1','u','w','i','s','z',
-                                   'a','3','4','5','h','7','6','9' };
   const unsigned char *s;
-  char *output, *d;
-  size_t datalen;
-
-  datalen = (databits + 7) / 8;
-  if (datalen > (1 << 16))
-    {
-      errno = EINVAL;
-      return NULL;
-    }
-
-  d = output = malloc (8 * (datalen / 5)
-                           + 2 * (datalen % 5)
-                           - ((datalen%5)>2)
-                           + 1);
-  if (!output)
-    return NULL;
+  char *d = output;
 
   /* I use straightforward code.  The compiler should be able to do a
      better job on optimization than me and it is easier to read.  */
@@ -103,73 +114,294 @@ zb32_encode (const void *data, unsigned int databits)
     default:
       break;
     }
-  *d = 0;
 
-  /* Need to strip some bytes if not a multiple of 40.  */
-  output[(databits + 5 - 1) / 5] = 0;
-  return output;
+  return d - output;
 }
 
 
+/* Decode the INPUTLEN characters at INPUT into the buffer OUTPUT
+   which must have a length of at least ZB32_DECODED_LEN(INPUTLEN).
+   Left over bits are ignored.  Returns the number of octets stored or
+   -1 for an invalid character.  If INPUTLEN is a multiple of 8 the
+   function may be called repeatedly to decode a stream.  */
+static long
+zb32_decode_buffer (const char *input, size_t inputlen, void *output)
+{
+  const unsigned char *s = (const unsigned char *)input;
+  unsigned char *d = output;
+  int v0, v1, v2, v3, v4, v5, v6, v7;
+  unsigned int acc;
+  int nbits;
 
+  for (; inputlen >= 8; s += 8, inputlen -= 8)
+    {
+      v0 = zb32val[s[0]];
+      v1 = zb32val[s[1]];
+      v2 = zb32val[s[2]];
+      v3 = zb32val[s[3]];
+      v4 = zb32val[s[4]];
+      v5 = zb32val[s[5]];
+      v6 = zb32val[s[6]];
+      v7 = zb32val[s[7]];
+      if ((v0 | v1 | v2 | v3 | v4 | v5 | v6 | v7) < 0)
+        return -1;
+      *d++ = (v0 << 3) | (v1 >> 2);
+      *d++ = ((v1 & 3) << 6) | (v2 << 1) | (v3 >> 4);
+      *d++ = ((v3 & 15) << 4) | (v4 >> 1);
+      *d++ = ((v4 & 1) << 7) | (v5 << 2) | (v6 >> 3);
+      *d++ = ((v6 & 7) << 5) | v7;
+    }
 
-int
-main (int argc, char **argv )
+  for (acc = 0, nbits = 0; inputlen; s++, inputlen--)
+    {
+      if ((v0 = zb32val[*s]) < 0)
+        return -1;
+      acc = (acc << 5) | v0;
+      nbits += 5;
+      if (nbits >= 8)
+        {
+          nbits -= 8;
+          *d++ = acc >> nbits;
+        }
+    }
+
+  return d - (unsigned char *)output;
+}
+
+
+
+static int
+write_error (void)
+{
+  fprintf (stderr, PGM ": write error: %s\n", strerror (errno));
+  return 1;
+}
+
+static int
+read_error (void)
 {
-  int c, i;
-  char buffer[500]; /* Needs to be a multiple of 5! */
-  char *output;
+  fprintf (stderr, PGM ": read error: %s\n", strerror (errno));
+  return 1;
+}
+
+
+/* Encode all of stdin into one line.  */
+static int
+encode_stream (void)
+{
+  static unsigned char buffer[BUFFER_SIZE];
+  static char output[ZB32_ENCODED_LEN (BUFFER_SIZE)];
+  size_t n;
 
-  if ( argc > 1 )
+  while ((n = fread (buffer, 1, sizeof buffer, stdin)))
     {
-      fprintf (stderr, "usage: " PGM " < input\n");
-      return 1;
+      n = zb32_encode_buffer (buffer, n, output);
+      if (fwrite (output, n, 1, stdout) != 1)
+        return write_error ();
     }
+  if (ferror (stdin))
+    return read_error ();
 
-  i = 0;
-  while ((c = getchar ()) != EOF)
+  putchar ('\n');
+  return 0;
+}
+
+
+/* Decode all of stdin; white space is ignored.  */
+static int
+decode_stream (void)
+{
+  static unsigned char buffer[BUFFER_SIZE];
+  static char input[BUFFER_SIZE + 8];
+  static unsigned char output[ZB32_DECODED_LEN (BUFFER_SIZE)];
+  size_t n, i, count;
+  long len;
+
+  count = 0;  /* Number of characters in INPUT; less than 8 here.  */
+  while ((n = fread (buffer, 1, sizeof buffer, stdin)))
     {
-      buffer[i++] = c;
-      if (i == sizeof buffer)
+      /* Strip the white space without branching.  */
+      for (i=0; i < n; i++)
         {
-          output = zb32_encode (buffer, 8 * sizeof buffer);
-          if (!output)
-            {
-              fprintf (stderr, PGM ": error converting data: %s\n",
-                       strerror (errno));
-              return 1;
-            }
-          fputs (output, stdout);
-          free (output);
-          i = 0;
+          input[count] = buffer[i];
+          count += (zb32val[buffer[i]] != -2);
         }
+      n = count & ~7;
+      len = zb32_decode_buffer (input, n, output);
+      if (len < 0)
+        goto invalid;
+      if (len && fwrite (output, len, 1, stdout) != 1)
+        return write_error ();
+      memmove (input, input + n, count - n);
+      count -= n;
     }
   if (ferror (stdin))
+    return read_error ();
+
+  len = zb32_decode_buffer (input, count, output);
+  if (len < 0)
+    goto invalid;
+  if (len && fwrite (output, len, 1, stdout) != 1)
+    return write_error ();
+  return 0;
+
+ invalid:
+  fprintf (stderr, PGM ": invalid z-base-32 character\n");
+  return 1;
+}
+
+
+/* Convert the hex string S of length N in place to binary.  Returns
+   the length of the binary string or -1 for invalid hex digits.  */
+static long
+hex2bin (char *s, size_t n)
+{
+  static const char hexdigits[] = "0123456789abcdef0123456789ABCDEF";
+  const char *p1, *p2;
+  size_t i;
+
+  if ((n & 1))
+    return -1;
+  for (i=0; i < n; i += 2)
     {
-      fprintf (stderr, PGM ": read error: %s\n", strerror (errno));
-      return 1;
+      if (!s[i] || !s[i+1]
+          || !(p1 = strchr (hexdigits, s[i]))
+          || !(p2 = strchr (hexdigits, s[i+1])))
+        return -1;
+      s[i/2] = ((p1 - hexdigits) % 16) * 16 + (p2 - hexdigits) % 16;
     }
+  return n / 2;
+}
+
+
+/* Convert each line of stdin to one line of output.  With HEXMODE
+   the binary values are given as hex strings.  */
+static int
+convert_lines (int decode, int hexmode)
+{
+  char *line = NULL;
+  size_t linesize = 0;
+  char *output = NULL;
+  size_t outputsize = 0;
+  ssize_t n;
+  long len;
+  unsigned long lnr = 0;
+  int rc = 0;
 
-  if (i)
+  while ((n = getline (&line, &linesize, stdin)) != -1)
     {
-      output = zb32_encode (buffer, 8 * i);
-      if (!output)
+      lnr++;
+      if (n && line[n-1] == '\n')
+        line[--n] = 0;
+      if (n && line[n-1] == '\r')
+        line[--n] = 0;
+      if (outputsize < 2 * n + 2)
+        {
+          outputsize = 2 * n + 2;
+          free (output);
+          output = malloc (outputsize);
+          if (!output)
+            {
+              fprintf (stderr, PGM ": out of core\n");
+              return 1;
+            }
+        }
+
+      if (decode)
+        {
+          len = zb32_decode_buffer (line, n, output);
+          if (len < 0)
+            {
+              fprintf (stderr, PGM ": line %lu: invalid z-base-32 character\n",
+                       lnr);
+              rc = 1;
+              continue;
+            }
+          if (hexmode)
+            {
+              for (n=0; n < len; n++)
+                printf ("%02x", ((unsigned char *)output)[n]);
+            }
+          else
+            fwrite (output, len, 1, stdout);
+        }
+      else
         {
-          fprintf (stderr, PGM ": error converting data: %s\n",
-                   strerror (errno));
-          return 1;
+          len = hexmode? hex2bin (line, n) : n;
+          if (len < 0)
+            {
+              fprintf (stderr, PGM ": line %lu: invalid hex string\n", lnr);
+              rc = 1;
+              continue;
+            }
+          len = zb32_encode_buffer (line, len, output);
+          fwrite (output, len, 1, stdout);
         }
-      fputs (output, stdout);
-      free (output);
+      putchar ('\n');
+      if (ferror (stdout))
+        return write_error ();
     }
+  if (ferror (stdin))
+    return read_error ();
 
-  putchar ('\n');
+  free (output);
+  free (line);
+  return rc;
+}
 
-  if (fflush (stdout) || ferror (stdout))
+
+int
+main (int argc, char **argv )
+{
+  int decode = 0;
+  int linemode = 0;
+  int hexmode = 0;
+  int rc;
+
+  for (argc--, argv++; argc && **argv == '-' && argv[0][1]; argc--, argv++)
+    {
+      const char *s;
+
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      for (s = *argv + 1; *s; s++)
+        {
+          if (*s == 'd')
+            decode = 1;
+          else if (*s == 'l')
+            linemode = 1;
+          else if (*s == 'x')
+            hexmode = 1;
+          else
+            argc = -1;
+        }
+      if (argc < 0)
+        break;
+    }
+  if (argc || (hexmode && !linemode))
     {
-      fprintf (stderr, PGM ": write error: %s\n", strerror (errno));
+      fprintf (stderr, "usage: " PGM " [-d] [-l [-x]] < input\n"
+               "  -d   decode instead of encode\n"
+               "  -l   convert each line of the input separately\n"
+               "  -x   the binary values for -l are given in hex\n");
       return 1;
     }
 
+  init_tables ();
+  if (linemode)
+    rc = convert_lines (decode, hexmode);
+  else if (decode)
+    rc = decode_stream ();
+  else
+    rc = encode_stream ();
+  if (rc)
+    return rc;
+
+  if (fflush (stdout) || ferror (stdout))
+    return write_error ();
+
   return 0;
 }